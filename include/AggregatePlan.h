@@ -0,0 +1,166 @@
+/**
+ * @file AggregatePlan.h - GROUP BY and the aggregate functions COUNT, SUM, MIN, MAX and AVG.
+ *
+ * HashAggregate keeps one entry per group in an open-addressing hash table keyed by the
+ * group's normalized binary key (see encode_key). Once the groups use up the memory
+ * budget, rows belonging to groups already in the table are still aggregated in place,
+ * but rows for new groups are hash-partitioned into spill files; each partition is
+ * aggregated on its own after the in-memory groups have been returned. A partition with
+ * too many groups to fit spills again the same way, with a differently seeded hash.
+ *
+ * Aggregation can be split in two: PARTIAL_AGGREGATION turns rows into per-group partial
+ * states (e.g., locally in each of several scan workers) and FINAL_AGGREGATION merges the
+ * partial states of the same group into the final values.
+ *
+ * An aggregate's result column is named by the call's text (e.g., "count(*)"), which is
+ * how evaluate() finds it when the call appears in HAVING, ORDER BY or the select list.
+ */
+#pragma once
+
+#include <memory>
+#include "QueryPlan.h"
+#include "SpillFile.h"
+
+enum AggregateFunction {
+    AGG_COUNT_STAR, AGG_COUNT, AGG_SUM, AGG_MIN, AGG_MAX, AGG_AVG
+};
+
+/**
+ * One aggregate function call.
+ */
+struct Aggregate {
+    AggregateFunction function;
+    const hsql::Expr *arg;  // nullptr for COUNT(*)
+    Identifier name;        // result column
+
+    /**
+     * Recognize an aggregate function call.
+     * @param expr       expression to check
+     * @param aggregate  filled in if expr is an aggregate call
+     * @returns          false if expr is not an aggregate call
+     * @throws           SQLExecError for aggregate calls that aren't supported (e.g., DISTINCT)
+     */
+    static bool from_expr(const hsql::Expr *expr, Aggregate &aggregate);
+};
+
+enum AggregateMode {
+    COMPLETE_AGGREGATION,  // rows in, final values out
+    PARTIAL_AGGREGATION,   // rows in, partial states out ("name#count" and "name#value" per aggregate)
+    FINAL_AGGREGATION      // partial states in, final values out
+};
+
+/**
+ * @class HashAggregate - hash-based grouping and aggregation with spilling
+ */
+class HashAggregate : public PlanOperator {
+public:
+    static const size_t NUM_PARTITIONS = 16;
+
+    /**
+     * @param child          input rows (owned)
+     * @param group_by       GROUP BY expressions (empty for a single group over all rows)
+     * @param aggregates     aggregates to compute per group
+     * @param mode           complete, partial or final aggregation
+     * @param memory_budget  bytes of groups to hold before spilling new groups
+     */
+    HashAggregate(PlanOperator *child, const std::vector<const hsql::Expr *> &group_by,
+                  const std::vector<Aggregate> &aggregates, AggregateMode mode = COMPLETE_AGGREGATION,
+                  size_t memory_budget = DEFAULT_MEMORY_BUDGET);
+
+    virtual ~HashAggregate();
+
+    virtual void open();
+
+    virtual bool next(ValueDict &row);
+
+    virtual void close();
+
+    virtual size_t estimated_rows();
+
+    virtual std::string get_name();
+
+    virtual void get_expressions(LabeledExpressions &expressions) const;
+
+    virtual std::vector<PlanOperator **> get_children() { return std::vector<PlanOperator **>(1, &child); }
+
+    virtual size_t get_memory_used() const { return groups_memory; }
+
+    /**
+     * @returns  number of rows the last run wrote to spill files (counting a row each time it spills)
+     */
+    virtual size_t get_spilled_rows() const { return spilled_rows; }
+
+    /**
+     * Column name of a group-by expression in this operator's output.
+     */
+    static Identifier group_column_name(const hsql::Expr *expr) { return expression_text(expr); }
+
+protected:
+    struct AggregateState {
+        int64_t count;
+        int64_t sum;
+        Value value;     // MIN/MAX so far
+        bool has_value;
+    };
+
+    struct Group {
+        std::string key;
+        size_t hash;
+        std::vector<Value> group_values;
+        std::vector<AggregateState> states;
+    };
+
+    /**
+     * Spilled rows; depth is how many times they've been spilled.
+     */
+    struct Partition {
+        std::unique_ptr<SpillFile> file;
+        size_t depth;
+    };
+
+    PlanOperator *child;
+    std::vector<const hsql::Expr *> group_by;
+    ColumnNames group_names;
+    std::vector<Aggregate> aggregates;
+    AggregateMode mode;
+    size_t memory_budget;
+
+    std::vector<Group> groups;
+    std::vector<uint32_t> slots;  // open addressing with linear probing: group index + 1, or 0 if empty
+    size_t groups_memory;
+
+    bool spilling;
+    size_t depth;                                        // of the rows being aggregated
+    std::vector<std::unique_ptr<SpillFile>> partitions;  // being spilled to
+    std::vector<Partition> pending;                      // still to be aggregated, taken from the back
+    size_t spilled_rows;
+    size_t emit_index;
+
+    virtual void reset_table();
+
+    virtual void consume(PlanOperator *source_child, SpillFile *source_file);
+
+    virtual void accumulate(const ValueDict &row);
+
+    /**
+     * Queue the partitions the last consume() spilled to.
+     */
+    virtual void queue_partitions();
+
+    virtual Group *find_group(const std::string &key, size_t hash);
+
+    virtual Group &add_group(const std::string &key, size_t hash, std::vector<Value> &group_values);
+
+    virtual void grow();
+
+    virtual void update(AggregateState &state, const Aggregate &aggregate, const ValueDict &row);
+
+    virtual void merge(AggregateState &state, const Aggregate &aggregate, const ValueDict &row);
+
+    virtual void emit(const Group &group, ValueDict &row) const;
+
+    virtual Value final_value(const AggregateState &state, const Aggregate &aggregate) const;
+};
+
+// Test function for the aggregation operator, returns true if all tests pass.
+bool test_aggregate_plan();
@@ -0,0 +1,355 @@
+/**
+ * @file BatchPlan.h - Vectorized (batch-at-a-time) plan operators.
+ *
+ * Instead of pulling one ValueDict per next() call, these operators exchange RowBatch
+ * objects holding up to RowBatch::CAPACITY rows in columnar form: INT columns are
+ * contiguous int32_t arrays and TEXT columns are an offsets array into one byte
+ * buffer. Filtering doesn't move data; it narrows the batch's selection vector.
+ *
+ * BatchOperator
+ *     BatchTableScan      decodes SlottedPage records straight into batches
+ *     BatchFilter         applies a compiled WHERE predicate to each batch
+ * BatchToRows             adapts a BatchOperator to the row-at-a-time PlanOperator interface
+ */
+#pragma once
+
+#include "QueryPlan.h"
+#include "heap_storage.h"
+#include "brin_index.h"
+
+/**
+ * @class ColumnVector - the values of one column for every row in a batch
+ */
+class ColumnVector {
+public:
+    ColumnAttribute::DataType data_type;
+    std::vector<int32_t> ints;        // INT: one value per row
+    std::vector<uint32_t> offsets;    // TEXT: row i is bytes[offsets[i] .. offsets[i + 1])
+    std::vector<char> bytes;          // TEXT: all the rows' characters, back to back
+
+    ColumnVector(ColumnAttribute::DataType data_type = ColumnAttribute::INT);
+
+    void clear();
+
+    void append_int(int32_t n) { ints.push_back(n); }
+
+    void append_text(const char *data, size_t size);
+
+    const char *text_data(size_t i) const { return bytes.data() + offsets[i]; }
+
+    size_t text_size(size_t i) const { return offsets[i + 1] - offsets[i]; }
+
+    /**
+     * Get row i's value as a Value (for handing rows to row-at-a-time operators).
+     */
+    Value get(size_t i) const;
+};
+
+typedef uint16_t SelectionIndex;
+typedef std::vector<SelectionIndex> SelectionVector;
+
+/**
+ * @class RowBatch - up to CAPACITY rows in columnar form plus the indices of the live ones
+ */
+class RowBatch {
+public:
+    static const size_t CAPACITY = 1024;
+
+    ColumnNames column_names;
+    std::vector<ColumnVector> columns;
+    size_t size;                    // rows physically present in the columns
+    SelectionVector selection;      // indices of the rows that are still selected, ascending
+
+    RowBatch() : size(0) {}
+
+    /**
+     * Set up empty columns of the given types (keeps allocated capacity when reused).
+     */
+    void reset(const ColumnNames &column_names, const ColumnAttributes &column_attributes);
+
+    /**
+     * Empty the columns but keep the layout.
+     */
+    void clear();
+
+    /**
+     * Mark every physically present row as selected.
+     */
+    void select_all();
+
+    bool full() const { return size >= CAPACITY; }
+};
+
+/**
+ * @class BatchOperator - abstract base class of vectorized operators
+ */
+class BatchOperator {
+public:
+    BatchOperator() {}
+
+    virtual ~BatchOperator() {}
+
+    BatchOperator(const BatchOperator &other) = delete;
+
+    BatchOperator &operator=(const BatchOperator &other) = delete;
+
+    virtual void open() = 0;
+
+    /**
+     * Produce the next batch.
+     * @param batch  refilled with the next rows; at least one row is selected on success
+     * @returns      false when the operator is exhausted
+     */
+    virtual bool next(RowBatch &batch) = 0;
+
+    virtual void close() = 0;
+
+    virtual const ColumnNames &get_column_names() const { return column_names; }
+
+    virtual const ColumnAttributes &get_column_attributes() const { return column_attributes; }
+
+    /**
+     * Rough number of rows this operator will produce, for choosing between plans.
+     */
+    virtual size_t estimated_rows() = 0;
+
+    /**
+     * For EXPLAIN: see PlanOperator.
+     */
+    virtual std::string get_name() = 0;
+
+    virtual void get_expressions(LabeledExpressions &) const {}
+
+    virtual std::vector<BatchOperator **> get_children() { return std::vector<BatchOperator **>(); }
+
+protected:
+    ColumnNames column_names;
+    ColumnAttributes column_attributes;
+};
+
+class BatchPredicate;
+
+/**
+ * @class BatchTableScan - reads a HeapTable a block at a time, decoding records into batches
+ *
+ * Sees the rows in the snapshot taken when it is opened. Blocks are read into the scan's
+ * arena, which is reset as it moves from block to block.
+ *
+ * Filters pushed into the scan (add_filter) are applied as records are decoded: only the
+ * columns the filters read are decoded for every record, and the rest only for the records
+ * that pass, straight from the block (see HeapTable's record format). When the filters
+ * limit a column with a BRIN index, open() leaves out the blocks the index rules out
+ * (unless told not to, as when the blocks left are scattered enough to cost more than
+ * reading them all; see Optimizer::choose_access_path).
+ */
+class BatchTableScan : public BatchOperator {
+public:
+    /**
+     * @param table      the table to scan
+     * @param qualifier  what the query calls the table, if not its name (shown by get_name)
+     */
+    BatchTableScan(HeapTable &table, const Identifier &qualifier = "");
+
+    virtual ~BatchTableScan();
+
+    virtual void open();
+
+    virtual bool next(RowBatch &batch);
+
+    virtual void close();
+
+    /**
+     * Only produce the rows that satisfy a predicate, too.
+     * @param predicate  compiled against this scan's columns (owned)
+     * @param expr       the expression it was compiled from, for EXPLAIN
+     */
+    virtual void add_filter(BatchPredicate *predicate, const hsql::Expr *expr = nullptr);
+
+    virtual size_t estimated_rows();
+
+    virtual std::string get_name();
+
+    virtual void get_expressions(LabeledExpressions &expressions) const;
+
+    /**
+     * @returns  how many of the table's blocks the last open left out, thanks to BRIN indexes
+     */
+    virtual size_t get_blocks_skipped() const { return blocks_skipped; }
+
+    /**
+     * Choose whether open() leaves out the blocks the BRIN indexes rule out (it does by
+     * default).
+     */
+    virtual void set_use_brin(bool use_brin) { this->use_brin = use_brin; }
+
+    virtual bool get_use_brin() const { return use_brin; }
+
+    /**
+     * Count the blocks a scan opened now would read.
+     * @param use_brin  whether to leave out those the BRIN indexes rule out
+     * @param runs      set to the number of runs of consecutive blocks among them
+     * @returns         the blocks
+     */
+    virtual size_t blocks_to_read(bool use_brin, size_t &runs);
+
+    /**
+     * Estimate the rows as this fraction of the table's, rather than a third per filter.
+     */
+    virtual void set_selectivity(double selectivity) { this->selectivity = selectivity; }
+
+protected:
+    HeapTable &table;
+    Identifier qualifier;
+    std::shared_ptr<const Snapshot> snapshot;
+    BlockIDs block_ids;  // kept between opens for its memory
+    size_t block_index;
+    Arena arena;  // the current block and what was read from it
+    SlottedPage *block;
+    ArenaRecordIDs *record_ids;
+    size_t record_index;
+    std::vector<BatchPredicate *> filters;
+    std::vector<const hsql::Expr *> filter_exprs;
+    std::vector<size_t> all_columns;
+    std::vector<size_t> filter_columns;  // the columns the filters read
+    RowBatch probe;                      // the filter columns of the records being filtered
+    SelectionVector passed;
+    size_t blocks_skipped;
+    bool use_brin;
+    double selectivity;  // or negative if not known
+
+    /**
+     * Leave out of block_ids the blocks the BRIN indexes rule out for the filters.
+     * @returns  the blocks left out
+     */
+    virtual size_t prune(BlockIDs &block_ids);
+
+    /**
+     * Append the given columns of a marshaled record to the batch's columns (leaving the
+     * others as they are) and count it as a row of the batch.
+     */
+    virtual void decode(const char *bytes, const std::vector<size_t> &columns, RowBatch &batch);
+
+    /**
+     * Apply the filters to the next count records of the block, appending those that pass
+     * to the batch.
+     */
+    virtual void filter(size_t count, RowBatch &batch);
+
+    virtual void release_block();
+};
+
+/**
+ * @class BatchPredicate - a WHERE expression compiled into vectorized kernels
+ *
+ * Each node takes the selection vector of rows still in play and narrows it to the
+ * rows for which the node is true.
+ */
+class BatchPredicate {
+public:
+    virtual ~BatchPredicate() {}
+
+    /**
+     * Narrow a selection to the rows satisfying this predicate.
+     * @param batch  rows to test
+     * @param in     selected row indices to test (ascending)
+     * @param out    replaced with the passing subset of in (ascending)
+     */
+    virtual void apply(const RowBatch &batch, const SelectionVector &in, SelectionVector &out) const = 0;
+
+    /**
+     * Mark the batch columns the predicate reads (apply touches no others).
+     * @param used  one flag per column of the batch layout
+     */
+    virtual void columns_used(std::vector<bool> &used) const = 0;
+
+    /**
+     * Narrow the values of a column to those a row could have and pass.
+     * @param column  a column of the batch layout
+     * @param range   narrowed, if the predicate says how (a parameter that isn't bound
+     *                yet doesn't)
+     * @returns       true if the predicate limits the column's values at all
+     */
+    virtual bool narrow(size_t, KeyRange &) const { return false; }
+
+    /**
+     * Compile a WHERE expression against a batch layout.
+     * Supports comparisons between columns and literals (or two columns of the same type)
+     * combined with AND, OR and NOT.
+     * @param expr          expression to compile
+     * @param column_names  layout of the batches the predicate will see
+     * @param attributes    their types
+     * @returns             the compiled predicate (freed by caller), or nullptr if expr
+     *                      uses something the kernels can't handle
+     */
+    static BatchPredicate *compile(const hsql::Expr *expr, const ColumnNames &column_names,
+                                   const ColumnAttributes &attributes);
+};
+
+/**
+ * @class BatchFilter - applies a compiled predicate, skipping batches where nothing passes
+ */
+class BatchFilter : public BatchOperator {
+public:
+    /**
+     * @param child      batches to filter (owned)
+     * @param predicate  compiled predicate (owned)
+     * @param expr       the expression it was compiled from, for EXPLAIN
+     */
+    BatchFilter(BatchOperator *child, BatchPredicate *predicate, const hsql::Expr *expr = nullptr);
+
+    virtual ~BatchFilter();
+
+    virtual void open();
+
+    virtual bool next(RowBatch &batch);
+
+    virtual void close();
+
+    virtual size_t estimated_rows() { return child->estimated_rows() / 3; }
+
+    virtual std::string get_name() { return "BatchFilter"; }
+
+    virtual void get_expressions(LabeledExpressions &expressions) const;
+
+    virtual std::vector<BatchOperator **> get_children() { return std::vector<BatchOperator **>(1, &child); }
+
+protected:
+    BatchOperator *child;
+    BatchPredicate *predicate;
+    const hsql::Expr *expr;
+    SelectionVector scratch;
+};
+
+/**
+ * @class BatchToRows - hands the selected rows of each batch one at a time to row operators
+ */
+class BatchToRows : public PlanOperator {
+public:
+    /**
+     * @param child      batches to unpack
+     * @param qualifier  if not empty, output columns are named "qualifier.column"
+     */
+    BatchToRows(BatchOperator *child, const Identifier &qualifier = "");
+
+    virtual ~BatchToRows();
+
+    virtual void open();
+
+    virtual bool next(ValueDict &row);
+
+    virtual void close();
+
+    virtual size_t estimated_rows() { return child->estimated_rows(); }
+
+    virtual std::string get_name() { return "BatchToRows"; }
+
+    virtual std::vector<BatchOperator **> get_batch_children() { return std::vector<BatchOperator **>(1, &child); }
+
+protected:
+    BatchOperator *child;
+    RowBatch batch;
+    size_t position;
+};
+
+// Test function for the vectorized operators, returns true if all tests pass.
+bool test_batch_plan();
@@ -0,0 +1,116 @@
+/**
+ * @file ExplainPlan.h - Instrumentation of plans for EXPLAIN ANALYZE.
+ *
+ * analyze_plan() wraps every operator of a plan in an AnalyzedOperator (or, for
+ * vectorized operators, an AnalyzedBatchOperator), which passes each call through and
+ * records the rows produced, the blocks read and the time spent, plus the most memory
+ * the operator reported holding. An operator's inputs are pulled from within its own
+ * calls, so its time and blocks include theirs.
+ */
+#pragma once
+
+#include "QueryPlan.h"
+#include "BatchPlan.h"
+
+/**
+ * What one operator did during a run.
+ */
+struct OperatorStats {
+    size_t rows;            // rows produced (selected rows, for vectorized operators)
+    size_t batches;         // batches produced (vectorized operators only)
+    uint64_t blocks_read;   // blocks read from heap files
+    uint64_t nanoseconds;   // wall time in open(), next() and close()
+    size_t peak_memory;     // most bytes get_memory_used() reported
+
+    OperatorStats() : rows(0), batches(0), blocks_read(0), nanoseconds(0), peak_memory(0) {}
+};
+
+/**
+ * @class AnalyzedOperator - passes calls through to an operator and records its OperatorStats
+ */
+class AnalyzedOperator : public PlanOperator {
+public:
+    /**
+     * @param op  operator to measure (owned)
+     */
+    explicit AnalyzedOperator(PlanOperator *op);
+
+    virtual ~AnalyzedOperator();
+
+    virtual void open();
+
+    virtual bool next(ValueDict &row);
+
+    virtual void close();
+
+    virtual const ColumnNames &get_column_names() const { return op->get_column_names(); }
+
+    virtual size_t estimated_rows() { return op->estimated_rows(); }
+
+    virtual std::string get_name() { return op->get_name(); }
+
+    virtual void get_expressions(LabeledExpressions &expressions) const { op->get_expressions(expressions); }
+
+    virtual std::vector<PlanOperator **> get_children() { return op->get_children(); }
+
+    virtual std::vector<BatchOperator **> get_batch_children() { return op->get_batch_children(); }
+
+    virtual size_t get_memory_used() const { return op->get_memory_used(); }
+
+    virtual PlanOperator *get_operator() const { return op; }
+
+    virtual const OperatorStats &get_stats() const { return stats; }
+
+protected:
+    PlanOperator *op;
+    OperatorStats stats;
+};
+
+/**
+ * @class AnalyzedBatchOperator - AnalyzedOperator for vectorized operators
+ */
+class AnalyzedBatchOperator : public BatchOperator {
+public:
+    /**
+     * @param op  operator to measure (owned)
+     */
+    explicit AnalyzedBatchOperator(BatchOperator *op);
+
+    virtual ~AnalyzedBatchOperator();
+
+    virtual void open();
+
+    virtual bool next(RowBatch &batch);
+
+    virtual void close();
+
+    virtual const ColumnNames &get_column_names() const { return op->get_column_names(); }
+
+    virtual const ColumnAttributes &get_column_attributes() const { return op->get_column_attributes(); }
+
+    virtual size_t estimated_rows() { return op->estimated_rows(); }
+
+    virtual std::string get_name() { return op->get_name(); }
+
+    virtual void get_expressions(LabeledExpressions &expressions) const { op->get_expressions(expressions); }
+
+    virtual std::vector<BatchOperator **> get_children() { return op->get_children(); }
+
+    virtual BatchOperator *get_operator() const { return op; }
+
+    virtual const OperatorStats &get_stats() const { return stats; }
+
+protected:
+    BatchOperator *op;
+    OperatorStats stats;
+};
+
+/**
+ * Wrap every operator of a plan for EXPLAIN ANALYZE. Must be done before the plan is
+ * first opened (operators may keep pointers to their inputs once open).
+ * @param plan  root of the plan; replaced by its AnalyzedOperator
+ */
+void analyze_plan(PlanOperator *&plan);
+
+// Test function for the EXPLAIN ANALYZE instrumentation, returns true if all tests pass.
+bool test_explain_plan();
@@ -0,0 +1,256 @@
+/**
+ * @file JoinPlan.h - Join operators.
+ *
+ * HashJoin handles joins with at least one equality between the two inputs. It builds
+ * a hash table on the smaller input and streams the other one past it; when the build
+ * side doesn't fit in its memory budget, both inputs are hash-partitioned into spill
+ * files and joined one partition pair at a time (a grace hash join). A partition whose
+ * build half still doesn't fit is split again with another hash seed; one that can't be
+ * split (e.g., every row has the same key) is joined a budget's worth of build rows at a
+ * time, rescanning its probe half for each.
+ * NestedLoopJoin is only for conditions with no equality to hash on (and cross products).
+ *
+ * Both produce the left input's columns followed by the right input's. Outer joins fill
+ * the columns of the missing side with NULLs.
+ */
+#pragma once
+
+#include <memory>
+#include <unordered_map>
+#include "QueryPlan.h"
+#include "SpillFile.h"
+
+enum JoinKind {
+    INNER_JOIN, LEFT_OUTER_JOIN, RIGHT_OUTER_JOIN
+};
+
+/**
+ * Which input a HashJoin builds its hash table on.
+ */
+enum BuildSide {
+    BUILD_SMALLER, BUILD_LEFT, BUILD_RIGHT
+};
+
+/**
+ * @class HashJoin - equi-join that builds on the smaller input and spills when it must
+ */
+class HashJoin : public PlanOperator {
+public:
+    static const size_t NUM_PARTITIONS = 16;
+
+    /**
+     * Times a partition may be split again before it is joined in chunks instead.
+     */
+    static const size_t MAX_PARTITION_DEPTH = 3;
+
+    /**
+     * @param left           left input (owned)
+     * @param right          right input (owned)
+     * @param left_keys      key expressions over the left input's columns
+     * @param right_keys     matching key expressions over the right input's columns
+     * @param join_type      inner, left outer or right outer
+     * @param residual       further conditions a matching pair must satisfy
+     * @param memory_budget  bytes of build rows to hold before partitioning to disk
+     */
+    HashJoin(PlanOperator *left, PlanOperator *right,
+             const std::vector<const hsql::Expr *> &left_keys,
+             const std::vector<const hsql::Expr *> &right_keys,
+             JoinKind join_type = INNER_JOIN,
+             const std::vector<const hsql::Expr *> &residual = std::vector<const hsql::Expr *>(),
+             size_t memory_budget = DEFAULT_MEMORY_BUDGET);
+
+    virtual ~HashJoin();
+
+    virtual void open();
+
+    virtual bool next(ValueDict &row);
+
+    virtual void close();
+
+    virtual size_t estimated_rows();
+
+    virtual std::string get_name();
+
+    virtual void get_expressions(LabeledExpressions &expressions) const;
+
+    virtual std::vector<PlanOperator **> get_children();
+
+    virtual size_t get_memory_used() const { return build_memory; }
+
+    /**
+     * @returns  true if the last run had to partition its inputs to disk
+     */
+    virtual bool did_spill() const { return spilled; }
+
+    /**
+     * Build on the given input (the default is whichever has fewer estimated rows when
+     * the join is opened).
+     */
+    virtual void set_build_side(BuildSide build_side) { this->build_side = build_side; }
+
+    /**
+     * Estimate the join's rows as this fraction of all the pairs of input rows, rather
+     * than as the larger input's.
+     */
+    virtual void set_selectivity(double selectivity) { this->selectivity = selectivity; }
+
+protected:
+    struct BuildRow {
+        ValueDict row;
+        bool matched;
+    };
+
+    enum Phase {
+        PROBING, UNMATCHED_BUILD_ROWS, DONE
+    };
+
+    /**
+     * The build and probe rows of one hash partition; depth is how many times it has been split again.
+     */
+    struct Partition {
+        std::unique_ptr<SpillFile> build;
+        std::unique_ptr<SpillFile> probe;
+        size_t depth;
+    };
+
+    PlanOperator *left;
+    PlanOperator *right;
+    std::vector<const hsql::Expr *> left_keys;
+    std::vector<const hsql::Expr *> right_keys;
+    JoinKind join_type;
+    std::vector<const hsql::Expr *> residual;
+    size_t memory_budget;
+    BuildSide build_side;
+    double selectivity;  // or negative if not known
+
+    // chosen in open() (see builds_left)
+    bool build_left;
+    PlanOperator *build;
+    PlanOperator *probe;
+    const std::vector<const hsql::Expr *> *build_keys;
+    const std::vector<const hsql::Expr *> *probe_keys;
+    bool keep_unmatched_build;
+    bool keep_unmatched_probe;
+
+    std::vector<BuildRow> build_rows;
+    std::unordered_multimap<std::string, size_t> hash_table;
+    size_t build_memory;
+
+    bool spilled;
+    std::vector<Partition> partitions;  // still to be joined, taken from the back
+    Partition partition;                // being joined
+    size_t build_rows_read;             // from partition.build so far
+    bool chunked;                       // partition.build is loaded a budget's worth at a time
+    std::vector<bool> probe_ever_matched;  // by probe row of a chunked partition
+    size_t probe_index;
+
+    Phase phase;
+    ValueDict probe_row;
+    bool have_probe_row;
+    bool probe_matched;
+    std::unordered_multimap<std::string, size_t>::const_iterator candidate, candidates_end;
+    size_t unmatched_index;
+
+    /**
+     * Compute a row's join key.
+     * @returns  false if any key is NULL (the row can't match anything)
+     */
+    virtual bool make_key(const std::vector<const hsql::Expr *> &keys, const ValueDict &row, std::string &key);
+
+    virtual size_t partition_of(const std::string &key, size_t depth) const;
+
+    virtual void add_build_row(const ValueDict &row, const std::string &key, bool has_key);
+
+    virtual void spill(const ValueDict &row, const std::string &key, bool has_key, size_t depth,
+                       std::vector<Partition> &parts, bool build_half);
+
+    virtual void partition_inputs();
+
+    /**
+     * Load the next pending partition (or its first chunk) into the hash table.
+     * @returns  false if there are none left
+     */
+    virtual bool next_partition();
+
+    /**
+     * Add build rows from the current partition to the hash table until they fill the budget.
+     * @returns  true if that was the last of them
+     */
+    virtual bool load_chunk();
+
+    /**
+     * Split the current partition NUM_PARTITIONS ways with the next depth's hash seed.
+     * @returns  false (and leaves it alone) if all of its build rows would land in one piece
+     */
+    virtual bool repartition();
+
+    virtual bool next_probe_row();
+
+    virtual void combine(const ValueDict &build_row, const ValueDict &probe_row, ValueDict &row) const;
+
+    virtual void pad(const ValueDict &present, bool present_is_build, ValueDict &row) const;
+
+    /**
+     * @returns  whether to build on the left input, as build_side says
+     */
+    virtual bool builds_left();
+};
+
+/**
+ * @class NestedLoopJoin - compares every pair of rows; the right input is held in memory
+ */
+class NestedLoopJoin : public PlanOperator {
+public:
+    /**
+     * @param left        left input (owned)
+     * @param right       right input (owned), materialized on open()
+     * @param join_type   inner, left outer or right outer
+     * @param conditions  predicates a pair must satisfy (none for a cross product)
+     */
+    NestedLoopJoin(PlanOperator *left, PlanOperator *right, JoinKind join_type = INNER_JOIN,
+                   const std::vector<const hsql::Expr *> &conditions = std::vector<const hsql::Expr *>());
+
+    virtual ~NestedLoopJoin();
+
+    virtual void open();
+
+    virtual bool next(ValueDict &row);
+
+    virtual void close();
+
+    virtual size_t estimated_rows();
+
+    virtual std::string get_name();
+
+    virtual void get_expressions(LabeledExpressions &expressions) const;
+
+    virtual std::vector<PlanOperator **> get_children();
+
+    virtual size_t get_memory_used() const { return right_memory; }
+
+    /**
+     * Estimate the join's rows as this fraction of all the pairs of input rows, rather
+     * than a third of them per condition.
+     */
+    virtual void set_selectivity(double selectivity) { this->selectivity = selectivity; }
+
+protected:
+    PlanOperator *left;
+    PlanOperator *right;
+    JoinKind join_type;
+    std::vector<const hsql::Expr *> conditions;
+    double selectivity;  // or negative if not known
+    std::vector<ValueDict> right_rows;
+    size_t right_memory;
+    std::vector<bool> right_matched;
+    ValueDict left_row;
+    bool have_left_row;
+    bool left_matched;
+    size_t right_index;
+    bool emitting_unmatched_right;
+
+    virtual bool next_left_row();
+};
+
+// Test function for the join operators, returns true if all tests pass.
+bool test_join_plan();
@@ -0,0 +1,202 @@
+/**
+ * @file Metrics.h - Counters and latency histograms for the storage layer and executor.
+ *
+ * Each thread counts into its own slots, so counting is a plain load and store with no
+ * locking or shared cache lines; SHOW STATS sums every thread's slots (plus those of
+ * threads that have exited). Instrumented code uses the METRIC_* macros, which compile
+ * to nothing unless SQL5300_METRICS is defined (see the Makefile).
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum MetricCounter {
+    BLOCK_READS,        // HeapFile::get
+    BLOCK_WRITES,       // HeapFile::put and get_new
+    BLOCKS_ALLOCATED,   // HeapFile::get_new
+    BYTES_READ,
+    BYTES_WRITTEN,
+    RECORDS_ADDED,      // SlottedPage::add
+    RECORDS_UPDATED,    // SlottedPage::put
+    RECORDS_DELETED,    // SlottedPage::del
+    MARSHAL_CALLS,      // HeapTable::marshal
+    MARSHAL_BYTES,
+    UNMARSHAL_CALLS,    // HeapTable::unmarshal
+    UNMARSHAL_BYTES,
+    SPILL_BYTES_WRITTEN,
+    STATEMENTS,         // SqlExecutor::execute
+    COMMITS,            // Transaction::commit
+    ABORTS,             // Transaction::abort
+    LOG_FLUSHES,        // GroupCommit flusher
+    LATCH_WAITS,        // PageLatch acquisitions that had to wait
+    VERSIONS_RECLAIMED, // HeapTable::prune
+    ARENA_CHUNK_MALLOCS, // Arena chunks that came from malloc rather than the pool
+    ROWS_MOVED,         // HeapTable::vacuum, merging sparse blocks
+    BLOCKS_TRUNCATED,   // HeapFile::remove_last
+    BRIN_BLOCKS_SKIPPED, // blocks a scan left out because a BrinIndex ruled them out
+    RANGES_SUMMARIZED,  // BrinIndex::summarize
+    MEMTABLES_WRITTEN,  // LsmTable memtables written out as runs
+    RUNS_MERGED,        // LsmTable runs merged away by compaction
+    BLOOM_FILTER_SKIPS, // LsmTable runs a point read skipped because of their Bloom filters
+    PLANS_REBUILT,      // SqlExecutor::runPrepared, plans made stale by a catalog change
+    NUM_METRIC_COUNTERS
+};
+
+enum MetricHistogram {
+    BLOCK_READ_LATENCY,
+    BLOCK_WRITE_LATENCY,
+    STATEMENT_LATENCY,
+    COMMIT_LATENCY,     // Transaction::commit, including the wait for the log flush
+    NUM_METRIC_HISTOGRAMS
+};
+
+/**
+ * @class LatencyHistogram - latencies in log-linear buckets, HDR-histogram style
+ *
+ * 16 sub-buckets per power of two of nanoseconds, so a value is within about 6% of its
+ * bucket's lower bound, which is what percentile() reports.
+ */
+class LatencyHistogram {
+public:
+    static const int SUB_BUCKET_BITS = 4;
+    static const size_t NUM_BUCKETS = (64 - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS;
+
+    LatencyHistogram();
+
+    virtual ~LatencyHistogram() {}
+
+    virtual void record(uint64_t nanoseconds);
+
+    virtual void merge(const LatencyHistogram &other);
+
+    virtual uint64_t get_count() const { return total; }
+
+    virtual double get_mean() const { return total == 0 ? 0 : (double)sum / total; }
+
+    virtual uint64_t get_max() const { return max; }
+
+    /**
+     * @param p  percentile, 0 to 100
+     * @returns  lower bound (in ns) of the bucket holding the value at percentile p
+     */
+    virtual uint64_t percentile(double p) const;
+
+    static size_t bucket(uint64_t nanoseconds);
+
+    static uint64_t lower_bound(size_t bucket);
+
+protected:
+    friend class Metrics;
+
+    std::vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+};
+
+/**
+ * @class Metrics - the process-wide registry of per-thread counters and histograms
+ */
+class Metrics {
+public:
+    /**
+     * One thread's counts. Only the owning thread writes them; readers use relaxed loads.
+     */
+    struct ThreadSlots {
+        std::atomic<uint64_t> counters[NUM_METRIC_COUNTERS];
+        std::atomic<uint64_t> buckets[NUM_METRIC_HISTOGRAMS][LatencyHistogram::NUM_BUCKETS];
+        std::atomic<uint64_t> sums[NUM_METRIC_HISTOGRAMS];
+        std::atomic<uint64_t> maxes[NUM_METRIC_HISTOGRAMS];
+
+        ThreadSlots();
+    };
+
+    static void add(MetricCounter counter, uint64_t n)
+    {
+        std::atomic<uint64_t> &slot = local().counters[counter];
+        slot.store(slot.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static void record(MetricHistogram histogram, uint64_t nanoseconds);
+
+    /**
+     * @returns  what the calling thread alone has counted so far (for EXPLAIN ANALYZE)
+     */
+    static uint64_t thread_count(MetricCounter counter)
+    {
+        return local().counters[counter].load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Sum the counts of all threads, live and exited.
+     * @param counters    set to the counter totals, indexed by MetricCounter
+     * @param histograms  set to the merged histograms, indexed by MetricHistogram
+     */
+    static void snapshot(std::vector<uint64_t> &counters, std::vector<LatencyHistogram> &histograms);
+
+    static const char *counter_name(MetricCounter counter);
+
+    static const char *histogram_name(MetricHistogram histogram);
+
+    /**
+     * @returns  whether the METRIC_* macros were compiled in
+     */
+    static bool enabled();
+
+    /**
+     * Add one thread's slots to totals.
+     */
+    static void add_slots(const ThreadSlots &slots, std::vector<uint64_t> &counters,
+                          std::vector<LatencyHistogram> &histograms);
+
+private:
+    static ThreadSlots &local();
+};
+
+/**
+ * Records the time from construction to destruction in a histogram.
+ */
+class MetricTimer {
+public:
+    explicit MetricTimer(MetricHistogram histogram)
+        : histogram(histogram), start(std::chrono::steady_clock::now()) {}
+
+    ~MetricTimer()
+    {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        Metrics::record(histogram, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+    MetricTimer(const MetricTimer &other) = delete;
+
+    MetricTimer &operator=(const MetricTimer &other) = delete;
+
+private:
+    MetricHistogram histogram;
+    std::chrono::steady_clock::time_point start;
+};
+
+#define METRIC_CONCAT_(a, b) a##b
+#define METRIC_CONCAT(a, b) METRIC_CONCAT_(a, b)
+
+#ifdef SQL5300_METRICS
+#define METRIC_ADD(counter, n) Metrics::add(counter, n)
+#define METRIC_TIME(histogram) MetricTimer METRIC_CONCAT(metric_timer_, __LINE__)(histogram)
+#else
+#define METRIC_ADD(counter, n) ((void)0)
+#define METRIC_TIME(histogram) ((void)0)
+#endif
+
+#define METRIC_INC(counter) METRIC_ADD(counter, 1)
+
+/**
+ * Format the current counters and histograms as a table (for SHOW STATS).
+ */
+std::string format_metrics();
+
+// Test function for the metrics registry, returns true if all tests pass.
+bool test_metrics();
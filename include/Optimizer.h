@@ -0,0 +1,117 @@
+/**
+ * @file Optimizer.h - Cost-based choices for SELECT plans.
+ * JoinInput
+ * JoinTree
+ * Optimizer
+ *
+ * The optimizer estimates how many rows each part of a plan produces from the tables'
+ * statistics (see table_stats.h): a predicate's selectivity comes from the histograms and
+ * distinct-value counts of the columns it compares. A table that hasn't been analyzed gets
+ * the executor's old guess of a third of the rows per predicate, and a join key of one is
+ * taken to be unique. Costs are in units of one block read.
+ *
+ * It chooses
+ *   - the access path of each heap table: a full scan, or a scan that skips the blocks its
+ *     BRIN indexes rule out (the only indexes there are), whichever costs less when every
+ *     run of blocks read costs a seek;
+ *   - the join order of each run of inner joins and cross products in a FROM clause: by
+ *     dynamic programming over the subsets of its inputs, bushy trees and all, for up to
+ *     MAX_DP_INPUTS inputs, and greedily beyond, joining the pair with the smallest result
+ *     first;
+ *   - the build side of each hash join: the input with fewer estimated rows.
+ * Outer joins aren't reordered; their inputs are joined as the query has them.
+ */
+#pragma once
+
+#include <memory>
+#include "QueryPlan.h"
+#include "BatchPlan.h"
+#include "table_stats.h"
+
+/**
+ * @struct JoinInput - what the optimizer knows of one input of a join (or of a scan)
+ */
+struct JoinInput {
+    ColumnNames column_names;             // as the query's expressions name them
+    ColumnNames table_column_names;       // the same columns' names in the table scanned, or empty
+    std::shared_ptr<TableStats> stats;    // the table's statistics, or nullptr
+    double rows;                          // rows the input produces (before any predicate given with it)
+
+    JoinInput() : rows(0) {}
+};
+
+/**
+ * @struct JoinTree - an order to join inputs in: a leaf is an input, any other node joins two trees
+ */
+struct JoinTree {
+    int input;                        // a leaf's input, or -1 for a join
+    std::unique_ptr<JoinTree> left;
+    std::unique_ptr<JoinTree> right;
+    bool build_left;                  // whether a hash join builds on its left input
+    double rows;                      // estimated rows out
+    double cost;                      // estimated cost of the whole tree
+
+    JoinTree() : input(-1), build_left(false), rows(0), cost(0) {}
+};
+
+/**
+ * @class Optimizer - estimates selectivities and costs, and picks access paths and join orders
+ */
+class Optimizer {
+public:
+    static const size_t MAX_DP_INPUTS = 10;
+    static constexpr double DEFAULT_SELECTIVITY = 1.0 / 3;
+    static constexpr double SEEK_COST = 4;      // starting a run of blocks not read in sequence
+    static constexpr double ROW_COST = 0.01;    // probing, comparing or producing a row
+    static constexpr double BUILD_COST = 0.02;  // adding a row to a hash table
+
+    enum AccessPath {
+        FULL_SCAN, BRIN_SCAN
+    };
+
+    /**
+     * @param expr    a predicate on the inputs' columns
+     * @param inputs  the inputs its column references resolve in
+     * @returns       the estimated fraction of the inputs' rows (or combinations of rows, for
+     *                a predicate on several inputs) for which it is true
+     */
+    static double selectivity(const hsql::Expr *expr, const std::vector<JoinInput> &inputs);
+
+    /**
+     * @returns  the estimated fraction of rows for which all the predicates are true
+     */
+    static double selectivity(const std::vector<const hsql::Expr *> &conjuncts, const std::vector<JoinInput> &inputs);
+
+    /**
+     * @param blocks  blocks read
+     * @param runs    runs of consecutive blocks they make
+     * @returns       the cost of reading them
+     */
+    static double scan_cost(size_t blocks, size_t runs) { return (double)blocks + SEEK_COST * (double)runs; }
+
+    /**
+     * Choose whether a scan leaves out the blocks its BRIN indexes rule out for its filters
+     * (a filter on a parameter limits nothing until the scan is opened, so such a scan
+     * keeps the indexes).
+     * @returns  the path chosen
+     */
+    static AccessPath choose_access_path(BatchTableScan &scan);
+
+    /**
+     * Choose the order to join some inputs in.
+     * @param inputs      the inputs, with their estimated rows
+     * @param predicates  conditions on the inputs' columns (each on one or more inputs)
+     * @returns           the cheapest join tree found
+     */
+    static std::unique_ptr<JoinTree> order_joins(const std::vector<JoinInput> &inputs,
+                                                 const std::vector<const hsql::Expr *> &predicates);
+
+    /**
+     * @param equi  whether the join has an equality to hash on (else it's nested loops)
+     * @returns     the cost of joining inputs of the given sizes into out rows
+     */
+    static double join_cost(double left_rows, double right_rows, double out_rows, bool equi);
+};
+
+// Test function for the optimizer, returns true if all tests pass.
+bool test_optimizer();
@@ -0,0 +1,129 @@
+/**
+ * @file PlanCache.h - Prepared statements and a cache of plans for repeated SQL.
+ *
+ * A PreparedStatement is a parsed statement whose plan has been built once and can be
+ * run again and again with different values bound to its ? placeholders.
+ *
+ * Statements that arrive as plain text have their literals replaced by placeholders
+ * (normalize_sql) so that all statements of the same shape share one cache entry: a
+ * repeat skips parsing, catalog lookups and planning. Entries are evicted least
+ * recently used first, and dropped as soon as DDL touches one of their tables. A plan
+ * remembers the catalog version it was built at, so one built before a change to the
+ * catalog made in another session is rebuilt rather than run.
+ */
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include "QueryPlan.h"
+
+/**
+ * Replace the literals in a SQL statement with ? placeholders and collapse its whitespace.
+ * Integers right after LIMIT or OFFSET and in an ORDER BY list (where they name a
+ * select-list position) are left alone, as are floating-point literals and integers too
+ * big for an INT (so they are rejected, not truncated).
+ * @param sql         statement text
+ * @param normalized  set to the statement with placeholders
+ * @param parameters  set to the replaced literals' values, in order
+ * @returns           false if sql already has placeholders (and so can't be normalized)
+ */
+bool normalize_sql(const std::string &sql, std::string &normalized, std::vector<Value> &parameters);
+
+/**
+ * Count the ? placeholders in a SQL statement (outside quotes).
+ */
+size_t count_placeholders(const std::string &sql);
+
+/**
+ * @class PreparedStatement - a parsed statement and the plan built for it
+ */
+class PreparedStatement {
+public:
+    /**
+     * @param parse            parser result holding exactly one statement (owned)
+     * @param parameter_count  number of ? placeholders in the statement
+     */
+    PreparedStatement(hsql::SQLParserResult *parse, size_t parameter_count);
+
+    virtual ~PreparedStatement();
+
+    PreparedStatement(const PreparedStatement &other) = delete;
+
+    PreparedStatement &operator=(const PreparedStatement &other) = delete;
+
+    const hsql::SQLStatement *get_statement() const { return parse->getStatement(0); }
+
+    /**
+     * Discard the plan (e.g., because a table it uses changed); it is rebuilt on next use.
+     */
+    virtual void invalidate();
+
+    hsql::SQLParserResult *parse;  // owns the expressions the plan refers to
+    PlanOperator *plan;            // nullptr until built
+    size_t parameter_count;
+    std::set<Identifier> tables;   // tables the plan was built against
+    size_t catalog_version;        // of the catalog the plan was built against
+    std::mutex running;            // a plan's operators hold state, so one run at a time
+};
+
+/**
+ * @class PlanCache - prepared statements by normalized SQL text, least recently used evicted first
+ */
+class PlanCache {
+public:
+    static const size_t DEFAULT_CAPACITY = 256;
+
+    PlanCache(size_t capacity = DEFAULT_CAPACITY);
+
+    virtual ~PlanCache() {}
+
+    PlanCache(const PlanCache &other) = delete;
+
+    PlanCache &operator=(const PlanCache &other) = delete;
+
+    /**
+     * @param normalized_sql  statement text from normalize_sql
+     * @returns               the cached statement, or nullptr
+     */
+    virtual std::shared_ptr<PreparedStatement> find(const std::string &normalized_sql);
+
+    /**
+     * Add a statement, evicting the least recently used one if the cache is full.
+     */
+    virtual void insert(const std::string &normalized_sql, std::shared_ptr<PreparedStatement> statement);
+
+    /**
+     * Drop every cached statement that uses a table.
+     */
+    virtual void invalidate(const Identifier &table_name);
+
+    virtual void clear();
+
+    virtual size_t size();
+
+    virtual size_t get_hits() const { return hits; }
+
+    virtual size_t get_misses() const { return misses; }
+
+protected:
+    typedef std::list<std::string> Recency;  // most recently used first
+
+    struct Entry {
+        std::shared_ptr<PreparedStatement> statement;
+        Recency::iterator recency;
+    };
+
+    size_t capacity;
+    Recency recency;
+    std::unordered_map<std::string, Entry> entries;
+    std::atomic<size_t> hits;
+    std::atomic<size_t> misses;
+    std::mutex lock;
+};
+
+// Test function for the plan cache, returns true if all tests pass.
+bool test_plan_cache();
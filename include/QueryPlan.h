@@ -0,0 +1,534 @@
+/**
+ * @file QueryPlan.h - Physical plan operators for executing SQL statements.
+ *
+ * Every operator follows the Volcano iterator model: open() prepares it, each call
+ * to next() pulls one row through the pipeline from its children, and close()
+ * releases whatever it holds. Operators own their children.
+ *
+ * PlanOperator
+ *     TableScan, Values               (leaves)
+ *     Filter, Project, Distinct, Limit (row-at-a-time transforms)
+ *     UnionAll                        (concatenates its children)
+ *     Insert, CreateTable, CreateIndex (statements with side effects)
+ */
+#pragma once
+
+#include <stdexcept>
+#include <unordered_set>
+#include "SQLParser.h"
+#include "storage_engine.h"
+
+class Tables;
+class BatchOperator;
+
+/**
+ * @class SQLExecError - errors from building or running a plan
+ */
+class SQLExecError : public std::runtime_error {
+public:
+    explicit SQLExecError(std::string s) : runtime_error(s) {}
+};
+
+/**
+ * Evaluate an expression against a row.
+ * Column references are looked up by name (or "table.name" when qualified);
+ * comparisons and logical operators yield INT 1 or 0.
+ * @param expr  expression to evaluate
+ * Comparisons, NOT, AND and OR follow SQL's three-valued logic, with NULL as unknown.
+ * @param row   values the expression's column references refer to
+ * @returns     the expression's value
+ * @throws      SQLExecError for unknown columns, type mismatches, or unsupported expressions
+ */
+Value evaluate(const hsql::Expr *expr, const ValueDict &row);
+
+/**
+ * Render an expression as canonical SQL text (function names lower-cased, no alias,
+ * placeholders numbered $1, $2, ...).
+ * Aggregate results are stored in rows under their call's text, and a function
+ * reference evaluates to the value found under that name.
+ * @param expr  expression to render
+ * @returns     its SQL text
+ */
+std::string expression_text(const hsql::Expr *expr);
+
+/**
+ * Bind the values that placeholders (?) evaluate to in the calling thread: the nth
+ * placeholder of a statement is (*parameters)[n]. The vector must outlive the run.
+ * @param parameters  values to bind, or nullptr to unbind
+ * @param literals    true if they are the literals normalize_sql took out of the statement's
+ *                    text, which column labels and messages then show instead of placeholders
+ */
+void bind_parameters(const std::vector<Value> *parameters, bool literals = false);
+
+/**
+ * Name a placeholder for a message: the literal bound to it, if the bound parameters are
+ * literals, else "parameter n".
+ */
+std::string parameter_text(const hsql::Expr *placeholder);
+
+/**
+ * Put the literals bound in place of placeholders back into an expression's text (see
+ * expression_text); without bound literals the text is returned as it is.
+ */
+std::string with_literals(const std::string &text);
+
+/**
+ * Evaluate a predicate against a row.
+ * @returns  true if expr evaluates to a non-zero INT (or non-empty TEXT)
+ */
+bool is_true(const hsql::Expr *expr, const ValueDict &row);
+
+/**
+ * Check whether every column an expression refers to is among column_names
+ * (unqualified names must match exactly one column, qualified or not; qualified
+ * names must match a column with the same qualifier or none).
+ * @returns  false if any reference is missing or ambiguous, or the expression
+ *           contains something other than columns, literals, parameters and operators
+ */
+bool resolves_in(const hsql::Expr *expr, const ColumnNames &column_names);
+
+/**
+ * Split an expression on AND into its conjuncts.
+ * @param expr       expression to split (may be nullptr)
+ * @param conjuncts  the conjuncts are appended here
+ */
+void split_conjuncts(const hsql::Expr *expr, std::vector<const hsql::Expr *> &conjuncts);
+
+/**
+ * Append a value's binary key to key. Keys compare with memcmp in the same order as
+ * the values (NULLs first; reversed if descending), and equal values always encode
+ * identically, so concatenated keys work both for sorting and as hash keys.
+ * @param value       value to encode
+ * @param descending  true to invert the order
+ * @param key         encoding is appended here
+ */
+void encode_key(const Value &value, bool descending, std::string &key);
+
+/**
+ * Expressions an operator shows in EXPLAIN, each list under a label such as "filter".
+ */
+typedef std::vector<std::pair<std::string, std::vector<const hsql::Expr *>>> LabeledExpressions;
+
+/**
+ * @class PlanOperator - abstract base class of all physical operators
+ */
+class PlanOperator {
+public:
+    PlanOperator() {}
+
+    virtual ~PlanOperator() {}
+
+    PlanOperator(const PlanOperator &other) = delete;
+
+    PlanOperator &operator=(const PlanOperator &other) = delete;
+
+    /**
+     * Get ready to produce rows (may be called again after close() to rerun).
+     */
+    virtual void open() = 0;
+
+    /**
+     * Produce the next row.
+     * @param row  filled with the row's values, keyed by get_column_names()
+     * @returns    false when the operator is exhausted
+     */
+    virtual bool next(ValueDict &row) = 0;
+
+    /**
+     * Release any resources held since open().
+     */
+    virtual void close() = 0;
+
+    /**
+     * The names of the columns in the rows this operator produces, in display order.
+     */
+    virtual const ColumnNames &get_column_names() const { return column_names; }
+
+    /**
+     * Rough number of rows next() will produce, for choosing between plans.
+     */
+    virtual size_t estimated_rows() = 0;
+
+    /**
+     * For EXPLAIN: the operator's name and whatever it shows besides expressions
+     * (e.g., "TableScan foo", or "HashJoin inner, build right").
+     */
+    virtual std::string get_name() = 0;
+
+    /**
+     * For EXPLAIN: the expressions the operator evaluates.
+     * @param expressions  labeled lists of expressions are appended here
+     */
+    virtual void get_expressions(LabeledExpressions &) const {}
+
+    /**
+     * The members holding this operator's inputs, so EXPLAIN can walk the plan and
+     * EXPLAIN ANALYZE can wrap each input in an AnalyzedOperator.
+     */
+    virtual std::vector<PlanOperator **> get_children() { return std::vector<PlanOperator **>(); }
+
+    /**
+     * Like get_children, for inputs that are vectorized operators.
+     */
+    virtual std::vector<BatchOperator **> get_batch_children() { return std::vector<BatchOperator **>(); }
+
+    /**
+     * Bytes the operator is holding in memory for its own state (hash tables, sort runs).
+     */
+    virtual size_t get_memory_used() const { return 0; }
+
+protected:
+    ColumnNames column_names;
+};
+
+/**
+ * @class PlanRun - opens a plan, and closes it when it goes out of scope
+ *
+ * A plan left open keeps its scans' snapshots, which hold back garbage collection for as
+ * long as the plan lives (a cached plan, for one), so a run that throws must close it too.
+ */
+class PlanRun {
+public:
+    PlanRun(PlanOperator *plan);
+
+    virtual ~PlanRun();
+
+    PlanRun(const PlanRun &other) = delete;
+
+    PlanRun &operator=(const PlanRun &other) = delete;
+
+    /**
+     * Close the plan now (the destructor then leaves it alone).
+     */
+    virtual void close();
+
+protected:
+    PlanOperator *plan;  // nullptr once closed
+};
+
+/**
+ * Prefix column names with "qualifier." (an empty qualifier leaves them alone).
+ */
+ColumnNames qualify(const ColumnNames &column_names, const Identifier &qualifier);
+
+/**
+ * @class TableScan - streams every row of a relation
+ */
+class TableScan : public PlanOperator {
+public:
+    /**
+     * @param relation   table to scan
+     * @param qualifier  if not empty, output columns are named "qualifier.column"
+     */
+    TableScan(DbRelation &relation, const Identifier &qualifier = "");
+
+    virtual ~TableScan();
+
+    virtual void open();
+
+    virtual bool next(ValueDict &row);
+
+    virtual void close();
+
+    virtual size_t estimated_rows() { return relation.estimated_row_count(); }
+
+    virtual std::string get_name();
+
+protected:
+    DbRelation &relation;
+    Identifier qualifier;
+    std::unique_ptr<DbRelationScan> scan;
+    ValueDict input;
+};
+
+/**
+ * @class Values - produces rows of literal expressions (INSERT ... VALUES, SELECT without FROM)
+ */
+class Values : public PlanOperator {
+public:
+    /**
+     * @param column_names  names for the produced columns
+     * @param rows          one list of expressions per row (not owned; owned by the AST)
+     */
+    Values(const ColumnNames &column_names, const std::vector<std::vector<hsql::Expr *>> &rows);
+
+    virtual void open();
+
+    virtual bool next(ValueDict &row);
+
+    virtual void close();
+
+    virtual size_t estimated_rows() { return rows.size(); }
+
+    virtual std::string get_name() { return "Values " + std::to_string(rows.size()) + (rows.size() == 1 ? " row" : " rows"); }
+
+protected:
+    std::vector<std::vector<hsql::Expr *>> rows;
+    size_t position;
+};
+
+/**
+ * @class Filter - passes through only the rows satisfying a predicate (WHERE)
+ */
+class Filter : public PlanOperator {
+public:
+    Filter(PlanOperator *child, const hsql::Expr *predicate);
+
+    /**
+     * @param conjuncts  predicates that must all be true
+     */
+    Filter(PlanOperator *child, const std::vector<const hsql::Expr *> &conjuncts);
+
+    virtual ~Filter();
+
+    virtual void open();
+
+    virtual bool next(ValueDict &row);
+
+    virtual void close();
+
+    // unless told otherwise, assume each predicate keeps a third of the rows
+    virtual size_t estimated_rows();
+
+    virtual std::string get_name() { return "Filter"; }
+
+    virtual void get_expressions(LabeledExpressions &expressions) const;
+
+    virtual std::vector<PlanOperator **> get_children() { return std::vector<PlanOperator **>(1, &child); }
+
+    /**
+     * Estimate the rows as this fraction of the child's.
+     */
+    virtual void set_selectivity(double selectivity) { this->selectivity = selectivity; }
+
+protected:
+    PlanOperator *child;
+    std::vector<const hsql::Expr *> conjuncts;
+    double selectivity;  // or negative if not known
+};
+
+/**
+ * @class Project - computes the select list for each row
+ */
+class Project : public PlanOperator {
+public:
+    Project(PlanOperator *child, const std::vector<hsql::Expr *> &select_list);
+
+    /**
+     * Pass the child's rows through with their columns in another order.
+     * @param column_names  the child's columns, in the order to produce them
+     */
+    Project(PlanOperator *child, const ColumnNames &column_names);
+
+    virtual ~Project();
+
+    virtual void open();
+
+    virtual bool next(ValueDict &row);
+
+    virtual void close();
+
+    virtual size_t estimated_rows() { return child->estimated_rows(); }
+
+    virtual std::string get_name() { return "Project"; }
+
+    virtual void get_expressions(LabeledExpressions &expressions) const;
+
+    virtual std::vector<PlanOperator **> get_children() { return std::vector<PlanOperator **>(1, &child); }
+
+protected:
+    PlanOperator *child;
+    std::vector<const hsql::Expr *> exprs;  // nullptr entries copy the same-named input column
+    ValueDict input;
+};
+
+/**
+ * @class Distinct - passes on the first of each set of equal rows (SELECT DISTINCT)
+ *
+ * Rows are compared by the normalized keys of all their columns (see encode_key), so NULLs
+ * are equal to each other here. The rows come out in the order they came in; the keys of
+ * the rows passed on so far are kept in memory.
+ */
+class Distinct : public PlanOperator {
+public:
+    Distinct(PlanOperator *child);
+
+    virtual ~Distinct();
+
+    virtual void open();
+
+    virtual bool next(ValueDict &row);
+
+    virtual void close();
+
+    virtual size_t estimated_rows() { return child->estimated_rows(); }
+
+    virtual std::string get_name() { return "Distinct"; }
+
+    virtual std::vector<PlanOperator **> get_children() { return std::vector<PlanOperator **>(1, &child); }
+
+protected:
+    PlanOperator *child;
+    std::unordered_set<std::string> seen;
+};
+
+/**
+ * @class Limit - stops after a given number of rows, optionally skipping some first
+ */
+class Limit : public PlanOperator {
+public:
+    Limit(PlanOperator *child, int64_t limit, int64_t offset = 0);
+
+    virtual ~Limit();
+
+    virtual void open();
+
+    virtual bool next(ValueDict &row);
+
+    virtual void close();
+
+    virtual size_t estimated_rows()
+    {
+        size_t rows = child->estimated_rows();
+        return limit < 0 || (size_t)limit > rows ? rows : (size_t)limit;
+    }
+
+    virtual std::string get_name();
+
+    virtual std::vector<PlanOperator **> get_children() { return std::vector<PlanOperator **>(1, &child); }
+
+protected:
+    PlanOperator *child;
+    int64_t limit;
+    int64_t offset;
+    int64_t produced;
+};
+
+/**
+ * @class UnionAll - all the rows of each child in turn (children must have the same columns)
+ */
+class UnionAll : public PlanOperator {
+public:
+    UnionAll(const std::vector<PlanOperator *> &children);
+
+    virtual ~UnionAll();
+
+    virtual void open();
+
+    virtual bool next(ValueDict &row);
+
+    virtual void close();
+
+    virtual size_t estimated_rows();
+
+    virtual std::string get_name() { return "UnionAll"; }
+
+    virtual std::vector<PlanOperator **> get_children();
+
+protected:
+    std::vector<PlanOperator *> children;
+    size_t current;
+};
+
+/**
+ * @class Insert - inserts every row from its child into a relation; produces no rows
+ */
+class Insert : public PlanOperator {
+public:
+    /**
+     * @param relation        table to insert into
+     * @param child           source of the rows to insert
+     * @param target_columns  the table columns the child's columns go into, by position
+     */
+    Insert(DbRelation &relation, PlanOperator *child, const ColumnNames &target_columns);
+
+    virtual ~Insert();
+
+    virtual void open();
+
+    virtual bool next(ValueDict &row);
+
+    virtual void close();
+
+    virtual size_t estimated_rows() { return 0; }
+
+    virtual std::string get_name() { return "Insert " + relation.get_table_name(); }
+
+    virtual std::vector<PlanOperator **> get_children() { return std::vector<PlanOperator **>(1, &child); }
+
+    /**
+     * @returns  number of rows inserted by the last run
+     */
+    virtual size_t get_row_count() const { return row_count; }
+
+protected:
+    DbRelation &relation;
+    PlanOperator *child;
+    ColumnNames target_columns;
+    size_t row_count;
+};
+
+/**
+ * @class CreateTable - records a new table in the catalog and creates its file; produces no rows
+ */
+class CreateTable : public PlanOperator {
+public:
+    /**
+     * @param engine  storage engine for the table (see Tables::create_table)
+     */
+    CreateTable(Tables &tables, Identifier table_name, const ColumnNames &column_names,
+                const ColumnAttributes &column_attributes, bool if_not_exists, Identifier engine = "HEAP");
+
+    virtual void open();
+
+    virtual bool next(ValueDict &row);
+
+    virtual void close();
+
+    virtual size_t estimated_rows() { return 0; }
+
+    virtual std::string get_name() { return "CreateTable " + table_name; }
+
+    /**
+     * @returns  false if the last run found the table already existed (IF NOT EXISTS)
+     */
+    virtual bool was_created() const { return created; }
+
+protected:
+    Tables &tables;
+    Identifier table_name;
+    ColumnNames new_column_names;
+    ColumnAttributes new_column_attributes;
+    bool if_not_exists;
+    Identifier engine;
+    bool created;
+};
+
+/**
+ * @class CreateIndex - records a new index in the catalog and builds it; produces no rows
+ */
+class CreateIndex : public PlanOperator {
+public:
+    CreateIndex(Tables &tables, Identifier table_name, Identifier index_name, Identifier column_name,
+                Identifier index_type);
+
+    virtual void open() {}
+
+    virtual bool next(ValueDict &row);
+
+    virtual void close() {}
+
+    virtual size_t estimated_rows() { return 0; }
+
+    virtual std::string get_name() { return "CreateIndex " + index_name; }
+
+protected:
+    Tables &tables;
+    Identifier table_name;
+    Identifier index_name;
+    Identifier column_name;
+    Identifier index_type;
+};
+
+// Test function for the plan operators, returns true if all tests pass.
+bool test_query_plan();
@@ -0,0 +1,232 @@
+/**
+ * @file ResultSink.h - Streaming output of statement results.
+ * OutputBuffer
+ * ResultSink
+ * TextSink: ResultSink
+ * CsvSink: ResultSink
+ * BinarySink: ResultSink
+ *
+ * A SELECT's rows are pushed into a ResultSink one at a time as the plan produces them,
+ * rather than formatted into one string that is printed once the last row is in. Each
+ * sink formats into an OutputBuffer, which hands its bytes to the output stream in large
+ * writes once it fills, so the memory a result takes is the buffer's, however many rows
+ * there are. The first row of each result is flushed as soon as it's formatted, so it
+ * doesn't wait behind the rest.
+ *
+ * Statements that don't return rows (and errors) are a message: one line of text.
+ */
+#pragma once
+
+#include <cstring>
+#include <ostream>
+#include <vector>
+#include "storage_engine.h"
+
+/**
+ * @class OutputBuffer - a fixed-size buffer in front of an output stream
+ */
+class OutputBuffer {
+public:
+    static const size_t CAPACITY = 64 * 1024;
+
+    /**
+     * @param out       where the bytes go
+     * @param capacity  bytes buffered before they are written out
+     */
+    explicit OutputBuffer(std::ostream &out, size_t capacity = CAPACITY);
+
+    virtual ~OutputBuffer();
+
+    OutputBuffer(const OutputBuffer &other) = delete;
+
+    OutputBuffer &operator=(const OutputBuffer &other) = delete;
+
+    void write(const char *data, size_t size)
+    {
+        if (size > capacity - used)
+        {
+            write_large(data, size);
+            return;
+        }
+        memcpy(&buffer[used], data, size);
+        used += size;
+    }
+
+    void write(const std::string &text) { write(text.data(), text.size()); }
+
+    void put(char c)
+    {
+        if (used == capacity)
+            flush();
+        buffer[used++] = c;
+    }
+
+    /**
+     * Write out what is buffered (the stream itself isn't flushed).
+     */
+    virtual void flush();
+
+    std::ostream &get_stream() const { return out; }
+
+protected:
+    std::ostream &out;
+    size_t capacity;
+    std::vector<char> buffer;
+    size_t used;
+
+    /**
+     * write for data that doesn't fit in what's left of the buffer.
+     */
+    virtual void write_large(const char *data, size_t size);
+};
+
+/**
+ * @class ResultSink - where a statement's result goes
+ *
+ * A result with rows is begin, then row for each row, then end; anything else is a
+ * message.
+ */
+class ResultSink {
+public:
+    /**
+     * @param out       where the formatted results go
+     * @param capacity  bytes buffered before they are written out
+     */
+    explicit ResultSink(std::ostream &out, size_t capacity = OutputBuffer::CAPACITY);
+
+    virtual ~ResultSink() {}
+
+    ResultSink(const ResultSink &other) = delete;
+
+    ResultSink &operator=(const ResultSink &other) = delete;
+
+    /**
+     * Start a result.
+     * @param column_names  the columns of its rows, in order
+     */
+    virtual void begin(const ColumnNames &column_names);
+
+    /**
+     * Add a row to the result begun.
+     * @param row  has a value for each column (a missing one is written as NULL)
+     */
+    virtual void row(const ValueDict &row);
+
+    /**
+     * Finish the result begun, and write it out.
+     */
+    virtual void end();
+
+    /**
+     * A statement's result that isn't rows, such as "created t" or an error.
+     */
+    virtual void message(const std::string &text) = 0;
+
+    /**
+     * Write out what is buffered.
+     */
+    virtual void flush() { buffer.flush(); }
+
+    size_t get_row_count() const { return row_count; }
+
+    /**
+     * @param format  "text", "csv" or "binary"
+     * @returns       a new sink of that format (freed by caller), or nullptr if it's none
+     */
+    static ResultSink *create(const std::string &format, std::ostream &out);
+
+protected:
+    OutputBuffer buffer;
+    ColumnNames column_names;
+    size_t row_count;
+
+    virtual void write_header() = 0;
+
+    virtual void write_row(const ValueDict &row) = 0;
+
+    virtual void write_trailer() = 0;
+
+    /**
+     * @returns  the row's value for a column (a null if it has none)
+     */
+    static const Value &value_of(const ValueDict &row, const Identifier &column_name);
+};
+
+/**
+ * @class TextSink - results as the shell has always shown them
+ *
+ * The column names, a rule, a line per row (text quoted, NULL for a null) and then
+ * "successfully returned n rows".
+ */
+class TextSink : public ResultSink {
+public:
+    explicit TextSink(std::ostream &out, size_t capacity = OutputBuffer::CAPACITY) : ResultSink(out, capacity) {}
+
+    virtual void message(const std::string &text);
+
+protected:
+    virtual void write_header();
+
+    virtual void write_row(const ValueDict &row);
+
+    virtual void write_trailer();
+};
+
+/**
+ * @class CsvSink - results as comma-separated values (RFC 4180)
+ *
+ * A header line of column names, then a line per row. Text that has a comma, a quote or a
+ * line break is quoted, with its quotes doubled; a null is an empty field. A result
+ * ends with a blank line, so that the results of several statements can be told apart.
+ * A message is a line of its own.
+ */
+class CsvSink : public ResultSink {
+public:
+    explicit CsvSink(std::ostream &out, size_t capacity = OutputBuffer::CAPACITY) : ResultSink(out, capacity) {}
+
+    virtual void message(const std::string &text);
+
+protected:
+    virtual void write_header();
+
+    virtual void write_row(const ValueDict &row);
+
+    virtual void write_trailer();
+
+    virtual void write_field(const std::string &text);
+};
+
+/**
+ * @class BinarySink - results in a compact, self-describing binary format
+ *
+ * Every frame starts with a tag byte; integers are little-endian.
+ *   'H' u16 column count, then each column name as u16 length and bytes   (begin)
+ *   'R' then each column as 'N' (null), 'I' i32, or 'T' u32 length and bytes   (row)
+ *   'E' u64 row count   (end)
+ *   'M' u32 length and bytes   (message)
+ */
+class BinarySink : public ResultSink {
+public:
+    explicit BinarySink(std::ostream &out, size_t capacity = OutputBuffer::CAPACITY) : ResultSink(out, capacity) {}
+
+    virtual void message(const std::string &text);
+
+protected:
+    virtual void write_header();
+
+    virtual void write_row(const ValueDict &row);
+
+    virtual void write_trailer();
+
+    template <typename T>
+    void write_integer(T n)
+    {
+        char bytes[sizeof(T)];
+        for (size_t i = 0; i < sizeof(T); i++)
+            bytes[i] = (char)((uint64_t)n >> (8 * i));
+        buffer.write(bytes, sizeof(T));
+    }
+};
+
+// Test function for result sinks, returns true if all tests pass.
+bool test_result_sink();
@@ -0,0 +1,124 @@
+/**
+ * @file Server.h - Multi-client server mode: SQL sessions over a Unix domain socket.
+ *
+ * One event-loop thread accepts connections and reads and writes all the sockets,
+ * multiplexed with epoll. Complete statements are handed to a fixed pool of worker
+ * threads, which run them against the shared environment, catalog and plan cache, and
+ * hand the output back to the event loop to send.
+ *
+ * Protocol: the client sends statements one per line (a trailing semicolon is optional).
+ * For each, the server sends back its output (or "Error: ..."), terminated by a NUL byte.
+ * A session's statements run one at a time, in order, on the session's own SqlExecutor,
+ * so prepared statements are per connection. "quit" closes the connection.
+ */
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/epoll.h>
+#include "SqlExecutor.h"
+
+/**
+ * @class Server - listens on a Unix socket and runs its clients' statements on a worker pool
+ */
+class Server {
+public:
+    /**
+     * Listen on a socket (replacing any stale socket file at the path).
+     * @param socket_path   where to create the socket
+     * @param worker_count  number of worker threads to run statements on
+     * @throws              std::runtime_error if the socket can't be set up
+     */
+    Server(const std::string &socket_path, size_t worker_count);
+
+    /**
+     * Finish the statements already handed to workers, then close every connection and
+     * remove the socket file.
+     */
+    virtual ~Server();
+
+    Server(const Server &other) = delete;
+
+    Server &operator=(const Server &other) = delete;
+
+    /**
+     * Serve clients until stop() is called.
+     */
+    virtual void run();
+
+    /**
+     * Make run() return. Safe to call from a signal handler.
+     */
+    virtual void stop();
+
+    virtual size_t get_worker_count() const { return worker_count; }
+
+protected:
+    /**
+     * One client connection. Only the event loop touches it, except for the statement and
+     * result of the job it has out with a worker (while busy).
+     */
+    struct Session {
+        int fd;
+        std::string input;       // received, not yet run
+        std::string output;      // results not yet sent
+        SqlExecutor executor;
+        bool busy;               // a worker has its statement
+        bool closing;            // the client hung up or quit; close once idle and flushed
+        uint32_t events;         // what epoll is watching for (0 once out of the epoll set)
+        std::string statement;   // job for the worker
+        std::string result;      // the worker's answer
+
+        explicit Session(int fd) : fd(fd), busy(false), closing(false), events(EPOLLIN | EPOLLRDHUP) {}
+    };
+
+    std::string socket_path;
+    size_t worker_count;
+    int listen_fd;
+    int epoll_fd;
+    int wakeup_fd;  // eventfd: workers finished jobs, or stop() was called
+    std::atomic<bool> stopping;
+    std::map<int, std::unique_ptr<Session>> sessions;
+    std::vector<std::thread> workers;
+
+    std::mutex queue_lock;
+    std::condition_variable queue_ready;
+    std::deque<Session *> jobs;       // waiting for a worker
+    std::deque<Session *> finished;   // waiting for the event loop
+    bool workers_stopping;
+
+    virtual void accept_clients();
+
+    virtual void read_client(Session &session);
+
+    virtual void write_client(Session &session);
+
+    virtual void watch(Session &session);
+
+    /**
+     * Give the session's next complete statement to the workers, if it has one and isn't
+     * already busy; close it if it's done.
+     */
+    virtual void dispatch(Session &session);
+
+    virtual void collect_finished();
+
+    virtual void close_session(Session &session);
+
+    virtual void work();
+
+    /**
+     * Run one statement for a session, catching its errors.
+     */
+    static std::string run_statement(SqlExecutor &executor, const std::string &statement);
+};
+
+// Test function for the server, returns true if all tests pass.
+bool test_server();
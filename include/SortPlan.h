@@ -0,0 +1,187 @@
+/**
+ * @file SortPlan.h - ORDER BY.
+ *
+ * Sort evaluates each row's ORDER BY expressions once into a normalized binary key
+ * (see encode_key) so that every comparison afterwards is a plain byte comparison.
+ * Rows are collected into an in-memory run until the memory budget is reached; the
+ * run is then sorted and written to a spill file. At the end the runs are merged with
+ * a loser tree (in several passes if there are more than MAX_FAN_IN of them).
+ * With a LIMIT, only the best N rows are kept, in a heap, as long as they fit in the
+ * memory budget; past that the sort falls back to runs and merging, stopping after N rows.
+ */
+#pragma once
+
+#include <memory>
+#include "QueryPlan.h"
+#include "SpillFile.h"
+
+/**
+ * @class LoserTree - tournament tree for merging k sorted sources
+ *
+ * Each internal node remembers the loser of the match played there, so after the
+ * winning source advances only the matches on its path to the root are replayed:
+ * log2(k) comparisons per item instead of k.
+ * Less(a, b) must say whether source a's current item comes before source b's
+ * (with exhausted sources after everything).
+ */
+template<typename Less>
+class LoserTree {
+public:
+    LoserTree(size_t k, Less less) : k(k), less(less), tree(k == 0 ? 1 : k) {}
+
+    /**
+     * Play the initial tournament (call once every source has its first item).
+     */
+    void init()
+    {
+        if (k <= 1)
+        {
+            tree[0] = 0;
+            return;
+        }
+        std::vector<size_t> winners(2 * k);
+        for (size_t i = 0; i < k; i++)
+            winners[k + i] = i;
+        for (size_t n = k - 1; n >= 1; n--)
+        {
+            size_t a = winners[2 * n], b = winners[2 * n + 1];
+            if (less(b, a))
+            {
+                winners[n] = b;
+                tree[n] = a;
+            }
+            else
+            {
+                winners[n] = a;
+                tree[n] = b;
+            }
+        }
+        tree[0] = winners[1];
+    }
+
+    /**
+     * @returns  the source whose current item comes first
+     */
+    size_t top() const { return tree[0]; }
+
+    /**
+     * Re-establish the winner after the top source has advanced.
+     */
+    void replay()
+    {
+        size_t winner = tree[0];
+        for (size_t n = (k + winner) / 2; n >= 1; n /= 2)
+            if (less(tree[n], winner))
+                std::swap(tree[n], winner);
+        tree[0] = winner;
+    }
+
+protected:
+    size_t k;
+    Less less;
+    std::vector<size_t> tree;  // tree[0] is the overall winner, tree[1..k-1] the losers
+};
+
+/**
+ * One ORDER BY term.
+ */
+struct SortKey {
+    const hsql::Expr *expr;  // nullptr for a column passed through by name (e.g., by a *)
+    bool descending;
+    Identifier column = "";  // that column, as named in the rows sorted
+};
+
+/**
+ * @class Sort - external merge sort
+ */
+class Sort : public PlanOperator {
+public:
+    static const size_t MAX_FAN_IN = 64;
+
+    /**
+     * @param child          rows to sort (owned)
+     * @param keys           ORDER BY terms, most significant first
+     * @param limit          if not negative, only the first limit rows are needed
+     * @param memory_budget  bytes of rows to hold before spilling a run
+     */
+    Sort(PlanOperator *child, const std::vector<SortKey> &keys, int64_t limit = -1,
+         size_t memory_budget = DEFAULT_MEMORY_BUDGET);
+
+    virtual ~Sort();
+
+    virtual void open();
+
+    virtual bool next(ValueDict &row);
+
+    virtual void close();
+
+    virtual size_t estimated_rows();
+
+    virtual std::string get_name();
+
+    virtual void get_expressions(LabeledExpressions &expressions) const;
+
+    virtual std::vector<PlanOperator **> get_children() { return std::vector<PlanOperator **>(1, &child); }
+
+    virtual size_t get_memory_used() const { return entries_memory; }
+
+    /**
+     * @returns  number of runs the last run of the sort wrote to disk
+     */
+    virtual size_t get_spilled_runs() const { return spilled_runs; }
+
+protected:
+    struct SortEntry {
+        std::string key;
+        ValueDict row;
+    };
+
+    // a sorted run being read back during a merge (from a spill file or from memory)
+    struct RunReader {
+        SpillFile *file;
+        std::vector<SortEntry> *entries;
+        size_t position;
+        bool exhausted;
+        SortEntry current;
+    };
+
+    PlanOperator *child;
+    std::vector<SortKey> keys;
+    std::vector<std::unique_ptr<hsql::Expr>> column_refs;  // the expressions of the keys given as columns
+    int64_t limit;
+    size_t memory_budget;
+
+    std::vector<SortEntry> entries;
+    size_t entries_memory;
+    size_t position;
+    size_t produced;  // rows returned from the merge, for the limit
+    std::vector<std::unique_ptr<SpillFile>> runs;
+    size_t spilled_runs;
+
+    std::vector<RunReader> readers;
+
+    struct ReaderLess {
+        const std::vector<RunReader> *readers;
+
+        bool operator()(size_t a, size_t b) const;
+    };
+
+    std::unique_ptr<LoserTree<ReaderLess>> merge_tree;
+
+    virtual void make_key(const ValueDict &row, std::string &key);
+
+    virtual void sort_entries();
+
+    virtual void spill_run();
+
+    virtual bool collect_top_n(size_t n, size_t &sequence);
+
+    virtual std::unique_ptr<SpillFile> merge(size_t first, size_t count);
+
+    virtual void start_merge(size_t first, size_t count, bool include_entries);
+
+    virtual bool advance(RunReader &reader);
+};
+
+// Test function for the sort operator, returns true if all tests pass.
+bool test_sort_plan();
@@ -0,0 +1,94 @@
+/**
+ * @file SpillFile.h - Temporary files for plan operators whose state outgrows memory.
+ *
+ * A SpillFile is written sequentially, rewound, and then read back sequentially.
+ * It lives in the database environment's directory and is removed when destroyed.
+ */
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "storage_engine.h"
+
+/**
+ * Default amount of memory an operator may use for its rows before it spills to disk.
+ */
+const size_t DEFAULT_MEMORY_BUDGET = 16 * 1024 * 1024;
+
+/**
+ * Estimate how many bytes a row occupies in memory (for enforcing memory budgets).
+ * @param row  row to measure
+ * @returns    approximate size including per-entry container overhead
+ */
+size_t row_memory(const ValueDict &row);
+
+/**
+ * @class SpillFile - an anonymous, sequentially accessed temporary file
+ */
+class SpillFile {
+public:
+    SpillFile();
+
+    virtual ~SpillFile();
+
+    SpillFile(const SpillFile &other) = delete;
+
+    SpillFile &operator=(const SpillFile &other) = delete;
+
+    /**
+     * Append raw bytes.
+     */
+    virtual void write(const void *data, size_t size);
+
+    /**
+     * Append a length-prefixed byte string.
+     */
+    virtual void write_string(const std::string &s);
+
+    /**
+     * Append a row's values in the order of column_names.
+     */
+    virtual void write_row(const ColumnNames &column_names, const ValueDict &row);
+
+    /**
+     * Finish writing and position at the beginning for reading.
+     */
+    virtual void rewind();
+
+    /**
+     * Read raw bytes.
+     * @returns  false at end of file
+     */
+    virtual bool read(void *data, size_t size);
+
+    /**
+     * Read a string written by write_string.
+     * @returns  false at end of file
+     */
+    virtual bool read_string(std::string &s);
+
+    /**
+     * Read a row written by write_row (with the same column_names).
+     * @param row  cleared and filled with the row
+     * @returns    false at end of file
+     */
+    virtual bool read_row(const ColumnNames &column_names, ValueDict &row);
+
+    /**
+     * Number of rows written with write_row.
+     */
+    virtual size_t get_row_count() const { return row_count; }
+
+    /**
+     * Number of bytes written.
+     */
+    virtual size_t get_size() const { return size; }
+
+protected:
+    std::string path;
+    FILE *file;
+    size_t row_count;
+    size_t size;
+    std::vector<char> buffer;
+};
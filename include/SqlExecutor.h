@@ -1,11 +1,43 @@
 /**
- * The SqlExecutor class in this header file is designed to "execute" SQLStatement objects,
- * mainly focusing on 'SELECT' and 'CREATE TABLE' queries. It interprets these statements,
- * constructing their SQL string representations and simulating SQL query execution.
+ * The SqlExecutor class in this header file is designed to execute SQLStatement objects,
+ * mainly focusing on 'SELECT', 'INSERT' and 'CREATE TABLE' queries. It builds a physical
+ * plan of QueryPlan operators for each statement and runs it against the heap storage
+ * engine. Scans and WHERE predicates run vectorized over column batches (BatchPlan.h);
+ * the rest of the plan, including joins (JoinPlan.h), sorts (SortPlan.h) and aggregation
+ * (AggregatePlan.h), streams rows one at a time.
+ *
+ * Plans for SELECT and INSERT are kept in a plan cache keyed by the statement's text with
+ * its literals turned into placeholders (PlanCache.h), and can be prepared by name with
+ * PREPARE name AS statement, run with EXECUTE name (values...) and freed with DEALLOCATE name.
+ *
+ * EXPLAIN statement shows the plan built for a SELECT or INSERT; EXPLAIN ANALYZE runs it
+ * and adds what each operator did (ExplainPlan.h).
+ *
+ * CREATE INDEX name ON table USING BRIN (column) gives a column a block-range index
+ * (brin_index.h), which scans whose WHERE clause compares the column to a constant use to
+ * skip blocks.
+ *
+ * A SELECT's rows are pushed into a ResultSink (ResultSink.h) as the plan produces them,
+ * so they are formatted and written out while it runs rather than gathered first.
+ *
+ * CREATE TABLE name (columns) USING LSM stores a table in the log-structured merge engine
+ * (lsm_storage.h) rather than the heap, for tables that are mostly written.
  */
+#pragma once
 
 #include "SQLParser.h"
 #include "string.h"
+#include "QueryPlan.h"
+#include "BatchPlan.h"
+#include "AggregatePlan.h"
+#include "SortPlan.h"
+#include "PlanCache.h"
+#include "ExplainPlan.h"
+#include "Optimizer.h"
+#include "ResultSink.h"
+#include "schema_tables.h"
+#include <atomic>
+#include <map>
 
 using namespace hsql;
 class SqlExecutor
@@ -15,34 +47,303 @@ public:
     ~SqlExecutor();
 
     /**
-     * Executes the given SQL statement (currently it just parses it to the query statement).
+     * Executes the given SQL statement.
      * @param query Pointer to the SQLStatement to be executed.
-     * @return A string representation of the result of the execution.
+     * @param sink  where its result goes
+     * @throws SQLExecError or DbRelationError if the statement fails (a SELECT's rows may
+     *         have gone to the sink already)
      */
-    std::string execute(const SQLStatement *query);
+    void execute(const SQLStatement *query, ResultSink &sink);
+
+    /**
+     * Executes SQL text: PREPARE, EXECUTE, DEALLOCATE, EXPLAIN, SHOW STATS and VACUUM, or
+     * one or more statements.
+     * Repeated SELECT and INSERT statements reuse their cached plan.
+     * @param sql   the SQL text
+     * @param sink  where the results go; a SELECT's rows are pushed into it as they are
+     *              produced
+     * @throws SQLExecError or DbRelationError if the statement fails
+     */
+    void execute(const std::string &sql, ResultSink &sink);
+
+    /**
+     * execute into a string, formatted by a TextSink.
+     * @param sql  the SQL text
+     * @return     a string representation of the result of the execution
+     * @throws SQLExecError or DbRelationError if the statement fails
+     */
+    std::string execute(const std::string &sql);
+
+    /**
+     * @return  the catalog shared by all executors (opened when the first is constructed)
+     */
+    static Tables &get_tables() { return *tables; }
 
 private:
+    /**
+     * The catalog, shared by all executors (opened by the first one).
+     */
+    static Tables *tables;
+
+    /**
+     * Plans by normalized statement text, shared by all executors.
+     */
+    static PlanCache *plan_cache;
+
+    /**
+     * Bumped by every change to the catalog or its statistics that can change a plan
+     * (CREATE TABLE, CREATE INDEX, DROP TABLE, ANALYZE). Any session's cached or prepared plan built
+     * at an older version is rebuilt before it next runs.
+     */
+    static std::atomic<size_t> catalog_version;
+
+    /**
+     * This executor's statements from PREPARE, by name.
+     */
+    std::map<Identifier, std::shared_ptr<PreparedStatement>> prepared;
+
+    /**
+     * Parses a statement to be prepared.
+     * @param sql              statement text (may have ? placeholders)
+     * @param parameter_count  number of placeholders in sql
+     * @return                 the statement, or nullptr if sql isn't one valid SELECT or INSERT
+     */
+    std::shared_ptr<PreparedStatement> prepare(const std::string &sql, size_t parameter_count);
+
+    /**
+     * Runs a prepared statement, building its plan first if it has none. The caller holds
+     * statement.running.
+     * @param statement   statement to run
+     * @param parameters  values for its placeholders
+     * @param sink        where the statement's result goes
+     * @param literals    true if the parameters are literals normalize_sql took out of the statement
+     */
+    void runPrepared(PreparedStatement &statement, const std::vector<Value> &parameters, ResultSink &sink,
+                     bool literals = false);
+
+    /**
+     * Handles PREPARE name AS statement.
+     * @param name  name for the statement
+     * @param body  the statement's text
+     * @return      a message saying the statement was prepared
+     */
+    std::string handlePrepare(const Identifier &name, const std::string &body);
+
+    /**
+     * Handles EXECUTE name (value, ...).
+     * @param name       name of the prepared statement
+     * @param arguments  text between the parentheses (empty for none)
+     * @param sink       where the statement's result goes
+     */
+    void handleExecute(const Identifier &name, const std::string &arguments, ResultSink &sink);
+
+    /**
+     * Handles EXPLAIN [ANALYZE] statement.
+     * @param sql      the statement to explain
+     * @param analyze  true to run the statement and show what each operator did
+     * @return         the plan, one operator per line with its inputs indented below it
+     */
+    std::string handleExplain(const std::string &sql, bool analyze);
+
+    /**
+     * Appends an operator's line of EXPLAIN output, then its inputs'.
+     * @param op     operator to describe (an AnalyzedOperator after EXPLAIN ANALYZE)
+     * @param depth  how deeply to indent it
+     * @param ss     where the output is appended
+     */
+    void explainOperator(PlanOperator *op, size_t depth, std::stringstream &ss);
+
+    /**
+     * explainOperator for vectorized operators.
+     */
+    void explainBatchOperator(BatchOperator *op, size_t depth, std::stringstream &ss);
+
+    /**
+     * Appends one operator's EXPLAIN line and the expressions it evaluates.
+     * @param name            the operator's name and details
+     * @param estimated_rows  the planner's estimate of its output
+     * @param expressions     expressions to show under it
+     * @param stats           what it did when run, or nullptr if it wasn't
+     * @param depth           how deeply to indent it
+     * @param ss              where the output is appended
+     */
+    void explainLine(const std::string &name, size_t estimated_rows, const LabeledExpressions &expressions,
+                     const OperatorStats *stats, size_t depth, std::stringstream &ss);
+
+    /**
+     * Handles SHOW STATS.
+     * @return  the storage and executor counters, latency histograms and plan cache hit rate
+     */
+    std::string handleShowStats();
+
+    /**
+     * Handles VACUUM table (see HeapTable::vacuum).
+     * @param table_name  the table to vacuum
+     * @return            what the vacuum did
+     */
+    std::string handleVacuum(const Identifier &table_name);
+
+    /**
+     * Handles ANALYZE table (see Tables::analyze).
+     * @param table_name  the table to analyze
+     * @return            how big the statistics say it is
+     */
+    std::string handleAnalyze(const Identifier &table_name);
+
+    /**
+     * Marks every session's plans stale, and drops the shared cached plans that use a
+     * table, after DDL or ANALYZE on it.
+     * @param table_name  the table that changed
+     */
+    void invalidatePlans(const Identifier &table_name);
+
+    /**
+     * Adds the names of the tables a FROM clause reads to names.
+     */
+    void collectTables(const TableRef *table, std::set<Identifier> &names);
+
     /**
      * Handles the SELECT statement.
      * @param selectStmt Pointer to the SelectStatement to be handled.
-     * @return A string representation of the SELECT query.
+     * @param sink       Where the selected rows go.
      */
-    std::string handleSelect(const SelectStatement *selectStmt);
+    void handleSelect(const SelectStatement *selectStmt, ResultSink &sink);
+
+    /**
+     * Runs a SELECT plan, pushing its rows into a sink. Nothing goes to the sink until the
+     * first row (or the end) has been produced, so a statement that fails from the start
+     * reports just its error.
+     * @param plan  plan to run (not freed; it can be run again)
+     * @param sink  where the selected rows go
+     */
+    void runSelectPlan(PlanOperator *plan, ResultSink &sink);
 
     /**
      * Handles the CREATE TABLE statement.
      * @param createStmt Pointer to the CreateStatement to be handled.
-     * @return A string representation of the CREATE query.
+     * @param engine     Storage engine for the table ("HEAP" or "LSM").
+     * @return A message saying whether the table was created.
      */
-    std::string handleCreate(const CreateStatement *createStmt);
+    std::string handleCreate(const CreateStatement *createStmt, const Identifier &engine = "HEAP");
+
+    /**
+     * Handles the DROP TABLE statement.
+     * @param dropStmt Pointer to the DropStatement to be handled.
+     * @return A message saying the table was dropped.
+     */
+    std::string handleDrop(const DropStatement *dropStmt);
+
+    /**
+     * Handles CREATE TABLE ... USING engine, which the parser doesn't know.
+     * @param sql     the statement without its USING clause
+     * @param engine  the storage engine named
+     * @return A message saying whether the table was created.
+     */
+    std::string handleCreateUsing(const std::string &sql, const Identifier &engine);
+
+    /**
+     * Handles the CREATE INDEX statement (BRIN indexes only).
+     * @param createStmt Pointer to the CreateStatement to be handled.
+     * @return A message saying the index was created.
+     */
+    std::string handleCreateIndex(const CreateStatement *createStmt);
 
     /**
      * Handles the INSERT statement.
      * @param inStmt Pointer to the InsertStatement to be handled.
-     * @return A string representation of the INSERT query.
+     * @return A message with the number of rows inserted.
      */
     std::string handleInsert(const InsertStatement *inStmt);
 
+    /**
+     * Builds the Insert operator, over VALUES or a SELECT, for an INSERT statement.
+     * @param inStmt  statement to plan
+     * @return        root of the plan (freed by caller)
+     */
+    Insert *buildInsertPlan(const InsertStatement *inStmt);
+
+    /**
+     * Runs an Insert plan.
+     * @param plan        plan to run (not freed; it can be run again)
+     * @param table_name  table being inserted into, for the message
+     * @return            a message with the number of rows inserted
+     */
+    std::string runInsertPlan(Insert *plan, const Identifier &table_name);
+
+    /**
+     * What follows an INSERT's commit, however it was run: summarizes the block ranges the
+     * rows filled and saves the table's statistics if they are due.
+     * @param table_name  table inserted into
+     */
+    void finishInsert(const Identifier &table_name);
+
+    /**
+     * Builds the operator tree for a SELECT statement:
+     * FROM (scans and joins) -> Filter (rest of WHERE) -> HashAggregate (GROUP BY) -> Filter (HAVING)
+     * -> Sort (ORDER BY) -> Project (select list) -> Limit.
+     * @param selectStmt  statement to plan
+     * @return            root of the plan (freed by caller)
+     */
+    PlanOperator *buildSelectPlan(const SelectStatement *selectStmt);
+
+    /**
+     * Adds the aggregate function calls within an expression to aggregates (once each).
+     * @param expr        expression to search (may be NULL)
+     * @param aggregates  list to add to
+     */
+    void collectAggregates(const Expr *expr, std::vector<Aggregate> &aggregates);
+
+    /**
+     * Resolves an ORDER BY term that names a select-list item by position or alias.
+     * @param order          ORDER BY term
+     * @param select_list    the statement's select list
+     * @param input_columns  the columns a * in the select list stands for
+     * @return               the key: the select-list expression it refers to, a column of
+     *                       a *, or the term's expression itself
+     */
+    SortKey resolveOrderKey(const OrderDescription *order, const std::vector<Expr *> &select_list,
+                            const ColumnNames &input_columns);
+
+    /**
+     * Builds the scan of one table, vectorized when the table is a HeapTable.
+     * The WHERE conjuncts that refer only to this table are pushed into the scan,
+     * compiled into batch kernels where possible and filtered row by row otherwise.
+     * @param table      relation to scan
+     * @param qualifier  prefix for the output column names ("" for none)
+     * @param conjuncts  WHERE conjuncts; the ones used here are removed
+     * @return           operator producing the table's qualifying rows (freed by caller)
+     */
+    PlanOperator *buildScanPlan(DbRelation &table, const Identifier &qualifier, std::vector<const Expr *> &conjuncts);
+
+    /**
+     * Builds the operators for a FROM clause. Tables' columns are qualified by their
+     * alias (or name). Joins with an equality between their inputs become hash joins,
+     * either from ON or, for inner joins and cross products, from the WHERE clause;
+     * others become nested-loop joins.
+     * @param table      table reference to plan
+     * @param conjuncts  WHERE conjuncts; the ones pushed into the plan are removed
+     * @return           operator producing the joined rows (freed by caller)
+     */
+    PlanOperator *buildTableRefPlan(const TableRef *table, std::vector<const Expr *> &conjuncts);
+
+    /**
+     * Builds a run of inner joins and cross products, joined in the order the optimizer
+     * finds cheapest (see Optimizer::order_joins). Their ON conditions and the WHERE
+     * conjuncts on their tables are pushed into the scans or become join conditions;
+     * the rows still have the columns in the order the query names the tables.
+     * @param table      an inner join or cross product
+     * @param conjuncts  WHERE conjuncts; the ones used here are removed
+     * @return           operator producing the joined rows (freed by caller)
+     */
+    PlanOperator *buildJoinPlan(const TableRef *table, std::vector<const Expr *> &conjuncts);
+
+    /**
+     * @param table  a FROM clause item
+     * @param plan   the operator built for it
+     * @return       what the optimizer is to know of it as a join input
+     */
+    JoinInput describeJoinInput(const TableRef *table, PlanOperator *plan);
+
     /**
      * Processes a TableRef and appends the corresponding SQL to the stringstream.
      * This function handles JOINS, CROSS PRODUCT and ALIASES
@@ -63,12 +364,20 @@ private:
      * @param expr Pointer to the Expr to be processed.
      * @param ss Reference to the stringstream where SQL is appended.
      */
-    void handleExpression(Expr *expr, std::stringstream &ss);
+    void handleExpression(const Expr *expr, std::stringstream &ss);
 
     /**
      * Processes an operator expression and appends the corresponding SQL to the stringstream.
      * @param expr Pointer to the Expr representing the operator to be processed.
      * @param ss Reference to the stringstream where SQL is appended.
      */
-    void handleOperatorExpression(Expr *expr, std::stringstream &ss);
+    void handleOperatorExpression(const Expr *expr, std::stringstream &ss);
+
+    /**
+     * Appends an operand of an operator expression, in parentheses if it needs them.
+     * @param operand  the operand
+     * @param parent   the operator expression it belongs to
+     * @param ss       where the SQL is appended
+     */
+    void handleOperand(const Expr *operand, const Expr *parent, std::stringstream &ss);
 };
@@ -0,0 +1,71 @@
+/**
+ * @file TestExprs.h - Expression trees for the plan tests, built the way the parser would.
+ *
+ * The tests in QueryPlan.cpp, JoinPlan.cpp, SortPlan.cpp, AggregatePlan.cpp, ExplainPlan.cpp
+ * and Optimizer.cpp build their predicates, select lists and sort keys with these. Each
+ * returns a new Expr (deleting it deletes its operands).
+ */
+#pragma once
+
+#include <cstring>
+#include <vector>
+#include "SQLParser.h"
+
+inline hsql::Expr *make_int(int64_t n)
+{
+    hsql::Expr *expr = new hsql::Expr(hsql::kExprLiteralInt);
+    expr->ival = n;
+    return expr;
+}
+
+inline hsql::Expr *make_text(const char *text)
+{
+    hsql::Expr *expr = new hsql::Expr(hsql::kExprLiteralString);
+    expr->name = strdup(text);
+    return expr;
+}
+
+inline hsql::Expr *make_column(const char *name)
+{
+    hsql::Expr *expr = new hsql::Expr(hsql::kExprColumnRef);
+    expr->name = strdup(name);
+    return expr;
+}
+
+// table.name
+inline hsql::Expr *make_column(const char *table, const char *name)
+{
+    hsql::Expr *expr = make_column(name);
+    expr->table = strdup(table);
+    return expr;
+}
+
+// left op right, for the single-character operators (=, <, >, +, -, *, /, %)
+inline hsql::Expr *make_op(hsql::Expr *left, char op, hsql::Expr *right)
+{
+    hsql::Expr *expr = new hsql::Expr(hsql::kExprOperator);
+    expr->opType = hsql::Expr::SIMPLE_OP;
+    expr->opChar = op;
+    expr->expr = left;
+    expr->expr2 = right;
+    return expr;
+}
+
+// left AND right, left OR right, and so on
+inline hsql::Expr *make_logical(hsql::Expr *left, hsql::Expr::OperatorType op, hsql::Expr *right)
+{
+    hsql::Expr *expr = new hsql::Expr(hsql::kExprOperator);
+    expr->opType = op;
+    expr->expr = left;
+    expr->expr2 = right;
+    return expr;
+}
+
+// function(arg)
+inline hsql::Expr *make_call(const char *function, hsql::Expr *arg)
+{
+    hsql::Expr *expr = new hsql::Expr(hsql::kExprFunctionRef);
+    expr->name = strdup(function);
+    expr->exprList = new std::vector<hsql::Expr *>{arg};
+    return expr;
+}
@@ -0,0 +1,149 @@
+/**
+ * @file arena.h - Bump-pointer memory for allocations that die together.
+ *
+ * Reading a block makes a handful of small objects (the page, its bytes, the ids of its
+ * records, a Dbt per record) that are all dropped when the reader moves on; marshaling a
+ * row makes a buffer that is dropped once the row is stored. An Arena hands such memory
+ * out by bumping a pointer through large chunks and takes all of it back with one reset(),
+ * so none of it goes through malloc and free one object at a time.
+ *
+ * Chunks come from a small per-thread pool and go back to it on reset, so a thread that
+ * keeps making and resetting arenas (a scan per statement, a block after block) stops
+ * calling malloc at all once the pool is warm. Objects with destructors made with make()
+ * are destroyed, newest first, on reset.
+ *
+ * An Arena is not thread-safe: it belongs to one statement, scan or call at a time.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/**
+ * @class Arena - a bump-pointer allocator freed all at once
+ */
+class Arena {
+public:
+    static const size_t CHUNK_SZ = 64 * 1024;
+
+    Arena() : chunk(nullptr), next(nullptr), limit(nullptr), finalizers(nullptr), used(0) {}
+
+    ~Arena() { reset(); }
+
+    Arena(const Arena &other) = delete;
+
+    Arena &operator=(const Arena &other) = delete;
+
+    /**
+     * @param size   bytes wanted
+     * @param align  their alignment (a power of two)
+     * @returns      uninitialized memory that lives until the next reset()
+     */
+    void *allocate(size_t size, size_t align = alignof(std::max_align_t))
+    {
+        char *p = (char *)(((uintptr_t)next + align - 1) & ~(uintptr_t)(align - 1));
+        if (next == nullptr || p + size > limit)
+            return allocate_slow(size, align);
+        next = p + size;
+        used += size;
+        return p;
+    }
+
+    /**
+     * Give back the end of the most recent allocation.
+     * @param p     what allocate() last returned
+     * @param size  how much of it to keep
+     */
+    void shrink(void *p, size_t size)
+    {
+        if (p != nullptr && (char *)p + size < next && (char *)p >= chunk_begin())
+        {
+            used -= next - ((char *)p + size);
+            next = (char *)p + size;
+        }
+    }
+
+    /**
+     * Construct an object in the arena. It is destroyed on reset() (not by delete).
+     */
+    template <class T, class... Args>
+    T *make(Args &&... args)
+    {
+        void *p = allocate(sizeof(T), alignof(T));
+        T *object = new (p) T(std::forward<Args>(args)...);
+        if (!std::is_trivially_destructible<T>::value)
+            add_finalizer(object, [](void *o) { static_cast<T *>(o)->~T(); });
+        return object;
+    }
+
+    /**
+     * Copy bytes into the arena.
+     */
+    void *copy(const void *bytes, size_t size);
+
+    /**
+     * Destroy everything made in the arena and take back all its memory.
+     */
+    void reset();
+
+    /**
+     * @returns  bytes handed out since the last reset
+     */
+    size_t bytes_used() const { return used; }
+
+protected:
+    struct Chunk {
+        Chunk *previous;
+        size_t size;  // usable bytes after the header
+    };
+    struct Finalizer {
+        Finalizer *previous;
+        void *object;
+        void (*destroy)(void *);
+    };
+
+    Chunk *chunk;  // the one being bumped through, linked to the earlier ones
+    char *next;
+    char *limit;
+    Finalizer *finalizers;
+    size_t used;
+
+    char *chunk_begin() const { return chunk == nullptr ? nullptr : (char *)(chunk + 1); }
+
+    void *allocate_slow(size_t size, size_t align);
+
+    void add_finalizer(void *object, void (*destroy)(void *));
+};
+
+/**
+ * @class ArenaAllocator - standard allocator drawing from an Arena, for containers that
+ * live no longer than the arena (deallocate does nothing; reset frees it all)
+ */
+template <class T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+
+    explicit ArenaAllocator(Arena &arena) : arena(&arena) {}
+
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+    T *allocate(size_t n) { return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T))); }
+
+    void deallocate(T *, size_t) {}
+
+    template <class U>
+    bool operator==(const ArenaAllocator<U> &other) const { return arena == other.arena; }
+
+    template <class U>
+    bool operator!=(const ArenaAllocator<U> &other) const { return arena != other.arena; }
+
+    Arena *arena;
+};
+
+// Test function for Arena, returns true if all tests pass.
+bool test_arena();
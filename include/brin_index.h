@@ -0,0 +1,185 @@
+/**
+ * @file brin_index.h - Block-range indexes: a min and max per range of blocks.
+ *
+ * Rows appended in key order (timestamps, sequence numbers) land in blocks whose numbers
+ * rise with the key, so a few bytes per range of blocks say where a key can be: the
+ * smallest and largest value of the column in the range. A range predicate then needs only
+ * the ranges whose [min, max] overlaps it, and everything else is skipped without being
+ * read. The index is a tiny fraction of the table and costs an insert next to nothing: a
+ * summary only ever widens, and only when a value falls outside it.
+ *
+ * The index is lossy: a range that may hold a match is scanned whole, and the WHERE clause
+ * still decides which of its rows qualify. A range the index knows nothing about (not yet
+ * summarized, like the one the table is still filling) is always scanned.
+ *
+ * The summaries are kept in memory; the index's definition is in the "_indices" catalog
+ * table, and the summaries are rebuilt when the table is first opened.
+ */
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include "heap_storage.h"
+
+/**
+ * @struct KeyRange - the values of a column that a WHERE clause's comparisons leave possible
+ */
+struct KeyRange {
+    Value low;
+    Value high;
+    bool has_low;
+    bool has_high;
+    bool low_inclusive;
+    bool high_inclusive;
+    bool empty;  // no value is possible
+
+    KeyRange() : has_low(false), has_high(false), low_inclusive(false), high_inclusive(false), empty(false) {}
+
+    /**
+     * Narrow to values above value (or equal to it, if inclusive).
+     */
+    void at_least(const Value &value, bool inclusive);
+
+    /**
+     * Narrow to values below value (or equal to it, if inclusive).
+     */
+    void at_most(const Value &value, bool inclusive);
+
+    /**
+     * @returns  true if the range leaves out any values at all
+     */
+    bool bounded() const { return has_low || has_high || empty; }
+
+    /**
+     * @returns  true if some value between min and max (inclusive) is in the range
+     */
+    bool overlaps(const Value &min, const Value &max) const;
+};
+
+/**
+ * A run of consecutive blocks, first to last.
+ */
+typedef std::pair<BlockID, BlockID> BlockRange;
+typedef std::vector<BlockRange> BlockRanges;
+
+/**
+ * @class BrinIndex - min/max summaries of one column of a HeapTable, per range of blocks
+ *
+ * Block range r holds blocks r * blocks_per_range + 1 through (r + 1) * blocks_per_range.
+ * A range is summarized once the file has grown past it (see HeapTable::summarize), by
+ * reading its blocks; after that, every record written to it widens its summary (see
+ * HeapTable::add_version), so the summary covers every version in the range, committed or
+ * not. Forgetting a summary is always safe, since an unsummarized range is scanned:
+ * vacuum forgets the ranges it reclaims space in, and summarizes them again tighter, and
+ * truncation forgets the ranges it cuts off.
+ *
+ * Summaries are kept only in memory, and Tables::get_table rebuilds them with a full read
+ * of the table the first time a process opens it. That cost is deliberate: a stored
+ * summary would have to be logged with every record that widens it, or a crash could
+ * leave it narrower than its range and scans would then miss rows.
+ *
+ * Safe for concurrent use. Writers widen a summary while they hold the latch of the block
+ * they wrote, and summarize reads each block under its latch, so a record is either in the
+ * block when it is read or widens the summary after.
+ */
+class BrinIndex {
+public:
+    static const BlockID BLOCKS_PER_RANGE = 16;
+
+    /**
+     * @param table             the table indexed
+     * @param index_name        the index's name in the catalog
+     * @param column            number of the column summarized
+     * @param blocks_per_range  blocks per summary
+     */
+    BrinIndex(HeapTable &table, const Identifier &index_name, size_t column,
+              BlockID blocks_per_range = BLOCKS_PER_RANGE);
+
+    virtual ~BrinIndex() {}
+
+    BrinIndex(const BrinIndex &other) = delete;
+
+    BrinIndex &operator=(const BrinIndex &other) = delete;
+
+    /**
+     * Widen the summary of a block's range to a record's value, if the range has one.
+     * The caller holds the block's latch.
+     * @param block_id  block the record was written to
+     * @param record    the marshaled record
+     */
+    virtual void add(BlockID block_id, const char *record);
+
+    /**
+     * Summarize the ranges that have no summary and lie wholly before the range of a block.
+     * Call it outside a transaction: it waits for each block's latch.
+     * @param last_block  the file's last block (its range is still being filled)
+     * @returns           how many ranges were summarized
+     */
+    virtual size_t summarize(BlockID last_block);
+
+    /**
+     * Drop the summaries of the ranges overlapping some blocks, so they are scanned until
+     * they're summarized again.
+     */
+    virtual void forget(BlockID first, BlockID last = UINT32_MAX);
+
+    /**
+     * @param range       values wanted
+     * @param last_block  the file's last block
+     * @returns           the runs of blocks (up to last_block) that may hold them
+     */
+    virtual BlockRanges block_ranges(const KeyRange &range, BlockID last_block);
+
+    /**
+     * Leave out of a list of blocks those that can't hold any of the values wanted.
+     * @returns  how many were left out
+     */
+    virtual size_t prune(const KeyRange &range, BlockIDs &block_ids);
+
+    const Identifier &get_index_name() const { return index_name; }
+
+    size_t get_column() const { return column; }
+
+    BlockID get_blocks_per_range() const { return blocks_per_range; }
+
+protected:
+    enum State {
+        UNSUMMARIZED,  // scanned whatever is asked for
+        SUMMARIZING,   // being read: writers widen it already, but it isn't complete yet
+        SUMMARIZED
+    };
+    struct Summary {
+        State state;
+        bool has_values;  // false if the range holds no records
+        Value min;
+        Value max;
+        uint64_t generation;  // bumped by forget, so a summarize it interrupted doesn't finish
+
+        Summary() : state(UNSUMMARIZED), has_values(false), generation(0) {}
+    };
+
+    HeapTable &table;
+    Identifier index_name;
+    size_t column;
+    BlockID blocks_per_range;
+    std::mutex lock;  // for summaries
+    std::vector<Summary> summaries;
+    std::atomic<size_t> ranges_known;        // summaries.size(), for writers to check without the lock
+    std::atomic<size_t> first_unsummarized;  // no range before it lacks a summary
+    std::mutex summarize_lock;               // one summarizer at a time
+
+    size_t range_of(BlockID block_id) const { return (block_id - 1) / blocks_per_range; }
+
+    /**
+     * Read a range's blocks and build its summary.
+     */
+    virtual void summarize_range(size_t range);
+
+    /**
+     * @returns  true if a range must be scanned for values in the key range
+     */
+    virtual bool may_contain(size_t range, const KeyRange &key_range);
+};
+
+// Test function for BrinIndex, returns true if all tests pass.
+bool test_brin_index();
@@ -9,8 +9,37 @@
  */
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
 #include "db_cxx.h"
 #include "storage_engine.h"
+#include "latches.h"
+#include "arena.h"
+#include "transactions.h"
+
+/**
+ * @class RecordView - a record's bytes where they lie in its block, not copied
+ *
+ * Valid while the SlottedPage it came from lives and the record isn't changed or moved
+ * (by put, del or add on the page). An empty view (no data) stands for a deleted record.
+ */
+struct RecordView {
+    const char *data;
+    u_int16_t size;
+
+    RecordView() : data(nullptr), size(0) {}
+
+    RecordView(const char *data, u_int16_t size) : data(data), size(size) {}
+
+    explicit operator bool() const { return data != nullptr; }
+};
+
+/**
+ * Record ids made in an Arena.
+ */
+typedef std::vector<RecordID, ArenaAllocator<RecordID>> ArenaRecordIDs;
 
 /**
  * @class SlottedPage - heap file implementation of DbBlock.
@@ -18,13 +47,20 @@
  *      Manage a database block that contains several records.
         Modeled after slotted-page from Database Systems Concepts, 6ed, Figure 10-9.
 
-        Record id are handed out sequentially starting with 1 as records are added with add().
+        Record id are handed out sequentially starting with 1 as records are added with add(),
+        except that add() first reuses the id of a deleted record (a tombstone), if there is one.
+        Records are only deleted once no snapshot can see them (see HeapTable::prune), so no
+        reader is left with the id of the record that replaces it.
         Each record has a header which is a fixed offset from the beginning of the block:
             Bytes 0x00 - Ox01: number of records
             Bytes 0x02 - 0x03: offset to end of free space
             Bytes 0x04 - 0x05: size of record 1
             Bytes 0x06 - 0x07: offset to record 1
+            Bytes 0x08 - 0x0f: begin stamp of record 1 (transaction that created it)
+            Bytes 0x10 - 0x17: end stamp of record 1 (transaction that updated or deleted it, or 0)
+            Bytes 0x18 - 0x19: size of record 2
             etc.
+        Each record is one version of a row (see Snapshot in transactions.h).
  *
  */
 class SlottedPage : public DbBlock {
@@ -33,7 +69,7 @@ public:
 
     // Big 5 - we only need the destructor, copy-ctor, move-ctor, and op= are unnecessary
     // but we delete them explicitly just to make sure we don't use them accidentally
-    virtual ~SlottedPage() {}
+    virtual ~SlottedPage();
 
     SlottedPage(const SlottedPage &other) = delete;
 
@@ -45,23 +81,114 @@ public:
 
     virtual RecordID add(const Dbt *data);
 
+    /**
+     * Add a record version created by a transaction.
+     * @param data   the record
+     * @param begin  the creating transaction's stamp
+     * @returns      the new record's id
+     */
+    virtual RecordID add(const Dbt *data, Stamp begin);
+
     virtual Dbt *get(RecordID record_id);
 
+    /**
+     * @param record_id  record in the block
+     * @returns          a view of the record in the block, or an empty view if it was deleted
+     */
+    virtual RecordView view(RecordID record_id);
+
+    /**
+     * Call visit(record_id, view) for each live record, in id order, without allocating.
+     * visit may delete the record it is given, but no other.
+     */
+    template <class Visitor>
+    void for_each_record(Visitor visit);
+
+    /**
+     * for_each_record over the record versions a snapshot sees.
+     */
+    template <class Visitor>
+    void for_each_record(const Snapshot &snapshot, Visitor visit);
+
     virtual void put(RecordID record_id, const Dbt &data);
 
     virtual void del(RecordID record_id);
 
-    virtual RecordIDs *ids(void);
+    /**
+     * Drop the tombstones at the end of the record headers, so they are neither scanned
+     * nor counted any more.
+     * @returns  how many were dropped
+     */
+    virtual u_int16_t compact();
+
+    /**
+     * @returns  bytes left for new records and their headers
+     */
+    virtual u_int16_t free_space();
+
+    using DbBlock::ids;
+
+    virtual void ids(RecordIDs &record_ids);
+
+    /**
+     * @param snapshot  a reader's snapshot
+     * @returns         ids of the record versions the snapshot sees
+     */
+    RecordIDs ids(const Snapshot &snapshot)
+    {
+        RecordIDs record_ids;
+        ids(snapshot, record_ids);
+        return record_ids;
+    }
+
+    /**
+     * ids(snapshot) into a caller's list.
+     */
+    virtual void ids(const Snapshot &snapshot, RecordIDs &record_ids);
+
+    /**
+     * ids(snapshot), made in an arena.
+     */
+    virtual ArenaRecordIDs *ids(const Snapshot &snapshot, Arena &arena);
+
+    /**
+     * Get a record version's stamps.
+     * @param record_id  record in the block
+     * @param begin      set to the stamp of the transaction that created it
+     * @param end        set to the stamp of the one that ended it, or Snapshot::FROZEN
+     */
+    virtual void get_stamps(RecordID record_id, Stamp &begin, Stamp &end);
+
+    /**
+     * End a record version: it is deleted, or replaced by a newer one, as of the stamp.
+     */
+    virtual void set_end(RecordID record_id, Stamp end);
+
+    /**
+     * @returns  the size of the largest record an empty block has room for
+     */
+    static u_int16_t max_record_size() { return DbBlock::BLOCK_SZ - 1 - HEADER_SZ - RECORD_HEADER_SZ; }
+
+    static const u_int16_t HEADER_SZ = 4;          // the block's header
+    static const u_int16_t RECORD_HEADER_SZ = 20;  // each record's header
 
 protected:
     u_int16_t num_records;
     u_int16_t end_free;
 
+    virtual u_int16_t header_offset(RecordID id);
+
+    virtual Stamp get_stamp(u_int16_t offset);
+
+    virtual void put_stamp(u_int16_t offset, Stamp stamp);
+
     virtual void get_header(u_int16_t &size, u_int16_t &loc, RecordID id = 0);
 
     virtual void put_header(RecordID id = 0, u_int16_t size = 0, u_int16_t loc = 0);
 
-    virtual bool has_room(u_int16_t size);
+    virtual bool has_room(u_int16_t size, u_int16_t new_headers = 1);
+
+    virtual RecordID tombstone();
 
     virtual void slide(u_int16_t start, u_int16_t end);
 
@@ -72,6 +199,30 @@ protected:
     virtual void *address(u_int16_t offset);
 };
 
+template <class Visitor>
+void SlottedPage::for_each_record(Visitor visit)
+{
+    u_int16_t size, loc;
+    for (RecordID id = 1; id <= this->num_records; id++)
+    {
+        get_header(size, loc, id);
+        if (loc != 0)  // not a tombstone
+            visit(id, RecordView((const char *)address(loc), size));
+    }
+}
+
+template <class Visitor>
+void SlottedPage::for_each_record(const Snapshot &snapshot, Visitor visit)
+{
+    u_int16_t size, loc;
+    for (RecordID id = 1; id <= this->num_records; id++)
+    {
+        get_header(size, loc, id);
+        if (loc != 0 && snapshot.sees(get_stamp(header_offset(id) + 4), get_stamp(header_offset(id) + 12)))
+            visit(id, RecordView((const char *)address(loc), size));
+    }
+}
+
 /**
  * @class HeapFile - heap file implementation of DbFile
  *
@@ -79,10 +230,18 @@ protected:
         database blocks for each Berkeley DB record in the RecNo file. In this way we are using Berkeley DB
         for buffer management and file management.
         Uses SlottedPage for storing records within blocks.
+
+        Safe for concurrent use: the Berkeley DB handle is free-threaded when the environment
+        is (DB_THREAD), blocks are read into private copies, and get_new hands out block ids
+        with an atomic increment, so allocating takes no lock. A block whose id is handed out
+        but not yet written (or whose allocation was rolled back) reads as empty. Writers of
+        the same block must still hold its latch (see latch() and HeapTable).
  */
 class HeapFile : public DbFile {
 public:
-    HeapFile(std::string name) : DbFile(name), dbfilename(""), last(0), closed(true), db(_DB_ENV, 0) {}
+    HeapFile(std::string name)
+        : DbFile(name), dbfilename(""), last(0), closed(true), latch_key(LatchManager::file_key(name)), read_flags(0),
+          db(_DB_ENV, 0) {}
 
     virtual ~HeapFile() {}
     HeapFile(const HeapFile &other) = delete;
@@ -105,30 +264,105 @@ public:
 
     virtual SlottedPage *get(BlockID block_id);
 
+    /**
+     * Read a block into an arena: the page and its bytes are freed by the arena's reset,
+     * not by delete.
+     */
+    virtual SlottedPage *get(BlockID block_id, Arena &arena);
+
     virtual void put(DbBlock *block);
 
-    virtual BlockIDs *block_ids();
+    /**
+     * Give back the file's last block, if block_id still is the last. The caller holds the
+     * block's latch and has made sure it's empty; writers that find their block gone (an id
+     * past get_last_block_id()) must allocate another.
+     * @returns  true if the block was removed
+     */
+    virtual bool remove_last(BlockID block_id);
+
+    using DbFile::block_ids;
+
+    virtual void block_ids(BlockIDs &ids);
 
     virtual u_int32_t get_last_block_id() { return last; }
 
+    /**
+     * @param block_id  block in this file
+     * @returns         the latch that writers of the block hold while they change it
+     */
+    virtual PageLatch &latch(BlockID block_id) { return LatchManager::latch(latch_key, block_id); }
+
+    virtual size_t get_latch_key() const { return latch_key; }
+
+    /**
+     * Blocks read by get, counted whether or not metrics are compiled in (EXPLAIN ANALYZE
+     * takes the difference around each operator call).
+     * @returns  how many blocks the calling thread has read from any heap file
+     */
+    static uint64_t thread_blocks_read() { return blocks_read; }
+
 protected:
+    static thread_local uint64_t blocks_read;
+
     std::string dbfilename;
-    u_int32_t last;
-    bool closed;
+    std::atomic<u_int32_t> last;
+    std::atomic<bool> closed;
+    std::mutex lock;  // for opening and closing
+    size_t latch_key;
+    u_int32_t read_flags;  // for reads outside a transaction
     Db db;
 
     virtual void db_open(uint flags = 0);
 };
 
+class BrinIndex;
+class TableStats;
+
+/**
+ * @struct VacuumStats - what a HeapTable::vacuum did
+ */
+struct VacuumStats {
+    size_t versions_reclaimed;  // dead versions deleted
+    size_t slots_freed;         // tombstones dropped from the ends of blocks' headers
+    size_t rows_moved;          // out of nearly empty blocks into earlier ones with room
+    size_t blocks_truncated;    // empty blocks given back from the end of the file
+
+    VacuumStats() : versions_reclaimed(0), slots_freed(0), rows_moved(0), blocks_truncated(0) {}
+};
+
 /**
  * @class HeapTable - Heap storage engine (implementation of DbRelation)
+ *
+ * Any number of threads may read and write a table at once. Writers hold the latch of the
+ * block they change, and each thread inserts into a block of its own (its insert block for
+ * the table, taken over from the file's last block or newly allocated), so concurrent
+ * inserts seldom touch the same block.
+ *
+ * Rows are multi-versioned (see transactions.h): insert, update and del each run in the
+ * current Transaction (or one of their own) and stamp the versions they create and end;
+ * select and scan see the rows in their snapshot, and project reads whichever version its
+ * handle names.
+ *
+ * A row is stored as a record of its columns in order (an INT in 4 bytes, a TEXT as a
+ * 2-byte length and its characters) behind a directory of 2-byte offsets, one for each
+ * column after the first TEXT column; the columns before have the same offset in every
+ * record, and tables without TEXT columns, or with just a last one, have no directory.
+ * So any column can be read without decoding the ones before it, and project, select and
+ * BatchTableScan decode only the columns they need.
+ *
+ * A column can have a BRIN index (see brin_index.h), which every version written to the
+ * table widens as it goes into its block; select and BatchTableScan skip the blocks it rules
+ * out.
+ *
+ * Once ANALYZE has gathered the table's statistics (see table_stats.h), insert and del keep
+ * them up to date, and estimated_row_count comes from them.
  */
 
 class HeapTable : public DbRelation {
 public:
     HeapTable(Identifier table_name, ColumnNames column_names, ColumnAttributes column_attributes);
 
-    virtual ~HeapTable() {}
+    virtual ~HeapTable();
 
     HeapTable(const HeapTable &other) = delete;
 
@@ -150,28 +384,224 @@ public:
 
     virtual Handle insert(const ValueDict *row);
 
-    virtual void update(const Handle handle, const ValueDict *new_values);
+    virtual Handle update(const Handle handle, const ValueDict *new_values);
 
     virtual void del(const Handle handle);
 
-    virtual Handles *select();
-
-    virtual Handles *select(const ValueDict *where);
-
-    virtual ValueDict *project(Handle handle);
-
-    virtual ValueDict *project(Handle handle, const ColumnNames *column_names);
+    using DbRelation::select;
+
+    virtual void select(const ValueDict *where, Handles &handles);
+
+    using DbRelation::project;
+
+    virtual void project(Handle handle, const ColumnNames *column_names, ValueDict &row);
+
+    /**
+     * project(handle, column_names), with the row and everything read to get it made in an
+     * arena (freed by its reset, not by delete).
+     */
+    virtual ValueDict *project(Handle handle, const ColumnNames *column_names, Arena &arena);
+
+    virtual std::unique_ptr<DbRelationScan> scan();
+
+    virtual size_t estimated_row_count();
+
+    /**
+     * Reclaim the space of the row versions that no snapshot can see any more. Call it
+     * outside a transaction: it waits for each block's latch.
+     * @returns  number of versions reclaimed
+     */
+    virtual size_t collect_garbage();
+
+    /**
+     * Vacuum the table: reclaim dead versions and compact each block, move the rows of
+     * nearly empty blocks into earlier blocks with room, and give back the empty blocks at
+     * the end of the file. Goes a block at a time, each in a short transaction, so readers
+     * and writers carry on meanwhile. Call it outside a transaction.
+     * @param pause  how long to sleep after each block, to leave the disk to others
+     * @returns      what it did
+     */
+    virtual VacuumStats vacuum(std::chrono::microseconds pause = std::chrono::microseconds(0));
+
+    /**
+     * @returns  about how many versions have been ended (by update and del) and not yet
+     *           reclaimed since the table was opened
+     */
+    virtual size_t get_dead_versions() const { return dead_versions; }
+
+    /**
+     * Give a column a BRIN index and summarize the block ranges the file has filled. The
+     * index lasts as long as the table object (the catalog keeps track of it across runs).
+     * Call it outside a transaction.
+     * @param index_name        the index's name
+     * @param column_name       column to index
+     * @param blocks_per_range  blocks per summary, or 0 for BrinIndex::BLOCKS_PER_RANGE
+     * @returns                 the index (owned by the table)
+     * @throws                  DbRelationError if there's no such column or it already has one
+     */
+    virtual BrinIndex &add_brin_index(const Identifier &index_name, const Identifier &column_name,
+                                      BlockID blocks_per_range = 0);
+
+    /**
+     * @param column  number of a column of the table
+     * @returns       the column's BRIN index, or nullptr if it has none
+     */
+    virtual BrinIndex *get_brin_index(size_t column) const { return brin_indexes[column]; }
+
+    /**
+     * Summarize, in each BRIN index, the block ranges the file has grown past. Call it
+     * outside a transaction (after an insert commits, say): it waits for blocks' latches.
+     */
+    virtual void summarize();
+
+    /**
+     * @returns  the table's statistics, or nullptr if it hasn't been analyzed
+     */
+    virtual std::shared_ptr<TableStats> get_stats() const { return std::atomic_load(&stats); }
+
+    /**
+     * Give the table statistics to keep up to date (replacing any it had).
+     */
+    virtual void set_stats(std::shared_ptr<TableStats> stats) { std::atomic_store(&this->stats, stats); }
 
 protected:
+    friend class HeapTableScan;
+    friend class BatchTableScan;
+    friend class BrinIndex;
+    friend class TableStats;
+
     HeapFile file;
 
+    // Where each column starts in a record (see marshal): at a fixed offset, up to and
+    // including the first TEXT column, or at the offset in its entry of the record's
+    // offset directory, after that.
+    std::vector<int> directory_entries;     // a column's entry in the directory, or -1
+    std::vector<u_int16_t> fixed_offsets;   // a column's offset, if it has no entry
+    u_int16_t directory_size;               // bytes of directory before the columns
+    std::atomic<size_t> dead_versions;
+    std::vector<std::atomic<BrinIndex *>> brin_indexes;  // by column; owned
+    std::shared_ptr<TableStats> stats;                   // read and replaced atomically
+
+    /**
+     * @param record  a marshaled row
+     * @param column  number of a column of the table
+     * @returns       where the column's value starts in the record
+     */
+    u_int16_t column_offset(const char *record, size_t column) const
+    {
+        if (directory_entries[column] < 0)
+            return fixed_offsets[column];
+        return *(const u_int16_t *)(record + directory_entries[column] * sizeof(u_int16_t));
+    }
+
+    /**
+     * Decode one column of a record, without looking at the others.
+     */
+    virtual void decode_column(const char *record, size_t column, Value &value) const;
+
+    /**
+     * Read the block of a row into an arena.
+     * @returns  a view of the row's record
+     * @throws   DbRelationError if there is no such row
+     */
+    virtual RecordView view(Handle handle, Arena &arena);
+
     virtual ValueDict *validate(const ValueDict *row);
 
+    /**
+     * Leave out of a list of blocks those the BRIN indexes rule out for equality on some
+     * columns.
+     * @param conditions  column numbers and the values they must equal
+     */
+    virtual void prune_blocks(const std::vector<std::pair<size_t, const Value *>> &conditions, BlockIDs &block_ids);
+
     virtual Handle append(const ValueDict *row);
 
+    virtual Handle append(const Dbt *data);
+
+    virtual RecordID add_to(BlockID block_id, const Dbt *data);
+
+    virtual RecordID add_version(SlottedPage *block, const Dbt *data, Stamp stamp);
+
+    virtual void end_version(SlottedPage *block, RecordID record_id, Stamp stamp);
+
+    virtual size_t prune(SlottedPage *block, Stamp horizon);
+
+    /**
+     * Reclaim a block's dead versions and drop its trailing tombstones, in a transaction
+     * of its own.
+     * @param used  set to the bytes the block's records and their headers take up
+     * @param room  set to the bytes it has left
+     */
+    virtual void vacuum_block(BlockID block_id, VacuumStats &stats, size_t &used, size_t &room);
+
+    /**
+     * Move all the rows of a block into another, in one transaction, as updates: the
+     * copies are new versions and the originals are ended.
+     * @returns  how many rows were moved: none if the block has versions that aren't
+     *           simply current, or a latch was busy, or the target hadn't room
+     */
+    virtual size_t move_rows(BlockID source, BlockID target);
+
+    /**
+     * Give back the empty blocks at the end of the file (all but the first).
+     * @returns  how many
+     */
+    virtual size_t truncate();
+
     virtual Dbt *marshal(const ValueDict *row);
 
+    virtual Dbt *marshal(const ValueDict *row, Arena &arena);
+
+    virtual u_int32_t marshal(const ValueDict *row, char *bytes);
+
     virtual ValueDict *unmarshal(Dbt *data);
+
+    virtual ValueDict *unmarshal(RecordView record, Arena &arena);
+
+    /**
+     * Unmarshal into row, reusing its entries (and their strings' memory) if it already
+     * has this table's columns.
+     */
+    virtual void unmarshal(RecordView record, ValueDict &row);
+
+    /**
+     * Unmarshal just the named columns (those the table has) into row, likewise.
+     */
+    virtual void unmarshal(RecordView record, const ColumnNames &column_names, ValueDict &row);
+};
+
+/**
+ * @class HeapTableScan - streaming cursor over a HeapTable
+ *
+ * Walks the heap file block by block, holding only the current SlottedPage and the ids of
+ * the record versions its snapshot sees, and unmarshals each one, straight from the block,
+ * as it is requested. Each
+ * block is read into the scan's arena, which is reset as the scan moves on.
+ */
+class HeapTableScan : public DbRelationScan {
+public:
+    HeapTableScan(HeapTable &table);
+
+    virtual ~HeapTableScan();
+
+    HeapTableScan(const HeapTableScan &other) = delete;
+
+    HeapTableScan &operator=(const HeapTableScan &other) = delete;
+
+    virtual bool next(Handle &handle, ValueDict &row);
+
+protected:
+    HeapTable &table;
+    std::shared_ptr<const Snapshot> snapshot;
+    BlockIDs block_ids;
+    size_t block_index;
+    Arena arena;  // the current block and what was read from it
+    SlottedPage *block;
+    ArenaRecordIDs *record_ids;
+    size_t record_index;
+
+    virtual void release_block();
 };
 
 // Test function for heap storage, returns true if all tests pass.
@@ -0,0 +1,114 @@
+/**
+ * @file latches.h - Short-term reader-writer latches on heap file blocks.
+ *
+ * A page latch guards a block while a thread works on its in-memory copy: a writer holds
+ * the block's latch exclusively from get() to put(), so two writers of one block can't
+ * lose each other's changes, and a reader that needs the block to stay the same across
+ * several reads holds it shared. Unlike transaction locks, a latch covers one operation on
+ * one block and is released before the next; a thread never holds two at once.
+ *
+ * Berkeley DB can't see waits on latches, so a latch holder blocked on a page lock of a
+ * transaction whose thread waits for the same latch would never be found as a deadlock.
+ * Inserts, the writers that run many to a transaction, therefore only try latches (see
+ * HeapTable::add_to) and go to another block when one is taken.
+ *
+ * The latches live in a fixed table indexed by a hash of (file, block id), so nothing is
+ * allocated per block. Blocks that hash alike share a latch, which costs some concurrency
+ * but, with one latch at a time, can't deadlock.
+ */
+#pragma once
+
+#include <pthread.h>
+#include <cstdint>
+#include <string>
+
+/**
+ * @class PageLatch - a reader-writer latch that prefers waiting writers to new readers
+ */
+class alignas(64) PageLatch {
+public:
+    PageLatch();
+
+    ~PageLatch();
+
+    PageLatch(const PageLatch &other) = delete;
+
+    PageLatch &operator=(const PageLatch &other) = delete;
+
+    void lock_shared();
+
+    void unlock_shared();
+
+    void lock();
+
+    /**
+     * @returns  true if the latch was free and is now held exclusively
+     */
+    bool try_lock();
+
+    void unlock();
+
+private:
+    pthread_rwlock_t rwlock;
+};
+
+/**
+ * @class LatchManager - finds the latch for a block
+ */
+class LatchManager {
+public:
+    static const size_t LATCHES = 4096;
+
+    /**
+     * @param file_key  the file's key (see file_key())
+     * @param block_id  block in the file
+     * @returns         the latch for the block
+     */
+    static PageLatch &latch(size_t file_key, uint32_t block_id);
+
+    /**
+     * @param name  a file's name
+     * @returns     a key for the file, the same for every HeapFile opened on it
+     */
+    static size_t file_key(const std::string &name);
+
+private:
+    static PageLatch latches[LATCHES];
+};
+
+/**
+ * @class SharedLatch - holds a latch shared for its lifetime
+ */
+class SharedLatch {
+public:
+    explicit SharedLatch(PageLatch &latch) : latch(latch) { latch.lock_shared(); }
+
+    ~SharedLatch() { latch.unlock_shared(); }
+
+    SharedLatch(const SharedLatch &other) = delete;
+
+    SharedLatch &operator=(const SharedLatch &other) = delete;
+
+private:
+    PageLatch &latch;
+};
+
+/**
+ * @class ExclusiveLatch - holds a latch exclusively for its lifetime
+ */
+class ExclusiveLatch {
+public:
+    explicit ExclusiveLatch(PageLatch &latch) : latch(latch) { latch.lock(); }
+
+    ~ExclusiveLatch() { latch.unlock(); }
+
+    ExclusiveLatch(const ExclusiveLatch &other) = delete;
+
+    ExclusiveLatch &operator=(const ExclusiveLatch &other) = delete;
+
+private:
+    PageLatch &latch;
+};
+
+// Test function for page latches and concurrent HeapTable access, returns true if all tests pass.
+bool test_latches();
@@ -0,0 +1,413 @@
+/**
+ * @file lsm_storage.h - Log-structured merge storage engine, for tables that are mostly written.
+ * BloomFilter
+ * LsmTable: DbRelation
+ *
+ * A heap table writes each row into a block it first reads, and looks for room in it; an
+ * LsmTable only ever appends. New row versions go into the memtable, an in-memory map
+ * sorted by row, and into its write-ahead log. When the memtable fills up it is frozen and
+ * written out, in one sequential pass, as an immutable sorted run. Runs are merged in the
+ * background (size-tiered: when a level has fanout runs, they become one run of the next
+ * level), which throws away the versions no snapshot can see any more.
+ *
+ * Every piece is made of the heap engine's parts: a run is a HeapFile of SlottedPages, with
+ * its records in (row, newest version first) order and each stamped with the transaction
+ * that wrote it; the log is a HeapTable, so it is written in the caller's transaction and
+ * rolled back with it; and the manifest, which lists the live logs and runs, is a HeapTable
+ * too, changed in a transaction of its own whenever a memtable is frozen or written out or
+ * runs are merged.
+ *
+ * Rows are keyed by their handle, not by any column, so the runs' Bloom filters only help
+ * a lookup by handle: a query on a column scans every run. There are no statistics,
+ * indexes or vacuum for an LSM table either (merging is its vacuum), and ANALYZE, CREATE
+ * INDEX and VACUUM refuse one.
+ */
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include "heap_storage.h"
+
+/**
+ * @class BloomFilter - a set of 64-bit keys that may answer "maybe" for keys not in it
+ *
+ * About 1% of absent keys get a false "maybe" at 10 bits per key.
+ */
+class BloomFilter {
+public:
+    /**
+     * @param keys          how many keys will be added
+     * @param bits_per_key  bits of filter for each
+     */
+    explicit BloomFilter(size_t keys = 0, size_t bits_per_key = 10);
+
+    virtual ~BloomFilter() {}
+
+    virtual void add(uint64_t key);
+
+    /**
+     * @returns  false if the key certainly wasn't added
+     */
+    virtual bool may_contain(uint64_t key) const;
+
+protected:
+    std::vector<uint64_t> bits;
+    size_t probes;
+};
+
+/**
+ * A version's place in an LsmTable: by row, and the newest version of a row first. Version
+ * numbers (seq) increase across the whole table, so they also order the memtables and runs.
+ */
+struct LsmKey {
+    uint64_t row_id;
+    uint64_t seq;
+
+    bool operator<(const LsmKey &other) const
+    {
+        return row_id < other.row_id || (row_id == other.row_id && seq > other.seq);
+    }
+};
+
+/**
+ * A row version in a memtable.
+ */
+struct LsmVersion {
+    Stamp stamp;         // the transaction that wrote it
+    bool deleted;        // a tombstone, written by del
+    std::string record;  // the marshaled row (empty for a tombstone)
+};
+
+typedef std::map<LsmKey, LsmVersion> LsmVersions;
+
+/**
+ * @struct LsmMemtable - the versions written since the last freeze, and their log
+ */
+struct LsmMemtable {
+    uint32_t number;  // of the log, in the manifest
+    LsmVersions versions;
+    size_t bytes;
+    std::unique_ptr<HeapTable> log;
+
+    LsmMemtable(uint32_t number, HeapTable *log) : number(number), bytes(0), log(log) {}
+};
+
+/**
+ * @struct LsmRun - an immutable sorted run, and what is kept in memory about it
+ *
+ * The fences and filter are rebuilt from the file when the table is opened. A run that
+ * compaction merged away is dropped when the last reader still using it lets go.
+ */
+struct LsmRun {
+    uint32_t number;
+    uint32_t level;
+    HeapFile file;
+    std::vector<uint64_t> fences;  // the first row in each block
+    uint64_t min_row_id;
+    uint64_t max_row_id;
+    uint64_t max_seq;
+    size_t versions;
+    BloomFilter filter;            // of the rows it has versions of
+    std::atomic<bool> obsolete;
+
+    LsmRun(const std::string &name, uint32_t number, uint32_t level);
+
+    virtual ~LsmRun();
+};
+
+/**
+ * @class LsmTable - log-structured merge storage engine (implementation of DbRelation)
+ *
+ * A row is identified by a row id given to it on insert, which its handle holds; update
+ * and del write a new version (or a tombstone) of the row under the same id, so handles
+ * never change. A point read (project) looks in the memtables and then in the runs, newest
+ * first, skipping the runs whose row range or Bloom filter rule the row out; select and scan
+ * merge them all in row order.
+ *
+ * Rows are multi-versioned like a HeapTable's (see transactions.h): every version carries
+ * its transaction's stamp, and a reader sees the newest version of each row its snapshot
+ * sees. An aborted transaction's versions are taken out of the memtable (and rolled back in
+ * the log). A memtable is only written out once all of its versions are committed, so runs
+ * hold nothing but committed versions; and compaction drops a version only if the next
+ * newer one is older than Snapshot::horizon().
+ *
+ * Safe for concurrent use. The memtables and the list of runs are behind one mutex, held
+ * only to look at or change them in memory; runs are read without it. Writers outside a
+ * transaction wait when two frozen memtables are already waiting to be written out, or the
+ * memtable has grown to twice its size before the compaction thread could freeze it.
+ */
+class LsmTable : public DbRelation {
+public:
+    static const size_t MEMTABLE_BYTES = 1 << 20;
+    static const size_t FANOUT = 4;
+
+    /**
+     * @param memtable_bytes  how big the memtable grows before it is written out
+     * @param fanout          runs a level holds before they are merged into one of the next
+     */
+    LsmTable(Identifier table_name, ColumnNames column_names, ColumnAttributes column_attributes,
+             size_t memtable_bytes = MEMTABLE_BYTES, size_t fanout = FANOUT);
+
+    virtual ~LsmTable();
+
+    LsmTable(const LsmTable &other) = delete;
+
+    LsmTable(LsmTable &&temp) = delete;
+
+    LsmTable &operator=(const LsmTable &other) = delete;
+
+    LsmTable &operator=(LsmTable &&temp) = delete;
+
+    virtual void create();
+
+    virtual void create_if_not_exists();
+
+    virtual void drop();
+
+    /**
+     * Read the manifest, replay the logs into memtables, load the runs' fences and filters
+     * and start the compaction thread.
+     */
+    virtual void open();
+
+    /**
+     * Stop the compaction thread and let go of the files. What is still in a memtable is
+     * in its log, and is replayed by the next open.
+     */
+    virtual void close();
+
+    virtual Handle insert(const ValueDict *row);
+
+    virtual Handle update(const Handle handle, const ValueDict *new_values);
+
+    virtual void del(const Handle handle);
+
+    using DbRelation::select;
+
+    virtual void select(const ValueDict *where, Handles &handles);
+
+    using DbRelation::project;
+
+    virtual void project(Handle handle, const ColumnNames *column_names, ValueDict &row);
+
+    virtual std::unique_ptr<DbRelationScan> scan();
+
+    virtual size_t estimated_row_count();
+
+    /**
+     * Freeze the memtable and wait until it, and every merge it leads to, is done. Call it
+     * outside a transaction.
+     */
+    virtual void flush();
+
+    /**
+     * @returns  how many runs each level has, level 0 first
+     */
+    virtual std::vector<size_t> get_level_sizes() const;
+
+protected:
+    friend class LsmTableScan;
+
+    size_t memtable_bytes;
+    size_t fanout;
+    HeapTable manifest;
+    std::atomic<bool> opened;
+    std::mutex open_lock;                     // for opening and closing
+    mutable std::mutex lock;                  // for everything below
+    std::condition_variable work;             // the compaction thread waits here
+    std::condition_variable done;             // flush() and writers wait here for it
+    std::shared_ptr<LsmMemtable> memtable;
+    std::deque<std::shared_ptr<LsmMemtable>> frozen;  // newest first
+    std::vector<std::shared_ptr<LsmRun>> runs;       // by level, and newest first in a level
+    uint64_t runs_changed;                    // bumped whenever runs is
+    uint64_t next_row_id;
+    uint64_t next_seq;
+    uint32_t next_number;                     // for the next log or run file
+    size_t flush_requests;
+    bool busy;                                // the compaction thread is at work
+    bool stopping;
+    std::thread compactor;
+
+    static Handle to_handle(uint64_t row_id) { return Handle((BlockID)(row_id >> 16), (RecordID)(row_id & 0xffff)); }
+
+    static uint64_t to_row_id(Handle handle) { return ((uint64_t)handle.first << 16) | handle.second; }
+
+    /**
+     * Find the newest version of a row that a snapshot sees. The caller holds the lock, which
+     * is let go of while the runs are read, and the answer holds for the memtables and runs
+     * as they are when it returns.
+     * @param version  set to it, if there is one
+     * @param found    set to whether there is one (it may be a tombstone)
+     * @param latest   set to whether it is the newest version of the row of all, rather than
+     *                 older than one the snapshot doesn't see
+     */
+    virtual void find(uint64_t row_id, const Snapshot &snapshot, std::unique_lock<std::mutex> &guard,
+                      LsmVersion &version, bool &found, bool &latest);
+
+    /**
+     * find in the memtables; the caller holds the lock.
+     * @returns  false if they have no version of the row at all
+     */
+    virtual bool find_in_memory(uint64_t row_id, const Snapshot &snapshot, LsmVersion &version, bool &found,
+                                bool &latest);
+
+    /**
+     * find in some runs, newest first.
+     */
+    virtual void find_in_runs(const std::vector<std::shared_ptr<LsmRun>> &runs, uint64_t row_id,
+                              const Snapshot &snapshot, LsmVersion &version, bool &found, bool &latest);
+
+    /**
+     * Write a new version of a row into the memtable (taken out again if the transaction
+     * aborts), let go of the lock and write it to the memtable's log.
+     */
+    virtual void write(uint64_t row_id, bool deleted, const std::string &record, std::unique_lock<std::mutex> &guard);
+
+    /**
+     * Write a new version of a row, after checking no other transaction has written one that
+     * the caller's snapshot doesn't see.
+     * @param make  builds the new version from the one replaced; returns false for a tombstone
+     */
+    virtual void replace(Handle handle, const std::function<bool(const LsmVersion &, std::string &)> &make);
+
+    virtual void run();
+
+    /**
+     * Freeze the memtable, with a new one (and log) to take its place.
+     */
+    virtual void freeze();
+
+    /**
+     * Write the oldest frozen memtable out as a level 0 run, once its versions are committed.
+     */
+    virtual void write_out();
+
+    /**
+     * Merge the runs of a level into one run of the next.
+     */
+    virtual void compact(uint32_t level);
+
+    /**
+     * @returns  the level with fanout runs or more, or -1 if none has
+     */
+    virtual int full_level() const;
+
+    /**
+     * Write versions, in LsmKey order, as a new run. Versions whose next newer version is
+     * older than horizon are dropped, and so are tombstones older than it if nothing is
+     * below the run.
+     * @param level     the run's level
+     * @param expected  about how many versions there are (to size the filter)
+     * @param bottom    whether no run is below the new one
+     * @param next      fills in the next version, or returns false at the end
+     */
+    virtual std::shared_ptr<LsmRun> write_run(
+        uint32_t level, size_t expected, bool bottom,
+        const std::function<bool(LsmKey &, Stamp &, bool &, RecordView &)> &next);
+
+    /**
+     * Read a run's blocks to build its fences and filter.
+     */
+    virtual void load(LsmRun &run);
+
+    /**
+     * Replace the manifest entries of some logs and runs with others, in one transaction.
+     * @param removed  (kind, number) of the entries to delete
+     * @param added    (kind, number, level) of the entries to insert
+     */
+    virtual void change_manifest(const std::vector<std::pair<std::string, uint32_t>> &removed,
+                                 const std::vector<std::tuple<std::string, uint32_t, uint32_t>> &added);
+
+    virtual HeapTable *new_log(uint32_t number);
+
+    virtual std::string file_name(const std::string &kind, uint32_t number) const;
+
+    virtual void marshal(const ValueDict *row, std::string &record);
+
+    virtual void unmarshal(const char *record, size_t size, const ColumnNames *column_names, ValueDict &row);
+};
+
+/**
+ * @class LsmRunCursor - reads a run's versions in order, a block at a time
+ */
+class LsmRunCursor {
+public:
+    /**
+     * Start at the run's first version.
+     */
+    explicit LsmRunCursor(std::shared_ptr<LsmRun> run);
+
+    virtual ~LsmRunCursor();
+
+    LsmRunCursor(const LsmRunCursor &other) = delete;
+
+    LsmRunCursor &operator=(const LsmRunCursor &other) = delete;
+
+    /**
+     * Move to the next version (which invalidates the record of this one).
+     */
+    virtual void advance();
+
+    /**
+     * @returns  false once it's past the last version
+     */
+    bool valid() const { return block != nullptr; }
+
+    LsmKey key;
+    Stamp stamp;
+    bool deleted;
+    RecordView record;  // the marshaled row
+
+protected:
+    std::shared_ptr<LsmRun> run;
+    BlockID block_id;
+    SlottedPage *block;
+    RecordIDs record_ids;
+    size_t position;
+};
+
+/**
+ * @class LsmTableScan - streaming cursor over an LsmTable
+ *
+ * Merges the versions of the memtables (copied when the scan starts) and of the runs (read
+ * a block at a time) in row order, and returns the newest version of each row that its
+ * snapshot sees. The runs it started with stay until it's destroyed, even if they are
+ * merged away meanwhile.
+ */
+class LsmTableScan : public DbRelationScan {
+public:
+    LsmTableScan(LsmTable &table);
+
+    virtual ~LsmTableScan();
+
+    LsmTableScan(const LsmTableScan &other) = delete;
+
+    LsmTableScan &operator=(const LsmTableScan &other) = delete;
+
+    virtual bool next(Handle &handle, ValueDict &row);
+
+    /**
+     * next, but without unmarshaling the row.
+     * @returns  false at the end
+     */
+    virtual bool next_record(uint64_t &row_id, RecordView &record);
+
+protected:
+    LsmTable &table;
+    std::shared_ptr<const Snapshot> snapshot;
+    std::vector<std::pair<LsmKey, LsmVersion>> memory;  // the memtables' versions, in order
+    size_t memory_position;
+    std::vector<std::unique_ptr<LsmRunCursor>> cursors;
+    int taken;         // where the last version came from: memory (0), a cursor (its index + 1) or none (-1)
+    uint64_t decided;  // the last row returned or found deleted
+};
+
+// Test function for LsmTable, returns true if all tests pass.
+bool test_lsm_storage();
@@ -0,0 +1,261 @@
+/**
+ * @file schema_tables.h - Catalog relations describing every table in the database.
+ * Columns: HeapTable
+ * Indices: HeapTable
+ * Engines: HeapTable
+ * Statistics: HeapTable
+ * Tables: HeapTable
+ *
+ * The catalog is itself stored in heap tables, so "_tables", "_columns", "_indices",
+ * "_engines" and "_statistics" describe themselves as well as all the user's tables.
+ */
+#pragma once
+
+#include <mutex>
+#include "heap_storage.h"
+#include "table_stats.h"
+
+/**
+ * Create the catalog tables if they don't already exist.
+ */
+void initialize_schema_tables();
+
+/**
+ * @class Columns - the "_columns" catalog relation: (table_name, column_name, data_type)
+ */
+class Columns : public HeapTable {
+public:
+    static const Identifier TABLE_NAME;
+
+    Columns();
+
+    virtual ~Columns() {}
+
+    /**
+     * Insert a column description after checking its data type is one we support.
+     */
+    virtual Handle insert(const ValueDict *row);
+
+protected:
+    friend class Tables;
+
+    static ColumnNames &COLUMN_NAMES();
+
+    static ColumnAttributes &COLUMN_ATTRIBUTES();
+};
+
+/**
+ * @class Indices - the "_indices" catalog relation: (table_name, index_name, column_name,
+ * index_type)
+ *
+ * Databases made before there were indexes don't have it until the first CREATE INDEX.
+ */
+class Indices : public HeapTable {
+public:
+    static const Identifier TABLE_NAME;
+
+    Indices();
+
+    virtual ~Indices() {}
+
+protected:
+    friend class Tables;
+
+    static ColumnNames &COLUMN_NAMES();
+
+    static ColumnAttributes &COLUMN_ATTRIBUTES();
+};
+
+/**
+ * @class Engines - the "_engines" catalog relation: (table_name, engine)
+ *
+ * Only tables stored by an engine other than the heap have a row. Databases made before
+ * there was a choice don't have it until the first CREATE TABLE ... USING LSM.
+ */
+class Engines : public HeapTable {
+public:
+    static const Identifier TABLE_NAME;
+
+    Engines();
+
+    virtual ~Engines() {}
+
+protected:
+    friend class Tables;
+
+    static ColumnNames &COLUMN_NAMES();
+
+    static ColumnAttributes &COLUMN_ATTRIBUTES();
+};
+
+/**
+ * @class Statistics - the "_statistics" catalog relation: (table_name, column_name,
+ * row_count, block_count, sketched_rows, sketch, histogram)
+ *
+ * A row per column of each analyzed table (see TableStats::to_rows). Databases made before
+ * there was ANALYZE don't have it until the first one.
+ */
+class Statistics : public HeapTable {
+public:
+    static const Identifier TABLE_NAME;
+
+    Statistics();
+
+    virtual ~Statistics() {}
+
+protected:
+    friend class Tables;
+
+    static ColumnNames &COLUMN_NAMES();
+
+    static ColumnAttributes &COLUMN_ATTRIBUTES();
+};
+
+/**
+ * @class Tables - the "_tables" catalog relation: (table_name)
+ *
+ * Also the way to get at a user table: get_table() builds (and caches) the
+ * DbRelation for a table from its catalog entries, indexes and all. Shared by all
+ * sessions, so the cache and table (and index) creation are each behind a mutex.
+ */
+class Tables : public HeapTable {
+public:
+    static const Identifier TABLE_NAME;
+
+    Tables();
+
+    virtual ~Tables();
+
+    /**
+     * Create the catalog tables and describe them in themselves.
+     */
+    virtual void create();
+
+    /**
+     * Check whether a table is described in the catalog.
+     * @param table_name  table to look for
+     * @returns           true if there is a "_tables" row for it
+     */
+    virtual bool exists(Identifier table_name);
+
+    /**
+     * Look up a table's schema in "_columns".
+     * @param table_name         table to describe
+     * @param column_names       filled with the table's column names, in order
+     * @param column_attributes  filled with the matching column attributes
+     */
+    virtual void get_columns(Identifier table_name, ColumnNames &column_names, ColumnAttributes &column_attributes);
+
+    /**
+     * Get the relation for a table, opening it the first time it is asked for.
+     * @param table_name  table to get
+     * @returns           the table's relation (owned by the catalog)
+     * @throws            DbRelationError if the table does not exist
+     */
+    virtual DbRelation &get_table(Identifier table_name);
+
+    /**
+     * @returns  the user tables opened so far by get_table (they stay open, and owned by
+     *           the catalog, until it is destroyed)
+     */
+    virtual std::vector<DbRelation *> get_open_tables();
+
+    /**
+     * Execute: CREATE TABLE [IF NOT EXISTS] <table_name> ( <columns> ) [USING <engine>]
+     * Records the schema in the catalog and creates the table's file.
+     * @param table_name         table to create
+     * @param column_names       its column names
+     * @param column_attributes  its column attributes
+     * @param if_not_exists      if true, quietly do nothing when the table already exists
+     * @param engine             storage engine: "HEAP" (a HeapTable) or "LSM" (an LsmTable)
+     * @returns                  false if the table already existed (and if_not_exists was set)
+     * @throws                   DbRelationError if the engine is unknown
+     */
+    virtual bool create_table(Identifier table_name, const ColumnNames &column_names,
+                              const ColumnAttributes &column_attributes, bool if_not_exists = false,
+                              Identifier engine = "HEAP");
+
+    /**
+     * Execute: DROP TABLE <table_name>
+     * Drops the table's file and removes it, its indexes and its statistics from the
+     * catalog. The relation get_table gave out for it stays allocated until the catalog
+     * is destroyed, in case a scan or the background vacuum still holds it. Call it
+     * outside a transaction.
+     * @param table_name  table to drop
+     * @throws            DbRelationError if the table doesn't exist or is a catalog table
+     */
+    virtual void drop_table(Identifier table_name);
+
+    /**
+     * @returns  the storage engine of a table: "HEAP" or "LSM"
+     */
+    virtual Identifier get_engine(Identifier table_name);
+
+    /**
+     * Execute: CREATE INDEX <index_name> ON <table_name> USING BRIN (<column_name>)
+     * Records the index in the catalog and builds it. Call it outside a transaction.
+     * @param table_name   table to index
+     * @param index_name   its name, unique among the table's indexes
+     * @param column_name  column to index
+     * @param index_type   kind of index; only "BRIN" is supported
+     * @throws             DbRelationError if the index can't be made
+     */
+    virtual void create_index(Identifier table_name, Identifier index_name, Identifier column_name,
+                              Identifier index_type);
+
+    /**
+     * Execute: ANALYZE <table_name>
+     * Gathers a heap table's statistics from a sample of its blocks, records them in the
+     * catalog and gives them to the table. Call it outside a transaction.
+     * @param table_name     table to analyze
+     * @param sample_blocks  blocks to read
+     * @returns              the statistics
+     * @throws               DbRelationError if the table isn't a heap table
+     */
+    virtual std::shared_ptr<TableStats> analyze(Identifier table_name,
+                                                size_t sample_blocks = TableStats::SAMPLE_BLOCKS);
+
+    /**
+     * Rewrite a table's "_statistics" rows if enough rows have been inserted and deleted
+     * since they were written: SAVE_CHANGES, or a tenth of the table if that's more. Call
+     * it outside a transaction (after an insert commits, say).
+     * @param force  write them whatever has changed
+     * @returns      true if they were written
+     */
+    virtual bool save_statistics(HeapTable &table, bool force = false);
+
+    static const size_t SAVE_CHANGES = 1000;
+
+protected:
+    Columns columns;
+    Indices indices;
+    Engines engines;
+    Statistics statistics;
+    std::map<Identifier, DbRelation *> table_cache;
+    std::vector<DbRelation *> dropped_tables;  // out of table_cache, but maybe still in use
+    std::mutex cache_lock;
+    std::mutex create_lock;      // so two sessions can't both create a table
+    std::mutex statistics_lock;  // so two sessions can't both rewrite a table's statistics
+
+    static ColumnNames &COLUMN_NAMES();
+
+    static ColumnAttributes &COLUMN_ATTRIBUTES();
+
+    virtual void describe(Identifier table_name, const ColumnNames &column_names,
+                          const ColumnAttributes &column_attributes);
+
+    /**
+     * Build the indexes "_indices" lists for a table just opened.
+     */
+    virtual void open_indexes(HeapTable &table);
+
+    /**
+     * Give a table just opened the statistics "_statistics" has for it.
+     */
+    virtual void open_statistics(HeapTable &table);
+
+    /**
+     * @returns  true if table_name is one of the catalog's tables
+     */
+    static bool is_catalog(const Identifier &table_name);
+};
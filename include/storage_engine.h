@@ -11,6 +11,7 @@
 
 #include <exception>
 #include <map>
+#include <memory>
 #include <utility>
 #include <vector>
 #include "db_cxx.h"
@@ -95,9 +96,20 @@ public:
 
     /**
      * Get all the record ids in this block (excluding deleted ones).
-     * @returns  pointer to list of record ids (freed by caller)
+     * @returns  list of record ids
      */
-    virtual RecordIDs *ids() = 0;
+    RecordIDs ids()
+    {
+        RecordIDs record_ids;
+        ids(record_ids);
+        return record_ids;
+    }
+
+    /**
+     * ids() into a caller's list, so its memory can be reused from block to block.
+     * @param record_ids  replaced with the record ids
+     */
+    virtual void ids(RecordIDs &record_ids) = 0;
 
     /**
      * Access the whole block's memory as a BerkeleyDB Dbt pointer.
@@ -185,9 +197,20 @@ public:
     /**
      * Get a list of all the valid BlockID's in the file
      * FIXME - not a good long-term approach, but we'll do this until we put in iterators
-     * @returns  a pointer to vector of BlockIDs (freed by caller)
+     * @returns  vector of BlockIDs
      */
-    virtual BlockIDs *block_ids() = 0;
+    BlockIDs block_ids()
+    {
+        BlockIDs ids;
+        block_ids(ids);
+        return ids;
+    }
+
+    /**
+     * block_ids() into a caller's vector, so its memory can be reused.
+     * @param ids  replaced with the BlockIDs
+     */
+    virtual void block_ids(BlockIDs &ids) = 0;
 
 protected:
     std::string name;  // filename (or part of it)
@@ -207,7 +230,7 @@ public:
 
     virtual ~ColumnAttribute() {}
 
-    virtual DataType get_data_type() { return data_type; }
+    virtual DataType get_data_type() const { return data_type; }
 
     virtual void set_data_type(DataType data_type) { this->data_type = data_type; }
 
@@ -218,18 +241,36 @@ protected:
 
 /**
  * @class Value - holds value for a field
+ *
+ * is_null marks a missing value (e.g., the unmatched side of an outer join);
+ * nulls only exist while executing queries and are never stored.
  */
 class Value {
 public:
     ColumnAttribute::DataType data_type;
     int32_t n;
     std::string s;
+    bool is_null;
+
+    Value() : n(0), is_null(false) { data_type = ColumnAttribute::INT; }
+
+    Value(int32_t n) : n(n), is_null(false) { data_type = ColumnAttribute::INT; }
 
-    Value() : n(0) { data_type = ColumnAttribute::INT; }
+    Value(std::string s) : n(0), s(s), is_null(false) { data_type = ColumnAttribute::TEXT; }
 
-    Value(int32_t n) : n(n) { data_type = ColumnAttribute::INT; }
+    static Value null() {
+        Value value;
+        value.is_null = true;
+        return value;
+    }
 
-    Value(std::string s) : n(0), s(s) { data_type = ColumnAttribute::TEXT; }
+    bool operator==(const Value &other) const {
+        if (is_null || other.is_null)
+            return is_null == other.is_null;
+        return data_type == other.data_type && (data_type == ColumnAttribute::INT ? n == other.n : s == other.s);
+    }
+
+    bool operator!=(const Value &other) const { return !(*this == other); }
 };
 
 // More type aliases
@@ -250,6 +291,26 @@ public:
 };
 
 
+/**
+ * @class DbRelationScan - forward-only cursor over the rows of a DbRelation
+ *
+ * Rows are produced one at a time, so a caller never needs the whole relation's
+ * handles in memory at once.
+ */
+class DbRelationScan {
+public:
+    virtual ~DbRelationScan() {}
+
+    /**
+     * Fetch the next row.
+     * @param handle  set to the handle of the row returned
+     * @param row     cleared and filled with the row's values (keyed by column name)
+     * @returns       false when there are no more rows
+     */
+    virtual bool next(Handle &handle, ValueDict &row) = 0;
+};
+
+
 /**
  * @class DbRelation - top-level object handling a physical database relation
  * 
@@ -268,6 +329,8 @@ public:
  *	select(where)
  *	project(handle)
  *	project(handle, column_names)
+ *	scan()
+ *	estimated_row_count()
  */
 class DbRelation {
 public:
@@ -319,8 +382,9 @@ public:
      * from an insert or select).
      * @param handle      the row to update
      * @param new_values  a dictionary keyed by column names for changing columns
+     * @returns           the row's handle from now on (a versioned relation may move it)
      */
-    virtual void update(const Handle handle, const ValueDict *new_values) = 0;
+    virtual Handle update(const Handle handle, const ValueDict *new_values) = 0;
 
     /**
      * Conceptually, execute: DELETE FROM <table_name> WHERE <handle>
@@ -332,32 +396,75 @@ public:
 
     /**
      * Conceptually, execute: SELECT <handle> FROM <table_name> WHERE 1
-     * @returns  a pointer to a list of handles for qualifying rows (caller frees)
+     * @returns  list of handles for qualifying rows
      */
-    virtual Handles *select() = 0;
+    Handles select() { return select(nullptr); }
 
     /**
      * Conceptually, execute: SELECT <handle> FROM <table_name> WHERE <where>
      * @param where  where-clause predicates
-     * @returns      a pointer to a list of handles for qualifying rows (freed by caller)
+     * @returns      list of handles for qualifying rows
+     */
+    Handles select(const ValueDict *where)
+    {
+        Handles handles;
+        select(where, handles);
+        return handles;
+    }
+
+    /**
+     * select(where) into a caller's list, so its memory can be reused across calls.
+     * @param where    where-clause predicates (nullptr for every row)
+     * @param handles  replaced with the handles of the qualifying rows
      */
-    virtual Handles *select(const ValueDict *where) = 0;
+    virtual void select(const ValueDict *where, Handles &handles) = 0;
 
     /**
      * Return a sequence of all values for handle (SELECT *).
      * @param handle  row to get values from
      * @returns       dictionary of values from row (keyed by all column names)
      */
-    virtual ValueDict *project(Handle handle) = 0;
+    ValueDict project(Handle handle) { return project(handle, nullptr); }
 
     /**
      * Return a sequence of values for handle given by column_names
      * (SELECT <column_names>).
      * @param handle        row to get values from
-     * @param column_names  list of column names to project
+     * @param column_names  list of column names to project (nullptr or empty for all)
      * @returns             dictionary of values from row (keyed by column_names)
      */
-    virtual ValueDict *project(Handle handle, const ColumnNames *column_names) = 0;
+    ValueDict project(Handle handle, const ColumnNames *column_names)
+    {
+        ValueDict row;
+        project(handle, column_names, row);
+        return row;
+    }
+
+    /**
+     * project(handle, column_names) into a caller's dictionary; a row that already has the
+     * same columns keeps its entries and their memory, so reusing one across calls saves
+     * allocating them again.
+     * @param row  replaced with the values
+     */
+    virtual void project(Handle handle, const ColumnNames *column_names, ValueDict &row) = 0;
+
+    /**
+     * Start a streaming scan over every row (SELECT * without materializing handles).
+     * @returns  a cursor positioned before the first row
+     */
+    virtual std::unique_ptr<DbRelationScan> scan() = 0;
+
+    /**
+     * Cheaply estimate how many rows the relation holds (for choosing between plans).
+     * @returns  approximate row count
+     */
+    virtual size_t estimated_row_count() = 0;
+
+    virtual const Identifier &get_table_name() const { return table_name; }
+
+    virtual const ColumnNames &get_column_names() const { return column_names; }
+
+    virtual const ColumnAttributes &get_column_attributes() const { return column_attributes; }
 
 protected:
     Identifier table_name;
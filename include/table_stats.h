@@ -0,0 +1,262 @@
+/**
+ * @file table_stats.h - Optimizer statistics for heap tables, gathered by ANALYZE.
+ * HyperLogLog
+ * EquiDepthHistogram
+ * ColumnStats
+ * TableStats
+ *
+ * ANALYZE reads a random sample of a table's blocks (reservoir sampling over the file's
+ * block ids, so each block is equally likely whatever the table's size) and summarizes the
+ * rows it finds: how many rows and blocks the table has, an equi-depth histogram of each
+ * INT column, and a HyperLogLog sketch of each column's distinct values. A sketch is a
+ * kilobyte however many values it has seen, and two sketches merge, so they can keep
+ * counting as rows are inserted.
+ *
+ * The statistics are kept in the "_statistics" catalog table (see schema_tables.h) and
+ * loaded with the table. Afterwards, every insert adds its row to them in memory and every
+ * delete takes one off the row count; the catalog copy is rewritten once enough rows have
+ * changed (see Tables::save_statistics).
+ */
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include "heap_storage.h"
+
+/**
+ * @class HyperLogLog - an estimate of how many distinct values a column has
+ *
+ * Each value is hashed; the first PRECISION bits of the hash pick a register, which keeps
+ * the longest run of leading zeros seen in the rest. About 3% standard error with 1024
+ * registers.
+ */
+class HyperLogLog {
+public:
+    static const unsigned PRECISION = 10;
+    static const size_t REGISTERS = (size_t)1 << PRECISION;
+
+    HyperLogLog() : registers(REGISTERS, 0) {}
+
+    virtual ~HyperLogLog() {}
+
+    void add(const Value &value) { add(hash(value)); }
+
+    void add(uint64_t hash);
+
+    /**
+     * Count the values another sketch has seen too.
+     */
+    void merge(const HyperLogLog &other);
+
+    /**
+     * @returns  about how many distinct values have been added
+     */
+    double estimate() const;
+
+    /**
+     * @returns  the registers as printable text, one character each
+     */
+    std::string to_string() const;
+
+    /**
+     * @param text  what to_string wrote
+     * @throws      DbRelationError if it isn't a sketch
+     */
+    static HyperLogLog from_string(const std::string &text);
+
+    static uint64_t hash(const Value &value);
+
+    bool operator==(const HyperLogLog &other) const { return registers == other.registers; }
+
+protected:
+    std::vector<uint8_t> registers;
+};
+
+/**
+ * @class EquiDepthHistogram - the distribution of an INT column's values
+ *
+ * Built from a sorted sample, cut into buckets that each hold the same number of sampled
+ * rows, so a bucket is narrow where values are dense. Each bucket knows the lowest and
+ * highest value in it and how many of the table's rows it stands for; within a bucket
+ * values are assumed to be spread evenly. A value that fills whole buckets by itself
+ * (low == high) is a frequent one, and equality on it is estimated from them.
+ */
+class EquiDepthHistogram {
+public:
+    static const size_t BUCKETS = 32;
+
+    struct Bucket {
+        int32_t low;
+        int32_t high;
+        double rows;
+    };
+
+    EquiDepthHistogram() {}
+
+    /**
+     * @param values          the sampled values
+     * @param rows_per_value  how many of the table's rows each sampled one stands for
+     * @param buckets         most buckets to cut them into
+     */
+    EquiDepthHistogram(std::vector<int32_t> values, double rows_per_value, size_t buckets = BUCKETS);
+
+    virtual ~EquiDepthHistogram() {}
+
+    /**
+     * Count an inserted row's value, widening the first or last bucket if it's outside.
+     */
+    void add(int32_t value);
+
+    bool empty() const { return buckets.empty(); }
+
+    /**
+     * @returns  the rows the buckets stand for
+     */
+    double rows() const;
+
+    /**
+     * @param or_equal  whether to count value itself
+     * @returns         the fraction of rows below value (or at most value)
+     */
+    double fraction_less(int32_t value, bool or_equal) const;
+
+    /**
+     * @param distinct  distinct values the column has
+     * @returns         the fraction of rows equal to value
+     */
+    double fraction_equal(int32_t value, double distinct) const;
+
+    const std::vector<Bucket> &get_buckets() const { return buckets; }
+
+    /**
+     * @returns  the buckets as text: "low:high:rows" for each, separated by spaces
+     */
+    std::string to_string() const;
+
+    /**
+     * @param text  what to_string wrote
+     * @throws      DbRelationError if it isn't a histogram
+     */
+    static EquiDepthHistogram from_string(const std::string &text);
+
+protected:
+    std::vector<Bucket> buckets;  // in order of value
+};
+
+/**
+ * @struct ColumnStats - what ANALYZE knows of a column
+ */
+struct ColumnStats {
+    ColumnAttribute::DataType data_type;
+    HyperLogLog sketch;
+    EquiDepthHistogram histogram;  // INT columns only
+    double sketched_rows;          // rows whose values went into the sketch
+
+    ColumnStats(ColumnAttribute::DataType data_type) : data_type(data_type), sketched_rows(0) {}
+};
+
+/**
+ * @class TableStats - the statistics of a table
+ *
+ * Safe for concurrent use: inserts add to them while the planner reads them.
+ */
+class TableStats {
+public:
+    static const size_t SAMPLE_BLOCKS = 100;
+
+    TableStats(const ColumnNames &column_names, const ColumnAttributes &column_attributes);
+
+    virtual ~TableStats() {}
+
+    TableStats(const TableStats &other) = delete;
+
+    TableStats &operator=(const TableStats &other) = delete;
+
+    /**
+     * Gather a table's statistics from a sample of its blocks, reading the rows the
+     * current snapshot sees.
+     * @param sample_blocks  blocks to read (all of them if the table has no more)
+     * @param seed           for picking them
+     * @returns              the statistics (not yet given to the table)
+     */
+    static std::shared_ptr<TableStats> analyze(HeapTable &table, size_t sample_blocks = SAMPLE_BLOCKS,
+                                               uint32_t seed = 5300);
+
+    /**
+     * Count an inserted row.
+     * @param row       the row, with all the table's columns
+     * @param block_id  the block it went into
+     */
+    void add_row(const ValueDict &row, BlockID block_id);
+
+    /**
+     * Change the row count without touching the columns' statistics (for a delete, or an
+     * insert undone).
+     */
+    void count_rows(int64_t delta);
+
+    size_t get_row_count() const;
+
+    size_t get_block_count() const;
+
+    /**
+     * @returns  blocks the last ANALYZE read
+     */
+    size_t get_sampled_blocks() const { return sampled_blocks; }
+
+    /**
+     * @returns  about how many distinct values a column has, or 0 if there's no such column
+     */
+    double distinct_values(const Identifier &column_name) const;
+
+    /**
+     * @returns  the fraction of rows whose column equals value (1 if there's no such column)
+     */
+    double fraction_equal(const Identifier &column_name, const Value &value) const;
+
+    /**
+     * @param or_equal  whether to count value itself
+     * @returns         the fraction of rows whose column is below value (or at most
+     *                  value), or -1 if the column has no histogram
+     */
+    double fraction_less(const Identifier &column_name, const Value &value, bool or_equal) const;
+
+    /**
+     * @returns  rows inserted or deleted since the statistics were gathered or last saved
+     */
+    size_t get_changes() const;
+
+    /**
+     * Forget some of the changes (those that were saved).
+     */
+    void clear_changes(size_t saved);
+
+    /**
+     * @returns  a "_statistics" row for each column (see Statistics)
+     */
+    std::vector<ValueDict> to_rows(const Identifier &table_name) const;
+
+    /**
+     * Take back what to_rows wrote for a column (one of the table's).
+     */
+    void load_row(const ValueDict &row);
+
+protected:
+    mutable std::mutex lock;
+    ColumnNames column_names;
+    std::vector<ColumnStats> columns;
+    double row_count;
+    size_t block_count;
+    size_t sampled_blocks;
+    size_t changes;
+
+    /**
+     * @returns  the number of a column, or -1 if the table hasn't it
+     */
+    int column_of(const Identifier &column_name) const;
+
+    double distinct_values(size_t column) const;
+};
+
+// Test function for table statistics, returns true if all tests pass.
+bool test_table_stats();
@@ -0,0 +1,254 @@
+/**
+ * @file transactions.h - Transactions and group commit on Berkeley DB's write-ahead log.
+ *
+ * The environment is opened with logging and transactions (see sql5300.cpp), so every
+ * HeapFile read and write is logged before its page can reach disk, and recovery on the
+ * next open replays or rolls back whatever the log holds. A HeapFile operation runs in the
+ * calling thread's current Transaction if it has one, otherwise in a transaction of its
+ * own (DB_AUTO_COMMIT).
+ *
+ * Commits don't flush the log themselves (DB_TXN_NOSYNC). A committing thread instead
+ * waits on the GroupCommit, whose flusher thread gives other commits the commit delay
+ * to arrive and then makes all of them durable with a single log flush (one fsync).
+ *
+ * Multi-version concurrency control: every Transaction gets a stamp, and each record
+ * version in a SlottedPage carries the stamps of the transactions that created it and
+ * ended it (by updating or deleting it). A reader looks at versions through a Snapshot,
+ * which sees what was committed when it was taken. Scans outside a transaction read
+ * without Berkeley DB read locks (DB_READ_UNCOMMITTED), so they never wait for writers;
+ * the snapshot hides whatever isn't committed, and an abort's versions vanish when Berkeley
+ * DB rolls the pages back. Versions no snapshot can see any more are garbage, reclaimed by
+ * HeapTable::collect_garbage and whenever an insert finds its block full.
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "db_cxx.h"
+
+/**
+ * @class GroupCommit - shares one log flush among all the commits waiting for it
+ */
+class GroupCommit {
+public:
+    /**
+     * Start the flusher thread.
+     * @param env    environment whose log to flush
+     * @param delay  how long to hold a flush for more commits to join it (zero flushes at once)
+     */
+    GroupCommit(DbEnv *env, std::chrono::microseconds delay = std::chrono::microseconds(0));
+
+    /**
+     * Flush anything still waiting, stop the flusher and checkpoint the environment.
+     */
+    virtual ~GroupCommit();
+
+    GroupCommit(const GroupCommit &other) = delete;
+
+    GroupCommit &operator=(const GroupCommit &other) = delete;
+
+    /**
+     * Block until everything logged so far, including the caller's commit, is on disk.
+     * Throws DbRelationError if the flush the caller joined failed; later flushes are tried
+     * afresh, so one failure doesn't fail every commit after it.
+     */
+    virtual void wait_durable();
+
+    virtual void set_delay(std::chrono::microseconds delay) { delay_us = delay.count(); }
+
+    virtual std::chrono::microseconds get_delay() const { return std::chrono::microseconds(delay_us.load()); }
+
+    /**
+     * @returns  number of wait_durable() calls so far
+     */
+    virtual uint64_t get_commits() const;
+
+    /**
+     * @returns  number of log flushes so far (commits / flushes is the average group size)
+     */
+    virtual uint64_t get_flushes() const;
+
+protected:
+    // one log flush, shared by the commits that joined it
+    struct Flush {
+        bool done = false;
+        std::string error;  // why it failed, if it did
+    };
+
+    DbEnv *env;
+    std::atomic<int64_t> delay_us;
+    mutable std::mutex lock;
+    std::condition_variable work;   // the flusher waits here for commits
+    std::condition_variable done;   // committers wait here for their flush
+    uint64_t requested;             // tickets handed out to committers
+    uint64_t flushed;               // every ticket up to this one has had its flush
+    uint64_t flushes;
+    bool stopping;
+    std::shared_ptr<Flush> next_flush;  // the flush that commits now join
+    std::thread flusher;
+
+    virtual void run();
+
+    /**
+     * Flush the log to disk (throws DbException if it can't).
+     */
+    virtual void flush_log();
+};
+
+/**
+ * A transaction stamp. Stamps are handed out in increasing order, starting from the clock
+ * (in nanoseconds) when the process starts or past the high-water mark the last run left on
+ * disk, whichever is later, so they keep increasing across restarts even if the clock has
+ * been stepped back.
+ */
+typedef uint64_t Stamp;
+
+/**
+ * @class Snapshot - which record versions a reader sees
+ *
+ * A version is seen if the transaction that created it had committed when the snapshot was
+ * taken and the one that ended it (if any) hadn't, or if the snapshot's own transaction
+ * created it (and didn't end it). While a snapshot exists, no version it can see is
+ * reclaimed.
+ */
+class Snapshot {
+public:
+    /**
+     * Stamp of versions that every snapshot sees (SlottedPage records added without a stamp).
+     */
+    static const Stamp FROZEN = 0;
+
+    /**
+     * Take a snapshot of what is committed now.
+     * @param own  stamp of the reader's transaction, whose own changes it sees
+     */
+    explicit Snapshot(Stamp own = FROZEN);
+
+    virtual ~Snapshot();
+
+    Snapshot(const Snapshot &other) = delete;
+
+    Snapshot &operator=(const Snapshot &other) = delete;
+
+    /**
+     * @param begin  stamp of the transaction that created a version
+     * @param end    stamp of the transaction that ended it, or FROZEN if none has
+     * @returns      true if this snapshot sees the version
+     */
+    virtual bool sees(Stamp begin, Stamp end) const;
+
+    /**
+     * @returns  a stamp below which every ended version is dead: no snapshot, now or later,
+     *           sees a version whose end stamp is less than it
+     */
+    static Stamp horizon();
+
+protected:
+    Stamp own;
+    Stamp xmin;                 // lowest stamp in progress when taken (or xmax)
+    Stamp xmax;                 // first stamp not yet handed out when taken
+    std::vector<Stamp> active;  // stamps in progress when taken, sorted
+
+    virtual bool committed(Stamp stamp) const;
+};
+
+/**
+ * @class Transaction - a scope whose HeapFile operations commit or abort together
+ *
+ * Constructing one makes it the calling thread's current transaction; a Transaction
+ * constructed while the thread already has one joins it instead, so only the outermost
+ * scope commits. Destroying an uncommitted Transaction aborts it.
+ *
+ * A Transaction has a stamp and its versions become visible to new snapshots when it
+ * commits, even if Berkeley DB transactions aren't enabled (though then nothing can be
+ * rolled back).
+ */
+class Transaction {
+public:
+    /**
+     * Begin a transaction (trivially, if transactions aren't enabled).
+     */
+    Transaction();
+
+    virtual ~Transaction();
+
+    Transaction(const Transaction &other) = delete;
+
+    Transaction &operator=(const Transaction &other) = delete;
+
+    /**
+     * Commit the transaction. A durable commit's versions become visible to new snapshots
+     * only once it is on disk (or its flush has failed, as it can't be undone by then).
+     * @param durable  wait until the commit is on disk; pass false to wait later with
+     *                 sync() instead (e.g. after releasing a lock, so that other threads'
+     *                 commits can share the flush), making the versions visible at once
+     */
+    virtual void commit(bool durable = true);
+
+    /**
+     * Roll back everything done in the transaction and run its on_abort actions.
+     */
+    virtual void abort();
+
+    /**
+     * @returns  the calling thread's current DbTxn, or nullptr if it has none
+     */
+    static DbTxn *current();
+
+    /**
+     * @returns  the stamp of the calling thread's current transaction, or Snapshot::FROZEN
+     *           if it has none
+     */
+    static Stamp stamp();
+
+    /**
+     * @returns  the snapshot for a read: the current transaction's (taken on its first
+     *           read, and seeing its own changes), or a new one if the thread has none
+     */
+    static std::shared_ptr<const Snapshot> snapshot();
+
+    /**
+     * Run action if the calling thread's current transaction aborts, to undo in-memory
+     * state that mirrors what the transaction wrote (like a cache of its rows).
+     * Does nothing outside a transaction.
+     */
+    static void on_abort(std::function<void()> action);
+
+    /**
+     * Turn transactions on or off for the process. The environment must have been opened
+     * with DB_INIT_TXN and DB_INIT_LOG.
+     * @param group_commit  where commits wait for durability, or nullptr for off
+     */
+    static void enable(GroupCommit *group_commit);
+
+    static bool enabled() { return group_commit != nullptr; }
+
+    /**
+     * Wait until everything committed so far, including autocommitted operations such as
+     * DDL, is on disk.
+     */
+    static void sync();
+
+protected:
+    static GroupCommit *group_commit;
+    DbTxn *txn;         // nullptr if this scope joined an outer transaction (or there is none)
+    Stamp own_stamp;    // FROZEN if this scope joined an outer transaction
+    bool finished;
+    std::vector<std::function<void()>> abort_actions;
+    std::shared_ptr<const Snapshot> own_snapshot;
+
+    virtual void end();
+};
+
+// Test function for transactions and group commit, returns true if all tests pass.
+bool test_transactions();
+
+// Test function for snapshot reads and garbage collection, returns true if all tests pass.
+bool test_mvcc();
@@ -0,0 +1,69 @@
+/**
+ * @file vacuum.h - Vacuuming the catalog's tables in the background.
+ *
+ * Updates and deletes leave ended row versions behind, which take up their blocks until
+ * they are reclaimed (see HeapTable::vacuum). The background vacuum is a thread that wakes
+ * up every so often, looks for open tables with many dead versions and vacuums them, at the
+ * lowest scheduling priority and with a pause after each block, so that it only uses what
+ * the statements leave over. VACUUM table does the same on demand.
+ */
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include "schema_tables.h"
+
+/**
+ * @class BackgroundVacuum - vacuums the tables that need it, now and then
+ */
+class BackgroundVacuum {
+public:
+    /**
+     * Start the vacuum thread.
+     * @param tables     catalog whose open tables to look after
+     * @param interval   how long to sleep between looks
+     * @param threshold  dead versions that make a table worth vacuuming
+     * @param pause      how long to sleep after each block vacuumed
+     */
+    BackgroundVacuum(Tables &tables, std::chrono::milliseconds interval = std::chrono::milliseconds(1000),
+                     size_t threshold = 1000, std::chrono::microseconds pause = std::chrono::microseconds(200));
+
+    /**
+     * Stop the thread, after it finishes the table it is vacuuming.
+     */
+    virtual ~BackgroundVacuum();
+
+    BackgroundVacuum(const BackgroundVacuum &other) = delete;
+
+    BackgroundVacuum &operator=(const BackgroundVacuum &other) = delete;
+
+    /**
+     * Look for tables to vacuum now instead of at the end of the interval.
+     */
+    virtual void wake();
+
+    /**
+     * @returns  number of tables vacuumed so far
+     */
+    virtual uint64_t get_vacuums() const;
+
+protected:
+    Tables &tables;
+    std::chrono::milliseconds interval;
+    size_t threshold;
+    std::chrono::microseconds pause;
+    mutable std::mutex lock;
+    std::condition_variable work;
+    bool stopping;
+    bool woken;
+    uint64_t vacuums;
+    std::thread thread;
+
+    virtual void run();
+};
+
+// Test function for vacuuming, returns true if all tests pass.
+bool test_vacuum();
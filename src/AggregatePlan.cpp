@@ -0,0 +1,555 @@
+/**
+ * Implementation of the HashAggregate operator declared in AggregatePlan.h.
+ */
+
+#include "AggregatePlan.h"
+#include "TestExprs.h"
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <strings.h>
+
+using namespace hsql;
+
+// Rough per-group cost of the Group, its vectors and its hash slots on top of the values.
+static const size_t GROUP_OVERHEAD = 128;
+
+static const size_t INITIAL_SLOTS = 1024;
+
+static const char *COUNT_SUFFIX = "#count";
+static const char *VALUE_SUFFIX = "#value";
+
+bool Aggregate::from_expr(const Expr *expr, Aggregate &aggregate)
+{
+    if (expr->type != kExprFunctionRef || expr->name == nullptr)
+        return false;
+
+    const Expr *arg = nullptr;
+    size_t arg_count = 0;
+    if (expr->exprList != nullptr)
+    {
+        arg_count = expr->exprList->size();
+        if (arg_count > 0)
+            arg = (*expr->exprList)[0];
+    }
+    else if (expr->expr != nullptr)
+    {
+        arg = expr->expr;
+        arg_count = 1;
+    }
+
+    if (strcasecmp(expr->name, "count") == 0)
+        aggregate.function = arg != nullptr && arg->type == kExprStar ? AGG_COUNT_STAR : AGG_COUNT;
+    else if (strcasecmp(expr->name, "sum") == 0)
+        aggregate.function = AGG_SUM;
+    else if (strcasecmp(expr->name, "min") == 0)
+        aggregate.function = AGG_MIN;
+    else if (strcasecmp(expr->name, "max") == 0)
+        aggregate.function = AGG_MAX;
+    else if (strcasecmp(expr->name, "avg") == 0)
+        aggregate.function = AGG_AVG;
+    else
+        return false;
+
+    if (expr->distinct)
+        throw SQLExecError("DISTINCT aggregates are not supported");
+    if (arg_count != 1)
+        throw SQLExecError(std::string(expr->name) + " takes exactly one argument");
+    if (arg->type == kExprStar && aggregate.function != AGG_COUNT_STAR)
+        throw SQLExecError(std::string(expr->name) + "(*) is not allowed");
+    aggregate.arg = aggregate.function == AGG_COUNT_STAR ? nullptr : arg;
+    aggregate.name = expression_text(expr);
+    return true;
+}
+
+static int32_t checked_int(int64_t n, const Identifier &name)
+{
+    if (n < std::numeric_limits<int32_t>::min() || n > std::numeric_limits<int32_t>::max())
+        throw SQLExecError("integer overflow in " + name);
+    return (int32_t)n;
+}
+
+// Orders two non-null values of the same type.
+static bool value_less(const Value &a, const Value &b)
+{
+    if (a.data_type != b.data_type)
+        throw SQLExecError("cannot compare INT with TEXT");
+    return a.data_type == ColumnAttribute::INT ? a.n < b.n : a.s < b.s;
+}
+
+//------------------------HashAggregate----------------------------------------------
+
+HashAggregate::HashAggregate(PlanOperator *child, const std::vector<const Expr *> &group_by,
+                             const std::vector<Aggregate> &aggregates, AggregateMode mode, size_t memory_budget)
+    : child(child), group_by(group_by), aggregates(aggregates), mode(mode), memory_budget(memory_budget),
+      groups_memory(0), spilling(false), depth(0), spilled_rows(0), emit_index(0)
+{
+    for (auto const expr : group_by)
+        group_names.push_back(group_column_name(expr));
+    column_names = group_names;
+    for (auto const &aggregate : aggregates)
+    {
+        if (mode == PARTIAL_AGGREGATION)
+        {
+            column_names.push_back(aggregate.name + COUNT_SUFFIX);
+            column_names.push_back(aggregate.name + VALUE_SUFFIX);
+        }
+        else
+        {
+            column_names.push_back(aggregate.name);
+        }
+    }
+}
+
+HashAggregate::~HashAggregate()
+{
+    delete child;
+}
+
+size_t HashAggregate::estimated_rows()
+{
+    if (group_by.empty())
+        return 1;
+    size_t rows = child->estimated_rows() / 10;
+    return rows == 0 ? 1 : rows;
+}
+
+// The aggregates are shown by their result column names, which are their calls' text.
+std::string HashAggregate::get_name()
+{
+    std::string name = "HashAggregate";
+    if (mode == PARTIAL_AGGREGATION)
+        name += " partial";
+    else if (mode == FINAL_AGGREGATION)
+        name += " final";
+    for (size_t i = 0; i < aggregates.size(); i++)
+        name += (i == 0 ? " " : ", ") + aggregates[i].name;
+    if (spilled_rows > 0)
+        name += ", spilled " + std::to_string(spilled_rows) + (spilled_rows == 1 ? " row" : " rows");
+    return name;
+}
+
+void HashAggregate::get_expressions(LabeledExpressions &expressions) const
+{
+    if (!group_by.empty())
+        expressions.push_back(std::make_pair("group by", group_by));
+}
+
+void HashAggregate::open()
+{
+    child->open();
+    reset_table();
+    spilling = false;
+    depth = 0;
+    partitions.clear();
+    pending.clear();
+    spilled_rows = 0;
+    consume(child, nullptr);
+    queue_partitions();
+}
+
+bool HashAggregate::next(ValueDict &row)
+{
+    while (emit_index >= groups.size())
+    {
+        // done with the groups in memory; aggregate the next spilled partition
+        if (pending.empty())
+            return false;
+        Partition partition = std::move(pending.back());
+        pending.pop_back();
+        partition.file->rewind();
+        reset_table();
+        depth = partition.depth;
+        consume(nullptr, partition.file.get());
+        queue_partitions();
+    }
+    emit(groups[emit_index++], row);
+    return true;
+}
+
+void HashAggregate::close()
+{
+    child->close();
+    reset_table();
+    partitions.clear();
+    pending.clear();
+}
+
+void HashAggregate::reset_table()
+{
+    groups.clear();
+    slots.assign(INITIAL_SLOTS, 0);
+    groups_memory = 0;
+    emit_index = 0;
+}
+
+// Aggregates every row from the child or a spill file, spilling the rows of groups that
+// don't fit.
+void HashAggregate::consume(PlanOperator *source_child, SpillFile *source_file)
+{
+    ValueDict row;
+    if (source_child != nullptr)
+    {
+        while (source_child->next(row))
+            accumulate(row);
+    }
+    else
+    {
+        while (source_file->read_row(child->get_column_names(), row))
+            accumulate(row);
+    }
+
+    // aggregates without GROUP BY produce a row even for no input
+    if (group_by.empty() && groups.empty() && source_child != nullptr)
+    {
+        std::vector<Value> no_values;
+        add_group("", std::hash<std::string>()(""), no_values);
+    }
+}
+
+// The table uses the hash's low bits, so partition on a remix of it. The mix is seeded
+// with the depth so that the groups of a partition that spills again spread out.
+static size_t partition_of(size_t hash, size_t depth)
+{
+    uint64_t mixed = hash + (depth + 1) * 0x9e3779b97f4a7c15ULL;
+    mixed = (mixed ^ (mixed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    mixed = (mixed ^ (mixed >> 27)) * 0x94d049bb133111ebULL;
+    return (mixed ^ (mixed >> 31)) % HashAggregate::NUM_PARTITIONS;
+}
+
+// A pass always takes in at least one new group before it starts spilling, so each one
+// makes progress however small the budget.
+void HashAggregate::accumulate(const ValueDict &row)
+{
+    std::string key;
+    std::vector<Value> group_values;
+    for (size_t i = 0; i < group_by.size(); i++)
+    {
+        if (mode == FINAL_AGGREGATION)
+        {
+            auto it = row.find(group_names[i]);
+            if (it == row.end())
+                throw SQLExecError("partial aggregate is missing column " + group_names[i]);
+            group_values.push_back(it->second);
+        }
+        else
+        {
+            group_values.push_back(evaluate(group_by[i], row));
+        }
+        encode_key(group_values.back(), false, key);
+    }
+    size_t hash = std::hash<std::string>()(key);
+
+    Group *group = find_group(key, hash);
+    if (group == nullptr)
+    {
+        if (spilling)
+        {
+            partitions[partition_of(hash, depth)]->write_row(child->get_column_names(), row);
+            spilled_rows++;
+            return;
+        }
+        group = &add_group(key, hash, group_values);
+        if (!spilling && groups_memory > memory_budget)
+        {
+            spilling = true;
+            for (size_t i = 0; i < NUM_PARTITIONS; i++)
+                partitions.emplace_back(new SpillFile());
+        }
+    }
+
+    for (size_t i = 0; i < aggregates.size(); i++)
+    {
+        if (mode == FINAL_AGGREGATION)
+            merge(group->states[i], aggregates[i], row);
+        else
+            update(group->states[i], aggregates[i], row);
+    }
+}
+
+void HashAggregate::queue_partitions()
+{
+    for (auto &file : partitions)
+        if (file->get_row_count() > 0)
+            pending.push_back(Partition{std::move(file), depth + 1});
+    partitions.clear();
+    spilling = false;
+}
+
+HashAggregate::Group *HashAggregate::find_group(const std::string &key, size_t hash)
+{
+    size_t mask = slots.size() - 1;
+    for (size_t i = hash & mask; slots[i] != 0; i = (i + 1) & mask)
+    {
+        Group &group = groups[slots[i] - 1];
+        if (group.hash == hash && group.key == key)
+            return &group;
+    }
+    return nullptr;
+}
+
+HashAggregate::Group &HashAggregate::add_group(const std::string &key, size_t hash, std::vector<Value> &group_values)
+{
+    // keep the table at most half full so probe sequences stay short
+    if ((groups.size() + 1) * 2 > slots.size())
+        grow();
+
+    groups.push_back(Group{key, hash, std::vector<Value>(), std::vector<AggregateState>(aggregates.size())});
+    Group &group = groups.back();
+    group.group_values.swap(group_values);
+    for (auto &state : group.states)
+    {
+        state.count = 0;
+        state.sum = 0;
+        state.has_value = false;
+    }
+
+    size_t mask = slots.size() - 1;
+    size_t i = hash & mask;
+    while (slots[i] != 0)
+        i = (i + 1) & mask;
+    slots[i] = (uint32_t)groups.size();
+
+    groups_memory += GROUP_OVERHEAD + key.size() * 2 + aggregates.size() * sizeof(AggregateState);
+    for (auto const &value : group.group_values)
+        groups_memory += value.s.size();
+    return group;
+}
+
+void HashAggregate::grow()
+{
+    slots.assign(slots.size() * 2, 0);
+    size_t mask = slots.size() - 1;
+    for (size_t g = 0; g < groups.size(); g++)
+    {
+        size_t i = groups[g].hash & mask;
+        while (slots[i] != 0)
+            i = (i + 1) & mask;
+        slots[i] = (uint32_t)(g + 1);
+    }
+}
+
+// NULL arguments are ignored, as in SQL.
+void HashAggregate::update(AggregateState &state, const Aggregate &aggregate, const ValueDict &row)
+{
+    if (aggregate.function == AGG_COUNT_STAR)
+    {
+        state.count++;
+        return;
+    }
+    Value value = evaluate(aggregate.arg, row);
+    if (value.is_null)
+        return;
+    state.count++;
+    switch (aggregate.function)
+    {
+    case AGG_SUM:
+    case AGG_AVG:
+        if (value.data_type != ColumnAttribute::INT)
+            throw SQLExecError(aggregate.name + " needs an INT argument");
+        state.sum += value.n;
+        break;
+    case AGG_MIN:
+        if (!state.has_value || value_less(value, state.value))
+            state.value = value;
+        state.has_value = true;
+        break;
+    case AGG_MAX:
+        if (!state.has_value || value_less(state.value, value))
+            state.value = value;
+        state.has_value = true;
+        break;
+    default:
+        break;
+    }
+}
+
+void HashAggregate::merge(AggregateState &state, const Aggregate &aggregate, const ValueDict &row)
+{
+    auto count = row.find(aggregate.name + COUNT_SUFFIX);
+    auto value = row.find(aggregate.name + VALUE_SUFFIX);
+    if (count == row.end() || value == row.end())
+        throw SQLExecError("partial aggregate is missing " + aggregate.name);
+    state.count += count->second.n;
+    if (value->second.is_null)
+        return;
+    switch (aggregate.function)
+    {
+    case AGG_SUM:
+    case AGG_AVG:
+        state.sum += value->second.n;
+        break;
+    case AGG_MIN:
+        if (!state.has_value || value_less(value->second, state.value))
+            state.value = value->second;
+        state.has_value = true;
+        break;
+    case AGG_MAX:
+        if (!state.has_value || value_less(state.value, value->second))
+            state.value = value->second;
+        state.has_value = true;
+        break;
+    default:
+        break;
+    }
+}
+
+void HashAggregate::emit(const Group &group, ValueDict &row) const
+{
+    row.clear();
+    for (size_t i = 0; i < group_names.size(); i++)
+        row[group_names[i]] = group.group_values[i];
+    for (size_t i = 0; i < aggregates.size(); i++)
+    {
+        const Aggregate &aggregate = aggregates[i];
+        const AggregateState &state = group.states[i];
+        if (mode != PARTIAL_AGGREGATION)
+        {
+            row[aggregate.name] = final_value(state, aggregate);
+            continue;
+        }
+        row[aggregate.name + COUNT_SUFFIX] = Value(checked_int(state.count, aggregate.name));
+        Value partial = Value::null();
+        if (aggregate.function == AGG_SUM || aggregate.function == AGG_AVG)
+        {
+            if (state.count > 0)
+                partial = Value(checked_int(state.sum, aggregate.name));
+        }
+        else if (state.has_value)
+        {
+            partial = state.value;
+        }
+        row[aggregate.name + VALUE_SUFFIX] = partial;
+    }
+}
+
+// SUM, MIN, MAX and AVG of no values are NULL; AVG is truncated to an INT.
+Value HashAggregate::final_value(const AggregateState &state, const Aggregate &aggregate) const
+{
+    switch (aggregate.function)
+    {
+    case AGG_COUNT_STAR:
+    case AGG_COUNT:
+        return Value(checked_int(state.count, aggregate.name));
+    case AGG_SUM:
+        return state.count == 0 ? Value::null() : Value(checked_int(state.sum, aggregate.name));
+    case AGG_AVG:
+        return state.count == 0 ? Value::null() : Value(checked_int(state.sum / state.count, aggregate.name));
+    case AGG_MIN:
+    case AGG_MAX:
+        return state.has_value ? state.value : Value::null();
+    }
+    return Value::null();
+}
+
+//------------------------tests----------------------------------------------
+
+// rows (g, x) for i in [from, to): g = i % groups, x = i
+static PlanOperator *make_input(int from, int to, int groups, std::vector<std::vector<Expr *>> &rows)
+{
+    std::vector<std::vector<Expr *>> these;
+    for (int i = from; i < to; i++)
+        these.push_back({make_int(i % groups), make_int(i)});
+    rows.insert(rows.end(), these.begin(), these.end());
+    return new Values({"g", "x"}, these);
+}
+
+// Checks count/sum/min/max/avg of x per g against the values computed directly, and that
+// the plan never holds more than max_memory bytes of groups.
+static bool check_groups(PlanOperator *plan, int n, int groups, const std::vector<Aggregate> &aggregates,
+                         size_t max_memory = SIZE_MAX)
+{
+    std::map<int32_t, bool> seen;
+    ValueDict row;
+    plan->open();
+    while (plan->next(row))
+    {
+        if (plan->get_memory_used() > max_memory)
+        {
+            plan->close();
+            return false;
+        }
+        int32_t g = row["g"].n;
+        int64_t count = 0, sum = 0;
+        for (int i = g; i < n; i += groups)
+        {
+            count++;
+            sum += i;
+        }
+        if (seen[g] || row[aggregates[0].name].n != count || row[aggregates[1].name].n != sum ||
+            row[aggregates[2].name].n != g || row[aggregates[3].name].n != g + (count - 1) * groups ||
+            row[aggregates[4].name].n != sum / count)
+        {
+            plan->close();
+            return false;
+        }
+        seen[g] = true;
+    }
+    plan->close();
+    return seen.size() == (size_t)groups;
+}
+
+// test function -- returns true if all tests pass
+bool test_aggregate_plan()
+{
+    std::cout << "\nTesting AggregatePlan...." << std::endl;
+    Expr *g = make_column("g");
+    std::vector<Expr *> calls = {make_call("COUNT", new Expr(kExprStar)), make_call("sum", make_column("x")),
+                                 make_call("min", make_column("x")), make_call("max", make_column("x")),
+                                 make_call("avg", make_column("x"))};
+    std::vector<Aggregate> aggregates(calls.size());
+    for (size_t i = 0; i < calls.size(); i++)
+        if (!Aggregate::from_expr(calls[i], aggregates[i]))
+            return false;
+    if (aggregates[0].name != "count(*)" || aggregates[0].function != AGG_COUNT_STAR)
+        return false;
+    std::vector<const Expr *> group_by = {g};
+    std::vector<std::vector<Expr *>> rows;
+    bool ok = true;
+
+    // in memory, then with a budget so small that nearly every group spills, and spills
+    // again from its partition (the budget is exceeded by at most the group that crosses it)
+    for (size_t budget : {DEFAULT_MEMORY_BUDGET, (size_t)1024})
+    {
+        HashAggregate aggregate(make_input(0, 20000, 500, rows), group_by, aggregates, COMPLETE_AGGREGATION, budget);
+        ok = ok && check_groups(&aggregate, 20000, 500, aggregates, budget + 1024);
+        std::cout << "memory budget " << budget << ": " << aggregate.get_spilled_rows() << " rows spilled" << std::endl;
+        ok = ok && (aggregate.get_spilled_rows() > 0) == (budget == 1024);
+    }
+    if (ok)
+        std::cout << "hash aggregation ok" << std::endl;
+
+    // two "workers" pre-aggregate halves of the input and a final stage merges them
+    std::vector<PlanOperator *> partials = {
+            new HashAggregate(make_input(0, 10000, 500, rows), group_by, aggregates, PARTIAL_AGGREGATION),
+            new HashAggregate(make_input(10000, 20000, 500, rows), group_by, aggregates, PARTIAL_AGGREGATION)};
+    HashAggregate final_stage(new UnionAll(partials), group_by, aggregates, FINAL_AGGREGATION);
+    ok = ok && check_groups(&final_stage, 20000, 500, aggregates);
+    if (ok)
+        std::cout << "partial/final aggregation ok" << std::endl;
+
+    // no GROUP BY and no rows: one row, COUNT 0 and NULL SUM
+    HashAggregate empty(make_input(0, 0, 1, rows), std::vector<const Expr *>(), aggregates);
+    ValueDict row;
+    size_t count = 0;
+    empty.open();
+    while (empty.next(row))
+    {
+        count++;
+        ok = ok && row["count(*)"].n == 0 && row["sum(x)"].is_null;
+    }
+    empty.close();
+    ok = ok && count == 1;
+    if (ok)
+        std::cout << "empty input ok" << std::endl;
+
+    for (auto &exprs : rows)
+        for (auto expr : exprs)
+            delete expr;
+    for (auto call : calls)
+        delete call;
+    delete g;
+    return ok;
+}
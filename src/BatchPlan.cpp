@@ -0,0 +1,976 @@
+/**
+ * Implementation of the vectorized plan operators declared in BatchPlan.h.
+ */
+
+#include "BatchPlan.h"
+#include "Metrics.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <iterator>
+
+using namespace hsql;
+
+//------------------------ColumnVector----------------------------------------------
+
+ColumnVector::ColumnVector(ColumnAttribute::DataType data_type) : data_type(data_type)
+{
+    clear();
+}
+
+void ColumnVector::clear()
+{
+    ints.clear();
+    bytes.clear();
+    offsets.clear();
+    offsets.push_back(0);
+}
+
+void ColumnVector::append_text(const char *data, size_t size)
+{
+    bytes.insert(bytes.end(), data, data + size);
+    offsets.push_back((uint32_t)bytes.size());
+}
+
+Value ColumnVector::get(size_t i) const
+{
+    if (data_type == ColumnAttribute::INT)
+        return Value(ints[i]);
+    return Value(std::string(text_data(i), text_size(i)));
+}
+
+//------------------------RowBatch----------------------------------------------
+
+void RowBatch::reset(const ColumnNames &column_names, const ColumnAttributes &column_attributes)
+{
+    if (this->column_names != column_names)
+    {
+        this->column_names = column_names;
+        columns.clear();
+        for (auto const &attribute : column_attributes)
+        {
+            columns.push_back(ColumnVector(attribute.get_data_type()));
+            columns.back().ints.reserve(CAPACITY);
+        }
+    }
+    clear();
+}
+
+void RowBatch::clear()
+{
+    for (auto &column : columns)
+        column.clear();
+    size = 0;
+    selection.clear();
+}
+
+void RowBatch::select_all()
+{
+    selection.resize(size);
+    for (size_t i = 0; i < size; i++)
+        selection[i] = (SelectionIndex)i;
+}
+
+//------------------------BatchTableScan----------------------------------------------
+
+BatchTableScan::BatchTableScan(HeapTable &table, const Identifier &qualifier)
+    : table(table), qualifier(qualifier), block_index(0), block(nullptr), record_ids(nullptr), record_index(0), blocks_skipped(0),
+      use_brin(true), selectivity(-1)
+{
+    column_names = table.get_column_names();
+    column_attributes = table.get_column_attributes();
+    for (size_t i = 0; i < column_names.size(); i++)
+        all_columns.push_back(i);
+}
+
+BatchTableScan::~BatchTableScan()
+{
+    close();
+    for (auto filter : filters)
+        delete filter;
+}
+
+void BatchTableScan::add_filter(BatchPredicate *predicate, const Expr *expr)
+{
+    filters.push_back(predicate);
+    filter_exprs.push_back(expr);
+    std::vector<bool> used(column_names.size(), false);
+    for (auto filter : filters)
+        filter->columns_used(used);
+    filter_columns.clear();
+    for (size_t i = 0; i < used.size(); i++)
+        if (used[i])
+            filter_columns.push_back(i);
+}
+
+size_t BatchTableScan::estimated_rows()
+{
+    size_t rows = table.estimated_row_count();
+    if (selectivity >= 0)
+        return (size_t)std::llround((double)rows * selectivity);
+    for (size_t i = 0; i < filters.size(); i++)
+        rows /= 3;  // as BatchFilter guesses
+    return rows;
+}
+
+// Names the alias the table goes by and the BRIN indexes the filters can use, if any.
+std::string BatchTableScan::get_name()
+{
+    std::string name = "BatchTableScan " + table.get_table_name();
+    if (!qualifier.empty() && qualifier != table.get_table_name())
+        name += " AS " + qualifier;
+    for (size_t i = 0; i < column_names.size() && use_brin; i++)
+    {
+        BrinIndex *index = table.get_brin_index(i);
+        if (index == nullptr)
+            continue;
+        KeyRange range;
+        bool narrowed = false;
+        for (auto filter : filters)
+            narrowed = filter->narrow(i, range) || narrowed;
+        if (narrowed)
+            name += " using " + index->get_index_name();
+    }
+    return name;
+}
+
+void BatchTableScan::get_expressions(LabeledExpressions &expressions) const
+{
+    std::vector<const Expr *> exprs;
+    for (auto expr : filter_exprs)
+        if (expr != nullptr)
+            exprs.push_back(expr);
+    if (!exprs.empty())
+        expressions.push_back(std::make_pair("filter", exprs));
+}
+
+void BatchTableScan::open()
+{
+    close();
+    table.open();
+    snapshot = Transaction::snapshot();
+    table.file.block_ids(block_ids);
+    block_index = 0;
+
+    blocks_skipped = use_brin ? prune(block_ids) : 0;
+    METRIC_ADD(BRIN_BLOCKS_SKIPPED, blocks_skipped);
+}
+
+size_t BatchTableScan::blocks_to_read(bool use_brin, size_t &runs)
+{
+    table.open();
+    BlockIDs ids;
+    table.file.block_ids(ids);
+    if (use_brin)
+        prune(ids);
+    runs = 0;
+    for (size_t i = 0; i < ids.size(); i++)
+        if (i == 0 || ids[i] != ids[i - 1] + 1)
+            runs++;
+    return ids.size();
+}
+
+// The filters all hold for every row, so each indexed column is in all their ranges.
+size_t BatchTableScan::prune(BlockIDs &block_ids)
+{
+    size_t skipped = 0;
+    for (size_t i = 0; i < column_names.size() && !filters.empty(); i++)
+    {
+        BrinIndex *index = table.get_brin_index(i);
+        if (index == nullptr)
+            continue;
+        KeyRange range;
+        for (auto filter : filters)
+            filter->narrow(i, range);
+        if (range.bounded())
+            skipped += index->prune(range, block_ids);
+    }
+    return skipped;
+}
+
+// Fills the batch from the current block onward, stopping when the batch is full
+// (remembering where we were) or the table is exhausted.
+bool BatchTableScan::next(RowBatch &batch)
+{
+    batch.reset(column_names, column_attributes);
+    while (!batch.full())
+    {
+        if (block != nullptr && record_index < record_ids->size())
+        {
+            size_t count = std::min(RowBatch::CAPACITY - batch.size, record_ids->size() - record_index);
+            if (filters.empty())
+                for (size_t i = 0; i < count; i++)
+                    decode(block->view((*record_ids)[record_index + i]).data, all_columns, batch);
+            else
+                filter(count, batch);
+            record_index += count;
+            continue;
+        }
+        release_block();
+        if (block_index >= block_ids.size())
+            break;
+        block = table.file.get(block_ids[block_index++], arena);
+        record_ids = block->ids(*snapshot, arena);
+        record_index = 0;
+    }
+    batch.select_all();
+    return batch.size > 0;
+}
+
+// Appends columns of one marshaled record (see HeapTable::marshal) to the batch's columns.
+void BatchTableScan::decode(const char *bytes, const std::vector<size_t> &columns, RowBatch &batch)
+{
+    for (size_t i : columns)
+    {
+        ColumnVector &column = batch.columns[i];
+        const char *value = bytes + table.column_offset(bytes, i);
+        if (column.data_type == ColumnAttribute::INT)
+        {
+            int32_t n;
+            memcpy(&n, value, sizeof(int32_t));
+            column.append_int(n);
+        }
+        else
+        {
+            u_int16_t size;
+            memcpy(&size, value, sizeof(u_int16_t));
+            column.append_text(value + sizeof(u_int16_t), size);
+        }
+    }
+    batch.size++;
+}
+
+// Late materialization: decodes just the filters' columns of the records into the probe
+// batch (the kernels look at no others), and all the columns of only the ones that pass.
+void BatchTableScan::filter(size_t count, RowBatch &batch)
+{
+    probe.reset(column_names, column_attributes);
+    for (size_t i = 0; i < count; i++)
+        decode(block->view((*record_ids)[record_index + i]).data, filter_columns, probe);
+    probe.select_all();
+    for (auto predicate : filters)
+    {
+        predicate->apply(probe, probe.selection, passed);
+        probe.selection.swap(passed);
+    }
+    for (SelectionIndex i : probe.selection)
+        decode(block->view((*record_ids)[record_index + i]).data, all_columns, batch);
+}
+
+void BatchTableScan::close()
+{
+    release_block();
+    block_ids.clear();
+    snapshot.reset();
+}
+
+void BatchTableScan::release_block()
+{
+    arena.reset();
+    record_ids = nullptr;
+    block = nullptr;
+}
+
+//------------------------BatchPredicate kernels----------------------------------------------
+
+enum CompareOp
+{
+    CMP_EQ, CMP_NE, CMP_LT, CMP_LE, CMP_GT, CMP_GE, CMP_NONE
+};
+
+// The comparison a kernel's functor makes
+template <typename Compare>
+struct CompareOpOf;
+template <>
+struct CompareOpOf<std::equal_to<int32_t>> { static const CompareOp op = CMP_EQ; };
+template <>
+struct CompareOpOf<std::not_equal_to<int32_t>> { static const CompareOp op = CMP_NE; };
+template <>
+struct CompareOpOf<std::less<int32_t>> { static const CompareOp op = CMP_LT; };
+template <>
+struct CompareOpOf<std::less_equal<int32_t>> { static const CompareOp op = CMP_LE; };
+template <>
+struct CompareOpOf<std::greater<int32_t>> { static const CompareOp op = CMP_GT; };
+template <>
+struct CompareOpOf<std::greater_equal<int32_t>> { static const CompareOp op = CMP_GE; };
+
+// Narrows a column's range by column <op> value. Returns false if op doesn't narrow it.
+static bool narrow_range(KeyRange &range, CompareOp op, const Value &value)
+{
+    switch (op)
+    {
+    case CMP_EQ:
+        range.at_least(value, true);
+        range.at_most(value, true);
+        return true;
+    case CMP_LT:
+    case CMP_LE:
+        range.at_most(value, op == CMP_LE);
+        return true;
+    case CMP_GT:
+    case CMP_GE:
+        range.at_least(value, op == CMP_GE);
+        return true;
+    default:
+        return false;
+    }
+}
+
+static int compare_text(const ColumnVector &column, size_t i, const char *data, size_t size)
+{
+    size_t row_size = column.text_size(i);
+    int cmp = memcmp(column.text_data(i), data, std::min(row_size, size));
+    if (cmp != 0)
+        return cmp;
+    return row_size < size ? -1 : (row_size > size ? 1 : 0);
+}
+
+// column <op> INT literal
+template <typename Compare>
+class IntConstantKernel : public BatchPredicate {
+public:
+    IntConstantKernel(size_t column, int32_t constant) : column(column), constant(constant) {}
+
+    virtual void apply(const RowBatch &batch, const SelectionVector &in, SelectionVector &out) const
+    {
+        const int32_t *values = batch.columns[column].ints.data();
+        Compare compare;
+        out.resize(in.size());
+        size_t k = 0;
+        for (SelectionIndex i : in)
+        {
+            out[k] = i;
+            k += compare(values[i], constant);  // branch-free: keep i only if it passes
+        }
+        out.resize(k);
+    }
+
+    virtual void columns_used(std::vector<bool> &used) const { used[column] = true; }
+
+    virtual bool narrow(size_t column, KeyRange &range) const
+    {
+        return column == this->column && narrow_range(range, CompareOpOf<Compare>::op, Value(constant));
+    }
+
+protected:
+    size_t column;
+    int32_t constant;
+};
+
+// INT column <op> INT column
+template <typename Compare>
+class IntColumnKernel : public BatchPredicate {
+public:
+    IntColumnKernel(size_t left, size_t right) : left(left), right(right) {}
+
+    virtual void apply(const RowBatch &batch, const SelectionVector &in, SelectionVector &out) const
+    {
+        const int32_t *left_values = batch.columns[left].ints.data();
+        const int32_t *right_values = batch.columns[right].ints.data();
+        Compare compare;
+        out.resize(in.size());
+        size_t k = 0;
+        for (SelectionIndex i : in)
+        {
+            out[k] = i;
+            k += compare(left_values[i], right_values[i]);
+        }
+        out.resize(k);
+    }
+
+    virtual void columns_used(std::vector<bool> &used) const
+    {
+        used[left] = true;
+        used[right] = true;
+    }
+
+protected:
+    size_t left;
+    size_t right;
+};
+
+// column <op> TEXT literal
+template <typename Compare>
+class TextConstantKernel : public BatchPredicate {
+public:
+    TextConstantKernel(size_t column, std::string constant) : column(column), constant(constant) {}
+
+    virtual void apply(const RowBatch &batch, const SelectionVector &in, SelectionVector &out) const
+    {
+        const ColumnVector &values = batch.columns[column];
+        Compare compare;
+        out.resize(in.size());
+        size_t k = 0;
+        for (SelectionIndex i : in)
+        {
+            out[k] = i;
+            k += compare(compare_text(values, i, constant.data(), constant.size()), 0);
+        }
+        out.resize(k);
+    }
+
+    virtual void columns_used(std::vector<bool> &used) const { used[column] = true; }
+
+    virtual bool narrow(size_t column, KeyRange &range) const
+    {
+        return column == this->column && narrow_range(range, CompareOpOf<Compare>::op, Value(constant));
+    }
+
+protected:
+    size_t column;
+    std::string constant;
+};
+
+// TEXT column <op> TEXT column
+template <typename Compare>
+class TextColumnKernel : public BatchPredicate {
+public:
+    TextColumnKernel(size_t left, size_t right) : left(left), right(right) {}
+
+    virtual void apply(const RowBatch &batch, const SelectionVector &in, SelectionVector &out) const
+    {
+        const ColumnVector &left_values = batch.columns[left];
+        const ColumnVector &right_values = batch.columns[right];
+        Compare compare;
+        out.resize(in.size());
+        size_t k = 0;
+        for (SelectionIndex i : in)
+        {
+            out[k] = i;
+            k += compare(compare_text(left_values, i, right_values.text_data(i), right_values.text_size(i)), 0);
+        }
+        out.resize(k);
+    }
+
+    virtual void columns_used(std::vector<bool> &used) const
+    {
+        used[left] = true;
+        used[right] = true;
+    }
+
+protected:
+    size_t left;
+    size_t right;
+};
+
+class AndPredicate : public BatchPredicate {
+public:
+    AndPredicate(BatchPredicate *left, BatchPredicate *right) : left(left), right(right) {}
+
+    virtual ~AndPredicate()
+    {
+        delete left;
+        delete right;
+    }
+
+    // the right side only sees the rows the left side kept
+    virtual void apply(const RowBatch &batch, const SelectionVector &in, SelectionVector &out) const
+    {
+        left->apply(batch, in, scratch);
+        right->apply(batch, scratch, out);
+    }
+
+    virtual void columns_used(std::vector<bool> &used) const
+    {
+        left->columns_used(used);
+        right->columns_used(used);
+    }
+
+    // a row passes both sides, so it's in both ranges
+    virtual bool narrow(size_t column, KeyRange &range) const
+    {
+        bool narrowed = left->narrow(column, range);
+        return right->narrow(column, range) || narrowed;
+    }
+
+protected:
+    BatchPredicate *left;
+    BatchPredicate *right;
+    mutable SelectionVector scratch;
+};
+
+class OrPredicate : public BatchPredicate {
+public:
+    OrPredicate(BatchPredicate *left, BatchPredicate *right) : left(left), right(right) {}
+
+    virtual ~OrPredicate()
+    {
+        delete left;
+        delete right;
+    }
+
+    // the right side only needs to look at rows the left side rejected
+    virtual void apply(const RowBatch &batch, const SelectionVector &in, SelectionVector &out) const
+    {
+        left->apply(batch, in, left_passed);
+        rest.clear();
+        std::set_difference(in.begin(), in.end(), left_passed.begin(), left_passed.end(), std::back_inserter(rest));
+        right->apply(batch, rest, right_passed);
+        out.clear();
+        std::merge(left_passed.begin(), left_passed.end(), right_passed.begin(), right_passed.end(),
+                   std::back_inserter(out));
+    }
+
+    virtual void columns_used(std::vector<bool> &used) const
+    {
+        left->columns_used(used);
+        right->columns_used(used);
+    }
+
+protected:
+    BatchPredicate *left;
+    BatchPredicate *right;
+    mutable SelectionVector left_passed;
+    mutable SelectionVector rest;
+    mutable SelectionVector right_passed;
+};
+
+class NotPredicate : public BatchPredicate {
+public:
+    NotPredicate(BatchPredicate *child) : child(child) {}
+
+    virtual ~NotPredicate() { delete child; }
+
+    virtual void apply(const RowBatch &batch, const SelectionVector &in, SelectionVector &out) const
+    {
+        child->apply(batch, in, passed);
+        out.clear();
+        std::set_difference(in.begin(), in.end(), passed.begin(), passed.end(), std::back_inserter(out));
+    }
+
+    virtual void columns_used(std::vector<bool> &used) const { child->columns_used(used); }
+
+protected:
+    BatchPredicate *child;
+    mutable SelectionVector passed;
+};
+
+//------------------------BatchPredicate::compile----------------------------------------------
+
+static CompareOp comparison_of(const Expr *expr)
+{
+    switch (expr->opType)
+    {
+    case Expr::NOT_EQUALS:
+        return CMP_NE;
+    case Expr::LESS_EQ:
+        return CMP_LE;
+    case Expr::GREATER_EQ:
+        return CMP_GE;
+    case Expr::SIMPLE_OP:
+        if (expr->opChar == '=')
+            return CMP_EQ;
+        if (expr->opChar == '<')
+            return CMP_LT;
+        if (expr->opChar == '>')
+            return CMP_GT;
+        return CMP_NONE;
+    default:
+        return CMP_NONE;
+    }
+}
+
+// a < b is the same as b > a
+static CompareOp mirror(CompareOp op)
+{
+    switch (op)
+    {
+    case CMP_LT:
+        return CMP_GT;
+    case CMP_LE:
+        return CMP_GE;
+    case CMP_GT:
+        return CMP_LT;
+    case CMP_GE:
+        return CMP_LE;
+    default:
+        return op;
+    }
+}
+
+// Instantiates a kernel template for a comparison operator.
+template <template <typename> class Kernel, typename A, typename B>
+static BatchPredicate *make_kernel(CompareOp op, A a, B b)
+{
+    switch (op)
+    {
+    case CMP_EQ:
+        return new Kernel<std::equal_to<int32_t>>(a, b);
+    case CMP_NE:
+        return new Kernel<std::not_equal_to<int32_t>>(a, b);
+    case CMP_LT:
+        return new Kernel<std::less<int32_t>>(a, b);
+    case CMP_LE:
+        return new Kernel<std::less_equal<int32_t>>(a, b);
+    case CMP_GT:
+        return new Kernel<std::greater<int32_t>>(a, b);
+    case CMP_GE:
+        return new Kernel<std::greater_equal<int32_t>>(a, b);
+    default:
+        return nullptr;
+    }
+}
+
+// column <op> ?: the value is only known when the plan runs, so the constant kernel is
+// (re)built whenever the bound parameter changes
+class ParameterKernel : public BatchPredicate {
+public:
+    ParameterKernel(CompareOp op, size_t column, ColumnAttribute::DataType data_type, const Expr *placeholder)
+        : op(op), column(column), data_type(data_type), placeholder(placeholder), kernel(nullptr) {}
+
+    virtual ~ParameterKernel() { delete kernel; }
+
+    virtual void apply(const RowBatch &batch, const SelectionVector &in, SelectionVector &out) const
+    {
+        Value value = evaluate(placeholder, ValueDict());
+        if (kernel == nullptr || !(value == bound))
+        {
+            if (value.is_null)
+            {
+                out.clear();
+                return;
+            }
+            if (value.data_type != data_type)
+                throw SQLExecError(parameter_text(placeholder) + (data_type == ColumnAttribute::INT ? " is not an INT" : " is not a TEXT"));
+            delete kernel;
+            kernel = nullptr;
+            if (data_type == ColumnAttribute::INT)
+                kernel = make_kernel<IntConstantKernel>(op, column, value.n);
+            else
+                kernel = make_kernel<TextConstantKernel>(op, column, value.s);
+            bound = value;
+        }
+        kernel->apply(batch, in, out);
+    }
+
+    virtual void columns_used(std::vector<bool> &used) const { used[column] = true; }
+
+    virtual bool narrow(size_t column, KeyRange &range) const
+    {
+        if (column != this->column || op == CMP_NE)
+            return false;
+        Value value;
+        try
+        {
+            value = evaluate(placeholder, ValueDict());
+        }
+        catch (SQLExecError const &)
+        {
+            return true;  // not bound yet (as when explaining): it narrows, by some amount
+        }
+        if (value.is_null)
+            range.empty = true;  // nothing passes
+        else if (value.data_type == data_type)
+            narrow_range(range, op, value);
+        return true;
+    }
+
+protected:
+    CompareOp op;
+    size_t column;
+    ColumnAttribute::DataType data_type;
+    const Expr *placeholder;
+    mutable BatchPredicate *kernel;
+    mutable Value bound;
+};
+
+// Index of a column reference in the batch layout, or -1.
+static int column_index(const Expr *expr, const ColumnNames &column_names)
+{
+    if (expr->type != kExprColumnRef)
+        return -1;
+    if (expr->hasTable())
+    {
+        auto it = std::find(column_names.begin(), column_names.end(), std::string(expr->table) + "." + expr->name);
+        if (it != column_names.end())
+            return (int)(it - column_names.begin());
+    }
+    auto it = std::find(column_names.begin(), column_names.end(), std::string(expr->name));
+    return it == column_names.end() ? -1 : (int)(it - column_names.begin());
+}
+
+static BatchPredicate *compile_comparison(const Expr *expr, const ColumnNames &column_names,
+                                          const ColumnAttributes &attributes)
+{
+    CompareOp op = comparison_of(expr);
+    if (op == CMP_NONE)
+        return nullptr;
+    const Expr *left = expr->expr;
+    const Expr *right = expr->expr2;
+    int left_column = column_index(left, column_names);
+    int right_column = column_index(right, column_names);
+    if (left_column < 0 && right_column >= 0)
+    {
+        std::swap(left, right);
+        std::swap(left_column, right_column);
+        op = mirror(op);
+    }
+    if (left_column < 0)
+        return nullptr;
+
+    ColumnAttribute::DataType type = attributes[left_column].get_data_type();
+    if (right_column >= 0)
+    {
+        if (attributes[right_column].get_data_type() != type)
+            return nullptr;
+        if (type == ColumnAttribute::INT)
+            return make_kernel<IntColumnKernel>(op, (size_t)left_column, (size_t)right_column);
+        return make_kernel<TextColumnKernel>(op, (size_t)left_column, (size_t)right_column);
+    }
+    if (right->type == kExprLiteralInt && type == ColumnAttribute::INT && right->ival >= INT32_MIN && right->ival <= INT32_MAX)
+        return make_kernel<IntConstantKernel>(op, (size_t)left_column, (int32_t)right->ival);
+    if (right->type == kExprLiteralString && type == ColumnAttribute::TEXT)
+        return make_kernel<TextConstantKernel>(op, (size_t)left_column, std::string(right->name));
+    if (right->type == kExprPlaceholder)
+        return new ParameterKernel(op, (size_t)left_column, type, right);
+    return nullptr;
+}
+
+static bool has_placeholder(const Expr *expr)
+{
+    if (expr == nullptr)
+        return false;
+    return expr->type == kExprPlaceholder || has_placeholder(expr->expr) || has_placeholder(expr->expr2);
+}
+
+BatchPredicate *BatchPredicate::compile(const Expr *expr, const ColumnNames &column_names,
+                                        const ColumnAttributes &attributes)
+{
+    if (expr->type != kExprOperator)
+        return nullptr;
+    if (expr->opType == Expr::AND || expr->opType == Expr::OR)
+    {
+        BatchPredicate *left = compile(expr->expr, column_names, attributes);
+        if (left == nullptr)
+            return nullptr;
+        BatchPredicate *right = compile(expr->expr2, column_names, attributes);
+        if (right == nullptr)
+        {
+            delete left;
+            return nullptr;
+        }
+        if (expr->opType == Expr::AND)
+            return new AndPredicate(left, right);
+        return new OrPredicate(left, right);
+    }
+    if (expr->opType == Expr::NOT)
+    {
+        // a parameter bound to NULL makes its comparison NULL, and NOT NULL is still NULL, but
+        // the kernels only keep or drop rows: such a NOT is left to be evaluated row by row
+        if (has_placeholder(expr->expr))
+            return nullptr;
+        BatchPredicate *child = compile(expr->expr, column_names, attributes);
+        return child == nullptr ? nullptr : new NotPredicate(child);
+    }
+    return compile_comparison(expr, column_names, attributes);
+}
+
+//------------------------BatchFilter----------------------------------------------
+
+BatchFilter::BatchFilter(BatchOperator *child, BatchPredicate *predicate, const Expr *expr)
+    : child(child), predicate(predicate), expr(expr)
+{
+    column_names = child->get_column_names();
+    column_attributes = child->get_column_attributes();
+}
+
+BatchFilter::~BatchFilter()
+{
+    delete child;
+    delete predicate;
+}
+
+void BatchFilter::open()
+{
+    child->open();
+}
+
+bool BatchFilter::next(RowBatch &batch)
+{
+    while (child->next(batch))
+    {
+        predicate->apply(batch, batch.selection, scratch);
+        batch.selection.swap(scratch);
+        if (!batch.selection.empty())
+            return true;
+    }
+    return false;
+}
+
+void BatchFilter::close()
+{
+    child->close();
+}
+
+void BatchFilter::get_expressions(LabeledExpressions &expressions) const
+{
+    if (expr != nullptr)
+        expressions.push_back(std::make_pair("filter", std::vector<const Expr *>(1, expr)));
+}
+
+//------------------------BatchToRows----------------------------------------------
+
+BatchToRows::BatchToRows(BatchOperator *child, const Identifier &qualifier) : child(child), position(0)
+{
+    column_names = qualify(child->get_column_names(), qualifier);
+}
+
+BatchToRows::~BatchToRows()
+{
+    delete child;
+}
+
+void BatchToRows::open()
+{
+    child->open();
+    batch.clear();
+    position = 0;
+}
+
+bool BatchToRows::next(ValueDict &row)
+{
+    while (position >= batch.selection.size())
+    {
+        if (!child->next(batch))
+            return false;
+        position = 0;
+    }
+    SelectionIndex i = batch.selection[position++];
+    row.clear();
+    for (size_t c = 0; c < column_names.size(); c++)
+        row[column_names[c]] = batch.columns[c].get(i);
+    return true;
+}
+
+void BatchToRows::close()
+{
+    child->close();
+}
+
+//------------------------tests----------------------------------------------
+
+// test function -- returns true if all tests pass
+bool test_batch_plan()
+{
+    std::cout << "\nTesting BatchPlan...." << std::endl;
+    ColumnNames column_names = {"a", "b", "c"};
+    ColumnAttributes column_attributes = {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT),
+                                          ColumnAttribute(ColumnAttribute::INT)};
+    HeapTable table("_test_batch_plan_cpp", column_names, column_attributes);
+    table.create_if_not_exists();
+
+    // enough rows to need several blocks and several batches
+    const int32_t N = 3000;
+    ValueDict row;
+    for (int32_t i = 0; i < N; i++)
+    {
+        row["a"] = Value(i);
+        row["b"] = Value(i % 2 ? "odd" : "even");
+        row["c"] = Value(-i);
+        table.insert(&row);
+    }
+    std::cout << "insert ok" << std::endl;
+
+    // WHERE (a >= 100 AND b = 'odd') OR a < 3
+    Expr *a_ge = new Expr(kExprOperator), *b_eq = new Expr(kExprOperator), *a_lt = new Expr(kExprOperator);
+    a_ge->opType = Expr::GREATER_EQ;
+    a_ge->expr = new Expr(kExprColumnRef);
+    a_ge->expr->name = strdup("a");
+    a_ge->expr2 = new Expr(kExprLiteralInt);
+    a_ge->expr2->ival = 100;
+    b_eq->opType = Expr::SIMPLE_OP;
+    b_eq->opChar = '=';
+    b_eq->expr = new Expr(kExprColumnRef);
+    b_eq->expr->name = strdup("b");
+    b_eq->expr2 = new Expr(kExprLiteralString);
+    b_eq->expr2->name = strdup("odd");
+    a_lt->opType = Expr::SIMPLE_OP;
+    a_lt->opChar = '<';
+    a_lt->expr = new Expr(kExprColumnRef);
+    a_lt->expr->name = strdup("a");
+    a_lt->expr2 = new Expr(kExprLiteralInt);
+    a_lt->expr2->ival = 3;
+    Expr *both = new Expr(kExprOperator);
+    both->opType = Expr::AND;
+    both->expr = a_ge;
+    both->expr2 = b_eq;
+    Expr where(kExprOperator);
+    where.opType = Expr::OR;
+    where.expr = both;
+    where.expr2 = a_lt;
+
+    BatchPredicate *predicate = BatchPredicate::compile(&where, column_names, column_attributes);
+    if (predicate == nullptr)
+        return false;
+    BatchToRows plan(new BatchFilter(new BatchTableScan(table), predicate));
+    int32_t count = 0;
+    bool matches = true;
+    plan.open();
+    while (plan.next(row))
+    {
+        count++;
+        matches = matches && is_true(&where, row);
+    }
+    plan.close();
+    if (!matches || count != 3 + (N - 100) / 2)
+    {
+        table.drop();
+        return false;
+    }
+    std::cout << "batch scan/filter ok" << std::endl;
+
+    // the same filter pushed into the scan, which decodes a and b to filter and c only for
+    // the rows that pass
+    BatchTableScan *scan = new BatchTableScan(table);
+    scan->add_filter(BatchPredicate::compile(&where, column_names, column_attributes), &where);
+    BatchToRows pushed(scan);
+    int32_t pushed_count = 0;
+    pushed.open();
+    while (pushed.next(row))
+    {
+        pushed_count++;
+        matches = matches && is_true(&where, row) && row["c"].n == -row["a"].n;
+    }
+    pushed.close();
+    if (!matches || pushed_count != count)
+    {
+        std::cout << "pushed filter: " << pushed_count << " rows" << std::endl;
+        table.drop();
+        return false;
+    }
+    std::cout << "filter in scan ok" << std::endl;
+
+    // WHERE a >= N - 100, with a BRIN index on a (which rises with the blocks): the scan
+    // leaves out the blocks before the last few
+    table.add_brin_index("_test_batch_plan_a", "a", 2);
+    Expr recent(kExprOperator);
+    recent.opType = Expr::GREATER_EQ;
+    recent.expr = new Expr(kExprColumnRef);
+    recent.expr->name = strdup("a");
+    recent.expr2 = new Expr(kExprLiteralInt);
+    recent.expr2->ival = N - 100;
+    scan = new BatchTableScan(table);
+    scan->add_filter(BatchPredicate::compile(&recent, column_names, column_attributes), &recent);
+    BatchToRows indexed(scan);
+    int32_t indexed_count = 0;
+    indexed.open();
+    while (indexed.next(row))
+    {
+        indexed_count++;
+        matches = matches && row["a"].n >= N - 100;
+    }
+    size_t skipped = scan->get_blocks_skipped();
+    bool named = scan->get_name() == "BatchTableScan _test_batch_plan_cpp using _test_batch_plan_a";
+    indexed.close();
+    table.drop();
+    if (!matches || indexed_count != 100 || skipped == 0 || !named)
+    {
+        std::cout << "brin scan: " << indexed_count << " rows, " << skipped << " blocks skipped" << std::endl;
+        return false;
+    }
+    std::cout << "brin scan ok (" << skipped << " blocks skipped)" << std::endl;
+    return true;
+}
@@ -0,0 +1,210 @@
+/**
+ * Implementation of the EXPLAIN ANALYZE instrumentation declared in ExplainPlan.h.
+ */
+
+#include "ExplainPlan.h"
+#include "TestExprs.h"
+#include "heap_storage.h"
+#include "SortPlan.h"
+#include "SqlExecutor.h"
+#include "schema_tables.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+using namespace hsql;
+
+// Adds the time and blocks read between construction and destruction to stats.
+class StatsTimer {
+public:
+    explicit StatsTimer(OperatorStats &stats)
+        : stats(stats), blocks(HeapFile::thread_blocks_read()), start(std::chrono::steady_clock::now()) {}
+
+    ~StatsTimer()
+    {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        stats.nanoseconds += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        stats.blocks_read += HeapFile::thread_blocks_read() - blocks;
+    }
+
+private:
+    OperatorStats &stats;
+    uint64_t blocks;
+    std::chrono::steady_clock::time_point start;
+};
+
+//------------------------AnalyzedOperator----------------------------------------------
+
+AnalyzedOperator::AnalyzedOperator(PlanOperator *op) : op(op)
+{
+}
+
+AnalyzedOperator::~AnalyzedOperator()
+{
+    delete op;
+}
+
+void AnalyzedOperator::open()
+{
+    StatsTimer timer(stats);
+    op->open();
+    stats.peak_memory = std::max(stats.peak_memory, op->get_memory_used());
+}
+
+bool AnalyzedOperator::next(ValueDict &row)
+{
+    StatsTimer timer(stats);
+    bool produced = op->next(row);
+    if (produced)
+        stats.rows++;
+    stats.peak_memory = std::max(stats.peak_memory, op->get_memory_used());
+    return produced;
+}
+
+void AnalyzedOperator::close()
+{
+    StatsTimer timer(stats);
+    stats.peak_memory = std::max(stats.peak_memory, op->get_memory_used());
+    op->close();
+}
+
+//------------------------AnalyzedBatchOperator----------------------------------------------
+
+AnalyzedBatchOperator::AnalyzedBatchOperator(BatchOperator *op) : op(op)
+{
+}
+
+AnalyzedBatchOperator::~AnalyzedBatchOperator()
+{
+    delete op;
+}
+
+void AnalyzedBatchOperator::open()
+{
+    StatsTimer timer(stats);
+    op->open();
+}
+
+bool AnalyzedBatchOperator::next(RowBatch &batch)
+{
+    StatsTimer timer(stats);
+    bool produced = op->next(batch);
+    if (produced)
+    {
+        stats.batches++;
+        stats.rows += batch.selection.size();
+    }
+    return produced;
+}
+
+void AnalyzedBatchOperator::close()
+{
+    StatsTimer timer(stats);
+    op->close();
+}
+
+//------------------------analyze_plan----------------------------------------------
+
+static void analyze_batch_plan(BatchOperator *&plan)
+{
+    for (auto const child : plan->get_children())
+        analyze_batch_plan(*child);
+    plan = new AnalyzedBatchOperator(plan);
+}
+
+void analyze_plan(PlanOperator *&plan)
+{
+    for (auto const child : plan->get_children())
+        analyze_plan(*child);
+    for (auto const child : plan->get_batch_children())
+        analyze_batch_plan(*child);
+    plan = new AnalyzedOperator(plan);
+}
+
+//------------------------tests----------------------------------------------
+
+// EXPLAIN ANALYZE INSERT finishes the insert as a plain INSERT does: the block ranges the
+// rows filled are summarized by the time it returns.
+static bool test_explain_insert()
+{
+    SqlExecutor executor;
+    executor.execute("CREATE TABLE _test_explain_insert (a INT)");
+    executor.execute("CREATE INDEX _test_explain_insert_a ON _test_explain_insert USING BRIN (a)");
+    executor.execute("INSERT INTO _test_explain_insert VALUES (1)");
+    for (int i = 0; i < 14; i++)
+        executor.execute("EXPLAIN ANALYZE INSERT INTO _test_explain_insert SELECT a + 1 FROM _test_explain_insert");
+    HeapTable &table = dynamic_cast<HeapTable &>(SqlExecutor::get_tables().get_table("_test_explain_insert"));
+    BlockID last = 0;
+    for (auto const &handle : table.select())
+        last = std::max(last, handle.first);
+    size_t left = table.get_brin_index(0)->summarize(last);
+    executor.execute("DROP TABLE _test_explain_insert");
+    if (last <= 16 || left > 0)
+    {
+        std::cout << "explain analyze insert left " << left << " ranges of " << last << " blocks unsummarized"
+                  << std::endl;
+        return false;
+    }
+    std::cout << "explain analyze insert ok" << std::endl;
+    return true;
+}
+
+// test function -- returns true if all tests pass
+bool test_explain_plan()
+{
+    std::cout << "\nTesting ExplainPlan...." << std::endl;
+    ColumnNames column_names = {"a"};
+    ColumnAttributes column_attributes = {ColumnAttribute(ColumnAttribute::INT)};
+    HeapTable table("_test_explain_plan_cpp", column_names, column_attributes);
+    table.create_if_not_exists();
+    for (int i = 0; i < 100; i++)
+    {
+        ValueDict row;
+        row["a"] = Value(i);
+        table.insert(&row);
+    }
+
+    // SELECT a FROM _test_explain_plan_cpp AS t WHERE a >= 50 ORDER BY a LIMIT 5
+    Expr *where = make_column("a");
+    Expr *bound = make_int(50);
+    Expr *predicate = new Expr(kExprOperator);
+    predicate->opType = Expr::GREATER_EQ;
+    predicate->expr = where;
+    predicate->expr2 = bound;
+    Expr *order = make_column("a");
+    PlanOperator *plan = new Limit(new Sort(new Filter(new BatchToRows(new BatchTableScan(table, "t")), predicate),
+                                            std::vector<SortKey>(1, SortKey{order, false})), 5);
+    analyze_plan(plan);
+
+    ValueDict row;
+    size_t count = 0;
+    plan->open();
+    while (plan->next(row))
+        count++;
+    plan->close();
+
+    // Limit -> Sort -> Filter -> BatchToRows -> BatchTableScan
+    AnalyzedOperator *limit = dynamic_cast<AnalyzedOperator *>(plan);
+    AnalyzedOperator *sort = dynamic_cast<AnalyzedOperator *>(*limit->get_children()[0]);
+    AnalyzedOperator *filter = dynamic_cast<AnalyzedOperator *>(*sort->get_children()[0]);
+    AnalyzedOperator *to_rows = dynamic_cast<AnalyzedOperator *>(*filter->get_children()[0]);
+    AnalyzedBatchOperator *scan = dynamic_cast<AnalyzedBatchOperator *>(*to_rows->get_batch_children()[0]);
+    bool ok = count == 5 && limit->get_stats().rows == 5 && sort->get_stats().rows == 5 &&
+              filter->get_stats().rows == 50 && to_rows->get_stats().rows == 100 && scan->get_stats().rows == 100 &&
+              scan->get_stats().batches >= 1 && sort->get_stats().peak_memory > 0 &&
+              limit->get_stats().nanoseconds >= sort->get_stats().nanoseconds &&
+              scan->get_stats().blocks_read > 0 && limit->get_stats().blocks_read == scan->get_stats().blocks_read &&
+              scan->get_name() == "BatchTableScan _test_explain_plan_cpp AS t";
+    if (!ok)
+        std::cout << "rows " << limit->get_stats().rows << " " << sort->get_stats().rows << " "
+                  << filter->get_stats().rows << " " << to_rows->get_stats().rows << " " << scan->get_stats().rows
+                  << ", blocks " << scan->get_stats().blocks_read << ", " << scan->get_name() << std::endl;
+    delete plan;
+    delete predicate;
+    delete order;
+    table.drop();
+    if (ok)
+        std::cout << "analyze ok" << std::endl;
+    return ok && test_explain_insert();
+}
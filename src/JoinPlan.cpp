@@ -0,0 +1,754 @@
+/**
+ * Implementation of the join operators declared in JoinPlan.h.
+ */
+
+#include "JoinPlan.h"
+#include "TestExprs.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+using namespace hsql;
+
+// Rough per-row cost of the hash table entry and BuildRow wrapper on top of the row itself.
+static const size_t BUILD_ROW_OVERHEAD = 64;
+
+// Rows of a join given as a fraction of the pairs of input rows; an outer join keeps at
+// least every row of the side it preserves.
+static size_t join_rows(size_t left_rows, size_t right_rows, double selectivity, JoinKind join_type)
+{
+    double rows = (double)left_rows * (double)right_rows * selectivity;
+    if (join_type == LEFT_OUTER_JOIN)
+        rows = std::max(rows, (double)left_rows);
+    else if (join_type == RIGHT_OUTER_JOIN)
+        rows = std::max(rows, (double)right_rows);
+    return (size_t)std::llround(rows);
+}
+
+static const char *join_kind_name(JoinKind join_type)
+{
+    switch (join_type)
+    {
+    case LEFT_OUTER_JOIN:
+        return "left outer";
+    case RIGHT_OUTER_JOIN:
+        return "right outer";
+    default:
+        return "inner";
+    }
+}
+
+// Checks a row against every condition.
+static bool all_true(const std::vector<const Expr *> &conditions, const ValueDict &row)
+{
+    for (auto const condition : conditions)
+        if (!is_true(condition, row))
+            return false;
+    return true;
+}
+
+// Adds a NULL for each of column_names.
+static void add_nulls(const ColumnNames &column_names, ValueDict &row)
+{
+    for (auto const &column_name : column_names)
+        row[column_name] = Value::null();
+}
+
+static ColumnNames concatenate(const ColumnNames &left, const ColumnNames &right)
+{
+    ColumnNames column_names(left);
+    column_names.insert(column_names.end(), right.begin(), right.end());
+    return column_names;
+}
+
+//------------------------HashJoin----------------------------------------------
+
+HashJoin::HashJoin(PlanOperator *left, PlanOperator *right,
+                   const std::vector<const Expr *> &left_keys, const std::vector<const Expr *> &right_keys,
+                   JoinKind join_type, const std::vector<const Expr *> &residual, size_t memory_budget)
+    : left(left), right(right), left_keys(left_keys), right_keys(right_keys), join_type(join_type),
+      residual(residual), memory_budget(memory_budget), build_side(BUILD_SMALLER), selectivity(-1), build_left(false), build(nullptr), probe(nullptr),
+      build_keys(nullptr), probe_keys(nullptr), keep_unmatched_build(false), keep_unmatched_probe(false),
+      build_memory(0), spilled(false), partition(), build_rows_read(0), chunked(false), probe_index(0), phase(DONE),
+      have_probe_row(false), probe_matched(false), unmatched_index(0)
+{
+    if (left_keys.empty() || left_keys.size() != right_keys.size())
+    {
+        delete left;
+        delete right;
+        throw SQLExecError("hash join needs matching key lists");
+    }
+    column_names = concatenate(left->get_column_names(), right->get_column_names());
+}
+
+HashJoin::~HashJoin()
+{
+    delete left;
+    delete right;
+}
+
+size_t HashJoin::estimated_rows()
+{
+    if (selectivity >= 0)
+        return join_rows(left->estimated_rows(), right->estimated_rows(), selectivity, join_type);
+    return std::max(left->estimated_rows(), right->estimated_rows());
+}
+
+// Before the first run, the build side shown is the one open() will pick.
+std::string HashJoin::get_name()
+{
+    bool shown_left = build != nullptr ? build_left : builds_left();
+    std::string name = std::string("HashJoin ") + join_kind_name(join_type) + ", build " + (shown_left ? "left" : "right");
+    if (spilled)
+        name += ", spilled";
+    return name;
+}
+
+void HashJoin::get_expressions(LabeledExpressions &expressions) const
+{
+    expressions.push_back(std::make_pair("left keys", left_keys));
+    expressions.push_back(std::make_pair("right keys", right_keys));
+    if (!residual.empty())
+        expressions.push_back(std::make_pair("residual", residual));
+}
+
+std::vector<PlanOperator **> HashJoin::get_children()
+{
+    std::vector<PlanOperator **> children;
+    children.push_back(&left);
+    children.push_back(&right);
+    return children;
+}
+
+void HashJoin::open()
+{
+    left->open();
+    right->open();
+
+    // build on the smaller input; an outer join's preserved side can be either one
+    build_left = builds_left();
+    build = build_left ? left : right;
+    probe = build_left ? right : left;
+    build_keys = build_left ? &left_keys : &right_keys;
+    probe_keys = build_left ? &right_keys : &left_keys;
+    JoinKind preserve_build = build_left ? LEFT_OUTER_JOIN : RIGHT_OUTER_JOIN;
+    JoinKind preserve_probe = build_left ? RIGHT_OUTER_JOIN : LEFT_OUTER_JOIN;
+    keep_unmatched_build = join_type == preserve_build;
+    keep_unmatched_probe = join_type == preserve_probe;
+
+    build_rows.clear();
+    hash_table.clear();
+    build_memory = 0;
+    spilled = false;
+    partitions.clear();
+    partition = Partition();
+    chunked = false;
+
+    ValueDict row;
+    std::string key;
+    while (build->next(row))
+    {
+        key.clear();
+        bool has_key = make_key(*build_keys, row, key);
+        if (!spilled && build_memory > memory_budget)
+            partition_inputs();
+        if (spilled)
+            spill(row, key, has_key, 0, partitions, true);
+        else
+            add_build_row(row, key, has_key);
+    }
+
+    if (spilled)
+    {
+        while (probe->next(row))
+        {
+            key.clear();
+            bool has_key = make_key(*probe_keys, row, key);
+            if (has_key || keep_unmatched_probe)
+                spill(row, key, has_key, 0, partitions, false);
+        }
+    }
+
+    phase = !spilled || next_partition() ? PROBING : DONE;
+    have_probe_row = false;
+}
+
+bool HashJoin::next(ValueDict &row)
+{
+    std::string key;
+    while (true)
+    {
+        switch (phase)
+        {
+        case PROBING:
+            if (have_probe_row)
+            {
+                while (candidate != candidates_end)
+                {
+                    BuildRow &build_row = build_rows[candidate->second];
+                    ++candidate;
+                    combine(build_row.row, probe_row, row);
+                    if (all_true(residual, row))
+                    {
+                        build_row.matched = true;
+                        probe_matched = true;
+                        return true;
+                    }
+                }
+                have_probe_row = false;
+                if (keep_unmatched_probe)
+                {
+                    // in a chunked partition, a probe row is unmatched if no chunk matched it
+                    bool unmatched = !probe_matched;
+                    if (chunked)
+                    {
+                        if (probe_matched)
+                            probe_ever_matched[probe_index - 1] = true;
+                        unmatched = !probe_ever_matched[probe_index - 1] &&
+                                    build_rows_read == partition.build->get_row_count();
+                    }
+                    if (unmatched)
+                    {
+                        pad(probe_row, false, row);
+                        return true;
+                    }
+                }
+            }
+            if (!next_probe_row())
+            {
+                phase = UNMATCHED_BUILD_ROWS;
+                unmatched_index = 0;
+                break;
+            }
+            have_probe_row = true;
+            probe_matched = false;
+            key.clear();
+            if (make_key(*probe_keys, probe_row, key))
+            {
+                auto range = hash_table.equal_range(key);
+                candidate = range.first;
+                candidates_end = range.second;
+            }
+            else
+            {
+                candidate = candidates_end = hash_table.end();
+            }
+            break;
+
+        case UNMATCHED_BUILD_ROWS:
+            while (keep_unmatched_build && unmatched_index < build_rows.size())
+            {
+                const BuildRow &build_row = build_rows[unmatched_index++];
+                if (!build_row.matched)
+                {
+                    pad(build_row.row, true, row);
+                    return true;
+                }
+            }
+            if (chunked && build_rows_read < partition.build->get_row_count())
+            {
+                // join the partition's next chunk of build rows with all of its probe rows
+                load_chunk();
+                partition.probe->rewind();
+                probe_index = 0;
+                phase = PROBING;
+            }
+            else
+            {
+                // done with this partition; move on to the next
+                phase = spilled && next_partition() ? PROBING : DONE;
+            }
+            break;
+
+        case DONE:
+            return false;
+        }
+    }
+}
+
+void HashJoin::close()
+{
+    left->close();
+    right->close();
+    build_rows.clear();
+    hash_table.clear();
+    partitions.clear();
+    partition = Partition();
+    probe_ever_matched.clear();
+    phase = DONE;
+}
+
+bool HashJoin::make_key(const std::vector<const Expr *> &keys, const ValueDict &row, std::string &key)
+{
+    for (auto const expr : keys)
+    {
+        Value value = evaluate(expr, row);
+        if (value.is_null)
+            return false;
+        encode_key(value, false, key);
+    }
+    return true;
+}
+
+// The hash table picks buckets with the same hash, so partition on a remix of it. The mix
+// is seeded with the depth so that the keys of a partition that's split again spread out.
+size_t HashJoin::partition_of(const std::string &key, size_t depth) const
+{
+    uint64_t hash = std::hash<std::string>()(key) + (depth + 1) * 0x9e3779b97f4a7c15ULL;
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return (hash ^ (hash >> 31)) % NUM_PARTITIONS;
+}
+
+// Rows with a NULL key never match, so they're only kept if they have to come out unmatched.
+void HashJoin::add_build_row(const ValueDict &row, const std::string &key, bool has_key)
+{
+    if (!has_key && !keep_unmatched_build)
+        return;
+    build_rows.push_back(BuildRow{row, false});
+    if (has_key)
+        hash_table.emplace(key, build_rows.size() - 1);
+    build_memory += row_memory(row) + key.size() + BUILD_ROW_OVERHEAD;
+}
+
+void HashJoin::spill(const ValueDict &row, const std::string &key, bool has_key, size_t depth,
+                     std::vector<Partition> &parts, bool build_half)
+{
+    Partition &part = parts[has_key ? partition_of(key, depth) : 0];
+    if (build_half)
+        part.build->write_row(build->get_column_names(), row);
+    else
+        part.probe->write_row(probe->get_column_names(), row);
+}
+
+// The build side outgrew the budget: move what's in memory out to the partition files.
+void HashJoin::partition_inputs()
+{
+    spilled = true;
+    for (size_t i = 0; i < NUM_PARTITIONS; i++)
+        partitions.push_back(Partition{std::unique_ptr<SpillFile>(new SpillFile()),
+                                       std::unique_ptr<SpillFile>(new SpillFile()), 0});
+    std::string key;
+    for (auto const &build_row : build_rows)
+    {
+        key.clear();
+        bool has_key = make_key(*build_keys, build_row.row, key);
+        spill(build_row.row, key, has_key, 0, partitions, true);
+    }
+    build_rows.clear();
+    hash_table.clear();
+    build_memory = 0;
+}
+
+// A partition whose build half doesn't fit is split again, up to MAX_PARTITION_DEPTH times;
+// after that, or if it can't be split, it's joined a chunk of build rows at a time.
+bool HashJoin::next_partition()
+{
+    while (!partitions.empty())
+    {
+        partition = std::move(partitions.back());
+        partitions.pop_back();
+        if ((partition.build->get_row_count() == 0 && !keep_unmatched_probe) ||
+            (partition.probe->get_row_count() == 0 && !keep_unmatched_build))
+            continue;  // nothing in it can come out
+
+        partition.build->rewind();
+        partition.probe->rewind();
+        build_rows_read = 0;
+        probe_index = 0;
+        chunked = false;
+        if (load_chunk())
+            return true;
+        if (partition.depth < MAX_PARTITION_DEPTH)
+        {
+            if (repartition())
+                continue;
+            load_chunk();  // repartition() read the build half through; start it over
+        }
+        chunked = true;
+        if (keep_unmatched_probe)
+            probe_ever_matched.assign(partition.probe->get_row_count(), false);
+        return true;
+    }
+    partition = Partition();
+    build_rows.clear();
+    hash_table.clear();
+    build_memory = 0;
+    return false;
+}
+
+// Always takes at least one row, so a chunked partition makes progress whatever the budget.
+bool HashJoin::load_chunk()
+{
+    build_rows.clear();
+    hash_table.clear();
+    build_memory = 0;
+
+    size_t row_count = partition.build->get_row_count();
+    ValueDict row;
+    std::string key;
+    while (build_rows_read < row_count && (build_rows.empty() || build_memory <= memory_budget) &&
+           partition.build->read_row(build->get_column_names(), row))
+    {
+        build_rows_read++;
+        key.clear();
+        bool has_key = make_key(*build_keys, row, key);
+        add_build_row(row, key, has_key);
+    }
+    return build_rows_read == row_count;
+}
+
+// Rows with the same key always land together, so a partition of one key (or of NULL keys
+// kept for an outer join) can't be split.
+bool HashJoin::repartition()
+{
+    build_rows.clear();
+    hash_table.clear();
+    build_memory = 0;
+
+    size_t depth = partition.depth + 1;
+    std::vector<Partition> pieces;
+    for (size_t i = 0; i < NUM_PARTITIONS; i++)
+        pieces.push_back(Partition{std::unique_ptr<SpillFile>(new SpillFile()),
+                                   std::unique_ptr<SpillFile>(new SpillFile()), depth});
+    ValueDict row;
+    std::string key;
+    partition.build->rewind();
+    while (partition.build->read_row(build->get_column_names(), row))
+    {
+        key.clear();
+        bool has_key = make_key(*build_keys, row, key);
+        spill(row, key, has_key, depth, pieces, true);
+    }
+    size_t nonempty = 0;
+    for (auto const &piece : pieces)
+        if (piece.build->get_row_count() > 0)
+            nonempty++;
+    if (nonempty < 2)
+    {
+        partition.build->rewind();
+        build_rows_read = 0;
+        return false;
+    }
+
+    while (partition.probe->read_row(probe->get_column_names(), row))
+    {
+        key.clear();
+        bool has_key = make_key(*probe_keys, row, key);
+        spill(row, key, has_key, depth, pieces, false);
+    }
+    for (auto &piece : pieces)
+        partitions.push_back(std::move(piece));
+    return true;
+}
+
+bool HashJoin::next_probe_row()
+{
+    if (!spilled)
+        return probe->next(probe_row);
+    if (!partition.probe->read_row(probe->get_column_names(), probe_row))
+        return false;
+    probe_index++;
+    return true;
+}
+
+void HashJoin::combine(const ValueDict &build_row, const ValueDict &probe_row, ValueDict &row) const
+{
+    row = build_row;
+    row.insert(probe_row.begin(), probe_row.end());
+}
+
+void HashJoin::pad(const ValueDict &present, bool present_is_build, ValueDict &row) const
+{
+    row = present;
+    add_nulls(present_is_build ? probe->get_column_names() : build->get_column_names(), row);
+}
+
+bool HashJoin::builds_left()
+{
+    if (build_side != BUILD_SMALLER)
+        return build_side == BUILD_LEFT;
+    return left->estimated_rows() < right->estimated_rows();
+}
+
+//------------------------NestedLoopJoin----------------------------------------------
+
+NestedLoopJoin::NestedLoopJoin(PlanOperator *left, PlanOperator *right, JoinKind join_type,
+                               const std::vector<const Expr *> &conditions)
+    : left(left), right(right), join_type(join_type), conditions(conditions), selectivity(-1), right_memory(0),
+      have_left_row(false), left_matched(false), right_index(0), emitting_unmatched_right(false)
+{
+    column_names = concatenate(left->get_column_names(), right->get_column_names());
+}
+
+NestedLoopJoin::~NestedLoopJoin()
+{
+    delete left;
+    delete right;
+}
+
+size_t NestedLoopJoin::estimated_rows()
+{
+    if (selectivity >= 0)
+        return join_rows(left->estimated_rows(), right->estimated_rows(), selectivity, join_type);
+    size_t rows = left->estimated_rows() * right->estimated_rows();
+    return conditions.empty() ? rows : rows / (3 * conditions.size());
+}
+
+std::string NestedLoopJoin::get_name()
+{
+    return std::string("NestedLoopJoin ") + join_kind_name(join_type);
+}
+
+void NestedLoopJoin::get_expressions(LabeledExpressions &expressions) const
+{
+    if (!conditions.empty())
+        expressions.push_back(std::make_pair("conditions", conditions));
+}
+
+std::vector<PlanOperator **> NestedLoopJoin::get_children()
+{
+    std::vector<PlanOperator **> children;
+    children.push_back(&left);
+    children.push_back(&right);
+    return children;
+}
+
+void NestedLoopJoin::open()
+{
+    left->open();
+    right->open();
+    right_rows.clear();
+    right_memory = 0;
+    ValueDict row;
+    while (right->next(row))
+    {
+        right_rows.push_back(row);
+        right_memory += row_memory(row);
+    }
+    right_matched.assign(right_rows.size(), false);
+    have_left_row = false;
+    emitting_unmatched_right = false;
+    right_index = 0;
+}
+
+bool NestedLoopJoin::next(ValueDict &row)
+{
+    while (true)
+    {
+        if (emitting_unmatched_right)
+        {
+            while (right_index < right_rows.size())
+            {
+                size_t i = right_index++;
+                if (!right_matched[i])
+                {
+                    row = right_rows[i];
+                    add_nulls(left->get_column_names(), row);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        if (have_left_row)
+        {
+            while (right_index < right_rows.size())
+            {
+                size_t i = right_index++;
+                row = left_row;
+                row.insert(right_rows[i].begin(), right_rows[i].end());
+                if (all_true(conditions, row))
+                {
+                    left_matched = true;
+                    right_matched[i] = true;
+                    return true;
+                }
+            }
+            have_left_row = false;
+            if (join_type == LEFT_OUTER_JOIN && !left_matched)
+            {
+                row = left_row;
+                add_nulls(right->get_column_names(), row);
+                return true;
+            }
+        }
+
+        if (!next_left_row())
+        {
+            if (join_type != RIGHT_OUTER_JOIN)
+                return false;
+            emitting_unmatched_right = true;
+            right_index = 0;
+            continue;
+        }
+        have_left_row = true;
+        left_matched = false;
+        right_index = 0;
+    }
+}
+
+void NestedLoopJoin::close()
+{
+    left->close();
+    right->close();
+    right_rows.clear();
+    right_matched.clear();
+}
+
+bool NestedLoopJoin::next_left_row()
+{
+    return left->next(left_row);
+}
+
+//------------------------tests----------------------------------------------
+
+// l(k, v): 300 rows with k = i % 60 and v = i; r(k, w): 50 rows with k = 0..49 and w = 10 * k
+static PlanOperator *left_input(std::vector<std::vector<Expr *>> &rows)
+{
+    rows.clear();
+    for (int i = 0; i < 300; i++)
+        rows.push_back({make_int(i % 60), make_int(i)});
+    return new Values({"l.k", "l.v"}, rows);
+}
+
+static PlanOperator *right_input(std::vector<std::vector<Expr *>> &rows)
+{
+    rows.clear();
+    for (int i = 0; i < 50; i++)
+        rows.push_back({make_int(i), make_int(10 * i)});
+    return new Values({"r.k", "r.w"}, rows);
+}
+
+// l(k, v): 400 rows with k = 7, then 20 with k = 200..219; v = i
+static PlanOperator *skewed_input(std::vector<std::vector<Expr *>> &rows)
+{
+    rows.clear();
+    for (int i = 0; i < 420; i++)
+        rows.push_back({make_int(i < 400 ? 7 : 200 + i - 400), make_int(i)});
+    return new Values({"l.k", "l.v"}, rows);
+}
+
+static void free_rows(std::vector<std::vector<Expr *>> &rows)
+{
+    for (auto &exprs : rows)
+        for (auto expr : exprs)
+            delete expr;
+    rows.clear();
+}
+
+// Runs a join and checks how many rows it returns, how many have a NULL right side, and
+// that it never holds more than max_memory bytes of build rows.
+static bool check_join(PlanOperator *join, size_t expected_rows, size_t expected_nulls,
+                       size_t max_memory = SIZE_MAX)
+{
+    size_t count = 0, nulls = 0;
+    ValueDict row;
+    join->open();
+    while (join->next(row))
+    {
+        count++;
+        if (join->get_memory_used() > max_memory)
+            return false;
+        if (row["r.w"].is_null)
+            nulls++;
+        else if (!row["l.k"].is_null && (row["l.k"].n != row["r.k"].n || row["r.w"].n != 10 * row["l.k"].n))
+            return false;
+    }
+    join->close();
+    std::cout << count << " rows (" << nulls << " unmatched)" << std::endl;
+    return count == expected_rows && nulls == expected_nulls;
+}
+
+// test function -- returns true if all tests pass
+bool test_join_plan()
+{
+    std::cout << "\nTesting JoinPlan...." << std::endl;
+    std::vector<std::vector<Expr *>> lrows, rrows;
+    Expr *lk = make_column("l", "k");
+    Expr *rk = make_column("r", "k");
+    std::vector<const Expr *> left_keys = {lk}, right_keys = {rk};
+    bool ok = true;
+
+    // 250 of the 300 left rows have k < 50 and match exactly one right row
+    for (size_t budget : {DEFAULT_MEMORY_BUDGET, (size_t)1})
+    {
+        std::cout << "memory budget " << budget << ": ";
+        HashJoin inner(left_input(lrows), right_input(rrows), left_keys, right_keys, INNER_JOIN,
+                       std::vector<const Expr *>(), budget);
+        ok = ok && check_join(&inner, 250, 0) && inner.did_spill() == (budget == 1);
+        free_rows(lrows);
+        free_rows(rrows);
+
+        HashJoin left_outer(left_input(lrows), right_input(rrows), left_keys, right_keys, LEFT_OUTER_JOIN,
+                            std::vector<const Expr *>(), budget);
+        ok = ok && check_join(&left_outer, 300, 50);
+        free_rows(lrows);
+        free_rows(rrows);
+
+        // r RIGHT JOIN l, built on r: every left row survives
+        HashJoin right_outer(right_input(rrows), left_input(lrows), right_keys, left_keys, RIGHT_OUTER_JOIN,
+                             std::vector<const Expr *>(), budget);
+        ok = ok && check_join(&right_outer, 300, 50);
+        free_rows(lrows);
+        free_rows(rrows);
+    }
+    if (!ok)
+        return false;
+    std::cout << "hash join ok" << std::endl;
+
+    // 400 left rows share one key, so splitting their partition again doesn't help; built
+    // on, they're joined a budget's worth at a time (give or take the row that crosses it)
+    size_t budget = 8 * 1024;
+    for (JoinKind join_type : {INNER_JOIN, LEFT_OUTER_JOIN, RIGHT_OUTER_JOIN})
+    {
+        std::cout << "skewed " << join_kind_name(join_type) << ": ";
+        HashJoin skewed(skewed_input(lrows), right_input(rrows), left_keys, right_keys, join_type,
+                        std::vector<const Expr *>(), budget);
+        skewed.set_build_side(BUILD_LEFT);
+        size_t expected = join_type == INNER_JOIN ? 400 : join_type == LEFT_OUTER_JOIN ? 420 : 400 + 49;
+        ok = ok && check_join(&skewed, expected, join_type == LEFT_OUTER_JOIN ? 20 : 0, budget + 1024) &&
+             skewed.did_spill();
+        free_rows(lrows);
+        free_rows(rrows);
+    }
+    if (!ok)
+        return false;
+    std::cout << "skewed hash join ok" << std::endl;
+
+    // residual condition: only pairs with v < 100 (k = 0..49 once each among i < 100, minus k >= 50)
+    Expr *small = make_op(make_column("l", "v"), '<', make_int(100));
+    HashJoin residual(left_input(lrows), right_input(rrows), left_keys, right_keys, INNER_JOIN, {small});
+    ok = check_join(&residual, 50 + 40, 0);
+    free_rows(lrows);
+    free_rows(rrows);
+    if (!ok)
+        return false;
+    std::cout << "residual ok" << std::endl;
+
+    // l.k < r.k has no equality to hash on: pairs with l.k < r.k, l.k in 0..59 five times over
+    Expr *less = make_op(make_column("l", "k"), '<', make_column("r", "k"));
+    NestedLoopJoin theta(left_input(lrows), right_input(rrows), INNER_JOIN, {less});
+    size_t expected = 0;
+    for (int k = 0; k < 60; k++)
+        expected += 5 * (k < 50 ? 49 - k : 0);
+    size_t count = 0;
+    ValueDict row;
+    theta.open();
+    while (theta.next(row))
+        if (row["l.k"].n < row["r.k"].n)
+            count++;
+    theta.close();
+    free_rows(lrows);
+    free_rows(rrows);
+    delete lk;
+    delete rk;
+    delete small;
+    delete less;
+    if (count != expected)
+        return false;
+    std::cout << "nested loop join ok" << std::endl;
+    return true;
+}
@@ -0,0 +1,291 @@
+/**
+ * Implementation of the metrics registry declared in Metrics.h.
+ */
+
+#include "Metrics.h"
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+static const char *COUNTER_NAMES[NUM_METRIC_COUNTERS] = {
+    "block_reads", "block_writes", "blocks_allocated", "bytes_read", "bytes_written", "records_added",
+    "records_updated", "records_deleted", "marshal_calls", "marshal_bytes", "unmarshal_calls", "unmarshal_bytes",
+    "spill_bytes_written", "statements", "commits", "aborts", "log_flushes", "latch_waits",
+    "versions_reclaimed", "arena_chunk_mallocs", "rows_moved", "blocks_truncated",
+    "brin_blocks_skipped", "ranges_summarized", "memtables_written", "runs_merged", "bloom_filter_skips",
+    "plans_rebuilt"};
+
+static const char *HISTOGRAM_NAMES[NUM_METRIC_HISTOGRAMS] = {"block_read", "block_write", "statement", "commit"};
+
+//------------------------LatencyHistogram----------------------------------------------
+
+LatencyHistogram::LatencyHistogram() : counts(NUM_BUCKETS, 0), total(0), sum(0), max(0)
+{
+}
+
+void LatencyHistogram::record(uint64_t nanoseconds)
+{
+    counts[bucket(nanoseconds)]++;
+    total++;
+    sum += nanoseconds;
+    if (nanoseconds > max)
+        max = nanoseconds;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+    for (size_t i = 0; i < NUM_BUCKETS; i++)
+        counts[i] += other.counts[i];
+    total += other.total;
+    sum += other.sum;
+    if (other.max > max)
+        max = other.max;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const
+{
+    if (total == 0)
+        return 0;
+    uint64_t rank = (uint64_t)std::ceil(p / 100.0 * total);
+    rank = rank < 1 ? 1 : rank;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < NUM_BUCKETS; i++)
+    {
+        seen += counts[i];
+        if (seen >= rank)
+            return lower_bound(i) < max ? lower_bound(i) : max;
+    }
+    return max;
+}
+
+size_t LatencyHistogram::bucket(uint64_t nanoseconds)
+{
+    if (nanoseconds < (1u << SUB_BUCKET_BITS))
+        return (size_t)nanoseconds;
+    int magnitude = 63 - __builtin_clzll(nanoseconds);  // position of the highest bit
+    int shift = magnitude - SUB_BUCKET_BITS;
+    size_t sub_bucket = (size_t)(nanoseconds >> shift) & ((1u << SUB_BUCKET_BITS) - 1);
+    return ((size_t)(shift + 1) << SUB_BUCKET_BITS) + sub_bucket;
+}
+
+uint64_t LatencyHistogram::lower_bound(size_t bucket)
+{
+    if (bucket < (1u << SUB_BUCKET_BITS))
+        return bucket;
+    int shift = (int)(bucket >> SUB_BUCKET_BITS) - 1;
+    uint64_t sub_bucket = bucket & ((1u << SUB_BUCKET_BITS) - 1);
+    return ((1ull << SUB_BUCKET_BITS) + sub_bucket) << shift;
+}
+
+//------------------------Metrics----------------------------------------------
+
+Metrics::ThreadSlots::ThreadSlots()
+{
+    for (auto &counter : counters)
+        counter.store(0, std::memory_order_relaxed);
+    for (int h = 0; h < NUM_METRIC_HISTOGRAMS; h++)
+    {
+        for (auto &count : buckets[h])
+            count.store(0, std::memory_order_relaxed);
+        sums[h].store(0, std::memory_order_relaxed);
+        maxes[h].store(0, std::memory_order_relaxed);
+    }
+}
+
+namespace {
+
+// Every thread's slots, and the totals of threads that have exited.
+struct Registry {
+    std::mutex lock;
+    std::vector<Metrics::ThreadSlots *> live;
+    std::vector<uint64_t> retired_counters;
+    std::vector<LatencyHistogram> retired_histograms;
+
+    Registry() : retired_counters(NUM_METRIC_COUNTERS, 0), retired_histograms(NUM_METRIC_HISTOGRAMS) {}
+};
+
+// Never destroyed, so threads exiting during shutdown can still fold in their counts.
+Registry *registry()
+{
+    static Registry *instance = new Registry();
+    return instance;
+}
+
+// Registers a thread's slots on its first count and retires them when the thread exits.
+struct SlotsOwner {
+    Metrics::ThreadSlots *slots;
+
+    SlotsOwner() : slots(new Metrics::ThreadSlots())
+    {
+        Registry *r = registry();
+        std::lock_guard<std::mutex> guard(r->lock);
+        r->live.push_back(slots);
+    }
+
+    ~SlotsOwner()
+    {
+        Registry *r = registry();
+        std::lock_guard<std::mutex> guard(r->lock);
+        Metrics::add_slots(*slots, r->retired_counters, r->retired_histograms);
+        for (auto it = r->live.begin(); it != r->live.end(); ++it)
+            if (*it == slots)
+            {
+                r->live.erase(it);
+                break;
+            }
+        delete slots;
+    }
+};
+
+} // namespace
+
+Metrics::ThreadSlots &Metrics::local()
+{
+    static thread_local SlotsOwner owner;
+    return *owner.slots;
+}
+
+void Metrics::add_slots(const ThreadSlots &slots, std::vector<uint64_t> &counters,
+                        std::vector<LatencyHistogram> &histograms)
+{
+    for (int c = 0; c < NUM_METRIC_COUNTERS; c++)
+        counters[c] += slots.counters[c].load(std::memory_order_relaxed);
+    for (int h = 0; h < NUM_METRIC_HISTOGRAMS; h++)
+    {
+        LatencyHistogram one;
+        for (size_t i = 0; i < LatencyHistogram::NUM_BUCKETS; i++)
+        {
+            one.counts[i] = slots.buckets[h][i].load(std::memory_order_relaxed);
+            one.total += one.counts[i];
+        }
+        one.sum = slots.sums[h].load(std::memory_order_relaxed);
+        one.max = slots.maxes[h].load(std::memory_order_relaxed);
+        histograms[h].merge(one);
+    }
+}
+
+void Metrics::record(MetricHistogram histogram, uint64_t nanoseconds)
+{
+    ThreadSlots &slots = local();
+    std::atomic<uint64_t> &count = slots.buckets[histogram][LatencyHistogram::bucket(nanoseconds)];
+    count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    slots.sums[histogram].store(slots.sums[histogram].load(std::memory_order_relaxed) + nanoseconds,
+                                std::memory_order_relaxed);
+    if (nanoseconds > slots.maxes[histogram].load(std::memory_order_relaxed))
+        slots.maxes[histogram].store(nanoseconds, std::memory_order_relaxed);
+}
+
+void Metrics::snapshot(std::vector<uint64_t> &counters, std::vector<LatencyHistogram> &histograms)
+{
+    Registry *r = registry();
+    std::lock_guard<std::mutex> guard(r->lock);
+    counters = r->retired_counters;
+    histograms = r->retired_histograms;
+    for (auto const slots : r->live)
+        add_slots(*slots, counters, histograms);
+}
+
+const char *Metrics::counter_name(MetricCounter counter)
+{
+    return COUNTER_NAMES[counter];
+}
+
+const char *Metrics::histogram_name(MetricHistogram histogram)
+{
+    return HISTOGRAM_NAMES[histogram];
+}
+
+bool Metrics::enabled()
+{
+#ifdef SQL5300_METRICS
+    return true;
+#else
+    return false;
+#endif
+}
+
+std::string format_metrics()
+{
+    if (!Metrics::enabled())
+        return "statistics were compiled out (build with -DSQL5300_METRICS)";
+
+    std::vector<uint64_t> counters;
+    std::vector<LatencyHistogram> histograms;
+    Metrics::snapshot(counters, histograms);
+
+    std::stringstream ss;
+    ss << std::left << std::setw(22) << "counter" << std::right << std::setw(14) << "value" << std::endl;
+    for (int c = 0; c < NUM_METRIC_COUNTERS; c++)
+        ss << std::left << std::setw(22) << Metrics::counter_name((MetricCounter)c) << std::right << std::setw(14)
+           << counters[c] << std::endl;
+
+    auto us = [](double ns) { return ns / 1000.0; };
+    ss << std::endl << std::left << std::setw(22) << "latency (us)" << std::right << std::setw(14) << "count"
+       << std::setw(10) << "mean" << std::setw(10) << "p50" << std::setw(10) << "p90" << std::setw(10) << "p99"
+       << std::setw(10) << "p99.9" << std::setw(10) << "max" << std::endl;
+    ss << std::fixed << std::setprecision(1);
+    for (int h = 0; h < NUM_METRIC_HISTOGRAMS; h++)
+    {
+        const LatencyHistogram &histogram = histograms[h];
+        ss << std::left << std::setw(22) << Metrics::histogram_name((MetricHistogram)h) << std::right << std::setw(14)
+           << histogram.get_count() << std::setw(10) << us(histogram.get_mean()) << std::setw(10)
+           << us(histogram.percentile(50)) << std::setw(10) << us(histogram.percentile(90)) << std::setw(10)
+           << us(histogram.percentile(99)) << std::setw(10) << us(histogram.percentile(99.9)) << std::setw(10)
+           << us(histogram.get_max());
+        if (h + 1 < NUM_METRIC_HISTOGRAMS)
+            ss << std::endl;
+    }
+    return ss.str();
+}
+
+//------------------------tests----------------------------------------------
+
+// test function -- returns true if all tests pass
+bool test_metrics()
+{
+    std::cout << "\nTesting Metrics...." << std::endl;
+    LatencyHistogram histogram;
+    for (uint64_t ns = 1; ns <= 100000; ns++)
+        histogram.record(ns);
+    // percentiles are bucket lower bounds, within 1/16 of the value
+    for (double p : {50.0, 90.0, 99.0})
+    {
+        double expected = p * 1000;
+        double actual = (double)histogram.percentile(p);
+        if (actual > expected || actual < expected * 15 / 16)
+        {
+            std::cout << "p" << p << " was " << actual << std::endl;
+            return false;
+        }
+    }
+    if (histogram.get_count() != 100000 || histogram.get_max() != 100000 || histogram.get_mean() != 50000.5)
+        return false;
+    for (size_t b = 0; b + 1 < LatencyHistogram::NUM_BUCKETS && LatencyHistogram::lower_bound(b + 1) < (1ull << 62); b++)
+        if (LatencyHistogram::bucket(LatencyHistogram::lower_bound(b)) != b)
+            return false;
+    std::cout << "histogram ok" << std::endl;
+
+    // counts from other threads, including ones that have exited, are all summed
+    std::vector<uint64_t> before, after;
+    std::vector<LatencyHistogram> histograms;
+    Metrics::snapshot(before, histograms);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+        threads.push_back(std::thread([] {
+            for (int i = 0; i < 1000; i++)
+                Metrics::add(SPILL_BYTES_WRITTEN, 2);
+            Metrics::record(STATEMENT_LATENCY, 1000);
+        }));
+    for (auto &thread : threads)
+        thread.join();
+    Metrics::add(SPILL_BYTES_WRITTEN, 1);
+    Metrics::snapshot(after, histograms);
+    if (after[SPILL_BYTES_WRITTEN] - before[SPILL_BYTES_WRITTEN] != 8001 ||
+        histograms[STATEMENT_LATENCY].get_count() < 4)
+        return false;
+    std::cout << "registry ok" << std::endl;
+    return true;
+}
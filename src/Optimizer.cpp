@@ -0,0 +1,820 @@
+/**
+ * Implementation of the cost-based choices declared in Optimizer.h.
+ */
+
+#include "Optimizer.h"
+#include "TestExprs.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <iostream>
+
+using namespace hsql;
+
+//------------------------selectivity----------------------------------------------
+
+enum Comparison {
+    NOT_COMPARISON, EQUAL, NOT_EQUAL, LESS, LESS_EQUAL, GREATER, GREATER_EQUAL
+};
+
+static Comparison comparison_of(const Expr *expr)
+{
+    switch (expr->opType)
+    {
+    case Expr::NOT_EQUALS:
+        return NOT_EQUAL;
+    case Expr::LESS_EQ:
+        return LESS_EQUAL;
+    case Expr::GREATER_EQ:
+        return GREATER_EQUAL;
+    case Expr::SIMPLE_OP:
+        if (expr->opChar == '=')
+            return EQUAL;
+        if (expr->opChar == '<')
+            return LESS;
+        if (expr->opChar == '>')
+            return GREATER;
+        return NOT_COMPARISON;
+    default:
+        return NOT_COMPARISON;
+    }
+}
+
+// a < b is b > a
+static Comparison mirror(Comparison comparison)
+{
+    switch (comparison)
+    {
+    case LESS:
+        return GREATER;
+    case LESS_EQUAL:
+        return GREATER_EQUAL;
+    case GREATER:
+        return LESS;
+    case GREATER_EQUAL:
+        return LESS_EQUAL;
+    default:
+        return comparison;
+    }
+}
+
+// Finds the input and column a column reference names, the way resolves_in matches names.
+static bool locate(const Expr *expr, const std::vector<JoinInput> &inputs, size_t &input, size_t &column)
+{
+    if (expr->type != kExprColumnRef)
+        return false;
+    if (expr->hasTable())
+    {
+        std::string qualified = std::string(expr->table) + "." + expr->name;
+        for (size_t i = 0; i < inputs.size(); i++)
+        {
+            for (size_t j = 0; j < inputs[i].column_names.size(); j++)
+            {
+                if (inputs[i].column_names[j] == qualified || inputs[i].column_names[j] == expr->name)
+                {
+                    input = i;
+                    column = j;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    std::string name = expr->name;
+    std::string suffix = "." + name;
+    int matches = 0;
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        for (size_t j = 0; j < inputs[i].column_names.size(); j++)
+        {
+            const Identifier &column_name = inputs[i].column_names[j];
+            if (column_name == name ||
+                (column_name.size() > suffix.size() &&
+                 column_name.compare(column_name.size() - suffix.size(), suffix.size(), suffix) == 0))
+            {
+                input = i;
+                column = j;
+                matches++;
+            }
+        }
+    }
+    return matches == 1;
+}
+
+// The statistics' name for an input's column, or "" if it has none.
+static Identifier stats_column(const JoinInput &input, size_t column)
+{
+    if (input.stats == nullptr || column >= input.table_column_names.size())
+        return "";
+    return input.table_column_names[column];
+}
+
+// Distinct values of a column, at most one per row of its input; without statistics,
+// every row is taken to have its own.
+static double distinct_values(const JoinInput &input, size_t column)
+{
+    double rows = std::max(input.rows, 1.0);
+    Identifier column_name = stats_column(input, column);
+    if (column_name.empty())
+        return rows;
+    double distinct = input.stats->distinct_values(column_name);
+    return distinct > 0 ? std::min(distinct, rows) : rows;
+}
+
+static bool is_constant(const Expr *expr)
+{
+    return expr->type == kExprLiteralInt || expr->type == kExprLiteralString || expr->type == kExprPlaceholder;
+}
+
+// column (comparison) constant
+static double compare_to_constant(const JoinInput &input, size_t column, Comparison comparison, const Expr *constant)
+{
+    Identifier column_name = stats_column(input, column);
+    if (column_name.empty())
+        return Optimizer::DEFAULT_SELECTIVITY;
+    if (constant->type == kExprPlaceholder)
+    {
+        // the value isn't known until the statement runs: any one of the column's values
+        double equal = 1 / distinct_values(input, column);
+        if (comparison == EQUAL)
+            return equal;
+        if (comparison == NOT_EQUAL)
+            return 1 - equal;
+        return Optimizer::DEFAULT_SELECTIVITY;
+    }
+
+    Value value = constant->type == kExprLiteralInt ? Value((int32_t)constant->ival) : Value(std::string(constant->name));
+    switch (comparison)
+    {
+    case EQUAL:
+        return input.stats->fraction_equal(column_name, value);
+    case NOT_EQUAL:
+        return 1 - input.stats->fraction_equal(column_name, value);
+    default:
+        break;
+    }
+    // x > v is not x <= v, and x >= v is not x < v
+    bool or_equal = comparison == LESS_EQUAL || comparison == GREATER;
+    double less = input.stats->fraction_less(column_name, value, or_equal);
+    if (less < 0)
+        return Optimizer::DEFAULT_SELECTIVITY;
+    return comparison == LESS || comparison == LESS_EQUAL ? less : 1 - less;
+}
+
+static double comparison_selectivity(const Expr *expr, const std::vector<JoinInput> &inputs)
+{
+    Comparison comparison = comparison_of(expr);
+    if (comparison == NOT_COMPARISON || expr->expr == nullptr || expr->expr2 == nullptr)
+        return Optimizer::DEFAULT_SELECTIVITY;
+    size_t left_input, left_column, right_input, right_column;
+    bool left_is_column = locate(expr->expr, inputs, left_input, left_column);
+    bool right_is_column = locate(expr->expr2, inputs, right_input, right_column);
+
+    if (left_is_column && right_is_column)
+    {
+        // a match for each value both have in common, assuming the column with fewer
+        // values has only values the other has too
+        double equal = 1 / std::max(distinct_values(inputs[left_input], left_column),
+                                    distinct_values(inputs[right_input], right_column));
+        if (comparison == EQUAL)
+            return equal;
+        if (comparison == NOT_EQUAL)
+            return 1 - equal;
+        return Optimizer::DEFAULT_SELECTIVITY;
+    }
+    if (left_is_column && is_constant(expr->expr2))
+        return compare_to_constant(inputs[left_input], left_column, comparison, expr->expr2);
+    if (right_is_column && is_constant(expr->expr))
+        return compare_to_constant(inputs[right_input], right_column, mirror(comparison), expr->expr);
+    return Optimizer::DEFAULT_SELECTIVITY;
+}
+
+// The bounds that the conjuncts comparing one column with constants put on it together.
+struct ColumnBounds {
+    size_t input;
+    size_t column;
+    ColumnAttribute::DataType data_type;  // of the constants, which a range can't mix
+    KeyRange range;
+    std::vector<const Expr *> conjuncts;
+};
+
+// column (<, <=, > or >=) literal, or the mirror of one, on a column with statistics
+static bool range_bound(const Expr *expr, const std::vector<JoinInput> &inputs, size_t &input, size_t &column,
+                        Comparison &comparison, Value &value)
+{
+    if (expr->type != kExprOperator || expr->expr == nullptr || expr->expr2 == nullptr)
+        return false;
+    comparison = comparison_of(expr);
+    if (comparison != LESS && comparison != LESS_EQUAL && comparison != GREATER && comparison != GREATER_EQUAL)
+        return false;
+    const Expr *constant = expr->expr2;
+    if (!locate(expr->expr, inputs, input, column))
+    {
+        constant = expr->expr;
+        comparison = mirror(comparison);
+        if (!locate(expr->expr2, inputs, input, column))
+            return false;
+    }
+    if (stats_column(inputs[input], column).empty())
+        return false;
+    if (constant->type == kExprLiteralInt)
+        value = Value((int32_t)constant->ival);
+    else if (constant->type == kExprLiteralString)
+        value = Value(std::string(constant->name));
+    else
+        return false;
+    return true;
+}
+
+// The fraction of rows within a column's range, looked up in its histogram as one range
+// (bounds aren't independent of each other), or -1 if it has none.
+static double range_selectivity(const JoinInput &input, size_t column, const KeyRange &range)
+{
+    if (range.empty)
+        return 0;
+    Identifier column_name = stats_column(input, column);
+    double below_high = range.has_high ? input.stats->fraction_less(column_name, range.high, range.high_inclusive) : 1;
+    double below_low = range.has_low ? input.stats->fraction_less(column_name, range.low, !range.low_inclusive) : 0;
+    if (below_high < 0 || below_low < 0)
+        return -1;
+    return std::max(below_high - below_low, 0.0);
+}
+
+//------------------------Optimizer----------------------------------------------
+
+double Optimizer::selectivity(const Expr *expr, const std::vector<JoinInput> &inputs)
+{
+    if (expr == nullptr)
+        return 1;
+    double selectivity = DEFAULT_SELECTIVITY;
+    if (expr->type == kExprOperator)
+    {
+        switch (expr->opType)
+        {
+        case Expr::AND:
+        {
+            std::vector<const Expr *> conjuncts;
+            split_conjuncts(expr, conjuncts);
+            selectivity = Optimizer::selectivity(conjuncts, inputs);
+            break;
+        }
+        case Expr::OR:
+        {
+            double left = Optimizer::selectivity(expr->expr, inputs);
+            double right = Optimizer::selectivity(expr->expr2, inputs);
+            selectivity = left + right - left * right;
+            break;
+        }
+        case Expr::NOT:
+            selectivity = 1 - Optimizer::selectivity(expr->expr, inputs);
+            break;
+        default:
+            selectivity = comparison_selectivity(expr, inputs);
+            break;
+        }
+    }
+    return std::min(std::max(selectivity, 0.0), 1.0);
+}
+
+double Optimizer::selectivity(const std::vector<const Expr *> &conjuncts, const std::vector<JoinInput> &inputs)
+{
+    // bounds on the same column (ts >= 100 and ts < 110) are merged into one range
+    double selectivity = 1;
+    std::vector<ColumnBounds> bounds;
+    for (auto const expr : conjuncts)
+    {
+        size_t input, column;
+        Comparison comparison;
+        Value value;
+        if (!range_bound(expr, inputs, input, column, comparison, value))
+        {
+            selectivity *= Optimizer::selectivity(expr, inputs);
+            continue;
+        }
+        auto it = std::find_if(bounds.begin(), bounds.end(), [&](const ColumnBounds &b) {
+            return b.input == input && b.column == column && b.data_type == value.data_type;
+        });
+        if (it == bounds.end())
+        {
+            bounds.push_back(ColumnBounds{input, column, value.data_type, KeyRange(), {}});
+            it = bounds.end() - 1;
+        }
+        if (comparison == GREATER || comparison == GREATER_EQUAL)
+            it->range.at_least(value, comparison == GREATER_EQUAL);
+        else
+            it->range.at_most(value, comparison == LESS_EQUAL);
+        it->conjuncts.push_back(expr);
+    }
+    for (auto const &b : bounds)
+    {
+        double within = range_selectivity(inputs[b.input], b.column, b.range);
+        if (within >= 0)
+        {
+            selectivity *= within;
+            continue;
+        }
+        for (auto const expr : b.conjuncts)
+            selectivity *= comparison_selectivity(expr, inputs);
+    }
+    return std::min(std::max(selectivity, 0.0), 1.0);
+}
+
+// Turning the indexes off only ever saves seeks, so it's only worth it if they leave out
+// some blocks but break the rest into many runs.
+Optimizer::AccessPath Optimizer::choose_access_path(BatchTableScan &scan)
+{
+    size_t all_runs, pruned_runs;
+    size_t all = scan.blocks_to_read(false, all_runs);
+    size_t pruned = scan.blocks_to_read(true, pruned_runs);
+    AccessPath path = BRIN_SCAN;
+    if (pruned < all && scan_cost(pruned, pruned_runs) > scan_cost(all, all_runs))
+        path = FULL_SCAN;
+    scan.set_use_brin(path == BRIN_SCAN);
+    return path;
+}
+
+double Optimizer::join_cost(double left_rows, double right_rows, double out_rows, bool equi)
+{
+    if (!equi)
+        return ROW_COST * left_rows * right_rows + ROW_COST * out_rows;
+    return BUILD_COST * std::min(left_rows, right_rows) + ROW_COST * std::max(left_rows, right_rows) +
+           ROW_COST * out_rows;
+}
+
+//------------------------join order----------------------------------------------
+
+// A predicate of order_joins: the inputs it refers to and what fraction of their
+// combined rows pass it.
+struct JoinPredicate {
+    std::vector<size_t> inputs;
+    std::vector<size_t> left_inputs;   // for an equality, those of each side
+    std::vector<size_t> right_inputs;
+    bool equi;
+    double selectivity;
+};
+
+static void inputs_of(const Expr *expr, const std::vector<JoinInput> &inputs, std::vector<size_t> &found, bool &located)
+{
+    if (expr == nullptr)
+        return;
+    if (expr->type == kExprColumnRef)
+    {
+        size_t input, column;
+        if (locate(expr, inputs, input, column))
+        {
+            if (std::find(found.begin(), found.end(), input) == found.end())
+                found.push_back(input);
+        }
+        else
+        {
+            located = false;
+        }
+        return;
+    }
+    inputs_of(expr->expr, inputs, found, located);
+    inputs_of(expr->expr2, inputs, found, located);
+    if (expr->exprList != nullptr)
+        for (auto const arg : *expr->exprList)
+            inputs_of(arg, inputs, found, located);
+}
+
+// Predicates whose columns aren't all in the inputs, or that have none, don't change
+// the order and are left out.
+static std::vector<JoinPredicate> describe_predicates(const std::vector<JoinInput> &inputs,
+                                                      const std::vector<const Expr *> &predicates)
+{
+    std::vector<JoinPredicate> described;
+    for (auto const expr : predicates)
+    {
+        JoinPredicate predicate;
+        bool located = true;
+        inputs_of(expr, inputs, predicate.inputs, located);
+        if (!located || predicate.inputs.empty())
+            continue;
+        predicate.equi = false;
+        if (expr->type == kExprOperator && comparison_of(expr) == EQUAL)
+        {
+            inputs_of(expr->expr, inputs, predicate.left_inputs, located);
+            inputs_of(expr->expr2, inputs, predicate.right_inputs, located);
+            predicate.equi = !predicate.left_inputs.empty() && !predicate.right_inputs.empty();
+            for (size_t input : predicate.left_inputs)
+                if (std::find(predicate.right_inputs.begin(), predicate.right_inputs.end(), input) !=
+                    predicate.right_inputs.end())
+                    predicate.equi = false;
+        }
+        predicate.selectivity = Optimizer::selectivity(expr, inputs);
+        described.push_back(predicate);
+    }
+    return described;
+}
+
+// Whether a group of inputs includes every one of some inputs; group is indexed by input.
+static bool within(const std::vector<size_t> &inputs, const std::vector<int> &group_of, int group)
+{
+    for (size_t input : inputs)
+        if (group_of[input] != group)
+            return false;
+    return true;
+}
+
+// Joining two groups of inputs: whether an equality between them can be hashed on, and the
+// selectivity of the predicates that first apply to them joined.
+static void join_groups(const std::vector<JoinPredicate> &predicates, const std::vector<int> &group_of,
+                        int left, int right, bool &equi, double &selectivity)
+{
+    equi = false;
+    selectivity = 1;
+    std::vector<int> joined(group_of);
+    for (auto &group : joined)
+        if (group == right)
+            group = left;
+    for (auto const &predicate : predicates)
+    {
+        if (!within(predicate.inputs, joined, left) || within(predicate.inputs, group_of, left) ||
+            within(predicate.inputs, group_of, right))
+            continue;
+        selectivity *= predicate.selectivity;
+        if (predicate.equi &&
+            ((within(predicate.left_inputs, group_of, left) && within(predicate.right_inputs, group_of, right)) ||
+             (within(predicate.left_inputs, group_of, right) && within(predicate.right_inputs, group_of, left))))
+            equi = true;
+    }
+}
+
+static std::unique_ptr<JoinTree> make_leaf(const std::vector<JoinInput> &inputs, size_t input)
+{
+    std::unique_ptr<JoinTree> leaf(new JoinTree());
+    leaf->input = (int)input;
+    leaf->rows = inputs[input].rows;
+    return leaf;
+}
+
+// Nested loops hold the right input in memory, so the smaller one goes there.
+static std::unique_ptr<JoinTree> make_join(std::unique_ptr<JoinTree> left, std::unique_ptr<JoinTree> right,
+                                           double rows, bool equi)
+{
+    if (!equi && left->rows < right->rows)
+        std::swap(left, right);
+    std::unique_ptr<JoinTree> join(new JoinTree());
+    join->build_left = left->rows < right->rows;
+    join->rows = rows;
+    join->cost = left->cost + right->cost + Optimizer::join_cost(left->rows, right->rows, rows, equi);
+    join->left = std::move(left);
+    join->right = std::move(right);
+    return join;
+}
+
+// Dynamic programming over the subsets of the inputs (as bit masks): the best tree for a
+// subset is the cheapest join of the best trees of two subsets that make it up.
+static std::unique_ptr<JoinTree> order_exhaustively(const std::vector<JoinInput> &inputs,
+                                                    const std::vector<JoinPredicate> &predicates)
+{
+    size_t n = inputs.size();
+    unsigned all = (1u << n) - 1;
+    std::vector<double> rows(all + 1, 0), cost(all + 1, 0);
+    std::vector<unsigned> split(all + 1, 0);
+    std::vector<bool> equi(all + 1, false);
+    for (unsigned mask = 1; mask <= all; mask++)
+    {
+        rows[mask] = 1;
+        for (size_t i = 0; i < n; i++)
+            if (mask & (1u << i))
+                rows[mask] *= inputs[i].rows;
+        for (auto const &predicate : predicates)
+        {
+            bool inside = true;
+            for (size_t input : predicate.inputs)
+                inside = inside && (mask & (1u << input)) != 0;
+            if (inside)
+                rows[mask] *= predicate.selectivity;
+        }
+    }
+
+    std::vector<int> group_of(n);
+    for (unsigned mask = 1; mask <= all; mask++)
+    {
+        if ((mask & (mask - 1)) == 0)
+            continue;  // a single input
+        unsigned lowest = mask & (~mask + 1);
+        bool found = false;
+        // the left side has the lowest input, so each split is tried once
+        for (unsigned left = (mask - 1) & mask; left != 0; left = (left - 1) & mask)
+        {
+            if ((left & lowest) == 0)
+                continue;
+            unsigned right = mask ^ left;
+            for (size_t i = 0; i < n; i++)
+                group_of[i] = (left & (1u << i)) ? 0 : (right & (1u << i)) ? 1 : 2;
+            bool hashed;
+            double selectivity;
+            join_groups(predicates, group_of, 0, 1, hashed, selectivity);
+            double total = cost[left] + cost[right] + Optimizer::join_cost(rows[left], rows[right], rows[mask], hashed);
+            if (!found || total < cost[mask])
+            {
+                found = true;
+                cost[mask] = total;
+                split[mask] = left;
+                equi[mask] = hashed;
+            }
+        }
+    }
+
+    std::function<std::unique_ptr<JoinTree>(unsigned)> build = [&](unsigned mask) {
+        if ((mask & (mask - 1)) == 0)
+        {
+            size_t input = 0;
+            while ((mask & (1u << input)) == 0)
+                input++;
+            return make_leaf(inputs, input);
+        }
+        return make_join(build(split[mask]), build(mask ^ split[mask]), rows[mask], equi[mask]);
+    };
+    return build(all);
+}
+
+// Repeatedly joins the two trees whose join has the fewest rows.
+static std::unique_ptr<JoinTree> order_greedily(const std::vector<JoinInput> &inputs,
+                                                const std::vector<JoinPredicate> &predicates)
+{
+    std::vector<std::unique_ptr<JoinTree>> trees;
+    std::vector<int> group_of(inputs.size());
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        trees.push_back(make_leaf(inputs, i));
+        group_of[i] = (int)i;
+    }
+    // trees[g] is the tree of group g, or nullptr once it is joined into another
+    for (size_t joins = 1; joins < inputs.size(); joins++)
+    {
+        int best_left = -1, best_right = -1;
+        bool best_equi = false;
+        double best_rows = 0;
+        for (size_t left = 0; left < trees.size(); left++)
+        {
+            for (size_t right = left + 1; right < trees.size() && trees[left] != nullptr; right++)
+            {
+                if (trees[right] == nullptr)
+                    continue;
+                bool equi;
+                double selectivity;
+                join_groups(predicates, group_of, (int)left, (int)right, equi, selectivity);
+                double rows = trees[left]->rows * trees[right]->rows * selectivity;
+                if (best_left < 0 || rows < best_rows)
+                {
+                    best_left = (int)left;
+                    best_right = (int)right;
+                    best_rows = rows;
+                    best_equi = equi;
+                }
+            }
+        }
+        trees[best_left] = make_join(std::move(trees[best_left]), std::move(trees[best_right]), best_rows, best_equi);
+        for (auto &group : group_of)
+            if (group == best_right)
+                group = best_left;
+    }
+    return std::move(trees[0]);
+}
+
+std::unique_ptr<JoinTree> Optimizer::order_joins(const std::vector<JoinInput> &inputs,
+                                                 const std::vector<const Expr *> &predicates)
+{
+    if (inputs.empty())
+        return nullptr;
+    std::vector<JoinPredicate> described = describe_predicates(inputs, predicates);
+    if (inputs.size() <= MAX_DP_INPUTS)
+        return order_exhaustively(inputs, described);
+    return order_greedily(inputs, described);
+}
+
+//------------------------tests----------------------------------------------
+
+static JoinInput make_input(const Identifier &name, double rows)
+{
+    JoinInput input;
+    input.column_names = {name + ".id", name + ".k"};
+    input.rows = rows;
+    return input;
+}
+
+// Every input is a leaf of the tree exactly once.
+static void collect_leaves(const JoinTree *tree, std::vector<int> &leaves)
+{
+    if (tree->input >= 0)
+    {
+        leaves.push_back(tree->input);
+        return;
+    }
+    collect_leaves(tree->left.get(), leaves);
+    collect_leaves(tree->right.get(), leaves);
+}
+
+static bool covers_inputs(const JoinTree *tree, size_t inputs)
+{
+    std::vector<int> leaves;
+    collect_leaves(tree, leaves);
+    std::sort(leaves.begin(), leaves.end());
+    for (size_t i = 0; i < leaves.size(); i++)
+        if (leaves[i] != (int)i)
+            return false;
+    return leaves.size() == inputs;
+}
+
+// t(id, grp) with 10000 rows, id unique and grp = id % 20
+static bool test_selectivity()
+{
+    const int32_t ROWS = 10000;
+    ColumnNames column_names = {"id", "grp"};
+    ColumnAttributes column_attributes = {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::INT)};
+    HeapTable table("_test_optimizer_cpp", column_names, column_attributes);
+    table.create_if_not_exists();
+    ValueDict row;
+    for (int32_t i = 0; i < ROWS; i++)
+    {
+        row["id"] = Value(i);
+        row["grp"] = Value(i % 20);
+        table.insert(&row);
+    }
+    JoinInput input;
+    input.column_names = qualify(column_names, "t");
+    input.table_column_names = column_names;
+    input.stats = TableStats::analyze(table);
+    input.rows = ROWS;
+    table.drop();
+    std::vector<JoinInput> inputs = {input};
+
+    Expr *below = make_op(make_column("t", "id"), '<', make_int(ROWS / 10));
+    Expr *above = make_op(make_int(ROWS / 2), '<', make_column("t", "id"));
+    Expr *group = make_op(make_column("t", "grp"), '=', make_int(3));
+    Expr *both = new Expr(kExprOperator);
+    both->opType = Expr::AND;
+    both->expr = make_op(make_column("t", "id"), '<', make_int(ROWS / 10));
+    both->expr2 = make_op(make_column("t", "grp"), '=', make_int(3));
+    Expr *self = make_op(make_column("t", "id"), '=', make_column("t", "grp"));
+    double s_below = Optimizer::selectivity(below, inputs), s_above = Optimizer::selectivity(above, inputs),
+           s_group = Optimizer::selectivity(group, inputs), s_both = Optimizer::selectivity(both, inputs),
+           s_self = Optimizer::selectivity(self, inputs);
+    bool ok = std::fabs(s_below - 0.1) < 0.03 && std::fabs(s_above - 0.5) < 0.05 && std::fabs(s_group - 0.05) < 0.01 &&
+              std::fabs(s_both - s_below * s_group) < 1e-9 && s_self > 0.5 / ROWS && s_self < 2.0 / ROWS;
+
+    // two bounds on one column are one range, not independent predicates
+    Expr *from = make_op(make_int(ROWS / 2), '<', make_column("t", "id"));
+    Expr *to = make_op(make_column("t", "id"), '<', make_int(ROWS / 2 + ROWS / 100));
+    double s_range = Optimizer::selectivity(std::vector<const Expr *>{from, to}, inputs);
+    ok = ok && std::fabs(s_range - 0.01) < 0.005;
+
+    // without statistics, the old guess
+    inputs[0].stats = nullptr;
+    ok = ok && std::fabs(Optimizer::selectivity(below, inputs) - Optimizer::DEFAULT_SELECTIVITY) < 1e-9 &&
+         std::fabs(Optimizer::selectivity(std::vector<const Expr *>{below, group}, inputs) -
+                   Optimizer::DEFAULT_SELECTIVITY * Optimizer::DEFAULT_SELECTIVITY) < 1e-9;
+    delete below;
+    delete above;
+    delete from;
+    delete to;
+    delete group;
+    delete both;
+    delete self;
+    if (!ok)
+    {
+        std::cout << "selectivity: id < " << ROWS / 10 << " " << s_below << ", id > " << ROWS / 2 << " " << s_above
+                  << ", grp = 3 " << s_group << ", id = grp " << s_self << ", range " << s_range << std::endl;
+        return false;
+    }
+    std::cout << "selectivity ok (" << s_below << ", " << s_above << ", " << s_group << ")" << std::endl;
+    return true;
+}
+
+// A star around a big fact table f: the small, filtered dimension d2 joins first, and each
+// hash join builds on its smaller input.
+static bool test_join_order()
+{
+    std::vector<JoinInput> inputs = {make_input("f", 1000000), make_input("d1", 5000), make_input("d2", 10),
+                                     make_input("d3", 200)};
+    std::vector<Expr *> exprs = {make_op(make_column("f", "k"), '=', make_column("d1", "id")),
+                                 make_op(make_column("d2", "id"), '=', make_column("f", "id")),
+                                 make_op(make_column("f", "k"), '=', make_column("d3", "k"))};
+    std::vector<const Expr *> predicates(exprs.begin(), exprs.end());
+    std::unique_ptr<JoinTree> tree = Optimizer::order_joins(inputs, predicates);
+
+    // the joins of two tables, and whether every join builds on its smaller input
+    std::vector<std::vector<int>> first_joins;
+    bool builds_smaller = true;
+    std::function<void(const JoinTree *)> check = [&](const JoinTree *join) {
+        if (join->input >= 0)
+            return;
+        builds_smaller = builds_smaller && join->build_left == (join->left->rows < join->right->rows);
+        if (join->left->input >= 0 && join->right->input >= 0)
+        {
+            std::vector<int> pair = {join->left->input, join->right->input};
+            std::sort(pair.begin(), pair.end());
+            first_joins.push_back(pair);
+        }
+        check(join->left.get());
+        check(join->right.get());
+    };
+    check(tree.get());
+    bool ok = covers_inputs(tree.get(), inputs.size()) && first_joins == std::vector<std::vector<int>>({{0, 2}}) &&
+              builds_smaller && tree->rows < 20;
+
+    // with no predicates, cross products still cover everything
+    std::unique_ptr<JoinTree> cross = Optimizer::order_joins(inputs, std::vector<const Expr *>());
+    ok = ok && covers_inputs(cross.get(), inputs.size()) && std::fabs(cross->rows - 1e6 * 5000 * 10 * 200) < 1;
+
+    // beyond MAX_DP_INPUTS, greedily: a chain of 12 tables, each joined on the next
+    std::vector<JoinInput> chain;
+    std::vector<std::string> names;
+    for (size_t i = 0; i < 12; i++)
+        names.push_back("c" + std::to_string(i));
+    for (size_t i = 0; i < 12; i++)
+        chain.push_back(make_input(names[i], (double)(100 * (i + 1))));
+    std::vector<Expr *> links;
+    for (size_t i = 0; i + 1 < 12; i++)
+        links.push_back(make_op(make_column(names[i].c_str(), "k"), '=', make_column(names[i + 1].c_str(), "id")));
+    std::vector<const Expr *> link_predicates(links.begin(), links.end());
+    std::unique_ptr<JoinTree> greedy = Optimizer::order_joins(chain, link_predicates);
+    ok = ok && covers_inputs(greedy.get(), chain.size()) && greedy->rows < 2000;
+
+    for (auto expr : exprs)
+        delete expr;
+    for (auto expr : links)
+        delete expr;
+    if (!ok)
+    {
+        std::cout << "join order: " << tree->rows << " rows at cost " << tree->cost << ", greedy chain "
+                  << greedy->rows << " rows" << std::endl;
+        return false;
+    }
+    std::cout << "join order ok (cost " << tree->cost << ", greedy chain cost " << greedy->cost << ")" << std::endl;
+    return true;
+}
+
+// Rows appended in ts order, then a table whose low and high values alternate block by
+// block: a narrow range is worth the index, but half of every other block isn't.
+static bool test_access_path()
+{
+    ColumnNames column_names = {"ts", "payload"};
+    ColumnAttributes column_attributes = {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)};
+    const int32_t ROWS = 4000, HIGH = 1000000;
+    ValueDict row;
+    row["payload"] = Value(std::string(100, 'p'));
+
+    // how many rows of this size fill a block
+    size_t rows_per_block = 0;
+    {
+        HeapTable scratch("_test_optimizer_scratch", column_names, column_attributes);
+        scratch.create_if_not_exists();
+        row["ts"] = Value(0);
+        while (scratch.insert(&row).first == 1)
+            rows_per_block++;
+        scratch.drop();
+    }
+
+    bool ok = rows_per_block > 0;
+    for (int alternating = 0; alternating < 2 && ok; alternating++)
+    {
+        HeapTable table("_test_optimizer_cpp", column_names, column_attributes);
+        table.create_if_not_exists();
+        for (int32_t i = 0; i < ROWS; i++)
+        {
+            bool odd_block = (i / rows_per_block) % 2 == 1;
+            row["ts"] = Value(alternating && odd_block ? HIGH + i : i);
+            table.insert(&row);
+        }
+        table.add_brin_index("_test_optimizer_ts", "ts", 1);
+        BatchTableScan scan(table);
+        Expr *expr = make_op(make_column("t", "ts"), '<', make_int(alternating ? HIGH : (int64_t)rows_per_block));
+        scan.add_filter(BatchPredicate::compile(expr, scan.get_column_names(), scan.get_column_attributes()), expr);
+        Optimizer::AccessPath path = Optimizer::choose_access_path(scan);
+        size_t rows = 0;
+        RowBatch batch;
+        scan.open();
+        while (scan.next(batch))
+            rows += batch.size;
+        scan.close();
+        size_t expected = 0;
+        for (int32_t i = 0; i < ROWS; i++)
+            if (alternating ? (i / rows_per_block) % 2 == 0 : (size_t)i < rows_per_block)
+                expected++;
+        ok = path == (alternating ? Optimizer::FULL_SCAN : Optimizer::BRIN_SCAN) && scan.get_use_brin() == !alternating &&
+             (alternating ? scan.get_blocks_skipped() == 0 : scan.get_blocks_skipped() > 0) && rows == expected;
+        if (!ok)
+            std::cout << "access path " << (path == Optimizer::FULL_SCAN ? "full scan" : "brin scan") << " for "
+                      << (alternating ? "alternating" : "ordered") << " blocks, " << scan.get_blocks_skipped()
+                      << " skipped" << std::endl;
+        delete expr;
+        table.drop();
+    }
+    if (!ok)
+        return false;
+    std::cout << "access path ok (" << rows_per_block << " rows per block)" << std::endl;
+    return true;
+}
+
+// test function -- returns true if all tests pass
+bool test_optimizer()
+{
+    std::cout << "\nTesting Optimizer...." << std::endl;
+    return test_selectivity() && test_join_order() && test_access_path();
+}
@@ -0,0 +1,400 @@
+/**
+ * Implementation of the plan cache declared in PlanCache.h.
+ */
+
+#include "PlanCache.h"
+#include "SqlExecutor.h"
+#include "ResultSink.h"
+#include "Metrics.h"
+#include <cctype>
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+
+using namespace hsql;
+
+static std::string upper(const std::string &word)
+{
+    std::string result;
+    for (char c : word)
+        result += (char)toupper((unsigned char)c);
+    return result;
+}
+
+static bool is_identifier_char(char c)
+{
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+// Copies a quoted token (with '' or "" as an escaped quote) starting at sql[i]; returns the index after it.
+static size_t scan_quoted(const std::string &sql, size_t i, std::string *contents)
+{
+    char quote = sql[i++];
+    while (i < sql.size())
+    {
+        if (sql[i] == quote)
+        {
+            if (i + 1 < sql.size() && sql[i + 1] == quote)
+            {
+                if (contents != nullptr)
+                    *contents += quote;
+                i += 2;
+                continue;
+            }
+            return i + 1;
+        }
+        if (contents != nullptr)
+            *contents += sql[i];
+        i++;
+    }
+    return i;
+}
+
+bool normalize_sql(const std::string &sql, std::string &normalized, std::vector<Value> &parameters)
+{
+    normalized.clear();
+    parameters.clear();
+    bool in_order_by = false;   // positions in ORDER BY are part of the statement's shape
+    std::string previous_word;  // last keyword/identifier, upper-cased
+    bool pending_space = false;
+
+    size_t i = 0;
+    while (i < sql.size())
+    {
+        char c = sql[i];
+        if (isspace((unsigned char)c))
+        {
+            pending_space = !normalized.empty();
+            i++;
+            continue;
+        }
+        if (pending_space)
+            normalized += ' ';
+        pending_space = false;
+
+        if (c == '?')
+            return false;
+
+        if (c == '\'')
+        {
+            std::string contents;
+            size_t end = scan_quoted(sql, i, &contents);
+            parameters.push_back(Value(contents));
+            normalized += '?';
+            i = end;
+            previous_word.clear();
+            continue;
+        }
+
+        if (c == '"')
+        {
+            size_t end = scan_quoted(sql, i, nullptr);
+            normalized.append(sql, i, end - i);
+            i = end;
+            previous_word.clear();
+            continue;
+        }
+
+        if (isdigit((unsigned char)c))
+        {
+            size_t end = i;
+            while (end < sql.size() && isdigit((unsigned char)sql[end]))
+                end++;
+            bool is_float = end < sql.size() && (sql[end] == '.' || is_identifier_char(sql[end]));
+            bool too_long = end - i > 18;  // left for the parser to deal with
+            // and one too big for an INT for the executor to reject, rather than bound truncated
+            bool too_big = !is_float && !too_long && std::stoll(sql.substr(i, end - i)) > INT32_MAX;
+            bool keep = is_float || too_long || too_big || in_order_by || previous_word == "LIMIT" || previous_word == "OFFSET";
+            if (is_float)
+                while (end < sql.size() && (is_identifier_char(sql[end]) || sql[end] == '.'))
+                    end++;
+            if (keep)
+            {
+                normalized.append(sql, i, end - i);
+            }
+            else
+            {
+                parameters.push_back(Value((int32_t)std::stoll(sql.substr(i, end - i))));
+                normalized += '?';
+            }
+            i = end;
+            previous_word.clear();
+            continue;
+        }
+
+        if (is_identifier_char(c))
+        {
+            size_t end = i;
+            while (end < sql.size() && is_identifier_char(sql[end]))
+                end++;
+            std::string word = sql.substr(i, end - i);
+            normalized += word;
+            std::string keyword = upper(word);
+            if (keyword == "BY" && previous_word == "ORDER")
+                in_order_by = true;
+            else if (keyword == "LIMIT" || keyword == "OFFSET")
+                in_order_by = false;
+            previous_word = keyword;
+            i = end;
+            continue;
+        }
+
+        // punctuation and operators; a comma keeps us in the same clause
+        normalized += c;
+        if (c != ',')
+            previous_word.clear();
+        if (c == ';')
+            in_order_by = false;
+        i++;
+    }
+    return true;
+}
+
+size_t count_placeholders(const std::string &sql)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < sql.size();)
+    {
+        if (sql[i] == '\'' || sql[i] == '"')
+        {
+            i = scan_quoted(sql, i, nullptr);
+            continue;
+        }
+        if (sql[i] == '?')
+            count++;
+        i++;
+    }
+    return count;
+}
+
+//------------------------PreparedStatement----------------------------------------------
+
+PreparedStatement::PreparedStatement(SQLParserResult *parse, size_t parameter_count)
+    : parse(parse), plan(nullptr), parameter_count(parameter_count), catalog_version(0)
+{
+}
+
+PreparedStatement::~PreparedStatement()
+{
+    delete plan;
+    delete parse;
+}
+
+void PreparedStatement::invalidate()
+{
+    delete plan;
+    plan = nullptr;
+    tables.clear();
+}
+
+//------------------------PlanCache----------------------------------------------
+
+PlanCache::PlanCache(size_t capacity) : capacity(capacity), hits(0), misses(0)
+{
+}
+
+std::shared_ptr<PreparedStatement> PlanCache::find(const std::string &normalized_sql)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = entries.find(normalized_sql);
+    if (it == entries.end())
+    {
+        misses++;
+        return nullptr;
+    }
+    hits++;
+    recency.splice(recency.begin(), recency, it->second.recency);
+    return it->second.statement;
+}
+
+void PlanCache::insert(const std::string &normalized_sql, std::shared_ptr<PreparedStatement> statement)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = entries.find(normalized_sql);
+    if (it != entries.end())
+    {
+        it->second.statement = statement;
+        recency.splice(recency.begin(), recency, it->second.recency);
+        return;
+    }
+    if (capacity == 0)
+        return;
+    if (entries.size() >= capacity)
+    {
+        entries.erase(recency.back());
+        recency.pop_back();
+    }
+    recency.push_front(normalized_sql);
+    entries[normalized_sql] = Entry{statement, recency.begin()};
+}
+
+// Statements still being run elsewhere keep their plan alive through their shared_ptr.
+void PlanCache::invalidate(const Identifier &table_name)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto it = entries.begin(); it != entries.end();)
+    {
+        if (it->second.statement->tables.count(table_name) > 0)
+        {
+            recency.erase(it->second.recency);
+            it = entries.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+void PlanCache::clear()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    entries.clear();
+    recency.clear();
+}
+
+size_t PlanCache::size()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return entries.size();
+}
+
+//------------------------tests----------------------------------------------
+
+static bool check_normalize(const std::string &sql, const std::string &expected, size_t expected_parameters)
+{
+    std::string normalized;
+    std::vector<Value> parameters;
+    if (!normalize_sql(sql, normalized, parameters) || normalized != expected ||
+        parameters.size() != expected_parameters)
+    {
+        std::cout << "normalize_sql(" << sql << ") gave " << normalized << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Runs a statement, returning what it wrote and its error, if any.
+static std::string run_literal(SqlExecutor &executor, const std::string &sql, std::string &error)
+{
+    std::ostringstream out;
+    error.clear();
+    try
+    {
+        TextSink sink(out);
+        executor.execute(sql, sink);
+    }
+    catch (SQLExecError &e)
+    {
+        error = e.what();
+    }
+    return out.str();
+}
+
+// Statements sharing a cached plan, and EXPLAIN of them, still show their own literals.
+static bool test_literals()
+{
+    SqlExecutor executor;
+    std::string error;
+    std::string one = run_literal(executor, "SELECT sum(1 + 1) FROM _tables WHERE table_name = '_columns'", error);
+    std::string two = run_literal(executor, "SELECT sum(2 + 1) FROM _tables WHERE table_name = '_columns'", error);
+    if (one.find("sum((1 + 1))") == std::string::npos || two.find("sum((2 + 1))") == std::string::npos ||
+        two.find("3") == std::string::npos || two.find('$') != std::string::npos)
+    {
+        std::cout << "labels: " << one << two << std::endl;
+        return false;
+    }
+    std::string wrong = run_literal(executor, "SELECT * FROM _tables WHERE table_name = 5", error);
+    if (!wrong.empty() || error != "5 is not a TEXT")
+    {
+        std::cout << "type error: " << wrong << error << std::endl;
+        return false;
+    }
+    std::string explained = run_literal(executor, "EXPLAIN SELECT * FROM _tables WHERE table_name = '_columns'", error);
+    if (explained.find("table_name = '_columns'") == std::string::npos || explained.find('$') != std::string::npos)
+    {
+        std::cout << "explain: " << explained << error << std::endl;
+        return false;
+    }
+    std::string big = run_literal(executor, "SELECT 3000000000", error);
+    if (error != "integer 3000000000 is out of range for an INT")
+    {
+        std::cout << "out of range: " << big << error << std::endl;
+        return false;
+    }
+    std::cout << "literals ok" << std::endl;
+    return true;
+}
+
+static uint64_t plans_rebuilt()
+{
+    std::vector<uint64_t> counters;
+    std::vector<LatencyHistogram> histograms;
+    Metrics::snapshot(counters, histograms);
+    return counters[PLANS_REBUILT];
+}
+
+// A statement prepared in one session is planned again after another session indexes its
+// table (which shows in the metrics, when they're compiled in).
+static bool test_replan()
+{
+    SqlExecutor one, two;
+    one.execute("CREATE TABLE _test_replan (a INT)");
+    for (int i = 1; i <= 3; i++)
+        one.execute("INSERT INTO _test_replan VALUES (" + std::to_string(i) + ")");
+    one.execute("PREPARE _test_replan_ones AS SELECT * FROM _test_replan WHERE a = ?");
+    std::string before = one.execute("EXECUTE _test_replan_ones (1)");
+    two.execute("CREATE INDEX _test_replan_a ON _test_replan USING BRIN (a)");
+    uint64_t rebuilt = plans_rebuilt();
+    std::string after = one.execute("EXECUTE _test_replan_ones (1)");
+    one.execute("EXECUTE _test_replan_ones (2)");
+    rebuilt = plans_rebuilt() - rebuilt;
+    one.execute("DROP TABLE _test_replan");
+    if (after != before || after.find("successfully returned 1 rows") == std::string::npos ||
+        (Metrics::enabled() && rebuilt != 1))
+    {
+        std::cout << "replan: " << after << " (" << rebuilt << " plans rebuilt)" << std::endl;
+        return false;
+    }
+    std::cout << "replan ok" << std::endl;
+    return true;
+}
+
+// test function -- returns true if all tests pass
+bool test_plan_cache()
+{
+    std::cout << "\nTesting PlanCache...." << std::endl;
+    if (!check_normalize("SELECT a,  b FROM t WHERE a = 12 AND b = 'it''s'", "SELECT a, b FROM t WHERE a = ? AND b = ?", 2) ||
+        !check_normalize("select * from t1 where x > 3 order by 2, a desc limit 10 offset 5",
+                         "select * from t1 where x > ? order by 2, a desc limit 10 offset 5", 1) ||
+        !check_normalize("INSERT INTO t VALUES (1, \"quoted id\", 'x')", "INSERT INTO t VALUES (?, \"quoted id\", ?)", 2))
+        return false;
+    std::string normalized;
+    std::vector<Value> parameters;
+    normalize_sql("select 'a b', 42", normalized, parameters);
+    if (parameters[0].s != "a b" || parameters[1].n != 42)
+        return false;
+    if (normalize_sql("select * from t where a = ?", normalized, parameters) ||
+        count_placeholders("select '?' from t where a = ? and b = ?") != 2)
+        return false;
+    std::cout << "normalize ok" << std::endl;
+
+    PlanCache cache(2);
+    auto a = std::make_shared<PreparedStatement>(nullptr, 0);
+    auto b = std::make_shared<PreparedStatement>(nullptr, 0);
+    auto c = std::make_shared<PreparedStatement>(nullptr, 0);
+    a->tables.insert("t");
+    b->tables.insert("u");
+    c->tables.insert("t");
+    cache.insert("a", a);
+    cache.insert("b", b);
+    cache.find("a");
+    cache.insert("c", c);  // evicts b, the least recently used
+    if (cache.find("b") != nullptr || cache.find("a") != a || cache.find("c") != c || cache.size() != 2)
+        return false;
+    cache.invalidate("t");
+    if (cache.size() != 0 || cache.get_hits() != 3 || cache.get_misses() != 1)
+        return false;
+    std::cout << "cache ok" << std::endl;
+    return test_literals() && test_replan();
+}
@@ -0,0 +1,1159 @@
+/**
+ * Implementation of the physical plan operators declared in QueryPlan.h.
+ */
+
+#include "QueryPlan.h"
+#include "TestExprs.h"
+#include "schema_tables.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+using namespace hsql;
+
+//------------------------expression evaluation----------------------------------
+
+// Finds a column reference in the row, trying "table.name" and then the bare name.
+static const Value &lookup_column(const Expr *expr, const ValueDict &row)
+{
+    if (expr->hasTable())
+    {
+        auto qualified = row.find(std::string(expr->table) + "." + expr->name);
+        if (qualified != row.end())
+            return qualified->second;
+    }
+    auto it = row.find(expr->name);
+    if (it != row.end())
+        return it->second;
+
+    // an unqualified name may still match exactly one qualified column (e.g., from a join)
+    std::string suffix = std::string(".") + expr->name;
+    const Value *found = nullptr;
+    for (auto const &column : row)
+    {
+        const Identifier &key = column.first;
+        if (key.size() > suffix.size() && key.compare(key.size() - suffix.size(), suffix.size(), suffix) == 0)
+        {
+            if (found != nullptr)
+                throw SQLExecError("column '" + std::string(expr->name) + "' is ambiguous");
+            found = &column.second;
+        }
+    }
+    if (found == nullptr)
+        throw SQLExecError("unknown column '" + std::string(expr->name) + "'");
+    return *found;
+}
+
+// NULL, 0 and '' are false.
+static bool truth(const Value &value)
+{
+    if (value.is_null)
+        return false;
+    return value.data_type == ColumnAttribute::INT ? value.n != 0 : !value.s.empty();
+}
+
+// Callers check for NULLs first; any comparison with NULL is NULL.
+static int compare_values(const Value &left, const Value &right)
+{
+    if (left.data_type != right.data_type)
+        throw SQLExecError("cannot compare INT with TEXT");
+    if (left.data_type == ColumnAttribute::INT)
+        return left.n < right.n ? -1 : (left.n > right.n ? 1 : 0);
+    return left.s.compare(right.s);
+}
+
+// Evaluates a comparison, which is NULL if either side is.
+static Value compare(const Expr *expr, const ValueDict &row, bool (*test)(int))
+{
+    Value left = evaluate(expr->expr, row);
+    Value right = evaluate(expr->expr2, row);
+    if (left.is_null || right.is_null)
+        return Value::null();
+    return Value(test(compare_values(left, right)) ? 1 : 0);
+}
+
+static int32_t int_operand(const Value &value)
+{
+    if (value.data_type != ColumnAttribute::INT)
+        throw SQLExecError("arithmetic requires INT operands");
+    return value.n;
+}
+
+// AND and OR in three-valued logic: FALSE decides an AND and TRUE an OR whatever the other
+// side is (which then isn't evaluated); otherwise a NULL on either side makes the result NULL.
+static Value evaluate_logical(const Expr *expr, const ValueDict &row)
+{
+    bool deciding = expr->opType == Expr::OR;
+    Value left = evaluate(expr->expr, row);
+    if (!left.is_null && truth(left) == deciding)
+        return Value(deciding ? 1 : 0);
+    Value right = evaluate(expr->expr2, row);
+    if (!right.is_null && truth(right) == deciding)
+        return Value(deciding ? 1 : 0);
+    if (left.is_null || right.is_null)
+        return Value::null();
+    return Value(deciding ? 0 : 1);
+}
+
+// Arithmetic is done in 64 bits; a result that doesn't fit back in an INT is an error
+// (this covers INT_MIN / -1, too, which would trap if done in 32).
+static Value checked_result(int64_t n, const Expr *expr)
+{
+    if (n < INT32_MIN || n > INT32_MAX)
+        throw SQLExecError("integer overflow in " + with_literals(expression_text(expr)));
+    return Value((int32_t)n);
+}
+
+static Value evaluate_operator(const Expr *expr, const ValueDict &row)
+{
+    switch (expr->opType)
+    {
+    case Expr::AND:
+    case Expr::OR:
+        return evaluate_logical(expr, row);
+    case Expr::NOT:
+    {
+        Value operand = evaluate(expr->expr, row);
+        return operand.is_null ? operand : Value(truth(operand) ? 0 : 1);
+    }
+    case Expr::UMINUS:
+    {
+        Value operand = evaluate(expr->expr, row);
+        return operand.is_null ? operand : checked_result(-(int64_t)int_operand(operand), expr);
+    }
+    case Expr::NOT_EQUALS:
+        return compare(expr, row, [](int cmp) { return cmp != 0; });
+    case Expr::LESS_EQ:
+        return compare(expr, row, [](int cmp) { return cmp <= 0; });
+    case Expr::GREATER_EQ:
+        return compare(expr, row, [](int cmp) { return cmp >= 0; });
+    case Expr::SIMPLE_OP:
+        break;
+    default:
+        throw SQLExecError("unsupported operator");
+    }
+
+    switch (expr->opChar)
+    {
+    case '=':
+        return compare(expr, row, [](int cmp) { return cmp == 0; });
+    case '<':
+        return compare(expr, row, [](int cmp) { return cmp < 0; });
+    case '>':
+        return compare(expr, row, [](int cmp) { return cmp > 0; });
+    default:
+        break;
+    }
+
+    Value left = evaluate(expr->expr, row);
+    Value right = evaluate(expr->expr2, row);
+    if (left.is_null || right.is_null)
+        return Value::null();
+    int64_t a = int_operand(left);
+    int64_t b = int_operand(right);
+    switch (expr->opChar)
+    {
+    case '+':
+        return checked_result(a + b, expr);
+    case '-':
+        return checked_result(a - b, expr);
+    case '*':
+        return checked_result(a * b, expr);
+    case '/':
+    case '%':
+        if (b == 0)
+            throw SQLExecError("division by zero");
+        return checked_result(expr->opChar == '/' ? a / b : a % b, expr);
+    default:
+        throw SQLExecError(std::string("unsupported operator '") + expr->opChar + "'");
+    }
+}
+
+static thread_local const std::vector<Value> *bound_parameters = nullptr;
+static thread_local bool bound_literals = false;
+
+void bind_parameters(const std::vector<Value> *parameters, bool literals)
+{
+    bound_parameters = parameters;
+    bound_literals = parameters != nullptr && literals;
+}
+
+// The nth bound literal as it was written, or "" if there isn't one.
+static std::string bound_literal(size_t n)
+{
+    if (!bound_literals || n >= bound_parameters->size())
+        return "";
+    const Value &value = (*bound_parameters)[n];
+    if (value.is_null)
+        return "NULL";
+    if (value.data_type == ColumnAttribute::INT)
+        return std::to_string(value.n);
+    return "'" + value.s + "'";  // as expression_text renders a string literal
+}
+
+std::string parameter_text(const Expr *placeholder)
+{
+    std::string literal = placeholder->ival < 0 ? "" : bound_literal((size_t)placeholder->ival);
+    return literal.empty() ? "parameter " + std::to_string(placeholder->ival + 1) : literal;
+}
+
+std::string with_literals(const std::string &text)
+{
+    if (!bound_literals)
+        return text;
+    std::string result;
+    size_t i = 0;
+    while (i < text.size())
+    {
+        size_t end = i + 1;
+        while (text[i] == '$' && end < text.size() && isdigit((unsigned char)text[end]))
+            end++;
+        std::string literal = end > i + 1 ? bound_literal(std::stoul(text.substr(i + 1, end - i - 1)) - 1) : "";
+        if (literal.empty())
+            result.append(text, i, end - i);
+        else
+            result += literal;
+        i = end;
+    }
+    return result;
+}
+
+Value evaluate(const Expr *expr, const ValueDict &row)
+{
+    switch (expr->type)
+    {
+    case kExprLiteralInt:
+        if (expr->ival < INT32_MIN || expr->ival > INT32_MAX)
+            throw SQLExecError("integer " + std::to_string(expr->ival) + " is out of range for an INT");
+        return Value((int32_t)expr->ival);
+    case kExprLiteralString:
+        return Value(std::string(expr->name));
+    case kExprColumnRef:
+        return lookup_column(expr, row);
+    case kExprOperator:
+        return evaluate_operator(expr, row);
+    case kExprPlaceholder:
+        if (bound_parameters == nullptr || expr->ival < 0 || (size_t)expr->ival >= bound_parameters->size())
+            throw SQLExecError("no value given for parameter " + std::to_string(expr->ival + 1));
+        return (*bound_parameters)[expr->ival];
+    case kExprFunctionRef:
+    {
+        // computed below us (e.g., by an aggregation) and passed up under its text
+        auto it = row.find(expression_text(expr));
+        if (it == row.end())
+            throw SQLExecError("function " + with_literals(expression_text(expr)) + " is not available here");
+        return it->second;
+    }
+    default:
+        throw SQLExecError("unsupported expression");
+    }
+}
+
+std::string expression_text(const Expr *expr)
+{
+    switch (expr->type)
+    {
+    case kExprStar:
+        return expr->table != nullptr ? std::string(expr->table) + ".*" : "*";
+    case kExprColumnRef:
+        return (expr->hasTable() ? std::string(expr->table) + "." : "") + expr->name;
+    case kExprLiteralInt:
+        return std::to_string(expr->ival);
+    case kExprLiteralString:
+        return "'" + std::string(expr->name) + "'";
+    case kExprPlaceholder:
+        return "$" + std::to_string(expr->ival + 1);  // numbered, so different parameters don't look alike
+    case kExprFunctionRef:
+    {
+        std::string text;
+        for (const char *c = expr->name; *c != '\0'; c++)
+            text += (char)tolower(*c);
+        text += "(";
+        if (expr->distinct)
+            text += "distinct ";
+        if (expr->exprList != nullptr)
+        {
+            for (size_t i = 0; i < expr->exprList->size(); i++)
+                text += (i > 0 ? ", " : "") + expression_text((*expr->exprList)[i]);
+        }
+        else if (expr->expr != nullptr)
+        {
+            text += expression_text(expr->expr);
+        }
+        return text + ")";
+    }
+    case kExprOperator:
+        switch (expr->opType)
+        {
+        case Expr::NOT:
+            return "NOT " + expression_text(expr->expr);
+        case Expr::UMINUS:
+            return "-" + expression_text(expr->expr);
+        case Expr::AND:
+            return "(" + expression_text(expr->expr) + " AND " + expression_text(expr->expr2) + ")";
+        case Expr::OR:
+            return "(" + expression_text(expr->expr) + " OR " + expression_text(expr->expr2) + ")";
+        case Expr::NOT_EQUALS:
+            return "(" + expression_text(expr->expr) + " <> " + expression_text(expr->expr2) + ")";
+        case Expr::LESS_EQ:
+            return "(" + expression_text(expr->expr) + " <= " + expression_text(expr->expr2) + ")";
+        case Expr::GREATER_EQ:
+            return "(" + expression_text(expr->expr) + " >= " + expression_text(expr->expr2) + ")";
+        case Expr::SIMPLE_OP:
+            return "(" + expression_text(expr->expr) + " " + expr->opChar + " " + expression_text(expr->expr2) + ")";
+        default:
+            return "(?)";
+        }
+    default:
+        return "?";
+    }
+}
+
+bool is_true(const Expr *expr, const ValueDict &row)
+{
+    return truth(evaluate(expr, row));
+}
+
+bool resolves_in(const Expr *expr, const ColumnNames &column_names)
+{
+    switch (expr->type)
+    {
+    case kExprLiteralInt:
+    case kExprLiteralString:
+    case kExprPlaceholder:
+        return true;
+    case kExprOperator:
+        return resolves_in(expr->expr, column_names) &&
+               (expr->expr2 == nullptr || resolves_in(expr->expr2, column_names));
+    case kExprColumnRef:
+        break;
+    default:
+        return false;
+    }
+
+    // t.a is t's column a, or a column a of a table whose columns aren't qualified, but
+    // never another table's a
+    if (expr->hasTable())
+    {
+        std::string qualified = std::string(expr->table) + "." + expr->name;
+        for (auto const &column_name : column_names)
+            if (column_name == qualified || column_name == expr->name)
+                return true;
+        return false;
+    }
+    std::string name = expr->name;
+    std::string suffix = "." + name;
+    int matches = 0;
+    for (auto const &column_name : column_names)
+        if (column_name == name ||
+            (column_name.size() > suffix.size() &&
+             column_name.compare(column_name.size() - suffix.size(), suffix.size(), suffix) == 0))
+            matches++;
+    return matches == 1;
+}
+
+void split_conjuncts(const Expr *expr, std::vector<const Expr *> &conjuncts)
+{
+    if (expr == nullptr)
+        return;
+    if (expr->type == kExprOperator && expr->opType == Expr::AND)
+    {
+        split_conjuncts(expr->expr, conjuncts);
+        split_conjuncts(expr->expr2, conjuncts);
+    }
+    else
+    {
+        conjuncts.push_back(expr);
+    }
+}
+
+ColumnNames qualify(const ColumnNames &column_names, const Identifier &qualifier)
+{
+    if (qualifier.empty())
+        return column_names;
+    ColumnNames qualified;
+    for (auto const &column_name : column_names)
+        qualified.push_back(qualifier + "." + column_name);
+    return qualified;
+}
+
+//------------------------PlanRun----------------------------------------------
+
+// If open() throws, what it did open is closed again.
+PlanRun::PlanRun(PlanOperator *plan) : plan(plan)
+{
+    try
+    {
+        plan->open();
+    }
+    catch (...)
+    {
+        close();
+        throw;
+    }
+}
+
+PlanRun::~PlanRun()
+{
+    try
+    {
+        close();
+    }
+    catch (...)
+    {
+        // already unwinding from the run's own error
+    }
+}
+
+void PlanRun::close()
+{
+    if (plan == nullptr)
+        return;
+    PlanOperator *closing = plan;
+    plan = nullptr;
+    closing->close();
+}
+
+//------------------------key encoding----------------------------------------------
+
+void encode_key(const Value &value, bool descending, std::string &key)
+{
+    size_t start = key.size();
+    if (value.is_null)
+    {
+        key.push_back('\x00');
+    }
+    else if (value.data_type == ColumnAttribute::INT)
+    {
+        // big-endian with the sign bit flipped, so negative numbers sort first
+        uint32_t bits = (uint32_t)value.n ^ 0x80000000u;
+        key.push_back('\x01');
+        for (int shift = 24; shift >= 0; shift -= 8)
+            key.push_back((char)((bits >> shift) & 0xff));
+    }
+    else
+    {
+        // 0x00 is escaped as 0x00 0xff and the string ends with 0x00 0x00,
+        // so a string sorts before any longer string it is a prefix of
+        key.push_back('\x02');
+        for (char c : value.s)
+        {
+            key.push_back(c);
+            if (c == '\x00')
+                key.push_back('\xff');
+        }
+        key.push_back('\x00');
+        key.push_back('\x00');
+    }
+    if (descending)
+        for (size_t i = start; i < key.size(); i++)
+            key[i] = ~key[i];
+}
+
+//------------------------TableScan----------------------------------------------
+
+TableScan::TableScan(DbRelation &relation, const Identifier &qualifier)
+    : relation(relation), qualifier(qualifier)
+{
+    column_names = qualify(relation.get_column_names(), qualifier);
+}
+
+std::string TableScan::get_name()
+{
+    std::string name = "TableScan " + relation.get_table_name();
+    if (!qualifier.empty() && qualifier != relation.get_table_name())
+        name += " AS " + qualifier;
+    return name;
+}
+
+TableScan::~TableScan()
+{
+    close();
+}
+
+void TableScan::open()
+{
+    close();
+    scan = relation.scan();
+}
+
+bool TableScan::next(ValueDict &row)
+{
+    Handle handle;
+    if (!scan->next(handle, input))
+        return false;
+    const ColumnNames &table_columns = relation.get_column_names();
+    row.clear();
+    for (size_t i = 0; i < table_columns.size(); i++)
+        row[column_names[i]] = input[table_columns[i]];
+    return true;
+}
+
+void TableScan::close()
+{
+    scan.reset();
+}
+
+//------------------------Values----------------------------------------------
+
+Values::Values(const ColumnNames &column_names, const std::vector<std::vector<Expr *>> &rows)
+    : rows(rows), position(0)
+{
+    this->column_names = column_names;
+}
+
+void Values::open()
+{
+    position = 0;
+}
+
+bool Values::next(ValueDict &row)
+{
+    if (position >= rows.size())
+        return false;
+    const std::vector<Expr *> &exprs = rows[position++];
+    if (exprs.size() != column_names.size())
+        throw SQLExecError("expected " + std::to_string(column_names.size()) + " values but got " +
+                           std::to_string(exprs.size()));
+    ValueDict empty;
+    row.clear();
+    for (size_t i = 0; i < exprs.size(); i++)
+        row[column_names[i]] = evaluate(exprs[i], empty);
+    return true;
+}
+
+void Values::close()
+{
+}
+
+//------------------------Filter----------------------------------------------
+
+Filter::Filter(PlanOperator *child, const Expr *predicate) : child(child), conjuncts(1, predicate), selectivity(-1)
+{
+    column_names = child->get_column_names();
+}
+
+Filter::Filter(PlanOperator *child, const std::vector<const Expr *> &conjuncts)
+    : child(child), conjuncts(conjuncts), selectivity(-1)
+{
+    column_names = child->get_column_names();
+}
+
+Filter::~Filter()
+{
+    delete child;
+}
+
+void Filter::open()
+{
+    child->open();
+}
+
+bool Filter::next(ValueDict &row)
+{
+    while (child->next(row))
+    {
+        bool passes = true;
+        for (auto const predicate : conjuncts)
+        {
+            if (!is_true(predicate, row))
+            {
+                passes = false;
+                break;
+            }
+        }
+        if (passes)
+            return true;
+    }
+    return false;
+}
+
+void Filter::close()
+{
+    child->close();
+}
+
+size_t Filter::estimated_rows()
+{
+    size_t rows = child->estimated_rows();
+    if (selectivity >= 0)
+        return (size_t)std::llround((double)rows * selectivity);
+    return rows / (conjuncts.empty() ? 1 : 3 * conjuncts.size());
+}
+
+void Filter::get_expressions(LabeledExpressions &expressions) const
+{
+    expressions.push_back(std::make_pair("filter", conjuncts));
+}
+
+//------------------------Project----------------------------------------------
+
+Project::Project(PlanOperator *child, const std::vector<Expr *> &select_list) : child(child)
+{
+    for (auto const expr : select_list)
+    {
+        if (expr->type == kExprStar)
+        {
+            for (auto const &column_name : child->get_column_names())
+            {
+                column_names.push_back(column_name);
+                exprs.push_back(nullptr);
+            }
+            continue;
+        }
+        std::string name;
+        if (expr->hasAlias())
+            name = expr->alias;
+        else if (expr->type == kExprColumnRef)
+            name = expr->name;
+        else if (expr->type == kExprFunctionRef)
+            name = expression_text(expr);
+        else
+            name = "expr" + std::to_string(column_names.size() + 1);
+        // the same column name from two tables of a join keeps its qualifier
+        if (!expr->hasAlias() && expr->type == kExprColumnRef && expr->hasTable() &&
+            std::find(column_names.begin(), column_names.end(), name) != column_names.end())
+            name = std::string(expr->table) + "." + name;
+        column_names.push_back(name);
+        exprs.push_back(expr);
+    }
+}
+
+Project::Project(PlanOperator *child, const ColumnNames &column_names)
+    : child(child), exprs(column_names.size(), nullptr)
+{
+    this->column_names = column_names;
+}
+
+Project::~Project()
+{
+    delete child;
+}
+
+void Project::open()
+{
+    child->open();
+}
+
+bool Project::next(ValueDict &row)
+{
+    if (!child->next(input))
+        return false;
+    row.clear();
+    for (size_t i = 0; i < exprs.size(); i++)
+    {
+        if (exprs[i] == nullptr)
+            row[column_names[i]] = input[column_names[i]];
+        else
+            row[column_names[i]] = evaluate(exprs[i], input);
+    }
+    return true;
+}
+
+void Project::close()
+{
+    child->close();
+}
+
+// Columns passed through by name aren't shown.
+void Project::get_expressions(LabeledExpressions &expressions) const
+{
+    std::vector<const Expr *> computed;
+    for (auto const expr : exprs)
+        if (expr != nullptr)
+            computed.push_back(expr);
+    if (!computed.empty())
+        expressions.push_back(std::make_pair("computes", computed));
+}
+
+//------------------------Distinct----------------------------------------------
+
+Distinct::Distinct(PlanOperator *child) : child(child)
+{
+    column_names = child->get_column_names();
+}
+
+Distinct::~Distinct()
+{
+    delete child;
+}
+
+void Distinct::open()
+{
+    seen.clear();
+    child->open();
+}
+
+bool Distinct::next(ValueDict &row)
+{
+    std::string key;
+    while (child->next(row))
+    {
+        key.clear();
+        for (auto const &column_name : column_names)
+            encode_key(row[column_name], false, key);
+        if (seen.insert(key).second)
+            return true;
+    }
+    return false;
+}
+
+void Distinct::close()
+{
+    seen.clear();
+    child->close();
+}
+
+//------------------------Limit----------------------------------------------
+
+Limit::Limit(PlanOperator *child, int64_t limit, int64_t offset)
+    : child(child), limit(limit), offset(offset < 0 ? 0 : offset), produced(0)
+{
+    column_names = child->get_column_names();
+}
+
+Limit::~Limit()
+{
+    delete child;
+}
+
+void Limit::open()
+{
+    produced = 0;
+    child->open();
+}
+
+// A negative limit means no limit (only an offset).
+bool Limit::next(ValueDict &row)
+{
+    while (produced < offset)
+    {
+        if (!child->next(row))
+            return false;
+        produced++;
+    }
+    if (limit >= 0 && produced >= offset + limit)
+        return false;
+    if (!child->next(row))
+        return false;
+    produced++;
+    return true;
+}
+
+void Limit::close()
+{
+    child->close();
+}
+
+std::string Limit::get_name()
+{
+    std::string name = "Limit";
+    if (limit >= 0)
+        name += " " + std::to_string(limit);
+    if (offset > 0)
+        name += " offset " + std::to_string(offset);
+    return name;
+}
+
+//------------------------UnionAll----------------------------------------------
+
+UnionAll::UnionAll(const std::vector<PlanOperator *> &children) : children(children), current(0)
+{
+    if (!children.empty())
+        column_names = children[0]->get_column_names();
+}
+
+UnionAll::~UnionAll()
+{
+    for (auto child : children)
+        delete child;
+}
+
+void UnionAll::open()
+{
+    for (auto child : children)
+        child->open();
+    current = 0;
+}
+
+bool UnionAll::next(ValueDict &row)
+{
+    while (current < children.size())
+    {
+        if (children[current]->next(row))
+            return true;
+        current++;
+    }
+    return false;
+}
+
+void UnionAll::close()
+{
+    for (auto child : children)
+        child->close();
+}
+
+size_t UnionAll::estimated_rows()
+{
+    size_t rows = 0;
+    for (auto child : children)
+        rows += child->estimated_rows();
+    return rows;
+}
+
+std::vector<PlanOperator **> UnionAll::get_children()
+{
+    std::vector<PlanOperator **> slots;
+    for (auto &child : children)
+        slots.push_back(&child);
+    return slots;
+}
+
+//------------------------Insert----------------------------------------------
+
+Insert::Insert(DbRelation &relation, PlanOperator *child, const ColumnNames &target_columns)
+    : relation(relation), child(child), target_columns(target_columns), row_count(0)
+{
+    if (child->get_column_names().size() != target_columns.size())
+    {
+        size_t given = child->get_column_names().size();
+        delete child;
+        throw SQLExecError("expected " + std::to_string(target_columns.size()) + " values but got " +
+                           std::to_string(given));
+    }
+}
+
+Insert::~Insert()
+{
+    delete child;
+}
+
+void Insert::open()
+{
+    row_count = 0;
+    child->open();
+}
+
+static const char *type_name(ColumnAttribute::DataType data_type)
+{
+    return data_type == ColumnAttribute::INT ? "INT" : "TEXT";
+}
+
+bool Insert::next(ValueDict &row)
+{
+    // the type each target column takes (the relation itself checks that they exist)
+    const ColumnNames &source_columns = child->get_column_names();
+    const ColumnNames &table_columns = relation.get_column_names();
+    std::vector<const ColumnAttribute *> target_attributes;
+    for (auto const &column_name : target_columns)
+    {
+        auto it = std::find(table_columns.begin(), table_columns.end(), column_name);
+        target_attributes.push_back(it == table_columns.end() ? nullptr
+                                    : &relation.get_column_attributes()[it - table_columns.begin()]);
+    }
+
+    ValueDict input;
+    while (child->next(input))
+    {
+        row.clear();
+        for (size_t i = 0; i < source_columns.size(); i++)
+        {
+            const Value &value = input[source_columns[i]];
+            if (!value.is_null && target_attributes[i] != nullptr &&
+                value.data_type != target_attributes[i]->get_data_type())
+                throw SQLExecError(std::string("cannot insert ") + type_name(value.data_type) + " into " +
+                                   type_name(target_attributes[i]->get_data_type()) + " column " + target_columns[i]);
+            row[target_columns[i]] = value;
+        }
+        relation.insert(&row);
+        row_count++;
+    }
+    return false;
+}
+
+void Insert::close()
+{
+    child->close();
+}
+
+//------------------------CreateTable----------------------------------------------
+
+CreateTable::CreateTable(Tables &tables, Identifier table_name, const ColumnNames &column_names,
+                         const ColumnAttributes &column_attributes, bool if_not_exists, Identifier engine)
+    : tables(tables), table_name(table_name), new_column_names(column_names),
+      new_column_attributes(column_attributes), if_not_exists(if_not_exists), engine(engine), created(false)
+{
+}
+
+void CreateTable::open()
+{
+    created = false;
+}
+
+bool CreateTable::next(ValueDict &)
+{
+    created = tables.create_table(table_name, new_column_names, new_column_attributes, if_not_exists, engine);
+    return false;
+}
+
+void CreateTable::close()
+{
+}
+
+//------------------------CreateIndex----------------------------------------------
+
+CreateIndex::CreateIndex(Tables &tables, Identifier table_name, Identifier index_name, Identifier column_name,
+                         Identifier index_type)
+    : tables(tables), table_name(table_name), index_name(index_name), column_name(column_name),
+      index_type(index_type)
+{
+}
+
+bool CreateIndex::next(ValueDict &)
+{
+    tables.create_index(table_name, index_name, column_name, index_type);
+    return false;
+}
+
+//------------------------tests----------------------------------------------
+
+// Fails on its second row; counts how often it is closed.
+class FailingOperator : public PlanOperator {
+public:
+    size_t closes = 0;
+    size_t produced = 0;
+
+    virtual void open() { produced = 0; }
+
+    virtual bool next(ValueDict &)
+    {
+        if (produced++ > 0)
+            throw SQLExecError("failing as asked");
+        return true;
+    }
+
+    virtual void close() { closes++; }
+
+    virtual size_t estimated_rows() { return 2; }
+
+    virtual std::string get_name() { return "FailingOperator"; }
+};
+
+// Evaluates left op right (or -left when op is '-' and right is nullptr).
+static bool overflows(Expr *left, char op, Expr *right)
+{
+    Expr *expr = right != nullptr ? make_op(left, op, right) : new Expr(kExprOperator);
+    if (right == nullptr)
+    {
+        expr->opType = Expr::UMINUS;
+        expr->expr = left;
+    }
+    bool caught = false;
+    try
+    {
+        evaluate(expr, ValueDict());
+    }
+    catch (SQLExecError &)
+    {
+        caught = true;
+    }
+    delete expr;
+    return caught;
+}
+
+// Results that don't fit in an INT are errors, not wrapped or trapped.
+static bool test_arithmetic()
+{
+    Expr *min = make_op(make_op(make_int(0), '-', make_int(INT32_MAX)), '-', make_int(1));
+    Value n = evaluate(min, ValueDict());
+    delete min;
+    Expr *mod = make_op(make_op(make_op(make_int(0), '-', make_int(INT32_MAX)), '-', make_int(1)), '%',
+                        make_op(make_int(0), '-', make_int(1)));
+    Value remainder = evaluate(mod, ValueDict());
+    delete mod;
+    bool ok = n.n == INT32_MIN && remainder.n == 0 &&
+              overflows(make_op(make_int(INT32_MIN), '-', make_int(0)), '/', make_op(make_int(0), '-', make_int(1))) &&
+              overflows(make_int(INT32_MAX), '+', make_int(1)) &&
+              overflows(make_op(make_int(INT32_MIN), '+', make_int(0)), '-', make_int(1)) &&
+              overflows(make_int(65536), '*', make_int(65536)) &&
+              overflows(make_op(make_int(INT32_MIN), '+', make_int(0)), '-', nullptr) &&
+              overflows(make_int(1), '/', make_int(0));
+    if (!ok)
+    {
+        std::cout << "arithmetic overflow not caught" << std::endl;
+        return false;
+    }
+    std::cout << "arithmetic ok" << std::endl;
+    return true;
+}
+
+// What a predicate evaluates to, as "1", "0" or "NULL".
+static std::string truth_value(Expr *expr, const ValueDict &row)
+{
+    Value value = evaluate(expr, row);
+    delete expr;
+    return value.is_null ? "NULL" : std::to_string(value.n);
+}
+
+// AND and OR with a NULL side (e.g., a column of an unmatched outer join row).
+static bool test_three_valued()
+{
+    ValueDict row;
+    row["w"] = Value::null();
+    row["k"] = Value(1);
+    Expr *negated = new Expr(kExprOperator);  // NOT (w = 5 AND k = 1)
+    negated->opType = Expr::NOT;
+    negated->expr = make_logical(make_op(make_column("w"), '=', make_int(5)), Expr::AND,
+                                 make_op(make_column("k"), '=', make_int(1)));
+    bool filtered = !is_true(negated, row);
+    delete negated;
+    std::vector<std::string> got = {
+        truth_value(make_logical(make_column("w"), Expr::AND, make_column("k")), row),
+        truth_value(make_logical(make_column("w"), Expr::AND, make_int(0)), row),
+        truth_value(make_logical(make_int(0), Expr::AND, make_column("w")), row),
+        truth_value(make_logical(make_column("w"), Expr::OR, make_column("k")), row),
+        truth_value(make_logical(make_column("w"), Expr::OR, make_int(0)), row),
+        truth_value(make_logical(make_int(1), Expr::OR, make_column("w")), row),
+        truth_value(make_logical(make_int(1), Expr::AND, make_column("k")), row),
+        truth_value(make_logical(make_int(0), Expr::OR, make_int(0)), row)};
+    std::vector<std::string> expected = {"NULL", "0", "0", "1", "NULL", "1", "1", "0"};
+    if (!filtered || got != expected)
+    {
+        std::cout << "three-valued logic wrong" << std::endl;
+        return false;
+    }
+    std::cout << "three-valued logic ok" << std::endl;
+    return true;
+}
+
+// Only the first of each set of equal rows comes through, in order.
+static bool test_distinct()
+{
+    ColumnNames column_names = {"a", "b"};
+    std::vector<std::vector<Expr *>> rows = {{make_int(2), make_text("x")}, {make_int(1), make_text("x")},
+                                             {make_int(2), make_text("x")}, {make_int(2), make_text("y")},
+                                             {make_int(1), make_text("x")}};
+    Distinct distinct(new Values(column_names, rows));
+    std::vector<std::string> got;
+    ValueDict row;
+    for (int run = 0; run < 2; run++)  // reopening starts over
+    {
+        distinct.open();
+        while (distinct.next(row))
+            got.push_back(std::to_string(row["a"].n) + row["b"].s);
+        distinct.close();
+    }
+    for (auto &exprs : rows)
+        for (auto expr : exprs)
+            delete expr;
+    std::vector<std::string> expected = {"2x", "1x", "2y", "2x", "1x", "2y"};
+    if (got != expected)
+    {
+        std::cout << "distinct produced " << got.size() << " rows" << std::endl;
+        return false;
+    }
+    std::cout << "distinct ok" << std::endl;
+    return true;
+}
+
+// A run that throws still closes its plan, exactly once.
+static bool test_plan_run()
+{
+    FailingOperator failing;
+    ValueDict row;
+    bool threw = false;
+    try
+    {
+        PlanRun run(&failing);
+        while (failing.next(row))
+            ;
+    }
+    catch (SQLExecError &)
+    {
+        threw = true;
+    }
+    {
+        PlanRun run(&failing);
+        failing.next(row);
+        run.close();
+    }
+    if (!threw || failing.closes != 2)
+    {
+        std::cout << "plan run closed " << failing.closes << " times" << std::endl;
+        return false;
+    }
+    std::cout << "plan run ok" << std::endl;
+    return true;
+}
+
+// test function -- returns true if all tests pass
+bool test_query_plan()
+{
+    std::cout << "\nTesting QueryPlan...." << std::endl;
+    ColumnNames column_names = {"a", "b"};
+    ColumnAttributes column_attributes = {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::INT)};
+    HeapTable table("_test_query_plan_cpp", column_names, column_attributes);
+    table.create_if_not_exists();
+
+    // INSERT 10 rows (i, i * i) through Values -> Insert
+    std::vector<std::vector<Expr *>> rows;
+    for (int i = 0; i < 10; i++)
+        rows.push_back({make_int(i), make_int(i * i)});
+    Insert insert(table, new Values(column_names, rows), column_names);
+    ValueDict row;
+    insert.open();
+    insert.next(row);
+    insert.close();
+    for (auto &exprs : rows)
+        for (auto expr : exprs)
+            delete expr;
+    if (insert.get_row_count() != 10)
+        return false;
+
+    // a value of the wrong type is refused rather than stored as some other value
+    std::vector<std::vector<Expr *>> wrong = {{make_int(10), make_text("ten")}};
+    Insert refused(table, new Values(column_names, wrong), column_names);
+    bool caught = false;
+    try
+    {
+        refused.open();
+        refused.next(row);
+    }
+    catch (SQLExecError &)
+    {
+        caught = true;
+    }
+    refused.close();
+    for (auto expr : wrong[0])
+        delete expr;
+    if (!caught || refused.get_row_count() != 0)
+    {
+        std::cout << "inserted TEXT into an INT column" << std::endl;
+        return false;
+    }
+    std::cout << "insert ok" << std::endl;
+
+    // SELECT a + b AS c FROM t WHERE a > 2 LIMIT 3 OFFSET 1
+    Expr *where = make_op(make_column("a"), '>', make_int(2));
+    Expr *sum = make_op(make_column("a"), '+', make_column("b"));
+    sum->alias = strdup("c");
+    std::vector<Expr *> select_list = {sum};
+    PlanOperator *plan = new Limit(new Project(new Filter(new TableScan(table), where), select_list), 3, 1);
+    std::vector<int32_t> expected = {4 + 16, 5 + 25, 6 + 36};
+    std::vector<int32_t> got;
+    plan->open();
+    while (plan->next(row))
+        got.push_back(row["c"].n);
+    plan->close();
+    delete plan;
+    delete where;
+    delete sum;
+    table.drop();
+    if (got != expected)
+        return false;
+    std::cout << "filter/project/limit ok" << std::endl;
+    return test_plan_run() && test_arithmetic() && test_distinct() && test_three_valued();
+}
@@ -0,0 +1,385 @@
+/**
+ * Implementation of the result sinks declared in ResultSink.h.
+ */
+
+#include "ResultSink.h"
+#include <iostream>
+#include <sstream>
+
+//------------------------OutputBuffer----------------------------------------------
+
+OutputBuffer::OutputBuffer(std::ostream &out, size_t capacity)
+    : out(out), capacity(std::max<size_t>(capacity, 1)), buffer(this->capacity), used(0)
+{
+}
+
+OutputBuffer::~OutputBuffer()
+{
+    try
+    {
+        flush();
+    }
+    catch (...)
+    {
+        // the stream is gone or broken; nothing to tell it
+    }
+}
+
+void OutputBuffer::flush()
+{
+    if (used == 0)
+        return;
+    out.write(buffer.data(), used);
+    used = 0;
+}
+
+// Fills the buffer, writes it out and carries on; what is at least a whole buffer's worth
+// goes straight to the stream.
+void OutputBuffer::write_large(const char *data, size_t size)
+{
+    size_t fits = capacity - used;
+    memcpy(&buffer[used], data, fits);
+    used += fits;
+    flush();
+    data += fits;
+    size -= fits;
+    if (size >= capacity)
+    {
+        out.write(data, size);
+        return;
+    }
+    memcpy(&buffer[0], data, size);
+    used = size;
+}
+
+//------------------------ResultSink----------------------------------------------
+
+ResultSink::ResultSink(std::ostream &out, size_t capacity) : buffer(out, capacity), row_count(0)
+{
+}
+
+void ResultSink::begin(const ColumnNames &column_names)
+{
+    this->column_names = column_names;
+    row_count = 0;
+    write_header();
+}
+
+void ResultSink::row(const ValueDict &row)
+{
+    write_row(row);
+    if (row_count++ == 0)
+        flush();  // the first row shouldn't wait for the buffer to fill
+}
+
+void ResultSink::end()
+{
+    write_trailer();
+    flush();
+}
+
+const Value &ResultSink::value_of(const ValueDict &row, const Identifier &column_name)
+{
+    static const Value null = Value::null();
+    auto found = row.find(column_name);
+    return found == row.end() ? null : found->second;
+}
+
+ResultSink *ResultSink::create(const std::string &format, std::ostream &out)
+{
+    if (format == "text")
+        return new TextSink(out);
+    if (format == "csv")
+        return new CsvSink(out);
+    if (format == "binary")
+        return new BinarySink(out);
+    return nullptr;
+}
+
+//------------------------TextSink----------------------------------------------
+
+void TextSink::message(const std::string &text)
+{
+    buffer.write(text);
+    buffer.put('\n');
+    flush();
+}
+
+void TextSink::write_header()
+{
+    for (auto const &column_name : column_names)
+    {
+        buffer.write(column_name);
+        buffer.put(' ');
+    }
+    buffer.write("\n+", 2);
+    for (size_t i = 0; i < column_names.size(); i++)
+        buffer.write("----------+", 11);
+    buffer.put('\n');
+}
+
+void TextSink::write_row(const ValueDict &row)
+{
+    for (auto const &column_name : column_names)
+    {
+        const Value &value = value_of(row, column_name);
+        if (value.is_null)
+        {
+            buffer.write("NULL", 4);
+        }
+        else if (value.data_type == ColumnAttribute::INT)
+        {
+            buffer.write(std::to_string(value.n));
+        }
+        else
+        {
+            buffer.put('"');
+            buffer.write(value.s);
+            buffer.put('"');
+        }
+        buffer.put(' ');
+    }
+    buffer.put('\n');
+}
+
+void TextSink::write_trailer()
+{
+    buffer.write("successfully returned " + std::to_string(row_count) + " rows\n");
+}
+
+//------------------------CsvSink----------------------------------------------
+
+void CsvSink::message(const std::string &text)
+{
+    buffer.write(text);
+    buffer.put('\n');
+    flush();
+}
+
+void CsvSink::write_header()
+{
+    for (size_t i = 0; i < column_names.size(); i++)
+    {
+        if (i > 0)
+            buffer.put(',');
+        write_field(column_names[i]);
+    }
+    buffer.write("\r\n", 2);
+}
+
+void CsvSink::write_row(const ValueDict &row)
+{
+    for (size_t i = 0; i < column_names.size(); i++)
+    {
+        if (i > 0)
+            buffer.put(',');
+        const Value &value = value_of(row, column_names[i]);
+        if (value.is_null)
+            continue;
+        if (value.data_type == ColumnAttribute::INT)
+            buffer.write(std::to_string(value.n));
+        else
+            write_field(value.s);
+    }
+    buffer.write("\r\n", 2);
+}
+
+void CsvSink::write_trailer()
+{
+    buffer.write("\r\n", 2);
+}
+
+// Quotes a field only if it has to be; an empty text is quoted so it isn't read as a null.
+void CsvSink::write_field(const std::string &text)
+{
+    if (!text.empty() && text.find_first_of(",\"\r\n") == std::string::npos)
+    {
+        buffer.write(text);
+        return;
+    }
+    buffer.put('"');
+    for (char c : text)
+    {
+        if (c == '"')
+            buffer.put('"');
+        buffer.put(c);
+    }
+    buffer.put('"');
+}
+
+//------------------------BinarySink----------------------------------------------
+
+void BinarySink::message(const std::string &text)
+{
+    buffer.put('M');
+    write_integer((uint32_t)text.size());
+    buffer.write(text);
+    flush();
+}
+
+void BinarySink::write_header()
+{
+    buffer.put('H');
+    write_integer((uint16_t)column_names.size());
+    for (auto const &column_name : column_names)
+    {
+        write_integer((uint16_t)column_name.size());
+        buffer.write(column_name);
+    }
+}
+
+void BinarySink::write_row(const ValueDict &row)
+{
+    buffer.put('R');
+    for (auto const &column_name : column_names)
+    {
+        const Value &value = value_of(row, column_name);
+        if (value.is_null)
+        {
+            buffer.put('N');
+        }
+        else if (value.data_type == ColumnAttribute::INT)
+        {
+            buffer.put('I');
+            write_integer(value.n);
+        }
+        else
+        {
+            buffer.put('T');
+            write_integer((uint32_t)value.s.size());
+            buffer.write(value.s);
+        }
+    }
+}
+
+void BinarySink::write_trailer()
+{
+    buffer.put('E');
+    write_integer((uint64_t)row_count);
+}
+
+//------------------------tests----------------------------------------------
+
+// A stream buffer that only counts what is written to it, and how.
+class CountingStreamBuf : public std::streambuf {
+public:
+    size_t bytes = 0;
+    size_t writes = 0;
+    size_t largest = 0;
+
+protected:
+    virtual std::streamsize xsputn(const char *, std::streamsize n)
+    {
+        bytes += (size_t)n;
+        writes++;
+        largest = std::max(largest, (size_t)n);
+        return n;
+    }
+
+    virtual int overflow(int c)
+    {
+        if (c != EOF)
+            xsputn(nullptr, 1);
+        return c;
+    }
+};
+
+static void write_result(ResultSink &sink)
+{
+    sink.begin(ColumnNames{"a", "b"});
+    ValueDict row;
+    row["a"] = Value(1);
+    row["b"] = Value("x, \"y\"");
+    sink.row(row);
+    row["a"] = Value(-2);
+    row["b"] = Value::null();
+    sink.row(row);
+    sink.end();
+    sink.message("created t");
+}
+
+static bool test_formats()
+{
+    std::ostringstream text;
+    {
+        TextSink sink(text);
+        write_result(sink);
+    }
+    std::string expected = "a b \n+----------+----------+\n1 \"x, \"y\"\" \n-2 NULL \nsuccessfully returned 2 rows\n"
+                           "created t\n";
+    if (text.str() != expected)
+    {
+        std::cout << "text sink wrote:\n" << text.str() << std::endl;
+        return false;
+    }
+
+    std::ostringstream csv;
+    {
+        CsvSink sink(csv);
+        write_result(sink);
+    }
+    if (csv.str() != "a,b\r\n1,\"x, \"\"y\"\"\"\r\n-2,\r\n\r\ncreated t\n")
+    {
+        std::cout << "csv sink wrote:\n" << csv.str() << std::endl;
+        return false;
+    }
+
+    std::ostringstream binary;
+    {
+        BinarySink sink(binary);
+        write_result(sink);
+    }
+    std::string expected_binary("H\x02\x00\x01\x00" "a\x01\x00" "b"
+                                "RI\x01\x00\x00\x00T\x06\x00\x00\x00x, \"y\""
+                                "RI\xfe\xff\xff\xffN"
+                                "E\x02\x00\x00\x00\x00\x00\x00\x00"
+                                "M\x09\x00\x00\x00" "created t", 56);
+    if (binary.str() != expected_binary)
+    {
+        std::cout << "binary sink wrote " << binary.str().size() << " bytes" << std::endl;
+        return false;
+    }
+    std::cout << "text/csv/binary formats ok" << std::endl;
+    return true;
+}
+
+// However many rows there are, the stream gets the first one at once and the rest in
+// buffer-sized writes.
+static bool test_streaming()
+{
+    const size_t CAPACITY = 4096, ROWS = 100000;
+    CountingStreamBuf counter;
+    std::ostream out(&counter);
+    TextSink sink(out, CAPACITY);
+    sink.begin(ColumnNames{"a", "b"});
+    ValueDict row;
+    row["b"] = Value(std::string(30, 'r'));
+    bool first_row_out = false;
+    for (size_t i = 0; i < ROWS; i++)
+    {
+        row["a"] = Value((int32_t)i);
+        sink.row(row);
+        if (i == 0)
+            first_row_out = counter.bytes > 0;
+    }
+    size_t before_end = counter.bytes;
+    sink.end();
+    size_t total = counter.bytes;
+    bool ok = first_row_out && before_end > total - CAPACITY && counter.largest <= CAPACITY &&
+              counter.writes <= total / CAPACITY + 3;
+    if (!ok)
+    {
+        std::cout << "streamed " << total << " bytes in " << counter.writes << " writes (largest "
+                  << counter.largest << ")" << std::endl;
+        return false;
+    }
+    std::cout << "streaming ok (" << counter.writes << " writes for " << total << " bytes)" << std::endl;
+    return true;
+}
+
+// test function -- returns true if all tests pass
+bool test_result_sink()
+{
+    std::cout << "\nTesting ResultSink...." << std::endl;
+    return test_formats() && test_streaming();
+}
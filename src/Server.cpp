@@ -0,0 +1,531 @@
+/**
+ * Implementation of the multi-client server declared in Server.h.
+ */
+
+#include "Server.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+static const size_t READ_CHUNK = 64 * 1024;
+static const int MAX_EVENTS = 64;
+
+static std::runtime_error system_error(const std::string &what)
+{
+    return std::runtime_error(what + ": " + strerror(errno));
+}
+
+// Removes a socket left behind at the address by a server that didn't shut down cleanly.
+// Anything else there (a file, or the socket of a server still listening) is left alone
+// and is an error.
+static void remove_stale_socket(const sockaddr_un &address)
+{
+    const char *path = address.sun_path;
+    struct stat status;
+    if (lstat(path, &status) < 0)
+    {
+        if (errno == ENOENT)
+            return;
+        throw system_error(path);
+    }
+    if (!S_ISSOCK(status.st_mode))
+        throw std::runtime_error(std::string(path) + " exists and is not a socket");
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe < 0)
+        throw system_error("socket");
+    int connected = connect(probe, (const sockaddr *)&address, sizeof(address));
+    int error = errno;
+    close(probe);
+    if (connected == 0)
+        throw std::runtime_error("another server is listening on " + std::string(path));
+    if (error != ECONNREFUSED)
+    {
+        errno = error;
+        throw system_error(path);
+    }
+    if (unlink(path) < 0 && errno != ENOENT)
+        throw system_error(path);
+}
+
+//------------------------Server----------------------------------------------
+
+Server::Server(const std::string &socket_path, size_t worker_count)
+    : socket_path(socket_path), worker_count(worker_count), listen_fd(-1), epoll_fd(-1), wakeup_fd(-1),
+      stopping(false), workers_stopping(false)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path))
+        throw std::runtime_error("socket path too long: " + socket_path);
+    strcpy(address.sun_path, socket_path.c_str());
+
+    remove_stale_socket(address);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+        throw system_error("socket");
+    bool bound = bind(listen_fd, (sockaddr *)&address, sizeof(address)) == 0;
+    if (!bound || listen(listen_fd, SOMAXCONN) < 0)
+    {
+        std::runtime_error error = system_error(socket_path);
+        close(listen_fd);
+        if (bound)
+            unlink(socket_path.c_str());
+        throw error;
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd < 0 || wakeup_fd < 0)
+    {
+        // the destructor won't run, so give back what did open, and the socket file
+        std::runtime_error error = system_error(epoll_fd < 0 ? "epoll_create1" : "eventfd");
+        if (epoll_fd >= 0)
+            close(epoll_fd);
+        if (wakeup_fd >= 0)
+            close(wakeup_fd);
+        close(listen_fd);
+        unlink(socket_path.c_str());
+        throw error;
+    }
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+    event.data.fd = wakeup_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &event);
+
+    for (size_t i = 0; i < worker_count; i++)
+        workers.push_back(std::thread(&Server::work, this));
+}
+
+Server::~Server()
+{
+    {
+        std::lock_guard<std::mutex> guard(queue_lock);
+        workers_stopping = true;
+    }
+    queue_ready.notify_all();
+    for (auto &worker : workers)
+        worker.join();
+    for (auto const &entry : sessions)
+        close(entry.first);
+    sessions.clear();
+    close(wakeup_fd);
+    close(epoll_fd);
+    close(listen_fd);
+    unlink(socket_path.c_str());
+}
+
+void Server::run()
+{
+    epoll_event events[MAX_EVENTS];
+    while (!stopping)
+    {
+        int count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw system_error("epoll_wait");
+        }
+        for (int i = 0; i < count; i++)
+        {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd)
+            {
+                accept_clients();
+                continue;
+            }
+            if (fd == wakeup_fd)
+            {
+                uint64_t ignored;
+                while (read(wakeup_fd, &ignored, sizeof(ignored)) > 0)
+                    ;
+                collect_finished();
+                continue;
+            }
+            auto found = sessions.find(fd);
+            if (found == sessions.end())
+                continue;  // closed earlier in this batch of events
+            Session &session = *found->second;
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                read_client(session);
+            if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                write_client(session);  // after a hangup, finds the client gone and drops the output
+            dispatch(session);
+        }
+    }
+}
+
+void Server::stop()
+{
+    stopping = true;
+    uint64_t one = 1;
+    ssize_t ignored = write(wakeup_fd, &one, sizeof(one));
+    (void)ignored;
+}
+
+// Accepts every pending connection and starts a session for each.
+void Server::accept_clients()
+{
+    while (true)
+    {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return;  // EAGAIN: no more; anything else: try again on the next event
+        epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+        {
+            close(fd);
+            continue;
+        }
+        sessions[fd].reset(new Session(fd));
+    }
+}
+
+// Reads everything the client has sent; marks the session closing when it hangs up.
+void Server::read_client(Session &session)
+{
+    char buffer[READ_CHUNK];
+    while (true)
+    {
+        ssize_t n = read(session.fd, buffer, sizeof(buffer));
+        if (n > 0)
+        {
+            session.input.append(buffer, (size_t)n);
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n < 0 && errno == EINTR)
+            continue;
+        session.closing = true;  // EOF or error; statements already received still run
+        watch(session);
+        return;
+    }
+}
+
+// Sends as much of the session's output as the socket takes, watching for EPOLLOUT if
+// some is left over.
+void Server::write_client(Session &session)
+{
+    size_t sent = 0;
+    while (sent < session.output.size())
+    {
+        ssize_t n = send(session.fd, session.output.data() + sent, session.output.size() - sent, MSG_NOSIGNAL);
+        if (n > 0)
+        {
+            sent += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        session.output.clear();  // the client is gone
+        session.input.clear();
+        session.closing = true;
+        sent = 0;
+        break;
+    }
+    session.output.erase(0, sent);
+    watch(session);
+}
+
+// Registers for the events the session now needs: input until it's closing, and room to
+// write while it has output left. A session that needs neither is taken out of the epoll
+// set, as epoll always reports a hangup (level-triggered) and the loop would spin on it
+// until the worker hands the session back.
+void Server::watch(Session &session)
+{
+    uint32_t readable = EPOLLIN | EPOLLRDHUP, writable = EPOLLOUT;
+    uint32_t events = (session.closing ? 0 : readable) | (session.output.empty() ? 0 : writable);
+    if (events == session.events)
+        return;
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.fd = session.fd;
+    int operation = events == 0 ? EPOLL_CTL_DEL : (session.events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD);
+    epoll_ctl(epoll_fd, operation, session.fd, &event);
+    session.events = events;
+}
+
+void Server::dispatch(Session &session)
+{
+    while (!session.busy)
+    {
+        size_t newline = session.input.find('\n');
+        if (newline == std::string::npos)
+            break;
+        std::string statement = session.input.substr(0, newline);
+        session.input.erase(0, newline + 1);
+        size_t first = statement.find_first_not_of(" \t\r");
+        size_t last = statement.find_last_not_of(" \t\r;");
+        if (first == std::string::npos || last == std::string::npos || last < first)
+            continue;  // blank line
+        statement = statement.substr(first, last - first + 1);
+        if (statement == "quit")
+        {
+            session.input.clear();
+            session.closing = true;
+            watch(session);
+            break;
+        }
+        session.statement = statement;
+        session.busy = true;
+        {
+            std::lock_guard<std::mutex> guard(queue_lock);
+            jobs.push_back(&session);
+        }
+        queue_ready.notify_one();
+    }
+    if (session.closing && !session.busy && session.output.empty())
+        close_session(session);
+}
+
+// Sends the results the workers have finished and starts the sessions' next statements.
+void Server::collect_finished()
+{
+    std::deque<Session *> done;
+    {
+        std::lock_guard<std::mutex> guard(queue_lock);
+        done.swap(finished);
+    }
+    for (Session *session : done)
+    {
+        session->busy = false;
+        session->output += session->result;
+        session->output += '\0';
+        session->result.clear();
+        write_client(*session);
+        dispatch(*session);  // may free the session
+    }
+}
+
+void Server::close_session(Session &session)
+{
+    int fd = session.fd;
+    if (session.events != 0)
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    sessions.erase(fd);
+}
+
+// A worker: runs statements from the job queue until the server shuts down.
+void Server::work()
+{
+    while (true)
+    {
+        Session *session;
+        {
+            std::unique_lock<std::mutex> guard(queue_lock);
+            queue_ready.wait(guard, [this] { return workers_stopping || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+            session = jobs.front();
+            jobs.pop_front();
+        }
+        session->result = run_statement(session->executor, session->statement);
+        {
+            std::lock_guard<std::mutex> guard(queue_lock);
+            finished.push_back(session);
+        }
+        uint64_t one = 1;
+        ssize_t ignored = write(wakeup_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+std::string Server::run_statement(SqlExecutor &executor, const std::string &statement)
+{
+    try
+    {
+        return executor.execute(statement);
+    }
+    catch (SQLExecError &e)
+    {
+        return std::string("Error: ") + e.what();
+    }
+    catch (DbRelationError &e)
+    {
+        return std::string("Error: ") + e.what();
+    }
+    catch (DbException &e)
+    {
+        return std::string("Error: ") + e.what();  // e.g., chosen as a deadlock victim
+    }
+    catch (std::exception &e)
+    {
+        return std::string("Error: ") + e.what();  // e.g., a row too big for a block
+    }
+}
+
+//------------------------tests----------------------------------------------
+
+// Connects to the server, sends text as is and returns the first count answers.
+static bool converse(const std::string &socket_path, const std::string &text, size_t count,
+                     std::vector<std::string> &answers)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (sockaddr *)&address, sizeof(address)) < 0 ||
+        send(fd, text.data(), text.size(), MSG_NOSIGNAL) != (ssize_t)text.size())
+    {
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    std::string received;
+    char buffer[4096];
+    while ((size_t)std::count(received.begin(), received.end(), '\0') < count)
+    {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n <= 0)
+            break;
+        received.append(buffer, (size_t)n);
+    }
+    close(fd);
+    answers.clear();
+    size_t start = 0, end;
+    while ((end = received.find('\0', start)) != std::string::npos)
+    {
+        answers.push_back(received.substr(start, end - start));
+        start = end + 1;
+    }
+    return answers.size() == count;
+}
+
+// Whether a server can be started on the socket path.
+static bool starts(const std::string &socket_path)
+{
+    try
+    {
+        Server server(socket_path, 1);
+        return true;
+    }
+    catch (std::runtime_error &)
+    {
+        return false;
+    }
+}
+
+// A server replaces a stale socket, but nothing else that is in the way.
+static bool test_socket_path(const std::string &home)
+{
+    std::string file_path = home + "/_test_server.file";
+    int file = open(file_path.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+    if (file >= 0)
+        close(file);
+    struct stat status;
+    bool kept = file >= 0 && !starts(file_path) && lstat(file_path.c_str(), &status) == 0 && S_ISREG(status.st_mode);
+    unlink(file_path.c_str());
+    if (!kept)
+    {
+        std::cout << "server replaced a regular file" << std::endl;
+        return false;
+    }
+
+    // as a server that was killed leaves it: bound, but no one listening
+    std::string stale_path = home + "/_test_server_stale.sock";
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, stale_path.c_str());
+    unlink(stale_path.c_str());
+    int stale = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool bound = stale >= 0 && bind(stale, (sockaddr *)&address, sizeof(address)) == 0;
+    if (stale >= 0)
+        close(stale);
+    if (!bound || !starts(stale_path))
+    {
+        std::cout << "stale socket not replaced" << std::endl;
+        unlink(stale_path.c_str());
+        return false;
+    }
+    std::cout << "socket path ok" << std::endl;
+    return true;
+}
+
+// test function -- returns true if all tests pass
+bool test_server()
+{
+    std::cout << "\nTesting Server...." << std::endl;
+    const char *home = nullptr;
+    _DB_ENV->get_home(&home);
+    std::string socket_path = std::string(home == nullptr ? "." : home) + "/_test_server.sock";
+    Server server(socket_path, 2);
+    std::thread loop(&Server::run, &server);
+
+    // concurrent sessions, each pipelining statements that must be answered in order
+    const int CLIENTS = 4;
+    std::vector<std::vector<std::string>> answers(CLIENTS);
+    std::vector<char> connected(CLIENTS, 0);
+    std::vector<std::thread> clients;
+    for (int i = 0; i < CLIENTS; i++)
+        clients.push_back(std::thread([&, i] {
+            std::string text = "PREPARE mine AS SELECT table_name FROM _tables WHERE table_name = ?\n"
+                               "EXECUTE mine ('_columns');\n\n"
+                               "no such statement\n";
+            connected[i] = converse(socket_path, text, 3, answers[i]);
+        }));
+    for (auto &client : clients)
+        client.join();
+    bool ok = true;
+    for (int i = 0; i < CLIENTS; i++)
+        ok = ok && connected[i] && answers[i][0] == "prepared mine" &&
+             answers[i][1].find("_columns") != std::string::npos &&
+             answers[i][1].find("returned 1 row") != std::string::npos && answers[i][2].find("invalid SQL") == 0;
+    if (!ok)
+        std::cout << "pipelined sessions failed" << std::endl;
+
+    // prepared statements belong to their session; quit ends it
+    std::vector<std::string> other;
+    if (ok && !(converse(socket_path, "EXECUTE mine ('_columns')\nquit\nSELECT * FROM _tables\n", 1, other) &&
+                other[0] == "Error: no prepared statement named mine"))
+    {
+        std::cout << "separate session: " << (other.empty() ? "no answer" : other[0]) << std::endl;
+        ok = false;
+    }
+
+    // a statement that fails with something other than a database error is still just an error
+    std::vector<std::string> big;
+    std::string text = "CREATE TABLE IF NOT EXISTS _test_server_rows (t TEXT)\nINSERT INTO _test_server_rows VALUES ('" +
+                       std::string(2 * DbBlock::BLOCK_SZ, 'x') + "')\nSELECT * FROM _tables\nDROP TABLE _test_server_rows\n";
+    if (ok && !(converse(socket_path, text, 4, big) && big[1].find("Error: ") == 0 &&
+                big[2].find("_test_server_rows") != std::string::npos && big[3] == "dropped _test_server_rows"))
+    {
+        std::cout << "too big a row: " << (big.size() < 2 ? "no answer" : big[1]) << std::endl;
+        ok = false;
+    }
+
+    // a second server can't take over the socket of one still running
+    if (ok && starts(socket_path))
+    {
+        std::cout << "second server took a live socket" << std::endl;
+        ok = false;
+    }
+
+    server.stop();
+    loop.join();
+    if (ok)
+        std::cout << "sessions ok" << std::endl;
+    return ok && test_socket_path(std::string(home == nullptr ? "." : home));
+}
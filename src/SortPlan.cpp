@@ -0,0 +1,344 @@
+/**
+ * Implementation of the Sort operator declared in SortPlan.h.
+ */
+
+#include "SortPlan.h"
+#include "TestExprs.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+using namespace hsql;
+
+// Rough per-row cost of the SortEntry and the key string's header on top of the row itself.
+static const size_t SORT_ENTRY_OVERHEAD = 64;
+
+static bool entry_less(const std::string &a, const std::string &b)
+{
+    return a.compare(b) < 0;
+}
+
+// Appends a row's arrival number (big-endian), making keys unique and the sort stable.
+static void append_sequence(size_t sequence, std::string &key)
+{
+    for (int shift = 56; shift >= 0; shift -= 8)
+        key.push_back((char)((uint64_t)sequence >> shift));
+}
+
+Sort::Sort(PlanOperator *child, const std::vector<SortKey> &keys, int64_t limit, size_t memory_budget)
+    : child(child), keys(keys), limit(limit), memory_budget(memory_budget), entries_memory(0), position(0),
+      produced(0), spilled_runs(0)
+{
+    column_names = child->get_column_names();
+    for (auto &key : this->keys)
+    {
+        if (key.expr != nullptr)
+            continue;
+        Expr *column_ref = new Expr(kExprColumnRef);
+        column_ref->name = strdup(key.column.c_str());
+        column_refs.emplace_back(column_ref);
+        key.expr = column_ref;
+    }
+}
+
+Sort::~Sort()
+{
+    delete child;
+}
+
+size_t Sort::estimated_rows()
+{
+    size_t rows = child->estimated_rows();
+    return limit < 0 || (size_t)limit > rows ? rows : (size_t)limit;
+}
+
+std::string Sort::get_name()
+{
+    std::string name = "Sort";
+    if (limit >= 0)
+        name += " top " + std::to_string(limit);
+    if (spilled_runs > 0)
+        name += ", spilled " + std::to_string(spilled_runs) + (spilled_runs == 1 ? " run" : " runs");
+    return name;
+}
+
+void Sort::get_expressions(LabeledExpressions &expressions) const
+{
+    for (auto const &key : keys)
+        expressions.push_back(std::make_pair(key.descending ? "key desc" : "key",
+                                             std::vector<const Expr *>(1, key.expr)));
+}
+
+void Sort::open()
+{
+    child->open();
+    entries.clear();
+    entries_memory = 0;
+    position = 0;
+    runs.clear();
+    spilled_runs = 0;
+    readers.clear();
+    merge_tree.reset();
+
+    produced = 0;
+    size_t sequence = 0;
+    if (limit >= 0 && collect_top_n((size_t)limit, sequence))
+        return;
+
+    ValueDict row;
+    while (child->next(row))
+    {
+        SortEntry entry;
+        make_key(row, entry.key);
+        append_sequence(sequence++, entry.key);
+        entries_memory += row_memory(row) + entry.key.size() + SORT_ENTRY_OVERHEAD;
+        entry.row.swap(row);
+        entries.push_back(std::move(entry));
+        if (entries_memory > memory_budget)
+            spill_run();
+    }
+    sort_entries();
+    if (runs.empty())
+        return;  // everything fit in memory
+
+    // merge the oldest runs until the rest (plus the one still in memory) can be merged in one pass
+    while (runs.size() + 1 > MAX_FAN_IN)
+    {
+        size_t count = runs.size() < MAX_FAN_IN ? runs.size() : MAX_FAN_IN;
+        std::unique_ptr<SpillFile> merged = merge(0, count);
+        runs.erase(runs.begin(), runs.begin() + count);
+        runs.insert(runs.begin(), std::move(merged));
+    }
+    start_merge(0, runs.size(), true);
+}
+
+bool Sort::next(ValueDict &row)
+{
+    if (!merge_tree)
+    {
+        if (position >= entries.size())
+            return false;
+        row.swap(entries[position++].row);
+        return true;
+    }
+
+    RunReader &top = readers[merge_tree->top()];
+    if (top.exhausted || (limit >= 0 && produced >= (size_t)limit))
+        return false;
+    row.swap(top.current.row);
+    advance(top);
+    merge_tree->replay();
+    produced++;
+    return true;
+}
+
+void Sort::close()
+{
+    child->close();
+    merge_tree.reset();
+    readers.clear();
+    runs.clear();
+    entries.clear();
+}
+
+void Sort::make_key(const ValueDict &row, std::string &key)
+{
+    key.clear();
+    for (auto const &sort_key : keys)
+        encode_key(evaluate(sort_key.expr, row), sort_key.descending, key);
+}
+
+void Sort::sort_entries()
+{
+    std::sort(entries.begin(), entries.end(),
+              [](const SortEntry &a, const SortEntry &b) { return entry_less(a.key, b.key); });
+}
+
+void Sort::spill_run()
+{
+    sort_entries();
+    std::unique_ptr<SpillFile> run(new SpillFile());
+    for (auto const &entry : entries)
+    {
+        run->write_string(entry.key);
+        run->write_row(column_names, entry.row);
+    }
+    runs.push_back(std::move(run));
+    spilled_runs++;
+    entries.clear();
+    entries_memory = 0;
+}
+
+// Keeps the n smallest keys in a max-heap: a row only gets in by evicting the current largest.
+// If the heap outgrows the memory budget, it is spilled as a run and false is returned: the
+// rest of the rows are then sorted like any others, and next() stops after n.
+bool Sort::collect_top_n(size_t n, size_t &sequence)
+{
+    auto heap_less = [](const SortEntry &a, const SortEntry &b) { return entry_less(a.key, b.key); };
+    ValueDict row;
+    SortEntry entry;
+    while (n > 0 && child->next(row))
+    {
+        make_key(row, entry.key);
+        append_sequence(sequence++, entry.key);
+        if (entries.size() < n)
+        {
+            entries_memory += row_memory(row) + entry.key.size() + SORT_ENTRY_OVERHEAD;
+            entry.row.swap(row);
+            entries.push_back(std::move(entry));
+            std::push_heap(entries.begin(), entries.end(), heap_less);
+        }
+        else if (entry_less(entry.key, entries.front().key))
+        {
+            std::pop_heap(entries.begin(), entries.end(), heap_less);
+            SortEntry &evicted = entries.back();
+            entries_memory -= row_memory(evicted.row) + evicted.key.size();
+            entries_memory += row_memory(row) + entry.key.size();
+            evicted.key.swap(entry.key);
+            evicted.row.swap(row);
+            std::push_heap(entries.begin(), entries.end(), heap_less);
+        }
+        if (entries_memory > memory_budget)
+        {
+            spill_run();
+            return false;
+        }
+    }
+    std::sort_heap(entries.begin(), entries.end(), heap_less);
+    return true;
+}
+
+std::unique_ptr<SpillFile> Sort::merge(size_t first, size_t count)
+{
+    start_merge(first, count, false);
+    std::unique_ptr<SpillFile> merged(new SpillFile());
+    while (true)
+    {
+        RunReader &top = readers[merge_tree->top()];
+        if (top.exhausted)
+            break;
+        merged->write_string(top.current.key);
+        merged->write_row(column_names, top.current.row);
+        advance(top);
+        merge_tree->replay();
+    }
+    merge_tree.reset();
+    readers.clear();
+    return merged;
+}
+
+void Sort::start_merge(size_t first, size_t count, bool include_entries)
+{
+    readers.clear();
+    for (size_t i = first; i < first + count; i++)
+    {
+        runs[i]->rewind();
+        readers.push_back(RunReader{runs[i].get(), nullptr, 0, false, SortEntry()});
+    }
+    if (include_entries && !entries.empty())
+        readers.push_back(RunReader{nullptr, &entries, 0, false, SortEntry()});
+    for (auto &reader : readers)
+        advance(reader);
+    merge_tree.reset(new LoserTree<ReaderLess>(readers.size(), ReaderLess{&readers}));
+    merge_tree->init();
+}
+
+bool Sort::advance(RunReader &reader)
+{
+    if (reader.file != nullptr)
+    {
+        if (!reader.file->read_string(reader.current.key) || !reader.file->read_row(column_names, reader.current.row))
+            reader.exhausted = true;
+    }
+    else if (reader.position < reader.entries->size())
+    {
+        SortEntry &entry = (*reader.entries)[reader.position++];
+        reader.current.key.swap(entry.key);
+        reader.current.row.swap(entry.row);
+    }
+    else
+    {
+        reader.exhausted = true;
+    }
+    return !reader.exhausted;
+}
+
+bool Sort::ReaderLess::operator()(size_t a, size_t b) const
+{
+    const RunReader &ra = (*readers)[a];
+    const RunReader &rb = (*readers)[b];
+    if (ra.exhausted)
+        return false;
+    if (rb.exhausted)
+        return true;
+    return entry_less(ra.current.key, rb.current.key);
+}
+
+//------------------------tests----------------------------------------------
+
+// Sorts 5000 pseudo-random rows and checks the output against std::stable_sort.
+static bool check_sort(const std::vector<SortKey> &keys, int64_t limit, size_t budget, bool expect_spill)
+{
+    std::vector<std::vector<Expr *>> rows;
+    std::vector<std::pair<int32_t, int32_t>> expected;
+    uint32_t seed = 12345;
+    for (int i = 0; i < 5000; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        int32_t a = (int32_t)(seed >> 16) % 1000 - 500;
+        rows.push_back({make_int(a), make_int(i)});
+        expected.push_back(std::make_pair(a, i));
+    }
+    bool descending = keys[0].descending;
+    std::stable_sort(expected.begin(), expected.end(),
+                     [descending](const std::pair<int32_t, int32_t> &x, const std::pair<int32_t, int32_t> &y) {
+                         return descending ? x.first > y.first : x.first < y.first;
+                     });
+    if (limit >= 0 && (size_t)limit < expected.size())
+        expected.resize(limit);
+
+    Sort sort(new Values({"a", "i"}, rows), keys, limit, budget);
+    ValueDict row;
+    size_t count = 0;
+    bool ok = true;
+    sort.open();
+    while (sort.next(row))
+    {
+        if (count >= expected.size() || row["a"].n != expected[count].first || row["i"].n != expected[count].second)
+            ok = false;
+        count++;
+    }
+    sort.close();
+    for (auto &exprs : rows)
+        for (auto expr : exprs)
+            delete expr;
+    std::cout << count << " rows, " << sort.get_spilled_runs() << " runs spilled" << std::endl;
+    return ok && count == expected.size() && (sort.get_spilled_runs() > 0) == expect_spill;
+}
+
+// test function -- returns true if all tests pass
+bool test_sort_plan()
+{
+    std::cout << "\nTesting SortPlan...." << std::endl;
+    Expr *a = make_column("a");
+    bool ok = check_sort({{a, false}}, -1, DEFAULT_MEMORY_BUDGET, false) &&
+              check_sort({{a, true}}, -1, DEFAULT_MEMORY_BUDGET, false);
+    if (ok)
+        std::cout << "in-memory sort ok" << std::endl;
+    // small enough for a couple of hundred runs, so there's an intermediate merge pass
+    ok = ok && check_sort({{a, false}}, -1, 8 * 1024, true) && check_sort({{a, true}}, -1, 8 * 1024, true);
+    if (ok)
+        std::cout << "external sort ok" << std::endl;
+    ok = ok && check_sort({{a, false}}, 10, DEFAULT_MEMORY_BUDGET, false) &&
+         check_sort({{a, true}}, 0, DEFAULT_MEMORY_BUDGET, false);
+    // a LIMIT whose rows don't fit in the budget falls back to the external sort
+    ok = ok && check_sort({{a, false}}, 2000, 8 * 1024, true) && check_sort({{a, true}}, 4999, 8 * 1024, true);
+    if (ok)
+        std::cout << "top-N ok" << std::endl;
+    // a key given as a column (e.g., ORDER BY a position a * stands for)
+    ok = ok && check_sort({{nullptr, true, "a"}}, -1, DEFAULT_MEMORY_BUDGET, false);
+    if (ok)
+        std::cout << "column key ok" << std::endl;
+    delete a;
+    return ok;
+}
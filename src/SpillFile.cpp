@@ -0,0 +1,147 @@
+/**
+ * Implementation of SpillFile, declared in SpillFile.h.
+ */
+
+#include "SpillFile.h"
+#include "Metrics.h"
+#include <atomic>
+#include <unistd.h>
+
+// Per-entry overhead of a std::map node plus the std::string headers in it.
+static const size_t MAP_ENTRY_OVERHEAD = 96;
+
+// Buffer for each spill file's stdio stream, so spilling does few large writes.
+static const size_t SPILL_BUFFER_SZ = 64 * 1024;
+
+enum SpillTag : char
+{
+    SPILL_NULL, SPILL_INT, SPILL_TEXT
+};
+
+size_t row_memory(const ValueDict &row)
+{
+    size_t bytes = sizeof(ValueDict);
+    for (auto const &column : row)
+        bytes += MAP_ENTRY_OVERHEAD + column.first.size() + column.second.s.size();
+    return bytes;
+}
+
+// Picks a unique file name in the database environment's home directory.
+static std::string spill_path()
+{
+    static std::atomic<unsigned> next_id(0);
+    const char *home = nullptr;
+    if (_DB_ENV != nullptr)
+        _DB_ENV->get_home(&home);
+    std::string dir = home == nullptr ? "." : home;
+    if (dir.empty() || dir.back() != '/')
+        dir += "/";
+    return dir + "_spill_" + std::to_string(getpid()) + "_" + std::to_string(next_id++) + ".tmp";
+}
+
+SpillFile::SpillFile() : path(spill_path()), file(nullptr), row_count(0), size(0), buffer(SPILL_BUFFER_SZ)
+{
+    file = fopen(path.c_str(), "w+b");
+    if (file == nullptr)
+        throw DbRelationError("could not create spill file " + path);
+    setvbuf(file, buffer.data(), _IOFBF, buffer.size());
+}
+
+SpillFile::~SpillFile()
+{
+    if (file != nullptr)
+        fclose(file);
+    std::remove(path.c_str());
+}
+
+void SpillFile::write(const void *data, size_t size)
+{
+    if (fwrite(data, 1, size, file) != size)
+        throw DbRelationError("could not write spill file " + path);
+    this->size += size;
+    METRIC_ADD(SPILL_BYTES_WRITTEN, size);
+}
+
+void SpillFile::write_string(const std::string &s)
+{
+    uint32_t length = (uint32_t)s.size();
+    write(&length, sizeof(length));
+    write(s.data(), length);
+}
+
+// Each value is a tag byte followed by an int32_t or a length-prefixed string.
+void SpillFile::write_row(const ColumnNames &column_names, const ValueDict &row)
+{
+    for (auto const &column_name : column_names)
+    {
+        auto it = row.find(column_name);
+        if (it == row.end() || it->second.is_null)
+        {
+            char tag = SPILL_NULL;
+            write(&tag, 1);
+        }
+        else if (it->second.data_type == ColumnAttribute::INT)
+        {
+            char tag = SPILL_INT;
+            write(&tag, 1);
+            write(&it->second.n, sizeof(int32_t));
+        }
+        else
+        {
+            char tag = SPILL_TEXT;
+            write(&tag, 1);
+            write_string(it->second.s);
+        }
+    }
+    row_count++;
+}
+
+void SpillFile::rewind()
+{
+    fflush(file);
+    std::rewind(file);
+}
+
+bool SpillFile::read(void *data, size_t size)
+{
+    return fread(data, 1, size, file) == size;
+}
+
+bool SpillFile::read_string(std::string &s)
+{
+    uint32_t length;
+    if (!read(&length, sizeof(length)))
+        return false;
+    s.resize(length);
+    return length == 0 || read(&s[0], length);
+}
+
+bool SpillFile::read_row(const ColumnNames &column_names, ValueDict &row)
+{
+    row.clear();
+    for (auto const &column_name : column_names)
+    {
+        char tag;
+        if (!read(&tag, 1))
+            return false;
+        if (tag == SPILL_NULL)
+        {
+            row[column_name] = Value::null();
+        }
+        else if (tag == SPILL_INT)
+        {
+            int32_t n;
+            if (!read(&n, sizeof(n)))
+                return false;
+            row[column_name] = Value(n);
+        }
+        else
+        {
+            std::string s;
+            if (!read_string(s))
+                return false;
+            row[column_name] = Value(s);
+        }
+    }
+    return true;
+}
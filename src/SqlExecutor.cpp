@@ -1,139 +1,1241 @@
 /**
  * Implementation of the SqlExecutor class defined in SqlExecutor.h.
  * This source file contains the logic for executing SQL statements,
- * specifically focusing on 'SELECT' and 'CREATE TABLE' queries. It
- * details how these statements are parsed and transformed into string
- * representations to simulate SQL queries execution.
+ * specifically focusing on 'SELECT', 'INSERT' and 'CREATE TABLE' queries.
+ * Each statement is turned into a tree of QueryPlan operators which is then
+ * opened, drained with next() into a ResultSink and closed. SELECT and INSERT plans are cached
+ * and run again for later statements of the same shape.
  */
 
 #include "SqlExecutor.h"
 #include "SQLParser.h"
+#include "JoinPlan.h"
+#include "SortPlan.h"
+#include "AggregatePlan.h"
+#include "Metrics.h"
+#include "transactions.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <iomanip>
 #include <string>
 #include <sstream>
 #include <iostream>
 
 using namespace hsql;
-SqlExecutor::SqlExecutor() {}
+
+Tables *SqlExecutor::tables = nullptr;
+PlanCache *SqlExecutor::plan_cache = nullptr;
+std::atomic<size_t> SqlExecutor::catalog_version(0);
+
+SqlExecutor::SqlExecutor()
+{
+    static std::mutex shared_lock;  // sessions may start concurrently
+    std::lock_guard<std::mutex> guard(shared_lock);
+    if (SqlExecutor::tables == nullptr)
+        SqlExecutor::tables = new Tables();
+    if (SqlExecutor::plan_cache == nullptr)
+        SqlExecutor::plan_cache = new PlanCache();
+}
 
 SqlExecutor::~SqlExecutor() {}
 
-std::string SqlExecutor::execute(const SQLStatement *query)
+void SqlExecutor::execute(const SQLStatement *query, ResultSink &sink)
 {
     if (query->type() == kStmtSelect)
-    {
-        return handleSelect((const SelectStatement *)query);
-    }
+        handleSelect((const SelectStatement *)query, sink);
     else if (query->type() == kStmtCreate)
-    {
-        return handleCreate((const CreateStatement *)query);
-    }
+        sink.message(handleCreate((const CreateStatement *)query));
     else if (query->type() == kStmtInsert)
+        sink.message(handleInsert((const InsertStatement *)query));
+    else if (query->type() == kStmtDrop)
+        sink.message(handleDrop((const DropStatement *)query));
+    else
+        sink.message("The only handled queries are `SELECT`, `INSERT`, `CREATE TABLE`, `CREATE INDEX` and `DROP TABLE`");
+}
+
+// Splits off the first word of text and returns it; text is left with the rest.
+static std::string next_word(std::string &text)
+{
+    size_t start = 0;
+    while (start < text.size() && isspace((unsigned char)text[start]))
+        start++;
+    size_t end = start;
+    while (end < text.size() && (isalnum((unsigned char)text[end]) || text[end] == '_'))
+        end++;
+    std::string word = text.substr(start, end - start);
+    text.erase(0, end);
+    return word;
+}
+
+static std::string upper(std::string word)
+{
+    for (auto &c : word)
+        c = (char)toupper((unsigned char)c);
+    return word;
+}
+
+// Runs the statement into a TextSink over a string, less the final line break.
+std::string SqlExecutor::execute(const std::string &sql)
+{
+    std::ostringstream out;
     {
-        return handleInsert((const InsertStatement *)query);
+        TextSink sink(out);
+        execute(sql, sink);
     }
-    return "The only handled queries are `SELECT` and `CREATE TABLE`";
+    std::string output = out.str();
+    if (!output.empty() && output.back() == '\n')
+        output.pop_back();
+    return output;
 }
 
-std::string SqlExecutor::handleInsert(const InsertStatement *inStmt)
+void SqlExecutor::execute(const std::string &sql, ResultSink &sink)
 {
-    std::stringstream ss;
-    ss << "INSERT INTO " << inStmt->tableName << " ";
-    if (inStmt->columns != NULL)
+    METRIC_INC(STATEMENTS);
+    METRIC_TIME(STATEMENT_LATENCY);
+
+    // PREPARE, EXECUTE, DEALLOCATE, EXPLAIN, SHOW STATS, VACUUM, ANALYZE and CREATE TABLE ...
+    // USING are handled here rather than by the parser
+    std::string rest = sql;
+    std::string command = upper(next_word(rest));
+    if (command == "EXPLAIN")
     {
-        ss << "(";
-        //  handle column list
-        size_t count = inStmt->columns->size();
-        for (size_t i = 0; i < count; ++i)
+        std::string statement = rest;
+        bool analyze = upper(next_word(statement)) == "ANALYZE";
+        sink.message(handleExplain(analyze ? statement : rest, analyze));
+        return;
+    }
+    if (command == "SHOW")
+    {
+        std::string what = rest;
+        if (upper(next_word(what)) == "STATS")
+        {
+            while (!what.empty() && (isspace((unsigned char)what.back()) || what.back() == ';'))
+                what.pop_back();
+            if (what.find_first_not_of(" \t\r\n") == std::string::npos)
+            {
+                sink.message(handleShowStats());
+                return;
+            }
+        }
+    }
+    if (command == "VACUUM")
+    {
+        while (!rest.empty() && (isspace((unsigned char)rest.back()) || rest.back() == ';'))
+            rest.pop_back();
+        std::string table_name = next_word(rest);
+        if (table_name.empty() || rest.find_first_not_of(" \t\r\n") != std::string::npos)
+            throw SQLExecError("expected VACUUM table");
+        sink.message(handleVacuum(table_name));
+        return;
+    }
+    if (command == "ANALYZE")
+    {
+        while (!rest.empty() && (isspace((unsigned char)rest.back()) || rest.back() == ';'))
+            rest.pop_back();
+        std::string table_name = next_word(rest);
+        if (table_name.empty() || rest.find_first_not_of(" \t\r\n") != std::string::npos)
+            throw SQLExecError("expected ANALYZE table");
+        sink.message(handleAnalyze(table_name));
+        return;
+    }
+    if (command == "CREATE")
+    {
+        // the parser has no storage engine clause, so it only sees what comes before it
+        std::string statement = rest;
+        while (!statement.empty() && (isspace((unsigned char)statement.back()) || statement.back() == ';'))
+            statement.pop_back();
+        size_t close = statement.rfind(')');
+        std::string tail = close == std::string::npos ? "" : statement.substr(close + 1);
+        if (upper(next_word(tail)) == "USING")
         {
-            ss << inStmt->columns->at(i);
+            std::string engine = next_word(tail);
+            if (engine.empty() || tail.find_first_not_of(" \t\r\n") != std::string::npos)
+                throw SQLExecError("expected CREATE TABLE table (columns) USING engine");
+            sink.message(handleCreateUsing("CREATE" + statement.substr(0, close + 1), engine));
+            return;
+        }
+    }
+    if (command == "PREPARE" || command == "EXECUTE" || command == "DEALLOCATE")
+    {
+        while (!rest.empty() && (isspace((unsigned char)rest.back()) || rest.back() == ';'))
+            rest.pop_back();
+        std::string name = next_word(rest);
+        if (command == "DEALLOCATE" && upper(name) == "PREPARE")
+            name = next_word(rest);
+        if (name.empty())
+            throw SQLExecError(command + " needs a statement name");
 
-            // Add a comma and space after each element except the last one
-            if (i < count - 1)
+        if (command == "PREPARE")
+        {
+            std::string keyword = upper(next_word(rest));
+            if (keyword != "AS" && keyword != "FROM")
+                throw SQLExecError("expected PREPARE " + name + " AS statement");
+            sink.message(handlePrepare(name, rest));
+            return;
+        }
+        if (command == "EXECUTE")
+        {
+            size_t open = rest.find_first_not_of(" \t\r\n");
+            if (open == std::string::npos)
             {
-                ss << ", ";
+                handleExecute(name, "", sink);
+                return;
             }
+            if (rest[open] != '(' || rest.back() != ')')
+                throw SQLExecError("expected EXECUTE " + name + " (value, ...)");
+            handleExecute(name, rest.substr(open + 1, rest.size() - open - 2), sink);
+            return;
         }
-        ss << ") ";
+        if (prepared.erase(name) == 0)
+            throw SQLExecError("no prepared statement named " + name);
+        sink.message("deallocated " + name);
+        return;
     }
-    switch (inStmt->type)
+
+    // a repeat of a statement's shape skips parsing and planning
+    std::string normalized;
+    std::vector<Value> parameters;
+    if (normalize_sql(sql, normalized, parameters))
     {
-    case InsertStatement::kInsertValues:
+        std::shared_ptr<PreparedStatement> statement = plan_cache->find(normalized);
+        std::unique_lock<std::mutex> running;
+        if (statement != nullptr)
+            running = std::unique_lock<std::mutex>(statement->running, std::try_to_lock);
+        if (!running.owns_lock())
+        {
+            // plan a miss and cache it; if another session is running the cached plan, build a
+            // private one rather than wait
+            bool miss = statement == nullptr;
+            statement = prepare(normalized, parameters.size());
+            if (statement != nullptr)
+            {
+                running = std::unique_lock<std::mutex>(statement->running);
+                if (miss)
+                    plan_cache->insert(normalized, statement);
+            }
+        }
+        if (statement != nullptr)
+        {
+            runPrepared(*statement, parameters, sink, true);
+            return;
+        }
+    }
+
+    SQLParserResult *result = SQLParser::parseSQLString(sql);
+    if (!result->isValid())
+    {
+        delete result;
+        sink.message("invalid SQL: " + sql);
+        return;
+    }
+    try
     {
-        ss << "VALUES (";
-        size_t exprCount = inStmt->values->size();
-        for (size_t i = 0; i < exprCount; ++i)
+        for (size_t i = 0; i < result->size(); i++)
         {
-            handleExpression(inStmt->values->at(i), ss);
-            if (i < exprCount - 1)
+            const SQLStatement *statement = result->getStatement(i);
+            if (result->size() == 1)
             {
-                ss << ", ";
+                execute(statement, sink);
             }
+            else
+            {
+                // each statement of several gets its own result, as if entered alone
+                try
+                {
+                    execute(statement, sink);
+                }
+                catch (SQLExecError &e)
+                {
+                    sink.message(std::string("Error: ") + e.what());
+                }
+                catch (DbRelationError &e)
+                {
+                    sink.message(std::string("Error: ") + e.what());
+                }
+            }
+            if (statement->type() == kStmtCreate)
+                invalidatePlans(((const CreateStatement *)statement)->tableName);
+        }
+    }
+    catch (...)
+    {
+        delete result;
+        throw;
+    }
+    delete result;
+}
+
+std::shared_ptr<PreparedStatement> SqlExecutor::prepare(const std::string &sql, size_t parameter_count)
+{
+    SQLParserResult *result = SQLParser::parseSQLString(sql);
+    if (!result->isValid() || result->size() != 1 ||
+        (result->getStatement(0)->type() != kStmtSelect && result->getStatement(0)->type() != kStmtInsert))
+    {
+        delete result;
+        return nullptr;
+    }
+    return std::make_shared<PreparedStatement>(result, parameter_count);
+}
+
+void SqlExecutor::runPrepared(PreparedStatement &statement, const std::vector<Value> &parameters, ResultSink &sink,
+                              bool literals)
+{
+    if (parameters.size() != statement.parameter_count)
+        throw SQLExecError("expected " + std::to_string(statement.parameter_count) + " parameters but got " +
+                           std::to_string(parameters.size()));
+
+    const SQLStatement *query = statement.get_statement();
+    size_t version = catalog_version;
+    if (statement.plan != nullptr && statement.catalog_version != version)
+    {
+        // planned before a change to the catalog or its statistics
+        statement.invalidate();
+        METRIC_INC(PLANS_REBUILT);
+    }
+    if (statement.plan == nullptr)
+    {
+        statement.catalog_version = version;
+        std::set<Identifier> names;
+        if (query->type() == kStmtSelect)
+        {
+            const SelectStatement *select = (const SelectStatement *)query;
+            statement.plan = buildSelectPlan(select);
+            if (select->fromTable != NULL)
+                collectTables(select->fromTable, names);
         }
+        else
+        {
+            const InsertStatement *insert = (const InsertStatement *)query;
+            statement.plan = buildInsertPlan(insert);
+            names.insert(insert->tableName);
+            if (insert->select != NULL && insert->select->fromTable != NULL)
+                collectTables(insert->select->fromTable, names);
+        }
+        statement.tables = names;
+    }
+
+    bind_parameters(&parameters, literals);
+    try
+    {
+        if (query->type() == kStmtSelect)
+            runSelectPlan(statement.plan, sink);
+        else
+            sink.message(runInsertPlan((Insert *)statement.plan, ((const InsertStatement *)query)->tableName));
+        bind_parameters(nullptr);
+    }
+    catch (...)
+    {
+        bind_parameters(nullptr);
+        throw;
+    }
+}
+
+std::string SqlExecutor::handlePrepare(const Identifier &name, const std::string &body)
+{
+    if (prepared.find(name) != prepared.end())
+        throw SQLExecError("prepared statement already exists: " + name);
+    std::shared_ptr<PreparedStatement> statement = prepare(body, count_placeholders(body));
+    if (statement == nullptr)
+        throw SQLExecError("only a single valid SELECT or INSERT can be prepared");
+    prepared[name] = statement;
+    return "prepared " + name;
+}
+
+void SqlExecutor::handleExecute(const Identifier &name, const std::string &arguments, ResultSink &sink)
+{
+    auto found = prepared.find(name);
+    if (found == prepared.end())
+        throw SQLExecError("no prepared statement named " + name);
+
+    // the arguments are evaluated as a select list
+    std::vector<Value> parameters;
+    if (arguments.find_first_not_of(" \t\r\n") != std::string::npos)
+    {
+        SQLParserResult *result = SQLParser::parseSQLString("SELECT " + arguments);
+        if (!result->isValid() || result->size() != 1)
+        {
+            delete result;
+            throw SQLExecError("invalid EXECUTE arguments: " + arguments);
+        }
+        try
+        {
+            for (auto const expr : *((const SelectStatement *)result->getStatement(0))->selectList)
+                parameters.push_back(evaluate(expr, ValueDict()));
+        }
+        catch (...)
+        {
+            delete result;
+            throw;
+        }
+        delete result;
+    }
+    std::lock_guard<std::mutex> guard(found->second->running);
+    runPrepared(*found->second, parameters, sink);
+}
+
+// The statement is planned the way execute plans it when the plan cache misses: from its
+// normalized text, before its literals are bound. So the plan explained is the plan that
+// runs, estimated without the literals' values as that one is.
+std::string SqlExecutor::handleExplain(const std::string &sql, bool analyze)
+{
+    std::string normalized;
+    std::vector<Value> parameters;
+    bool literals = normalize_sql(sql, normalized, parameters);
+    SQLParserResult *result = SQLParser::parseSQLString(literals ? normalized : sql);
+    if (!result->isValid() || result->size() != 1)
+    {
+        delete result;
+        throw SQLExecError("EXPLAIN needs one SELECT or INSERT statement");
+    }
+    const SQLStatement *statement = result->getStatement(0);
+    PlanOperator *plan = nullptr;
+    std::stringstream ss;
+    try
+    {
+        Insert *insert = nullptr;
+        if (statement->type() == kStmtSelect)
+            plan = buildSelectPlan((const SelectStatement *)statement);
+        else if (statement->type() == kStmtInsert)
+            plan = insert = buildInsertPlan((const InsertStatement *)statement);
+        else
+            throw SQLExecError("EXPLAIN needs one SELECT or INSERT statement");
+        bind_parameters(&parameters, literals);
+
+        size_t count = 0;
+        double milliseconds = 0;
+        if (analyze)
+        {
+            analyze_plan(plan);
+            auto start = std::chrono::steady_clock::now();
+            Transaction transaction;
+            ValueDict row;
+            PlanRun run(plan);
+            while (plan->next(row))
+                count++;
+            run.close();
+            transaction.commit();
+            if (insert != nullptr)
+                finishInsert(((const InsertStatement *)statement)->tableName);
+            milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        explainOperator(plan, 0, ss);
+        if (analyze)
+        {
+            if (insert != nullptr)
+                count = insert->get_row_count();
+            ss << (insert != nullptr ? "inserted " : "returned ") << count << (count == 1 ? " row" : " rows")
+               << " in " << std::fixed << std::setprecision(3) << milliseconds << " ms";
+        }
+    }
+    catch (...)
+    {
+        bind_parameters(nullptr);
+        delete plan;
+        delete result;
+        throw;
+    }
+    std::string output = with_literals(ss.str());
+    bind_parameters(nullptr);
+    delete plan;
+    delete result;
+    if (!output.empty() && output.back() == '\n')
+        output.pop_back();
+    return output;
+}
+
+void SqlExecutor::explainOperator(PlanOperator *op, size_t depth, std::stringstream &ss)
+{
+    AnalyzedOperator *analyzed = dynamic_cast<AnalyzedOperator *>(op);
+    LabeledExpressions expressions;
+    op->get_expressions(expressions);
+    explainLine(op->get_name(), op->estimated_rows(), expressions,
+                analyzed != nullptr ? &analyzed->get_stats() : nullptr, depth, ss);
+    for (auto const child : op->get_children())
+        explainOperator(*child, depth + 1, ss);
+    for (auto const child : op->get_batch_children())
+        explainBatchOperator(*child, depth + 1, ss);
+}
+
+void SqlExecutor::explainBatchOperator(BatchOperator *op, size_t depth, std::stringstream &ss)
+{
+    AnalyzedBatchOperator *analyzed = dynamic_cast<AnalyzedBatchOperator *>(op);
+    LabeledExpressions expressions;
+    op->get_expressions(expressions);
+    explainLine(op->get_name(), op->estimated_rows(), expressions,
+                analyzed != nullptr ? &analyzed->get_stats() : nullptr, depth, ss);
+    for (auto const child : op->get_children())
+        explainBatchOperator(*child, depth + 1, ss);
+}
+
+void SqlExecutor::explainLine(const std::string &name, size_t estimated_rows, const LabeledExpressions &expressions,
+                              const OperatorStats *stats, size_t depth, std::stringstream &ss)
+{
+    std::string indent(depth * 4, ' ');
+    ss << indent << (depth > 0 ? "-> " : "") << name << "  (estimated rows " << estimated_rows << ")";
+    if (stats != nullptr)
+    {
+        ss << " (rows " << stats->rows;
+        if (stats->batches > 0)
+            ss << " in " << stats->batches << (stats->batches == 1 ? " batch" : " batches");
+        ss << ", blocks " << stats->blocks_read;
+        ss << ", time " << std::fixed << std::setprecision(3) << stats->nanoseconds / 1e6 << " ms";
+        if (stats->peak_memory > 0)
+            ss << ", memory " << std::setprecision(1) << stats->peak_memory / 1024.0 << " KB";
         ss << ")";
+        ss.unsetf(std::ios::fixed);
+        ss << std::setprecision(6);
+    }
+    ss << std::endl;
+
+    // expressions go under the operator's name
+    if (depth > 0)
+        indent += "   ";
+    for (auto const &labeled : expressions)
+    {
+        ss << indent << "    " << labeled.first << ": ";
+        for (size_t i = 0; i < labeled.second.size(); i++)
+        {
+            if (i > 0)
+                ss << ", ";
+            handleExpression(labeled.second[i], ss);
+        }
+        ss << std::endl;
+    }
+}
+
+std::string SqlExecutor::handleShowStats()
+{
+    std::stringstream ss;
+    ss << format_metrics() << std::endl
+       << std::endl
+       << "plan cache: " << plan_cache->size() << " plans, " << plan_cache->get_hits() << " hits, "
+       << plan_cache->get_misses() << " misses";
+    return ss.str();
+}
+
+std::string SqlExecutor::handleVacuum(const Identifier &table_name)
+{
+    if (tables->get_engine(table_name) == "LSM")
+        throw SQLExecError("VACUUM is not supported for LSM table '" + table_name + "'");  // merges drop dead versions
+    HeapTable *table = dynamic_cast<HeapTable *>(&tables->get_table(table_name));
+    if (table == nullptr)
+        throw SQLExecError("cannot vacuum " + table_name);
+    VacuumStats stats = table->vacuum();
+    std::stringstream ss;
+    ss << "vacuumed " << table_name << ": " << stats.versions_reclaimed << " dead versions reclaimed, "
+       << stats.slots_freed << " slots freed, " << stats.rows_moved << " rows moved, " << stats.blocks_truncated
+       << " blocks truncated";
+    return ss.str();
+}
+
+std::string SqlExecutor::handleAnalyze(const Identifier &table_name)
+{
+    std::shared_ptr<TableStats> stats = tables->analyze(table_name);
+    invalidatePlans(table_name);
+    std::stringstream ss;
+    ss << "analyzed " << table_name << ": about " << stats->get_row_count() << " rows in "
+       << stats->get_block_count() << " blocks (" << stats->get_sampled_blocks() << " sampled)";
+    return ss.str();
+}
+
+// Prepared statements, this session's or another's, see the new version when they next run.
+void SqlExecutor::invalidatePlans(const Identifier &table_name)
+{
+    catalog_version++;
+    plan_cache->invalidate(table_name);
+}
+
+void SqlExecutor::collectTables(const TableRef *table, std::set<Identifier> &names)
+{
+    switch (table->type)
+    {
+    case kTableName:
+        names.insert(table->name);
+        break;
+    case kTableJoin:
+        collectTables(table->join->left, names);
+        collectTables(table->join->right, names);
         break;
+    case kTableCrossProduct:
+        for (auto const table_ref : *table->list)
+            collectTables(table_ref, names);
+        break;
+    default:
+        break;
+    }
+}
+
+std::string SqlExecutor::handleInsert(const InsertStatement *inStmt)
+{
+    Insert *plan = buildInsertPlan(inStmt);
+    std::string output;
+    try
+    {
+        output = runInsertPlan(plan, inStmt->tableName);
+    }
+    catch (...)
+    {
+        delete plan;
+        throw;
     }
+    delete plan;
+    return output;
+}
+
+Insert *SqlExecutor::buildInsertPlan(const InsertStatement *inStmt)
+{
+    DbRelation &table = tables->get_table(inStmt->tableName);
+
+    // the columns being filled, in the order the values are given
+    ColumnNames target_columns;
+    if (inStmt->columns != NULL)
+    {
+        for (auto const column_name : *inStmt->columns)
+            target_columns.push_back(column_name);
+    }
+    else
+    {
+        target_columns = table.get_column_names();
+    }
+
+    PlanOperator *source;
+    switch (inStmt->type)
+    {
+    case InsertStatement::kInsertValues:
+        source = new Values(target_columns, std::vector<std::vector<Expr *>>(1, *inStmt->values));
+        break;
     case InsertStatement::kInsertSelect:
-        ss << handleSelect(inStmt->select);
+        source = buildSelectPlan(inStmt->select);
         break;
+    default:
+        throw SQLExecError("unsupported INSERT");
     }
-    return ss.str();
+
+    return new Insert(table, source, target_columns);
 }
 
-std::string SqlExecutor::handleSelect(const SelectStatement *selectStmt)
+std::string SqlExecutor::runInsertPlan(Insert *plan, const Identifier &table_name)
 {
+    // all the rows or none of them
+    Transaction transaction;
+    ValueDict row;
+    PlanRun run(plan);
+    plan->next(row);
+    run.close();
+    transaction.commit();
+    finishInsert(table_name);
+
     std::stringstream ss;
+    ss << "successfully inserted " << plan->get_row_count() << " row" << (plan->get_row_count() == 1 ? "" : "s")
+       << " into " << table_name;
+    return ss.str();
+}
 
-    ss << "SELECT ";
+void SqlExecutor::finishInsert(const Identifier &table_name)
+{
+    HeapTable *table = dynamic_cast<HeapTable *>(&tables->get_table(table_name));
+    if (table != nullptr)
+    {
+        table->summarize();  // the block ranges the rows filled, now that no transaction holds their pages
+        tables->save_statistics(*table);
+    }
+}
+
+void SqlExecutor::handleSelect(const SelectStatement *selectStmt, ResultSink &sink)
+{
+    PlanOperator *plan = buildSelectPlan(selectStmt);
+    try
+    {
+        runSelectPlan(plan, sink);
+    }
+    catch (...)
+    {
+        delete plan;
+        throw;
+    }
+    delete plan;
+}
+
+// Each row goes to the sink as soon as the plan produces it; the plan is closed however
+// the run ends, since a cached plan outlives it. A plan cached for a statement's shape
+// names its columns with placeholders, so they are relabeled with this run's literals.
+void SqlExecutor::runSelectPlan(PlanOperator *plan, ResultSink &sink)
+{
+    ColumnNames column_names = plan->get_column_names();
+    ColumnNames labels;
+    for (auto const &column_name : column_names)
+        labels.push_back(with_literals(column_name));
+    bool relabel = labels != column_names;
+
+    ValueDict row, labeled;
+    PlanRun run(plan);
+    bool more = plan->next(row);
+    sink.begin(labels);
+    while (more)
+    {
+        if (relabel)
+        {
+            for (size_t i = 0; i < column_names.size(); i++)
+                labeled[labels[i]] = row[column_names[i]];
+            sink.row(labeled);
+        }
+        else
+        {
+            sink.row(row);
+        }
+        more = plan->next(row);
+    }
+    run.close();
+    sink.end();
+}
+
+PlanOperator *SqlExecutor::buildSelectPlan(const SelectStatement *selectStmt)
+{
+    std::vector<const Expr *> conjuncts;
+    split_conjuncts(selectStmt->whereClause, conjuncts);
+
+    PlanOperator *plan;
+    if (selectStmt->fromTable == NULL)
+        plan = new Values(ColumnNames(), std::vector<std::vector<Expr *>>(1));
+    else if (selectStmt->fromTable->type == kTableName && selectStmt->fromTable->alias == NULL)
+        plan = buildScanPlan(tables->get_table(selectStmt->fromTable->name), "", conjuncts);
+    else
+        plan = buildTableRefPlan(selectStmt->fromTable, conjuncts);
+
+    // whatever of the WHERE clause couldn't be pushed down
+    if (!conjuncts.empty())
+        plan = new Filter(plan, conjuncts);
+
+    // GROUP BY / aggregate functions, then HAVING
+    std::vector<Aggregate> aggregates;
+    for (auto const expr : *selectStmt->selectList)
+        collectAggregates(expr, aggregates);
+    if (selectStmt->groupBy != NULL && selectStmt->groupBy->having != NULL)
+        collectAggregates(selectStmt->groupBy->having, aggregates);
+    if (selectStmt->order != NULL)
+        for (auto const order : *selectStmt->order)
+            collectAggregates(order->expr, aggregates);
+    if (!aggregates.empty() || selectStmt->groupBy != NULL)
+    {
+        std::vector<const Expr *> group_by;
+        if (selectStmt->groupBy != NULL && selectStmt->groupBy->columns != NULL)
+            group_by.assign(selectStmt->groupBy->columns->begin(), selectStmt->groupBy->columns->end());
+        plan = new HashAggregate(plan, group_by, aggregates);
+        if (selectStmt->groupBy != NULL && selectStmt->groupBy->having != NULL)
+            plan = new Filter(plan, selectStmt->groupBy->having);
+    }
+
+    // ORDER BY, below the projection so it can use columns that aren't selected
+    if (selectStmt->order != NULL)
+    {
+        std::vector<SortKey> keys;
+        for (auto const order : *selectStmt->order)
+            keys.push_back(resolveOrderKey(order, *selectStmt->selectList, plan->get_column_names()));
+        int64_t top_n = -1;  // DISTINCT may need more rows than the limit, to make up for duplicates
+        if (selectStmt->limit != NULL && selectStmt->limit->limit >= 0 && !selectStmt->selectDistinct)
+            top_n = selectStmt->limit->limit + std::max(selectStmt->limit->offset, (int64_t)0);
+        plan = new Sort(plan, keys, top_n);
+    }
+
+    // Select list, without duplicate rows for DISTINCT
+    plan = new Project(plan, *selectStmt->selectList);
     if (selectStmt->selectDistinct)
+        plan = new Distinct(plan);
+
+    // LIMIT / OFFSET
+    if (selectStmt->limit != NULL)
+        plan = new Limit(plan, selectStmt->limit->limit, selectStmt->limit->offset);
+    return plan;
+}
+
+void SqlExecutor::collectAggregates(const Expr *expr, std::vector<Aggregate> &aggregates)
+{
+    if (expr == NULL)
+        return;
+    Aggregate aggregate;
+    if (Aggregate::from_expr(expr, aggregate))
     {
-        ss << "DISTINCT ";
+        for (auto const &existing : aggregates)
+            if (existing.name == aggregate.name)
+                return;
+        aggregates.push_back(aggregate);
+        return;
     }
+    collectAggregates(expr->expr, aggregates);
+    collectAggregates(expr->expr2, aggregates);
+    if (expr->exprList != NULL)
+        for (auto const arg : *expr->exprList)
+            collectAggregates(arg, aggregates);
+}
 
-    // Select list
-    size_t count = selectStmt->selectList->size();
-    for (size_t i = 0; i < count; ++i)
+SortKey SqlExecutor::resolveOrderKey(const OrderDescription *order, const std::vector<Expr *> &select_list,
+                                     const ColumnNames &input_columns)
+{
+    const Expr *expr = order->expr;
+    bool descending = order->type == kOrderDesc;
+    // ORDER BY 2 means the second column of the result, counting each column a * stands for
+    if (expr->type == kExprLiteralInt)
     {
-        hsql::Expr *expr = selectStmt->selectList->at(i);
-        handleExpression(expr, ss);
+        int64_t position = expr->ival;
+        for (auto const item : select_list)
+        {
+            if (position < 1)
+                break;
+            if (item->type != kExprStar)
+            {
+                if (position == 1)
+                    return SortKey{item, descending};
+                position--;
+                continue;
+            }
+            // as Project expands it: every input column
+            if ((size_t)position <= input_columns.size())
+                return SortKey{nullptr, descending, input_columns[position - 1]};
+            position -= input_columns.size();
+        }
+        throw SQLExecError("ORDER BY position " + std::to_string(expr->ival) + " is not in the select list");
+    }
+    // ORDER BY alias means that select-list item
+    if (expr->type == kExprColumnRef && !expr->hasTable())
+        for (auto const item : select_list)
+            if (item->hasAlias() && strcmp(item->alias, expr->name) == 0)
+                return SortKey{item, descending};
+    return SortKey{expr, descending};
+}
 
-        // Add a comma and space after each element except the last one
-        if (i < count - 1)
+PlanOperator *SqlExecutor::buildScanPlan(DbRelation &table, const Identifier &qualifier,
+                                         std::vector<const Expr *> &conjuncts)
+{
+    // take the conjuncts that only refer to this table
+    ColumnNames column_names = qualify(table.get_column_names(), qualifier);
+    std::vector<const Expr *> local;
+    for (auto it = conjuncts.begin(); it != conjuncts.end();)
+    {
+        if (resolves_in(*it, column_names))
+        {
+            local.push_back(*it);
+            it = conjuncts.erase(it);
+        }
+        else
         {
-            ss << ", ";
+            ++it;
         }
     }
 
-    // FROM Clause
-    ss << " FROM ";
-    handleTableRef(selectStmt->fromTable, ss);
+    HeapTable *heap_table = dynamic_cast<HeapTable *>(&table);
+    if (heap_table == nullptr)
+    {
+        PlanOperator *scan = new TableScan(table, qualifier);
+        return local.empty() ? scan : new Filter(scan, local);
+    }
 
-    // WHERE Clause
-    if (selectStmt->whereClause != NULL)
+    // compile what we can into batch kernels run by the scan itself, so it only decodes
+    // the rest of the rows that pass; the rest is filtered row by row
+    BatchTableScan *scan = new BatchTableScan(*heap_table, qualifier);
+    std::vector<const Expr *> compiled, uncompiled;
+    for (auto const expr : local)
     {
-        ss << " WHERE ";
-        handleExpression(selectStmt->whereClause, ss);
+        BatchPredicate *predicate = BatchPredicate::compile(expr, scan->get_column_names(), scan->get_column_attributes());
+        if (predicate != NULL)
+        {
+            scan->add_filter(predicate, expr);
+            compiled.push_back(expr);
+        }
+        else
+        {
+            uncompiled.push_back(expr);
+        }
     }
-    return ss.str();
+
+    // estimate the rows from the table's statistics, and see whether its BRIN indexes pay
+    JoinInput input;
+    input.column_names = column_names;
+    input.table_column_names = table.get_column_names();
+    input.stats = heap_table->get_stats();
+    input.rows = (double)heap_table->estimated_row_count();
+    std::vector<JoinInput> inputs(1, input);
+    if (!compiled.empty())
+    {
+        scan->set_selectivity(Optimizer::selectivity(compiled, inputs));
+        Optimizer::choose_access_path(*scan);
+    }
+    PlanOperator *plan = new BatchToRows(scan, qualifier);
+    if (!uncompiled.empty())
+    {
+        Filter *filter = new Filter(plan, uncompiled);
+        filter->set_selectivity(Optimizer::selectivity(uncompiled, inputs));
+        plan = filter;
+    }
+    return plan;
 }
 
-std::string SqlExecutor::handleCreate(const CreateStatement *createStmt)
+// Moves the conjuncts of the form left-expression = right-expression into the key lists.
+// If take_residual, the other conjuncts that refer only to these two inputs are moved to residual.
+static void extract_join_keys(std::vector<const Expr *> &conjuncts, const ColumnNames &left, const ColumnNames &right,
+                              bool take_residual, std::vector<const Expr *> &left_keys,
+                              std::vector<const Expr *> &right_keys, std::vector<const Expr *> &residual)
 {
-    std::stringstream ss;
-    ss << "CREATE TABLE " << createStmt->tableName << " (";
-    size_t numColumns = createStmt->columns->size();
-    for (size_t i = 0; i < numColumns; ++i)
+    ColumnNames both(left);
+    both.insert(both.end(), right.begin(), right.end());
+    for (auto it = conjuncts.begin(); it != conjuncts.end();)
+    {
+        const Expr *expr = *it;
+        if (!resolves_in(expr, both))
+        {
+            ++it;
+            continue;
+        }
+        if (expr->type == kExprOperator && expr->opType == Expr::SIMPLE_OP && expr->opChar == '=')
+        {
+            if (resolves_in(expr->expr, left) && resolves_in(expr->expr2, right) && !resolves_in(expr->expr, right))
+            {
+                left_keys.push_back(expr->expr);
+                right_keys.push_back(expr->expr2);
+                it = conjuncts.erase(it);
+                continue;
+            }
+            if (resolves_in(expr->expr, right) && resolves_in(expr->expr2, left) && !resolves_in(expr->expr2, right))
+            {
+                left_keys.push_back(expr->expr2);
+                right_keys.push_back(expr->expr);
+                it = conjuncts.erase(it);
+                continue;
+            }
+        }
+        if (take_residual)
+        {
+            residual.push_back(expr);
+            it = conjuncts.erase(it);
+            continue;
+        }
+        ++it;
+    }
+}
+
+// Hash join if there's an equality to hash on, otherwise nested loops. The selectivity is
+// that of all the join's conditions (or negative if it isn't known).
+static PlanOperator *make_join(PlanOperator *left, PlanOperator *right, JoinKind join_type,
+                               std::vector<const Expr *> &left_keys, std::vector<const Expr *> &right_keys,
+                               std::vector<const Expr *> &residual, double selectivity = -1,
+                               BuildSide build_side = BUILD_SMALLER)
+{
+    if (left_keys.empty())
+    {
+        NestedLoopJoin *join = new NestedLoopJoin(left, right, join_type, residual);
+        join->set_selectivity(selectivity);
+        return join;
+    }
+    HashJoin *join = new HashJoin(left, right, left_keys, right_keys, join_type, residual);
+    join->set_selectivity(selectivity);
+    join->set_build_side(build_side);
+    return join;
+}
+
+static JoinKind join_kind(const JoinDefinition *join)
+{
+    if (join->type == kJoinLeft)
+        return LEFT_OUTER_JOIN;
+    if (join->type == kJoinRight)
+        return RIGHT_OUTER_JOIN;
+    return INNER_JOIN;
+}
+
+// Gathers the tables of a run of inner joins and cross products, and their ON conditions.
+static void flatten_joins(const TableRef *table, std::vector<const TableRef *> &leaves,
+                          std::vector<const Expr *> &on_conjuncts)
+{
+    if (table->type == kTableCrossProduct)
+    {
+        for (auto const table_ref : *table->list)
+            flatten_joins(table_ref, leaves, on_conjuncts);
+        return;
+    }
+    if (table->type == kTableJoin && join_kind(table->join) == INNER_JOIN)
+    {
+        flatten_joins(table->join->left, leaves, on_conjuncts);
+        flatten_joins(table->join->right, leaves, on_conjuncts);
+        split_conjuncts(table->join->condition, on_conjuncts);
+        return;
+    }
+    leaves.push_back(table);
+}
+
+// Joins the leaves in the tree's order, taking each join's conditions out of the pool.
+static PlanOperator *assemble_joins(const JoinTree *tree, std::vector<PlanOperator *> &leaves,
+                                    const std::vector<JoinInput> &inputs, std::vector<const Expr *> &pool)
+{
+    if (tree->input >= 0)
+    {
+        PlanOperator *leaf = leaves[tree->input];
+        leaves[tree->input] = nullptr;
+        return leaf;
+    }
+    PlanOperator *left = assemble_joins(tree->left.get(), leaves, inputs, pool);
+    PlanOperator *right;
+    try
+    {
+        right = assemble_joins(tree->right.get(), leaves, inputs, pool);
+    }
+    catch (...)
+    {
+        delete left;
+        throw;
+    }
+
+    std::vector<const Expr *> before(pool), applied, left_keys, right_keys, residual;
+    extract_join_keys(pool, left->get_column_names(), right->get_column_names(), true, left_keys, right_keys, residual);
+    for (auto const expr : before)
+        if (std::find(pool.begin(), pool.end(), expr) == pool.end())
+            applied.push_back(expr);
+    return make_join(left, right, INNER_JOIN, left_keys, right_keys, residual, Optimizer::selectivity(applied, inputs),
+                     tree->build_left ? BUILD_LEFT : BUILD_RIGHT);
+}
+
+PlanOperator *SqlExecutor::buildTableRefPlan(const TableRef *table, std::vector<const Expr *> &conjuncts)
+{
+    switch (table->type)
     {
-        ColumnDefinition *col = createStmt->columns->at(i);
-        ss << columnDefinitionToString(col);
+    case kTableName:
+        return buildScanPlan(tables->get_table(table->name), table->alias != NULL ? table->alias : table->name,
+                             conjuncts);
 
-        // Add a comma after all but the last column
-        if (i < numColumns - 1)
+    case kTableJoin:
+    {
+        const JoinDefinition *join = table->join;
+        JoinKind join_type = join_kind(join);
+        if (join_type == INNER_JOIN)
+            return buildJoinPlan(table, conjuncts);
+
+        // outer joins keep their order; WHERE conditions can be pushed below a join only on the side whose rows it preserves
+        std::vector<const Expr *> no_conjuncts;
+        PlanOperator *left = buildTableRefPlan(join->left, join_type == RIGHT_OUTER_JOIN ? no_conjuncts : conjuncts);
+        PlanOperator *right;
+        try
+        {
+            right = buildTableRefPlan(join->right, join_type == LEFT_OUTER_JOIN ? no_conjuncts : conjuncts);
+        }
+        catch (...)
         {
-            ss << ", ";
+            delete left;
+            throw;
         }
+
+        std::vector<const Expr *> on_conjuncts, left_keys, right_keys, residual;
+        split_conjuncts(join->condition, on_conjuncts);
+        std::vector<JoinInput> inputs = {describeJoinInput(join->left, left), describeJoinInput(join->right, right)};
+        double selectivity = Optimizer::selectivity(on_conjuncts, inputs);
+        extract_join_keys(on_conjuncts, left->get_column_names(), right->get_column_names(), true,
+                          left_keys, right_keys, residual);
+        residual.insert(residual.end(), on_conjuncts.begin(), on_conjuncts.end());
+        return make_join(left, right, join_type, left_keys, right_keys, residual, selectivity);
     }
-    ss << ")";
-    return ss.str();
+
+    case kTableCrossProduct:
+        return buildJoinPlan(table, conjuncts);
+
+    default:
+        throw SQLExecError("unsupported FROM clause");
+    }
+}
+
+PlanOperator *SqlExecutor::buildJoinPlan(const TableRef *table, std::vector<const Expr *> &conjuncts)
+{
+    std::vector<const TableRef *> refs;
+    std::vector<const Expr *> pool;  // conditions on the tables, each to be used once
+    flatten_joins(table, refs, pool);
+
+    std::vector<PlanOperator *> leaves(refs.size(), nullptr);
+    PlanOperator *plan = nullptr;
+    try
+    {
+        // the tables' columns, in the query's order; what isn't a table (an outer join)
+        // is built right away for them
+        ColumnNames column_names;
+        for (size_t i = 0; i < refs.size(); i++)
+        {
+            ColumnNames leaf_column_names;
+            if (refs[i]->type == kTableName)
+            {
+                leaf_column_names = qualify(tables->get_table(refs[i]->name).get_column_names(),
+                                            refs[i]->alias != NULL ? refs[i]->alias : refs[i]->name);
+            }
+            else
+            {
+                leaves[i] = buildTableRefPlan(refs[i], conjuncts);
+                leaf_column_names = leaves[i]->get_column_names();
+            }
+            column_names.insert(column_names.end(), leaf_column_names.begin(), leaf_column_names.end());
+        }
+
+        // for inner joins, the WHERE conjuncts on their tables are as good as ON conditions
+        for (auto it = conjuncts.begin(); it != conjuncts.end();)
+        {
+            if (resolves_in(*it, column_names))
+            {
+                pool.push_back(*it);
+                it = conjuncts.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+
+        // the conditions on one table go below the joins
+        std::vector<JoinInput> inputs;
+        for (size_t i = 0; i < refs.size(); i++)
+        {
+            if (leaves[i] == nullptr)
+            {
+                leaves[i] = buildScanPlan(tables->get_table(refs[i]->name),
+                                          refs[i]->alias != NULL ? refs[i]->alias : refs[i]->name, pool);
+            }
+            else
+            {
+                std::vector<const Expr *> local;
+                for (auto it = pool.begin(); it != pool.end();)
+                {
+                    if (resolves_in(*it, leaves[i]->get_column_names()))
+                    {
+                        local.push_back(*it);
+                        it = pool.erase(it);
+                    }
+                    else
+                    {
+                        ++it;
+                    }
+                }
+                if (!local.empty())
+                {
+                    Filter *filter = new Filter(leaves[i], local);
+                    filter->set_selectivity(
+                        Optimizer::selectivity(local, std::vector<JoinInput>(1, describeJoinInput(refs[i], leaves[i]))));
+                    leaves[i] = filter;
+                }
+            }
+            inputs.push_back(describeJoinInput(refs[i], leaves[i]));
+        }
+
+        std::unique_ptr<JoinTree> order = Optimizer::order_joins(inputs, pool);
+        plan = assemble_joins(order.get(), leaves, inputs, pool);
+        if (plan->get_column_names() != column_names)
+            plan = new Project(plan, column_names);
+        if (!pool.empty())
+            plan = new Filter(plan, pool);  // conditions on none of the tables
+    }
+    catch (...)
+    {
+        for (auto leaf : leaves)
+            delete leaf;
+        delete plan;
+        throw;
+    }
+    return plan;
+}
+
+JoinInput SqlExecutor::describeJoinInput(const TableRef *table, PlanOperator *plan)
+{
+    JoinInput input;
+    input.column_names = plan->get_column_names();
+    input.rows = (double)plan->estimated_rows();
+    if (table->type == kTableName)
+    {
+        HeapTable *heap_table = dynamic_cast<HeapTable *>(&tables->get_table(table->name));
+        if (heap_table != nullptr)
+        {
+            input.table_column_names = heap_table->get_column_names();
+            input.stats = heap_table->get_stats();
+        }
+    }
+    return input;
+}
+
+std::string SqlExecutor::handleDrop(const DropStatement *dropStmt)
+{
+    if (dropStmt->type != DropStatement::kTable)
+        throw SQLExecError("only DROP TABLE is supported");
+    Identifier table_name = dropStmt->name;
+    tables->drop_table(table_name);
+    invalidatePlans(table_name);
+    return "dropped " + table_name;
+}
+
+std::string SqlExecutor::handleCreateUsing(const std::string &sql, const Identifier &engine)
+{
+    SQLParserResult *result = SQLParser::parseSQLString(sql);
+    if (!result->isValid())
+    {
+        delete result;
+        return "invalid SQL: " + sql;
+    }
+    std::string output;
+    try
+    {
+        if (result->size() != 1 || result->getStatement(0)->type() != kStmtCreate ||
+            ((const CreateStatement *)result->getStatement(0))->type != CreateStatement::kTable)
+            throw SQLExecError("only CREATE TABLE takes a storage engine");
+        const CreateStatement *createStmt = (const CreateStatement *)result->getStatement(0);
+        output = handleCreate(createStmt, engine);
+        invalidatePlans(createStmt->tableName);
+    }
+    catch (...)
+    {
+        delete result;
+        throw;
+    }
+    delete result;
+    return output;
+}
+
+std::string SqlExecutor::handleCreate(const CreateStatement *createStmt, const Identifier &engine)
+{
+    if (createStmt->type == CreateStatement::kIndex)
+        return handleCreateIndex(createStmt);
+    if (createStmt->type != CreateStatement::kTable)
+        throw SQLExecError("only CREATE TABLE and CREATE INDEX are supported");
+
+    ColumnNames column_names;
+    ColumnAttributes column_attributes;
+    for (auto const col : *createStmt->columns)
+    {
+        column_names.push_back(col->name);
+        switch (col->type)
+        {
+        case ColumnDefinition::INT:
+            column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+            break;
+        case ColumnDefinition::TEXT:
+            column_attributes.push_back(ColumnAttribute(ColumnAttribute::TEXT));
+            break;
+        default:
+            throw SQLExecError("unsupported column type in " + columnDefinitionToString(col));
+        }
+    }
+
+    CreateTable plan(*tables, createStmt->tableName, column_names, column_attributes, createStmt->ifNotExists,
+                     engine);
+    ValueDict row;
+    plan.open();
+    plan.next(row);
+    plan.close();
+    Transaction::sync();  // the catalog rows were autocommitted
+    return std::string(plan.was_created() ? "created " : "table already exists: ") + createStmt->tableName;
+}
+
+std::string SqlExecutor::handleCreateIndex(const CreateStatement *createStmt)
+{
+    if (createStmt->indexColumns == NULL || createStmt->indexColumns->size() != 1)
+        throw SQLExecError("a BRIN index is on one column");
+    CreateIndex plan(*tables, createStmt->tableName, createStmt->indexName, createStmt->indexColumns->at(0),
+                     createStmt->indexType != NULL ? createStmt->indexType : "BTREE");
+    ValueDict row;
+    plan.open();
+    plan.next(row);
+    plan.close();
+    Transaction::sync();  // the catalog row was autocommitted
+    return std::string("created index ") + createStmt->indexName;
 }
 
 void SqlExecutor::handleTableRef(TableRef *table, std::stringstream &ss)
@@ -162,6 +1264,8 @@ void SqlExecutor::handleTableRef(TableRef *table, std::stringstream &ss)
 
         handleExpression(table->join->condition, ss);
         break;
+    case kTableSelect:
+        throw SQLExecError("subqueries in FROM are not supported");
     case kTableCrossProduct:
         size_t count = table->list->size();
         for (size_t i = 0; i < count; ++i)
@@ -182,12 +1286,12 @@ void SqlExecutor::handleTableRef(TableRef *table, std::stringstream &ss)
     }
 }
 
-void SqlExecutor::handleExpression(Expr *expr, std::stringstream &ss)
+void SqlExecutor::handleExpression(const Expr *expr, std::stringstream &ss)
 {
     switch (expr->type)
     {
     case kExprStar:
-        ss << "*";
+        ss << (expr->table != NULL ? std::string(expr->table) + "." : "") << "*";
         break;
     case kExprColumnRef:
         ss << (expr->hasTable() ? std::string(expr->table) + "." : "") << expr->name;
@@ -199,15 +1303,35 @@ void SqlExecutor::handleExpression(Expr *expr, std::stringstream &ss)
         ss << expr->ival;
         break;
     case kExprLiteralString:
-        ss << expr->name;
+        ss << "'" << expr->name << "'";
+        break;
+    case kExprPlaceholder:
+        ss << with_literals(expression_text(expr));  // the literal it stands for, if there is one
+        break;
+    case kExprFunctionRef:
+        ss << expr->name << "(";
+        if (expr->distinct)
+            ss << "DISTINCT ";
+        if (expr->exprList != NULL)
+        {
+            for (size_t i = 0; i < expr->exprList->size(); i++)
+            {
+                if (i > 0)
+                    ss << ", ";
+                handleExpression(expr->exprList->at(i), ss);
+            }
+        }
+        else if (expr->expr != NULL)
+        {
+            handleExpression(expr->expr, ss);
+        }
+        ss << ")";
         break;
-
     case kExprOperator:
         handleOperatorExpression(expr, ss);
         break;
     default:
-        fprintf(stderr, "Unrecognized expression type %d\n", expr->type);
-        return;
+        throw SQLExecError("unrecognized expression type " + std::to_string(expr->type));
     }
     if (expr->alias != NULL)
     {
@@ -215,15 +1339,23 @@ void SqlExecutor::handleExpression(Expr *expr, std::stringstream &ss)
     }
 }
 
-void SqlExecutor::handleOperatorExpression(Expr *expr, std::stringstream &ss)
+void SqlExecutor::handleOperatorExpression(const Expr *expr, std::stringstream &ss)
 {
-    handleExpression(expr->expr, ss);
     if (expr == NULL)
     {
         ss << "null";
         return;
     }
 
+    // unary operators
+    if (expr->opType == Expr::NOT || expr->opType == Expr::UMINUS)
+    {
+        ss << (expr->opType == Expr::NOT ? "NOT " : "-");
+        handleOperand(expr->expr, expr, ss);
+        return;
+    }
+
+    handleOperand(expr->expr, expr, ss);
     switch (expr->opType)
     {
     case Expr::SIMPLE_OP:
@@ -235,15 +1367,33 @@ void SqlExecutor::handleOperatorExpression(Expr *expr, std::stringstream &ss)
     case Expr::OR:
         ss << " OR ";
         break;
-    case Expr::NOT:
-        ss << " NOT ";
+    case Expr::NOT_EQUALS:
+        ss << " <> ";
+        break;
+    case Expr::LESS_EQ:
+        ss << " <= ";
+        break;
+    case Expr::GREATER_EQ:
+        ss << " >= ";
         break;
     default:
         ss << " " << expr->opType << " ";
         break;
     }
     if (expr->expr2 != NULL)
-        handleExpression(expr->expr2, ss);
+        handleOperand(expr->expr2, expr, ss);
+}
+
+// Binary operators inside other operators are parenthesized, except in runs of AND or of OR.
+void SqlExecutor::handleOperand(const Expr *operand, const Expr *parent, std::stringstream &ss)
+{
+    bool nested = operand->type == kExprOperator && operand->opType != Expr::NOT && operand->opType != Expr::UMINUS &&
+                  !(operand->opType == parent->opType && (parent->opType == Expr::AND || parent->opType == Expr::OR));
+    if (nested)
+        ss << "(";
+    handleExpression(operand, ss);
+    if (nested)
+        ss << ")";
 }
 
 std::string SqlExecutor::columnDefinitionToString(const ColumnDefinition *col)
@@ -0,0 +1,194 @@
+/**
+ * Implementation of the arena allocator declared in arena.h.
+ */
+
+#include "arena.h"
+#include "Metrics.h"
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Free standard-size chunks, per thread, so arenas can come and go without malloc.
+class ChunkPool {
+public:
+    static const size_t MAX_CHUNKS = 32;
+
+    void *chunks[MAX_CHUNKS];
+    size_t count;
+
+    ChunkPool() : count(0) {}
+
+    ~ChunkPool()
+    {
+        while (count > 0)
+            free(chunks[--count]);
+    }
+};
+
+static thread_local ChunkPool chunk_pool;
+
+//------------------------Arena----------------------------------------------
+
+// Starts a new chunk big enough for the allocation, then allocates from it.
+void *Arena::allocate_slow(size_t size, size_t align)
+{
+    size_t need = size + align;
+    if (need > CHUNK_SZ)
+    {
+        // an oversized chunk of its own, kept behind the current one so bumping carries on there
+        Chunk *big = (Chunk *)malloc(sizeof(Chunk) + need);
+        if (big == nullptr)
+            throw std::bad_alloc();
+        METRIC_INC(ARENA_CHUNK_MALLOCS);
+        big->size = need;
+        if (chunk != nullptr)
+        {
+            big->previous = chunk->previous;
+            chunk->previous = big;
+        }
+        else
+        {
+            big->previous = nullptr;
+            chunk = big;
+            next = limit = (char *)(big + 1) + need;  // full: the next allocation starts a chunk
+        }
+        used += size;
+        return (void *)(((uintptr_t)(big + 1) + align - 1) & ~(uintptr_t)(align - 1));
+    }
+    Chunk *fresh;
+    if (chunk_pool.count > 0)
+        fresh = (Chunk *)chunk_pool.chunks[--chunk_pool.count];
+    else
+    {
+        fresh = (Chunk *)malloc(sizeof(Chunk) + CHUNK_SZ);
+        if (fresh == nullptr)
+            throw std::bad_alloc();
+        METRIC_INC(ARENA_CHUNK_MALLOCS);
+    }
+    fresh->previous = chunk;
+    fresh->size = CHUNK_SZ;
+    chunk = fresh;
+    next = (char *)(fresh + 1);
+    limit = next + CHUNK_SZ;
+    return allocate(size, align);
+}
+
+// Copies bytes into memory from the arena and returns it.
+void *Arena::copy(const void *bytes, size_t size)
+{
+    void *p = allocate(size, 1);
+    memcpy(p, bytes, size);
+    return p;
+}
+
+// Destroys the objects made in the arena, newest first, then gives its chunks back to the
+// thread's pool (or to malloc, if they're oversized or the pool is full).
+void Arena::reset()
+{
+    for (Finalizer *f = finalizers; f != nullptr; f = f->previous)
+        f->destroy(f->object);
+    finalizers = nullptr;
+    while (chunk != nullptr)
+    {
+        Chunk *previous = chunk->previous;
+        if (chunk->size == CHUNK_SZ && chunk_pool.count < ChunkPool::MAX_CHUNKS)
+            chunk_pool.chunks[chunk_pool.count++] = chunk;
+        else
+            free(chunk);
+        chunk = previous;
+    }
+    next = limit = nullptr;
+    used = 0;
+}
+
+// Remembers to destroy an object on reset.
+void Arena::add_finalizer(void *object, void (*destroy)(void *))
+{
+    Finalizer *f = (Finalizer *)allocate(sizeof(Finalizer), alignof(Finalizer));
+    f->previous = finalizers;
+    f->object = object;
+    f->destroy = destroy;
+    finalizers = f;
+}
+
+//------------------------tests----------------------------------------------
+
+// Records the order objects are destroyed in.
+struct Tracked {
+    std::vector<int> &destroyed;
+    int id;
+    std::string name;  // something with a destructor of its own
+
+    Tracked(std::vector<int> &destroyed, int id) : destroyed(destroyed), id(id), name(100, 'x') {}
+
+    ~Tracked() { destroyed.push_back(id); }
+};
+
+// test function -- returns true if all tests pass
+bool test_arena()
+{
+    std::cout << "\nTesting Arena...." << std::endl;
+    std::vector<int> destroyed;
+    void *first;
+    {
+        Arena arena;
+        first = arena.allocate(1);
+        for (size_t align = 1; align <= 64; align *= 2)
+            if ((uintptr_t)arena.allocate(3, align) % align != 0)
+            {
+                std::cout << "misaligned for " << align << std::endl;
+                return false;
+            }
+
+        // enough small objects to fill several chunks, and some oversized allocations
+        for (int i = 0; i < 5000; i++)
+        {
+            Tracked *t = arena.make<Tracked>(destroyed, i);
+            if (t->id != i)
+                return false;
+            if (i % 1000 == 0)
+                memset(arena.allocate(3 * Arena::CHUNK_SZ), 0, 3 * Arena::CHUNK_SZ);
+        }
+
+        char *p = (char *)arena.allocate(4096, 1);
+        size_t before = arena.bytes_used();
+        arena.shrink(p, 10);
+        if (arena.bytes_used() != before - 4086 || (char *)arena.allocate(1, 1) != p + 10)
+        {
+            std::cout << "shrink didn't give back the end" << std::endl;
+            return false;
+        }
+
+        std::vector<int, ArenaAllocator<int>> numbers{ArenaAllocator<int>(arena)};
+        for (int i = 0; i < 100000; i++)
+            numbers.push_back(i);
+        if (numbers[99999] != 99999)
+            return false;
+
+        arena.reset();
+        if (destroyed.size() != 5000 || destroyed.front() != 4999 || destroyed.back() != 0 || arena.bytes_used() != 0)
+        {
+            std::cout << "reset destroyed " << destroyed.size() << " objects" << std::endl;
+            return false;
+        }
+        arena.make<Tracked>(destroyed, 5000);
+    }
+    if (destroyed.size() != 5001)
+    {
+        std::cout << "destructor didn't reset" << std::endl;
+        return false;
+    }
+    std::cout << "allocate/make/reset ok" << std::endl;
+
+    // a later arena on this thread reuses the chunks instead of allocating new ones
+    Arena again;
+    if (again.allocate(1) != first)
+    {
+        std::cout << "chunk wasn't reused" << std::endl;
+        return false;
+    }
+    std::cout << "chunk pool ok" << std::endl;
+    return true;
+}
@@ -0,0 +1,667 @@
+/**
+ * @file bench.cpp
+ *
+ * Microbenchmarks for the storage layer: SlottedPage, HeapFile and HeapTable operations
+ * across record sizes and table sizes. Built by "make bench".
+ *
+ * Each benchmark runs a few warmup repetitions and then a number of timed ones; only the
+ * operations themselves are timed, not the setup around them. A repetition's sample is
+ * its average time per operation, and the samples are summarized as mean, percentiles,
+ * min and max. Results go to stdout as a table, as CSV, or as one JSON object per line.
+ *
+ * The scaling benchmarks (heap_table.insert_mt and heap_table.scan_mt) run the same work
+ * on 1 to N threads at once and time it by the wall clock, so their operations per second
+ * is the table's total throughput at each thread count.
+ *
+ * Usage: sql5300_bench [-r reps] [-w warmup] [-o text|csv|json] [-b filter]
+ *                      [-s record sizes] [-n table sizes] [-t thread counts] dbenvpath
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include "db_cxx.h"
+#include "arena.h"
+#include "heap_storage.h"
+
+using namespace std;
+
+/*
+ * we allocate and initialize the _DB_ENV global
+ */
+DbEnv *_DB_ENV;
+
+// Keeps the compiler from dropping work whose result is otherwise unused.
+static volatile size_t bench_sink = 0;
+
+// Times the parts of a repetition between start() and stop().
+class Timer {
+public:
+    Timer() : elapsed(0) {}
+
+    void start() { started = chrono::steady_clock::now(); }
+
+    void stop() { elapsed += chrono::duration<double, nano>(chrono::steady_clock::now() - started).count(); }
+
+    double get_elapsed() const { return elapsed; }
+
+private:
+    chrono::steady_clock::time_point started;
+    double elapsed;  // nanoseconds
+};
+
+// Runs one repetition, timing its operations, and returns how many operations it ran.
+typedef function<size_t(Timer &)> Repetition;
+
+struct BenchConfig {
+    size_t warmup;
+    size_t repetitions;
+    string format;
+    string filter;
+    vector<size_t> record_sizes;
+    vector<size_t> table_sizes;
+    vector<size_t> thread_counts;
+};
+
+struct BenchResult {
+    string name;
+    size_t record_size;
+    size_t n;              // rows in the table, or blocks in the file
+    size_t threads;
+    size_t ops;            // operations per repetition
+    vector<double> samples;  // nanoseconds per operation, one per repetition, sorted
+};
+
+// Nearest-rank percentile of sorted samples.
+static double percentile(const vector<double> &sorted, double p)
+{
+    size_t rank = (size_t)(p / 100.0 * sorted.size() + 0.5);
+    rank = rank < 1 ? 1 : (rank > sorted.size() ? sorted.size() : rank);
+    return sorted[rank - 1];
+}
+
+static void print_header(const BenchConfig &config)
+{
+    if (config.format == "csv")
+        cout << "benchmark,record_size,n,threads,ops_per_rep,reps,mean_ns,p50_ns,p90_ns,p99_ns,min_ns,max_ns,ops_per_sec\n";
+    else if (config.format == "text")
+        cout << left << setw(24) << "benchmark" << right << setw(8) << "record" << setw(8) << "n" << setw(8) << "threads"
+             << setw(10) << "ops/rep"
+             << setw(12) << "mean ns" << setw(12) << "p50 ns" << setw(12) << "p90 ns" << setw(12) << "p99 ns"
+             << setw(12) << "min ns" << setw(12) << "max ns" << setw(14) << "ops/sec" << "\n";
+}
+
+static void print_result(const BenchConfig &config, const BenchResult &result)
+{
+    const vector<double> &s = result.samples;
+    double mean = 0;
+    for (double sample : s)
+        mean += sample;
+    mean /= s.size();
+    double ops_per_sec = mean > 0 ? 1e9 / mean : 0;
+    cout << fixed << setprecision(1);
+    if (config.format == "csv")
+    {
+        cout << result.name << "," << result.record_size << "," << result.n << "," << result.threads << ","
+             << result.ops << "," << s.size()
+             << "," << mean << "," << percentile(s, 50) << "," << percentile(s, 90) << "," << percentile(s, 99)
+             << "," << s.front() << "," << s.back() << "," << ops_per_sec << "\n";
+    }
+    else if (config.format == "json")
+    {
+        cout << "{\"benchmark\":\"" << result.name << "\",\"record_size\":" << result.record_size << ",\"n\":"
+             << result.n << ",\"threads\":" << result.threads << ",\"ops_per_rep\":" << result.ops << ",\"reps\":" << s.size() << ",\"mean_ns\":" << mean
+             << ",\"p50_ns\":" << percentile(s, 50) << ",\"p90_ns\":" << percentile(s, 90) << ",\"p99_ns\":"
+             << percentile(s, 99) << ",\"min_ns\":" << s.front() << ",\"max_ns\":" << s.back()
+             << ",\"ops_per_sec\":" << ops_per_sec << "}\n";
+    }
+    else
+    {
+        cout << left << setw(24) << result.name << right << setw(8) << result.record_size << setw(8) << result.n
+             << setw(8) << result.threads << setw(10) << result.ops << setw(12) << mean << setw(12) << percentile(s, 50) << setw(12)
+             << percentile(s, 90) << setw(12) << percentile(s, 99) << setw(12) << s.front() << setw(12) << s.back()
+             << setw(14) << ops_per_sec << "\n";
+    }
+    cout.unsetf(ios::fixed);
+    cout << setprecision(6) << flush;  // flushed so a long run shows progress
+}
+
+// Runs the warmup and timed repetitions of one benchmark (unless the filter excludes it) and prints the result.
+static void run(const BenchConfig &config, const string &name, size_t record_size, size_t n, Repetition repetition,
+                size_t threads = 1)
+{
+    if (name.find(config.filter) == string::npos)
+        return;
+    BenchResult result{name, record_size, n, threads, 0, vector<double>()};
+    for (size_t i = 0; i < config.warmup + config.repetitions; i++)
+    {
+        Timer timer;
+        size_t ops = repetition(timer);
+        if (i < config.warmup || ops == 0)
+            continue;
+        result.ops = ops;
+        result.samples.push_back(timer.get_elapsed() / ops);
+    }
+    sort(result.samples.begin(), result.samples.end());
+    if (!result.samples.empty())
+        print_result(config, result);
+}
+
+// Deterministic pseudo-random numbers, so runs are comparable.
+static uint32_t next_random(uint32_t &seed)
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+//------------------------SlottedPage----------------------------------------------
+
+// A page-sized buffer made into an empty SlottedPage.
+struct PageBuffer {
+    char block[DbBlock::BLOCK_SZ];
+    Dbt dbt;
+    SlottedPage *page;
+
+    PageBuffer() : dbt(block, sizeof(block))
+    {
+        memset(block, 0, sizeof(block));
+        page = new SlottedPage(dbt, 1, true);
+    }
+
+    ~PageBuffer() { delete page; }
+
+    // Adds records until the page is full; returns how many fit.
+    size_t fill(const Dbt &record)
+    {
+        size_t count = 0;
+        try
+        {
+            while (true)
+            {
+                page->add(&record);
+                count++;
+            }
+        }
+        catch (DbBlockNoRoomError &)
+        {
+        }
+        return count;
+    }
+};
+
+static void bench_slotted_page(const BenchConfig &config)
+{
+    for (size_t record_size : config.record_sizes)
+    {
+        if (record_size + 8 > DbBlock::BLOCK_SZ)
+            continue;
+        string bytes(record_size, 'x');
+        Dbt record((void *)bytes.data(), (u_int32_t)record_size);
+        string other_bytes(record_size, 'y');
+        Dbt other((void *)other_bytes.data(), (u_int32_t)record_size);
+        size_t capacity = PageBuffer().fill(record);
+
+        run(config, "slotted_page.add", record_size, capacity, [&](Timer &timer) {
+            PageBuffer buffer;
+            timer.start();
+            for (size_t i = 0; i < capacity; i++)
+                buffer.page->add(&record);
+            timer.stop();
+            return capacity;
+        });
+
+        run(config, "slotted_page.get", record_size, capacity, [&](Timer &timer) {
+            PageBuffer buffer;
+            buffer.fill(record);
+            timer.start();
+            for (RecordID id = 1; id <= capacity; id++)
+            {
+                Dbt *data = buffer.page->get(id);
+                bench_sink += data->get_size();
+                delete data;
+            }
+            timer.stop();
+            return capacity;
+        });
+
+        run(config, "slotted_page.view", record_size, capacity, [&](Timer &timer) {
+            PageBuffer buffer;
+            buffer.fill(record);
+            timer.start();
+            for (RecordID id = 1; id <= capacity; id++)
+                bench_sink += buffer.page->view(id).size;
+            timer.stop();
+            return capacity;
+        });
+
+        run(config, "slotted_page.put", record_size, capacity, [&](Timer &timer) {
+            PageBuffer buffer;
+            buffer.fill(record);
+            timer.start();
+            for (RecordID id = 1; id <= capacity; id++)
+                buffer.page->put(id, other);
+            timer.stop();
+            return capacity;
+        });
+
+        run(config, "slotted_page.del", record_size, capacity, [&](Timer &timer) {
+            PageBuffer buffer;
+            buffer.fill(record);
+            timer.start();
+            for (RecordID id = 1; id <= capacity; id++)
+                buffer.page->del(id);
+            timer.stop();
+            return capacity;
+        });
+
+        run(config, "slotted_page.for_each", record_size, capacity, [&](Timer &timer) {
+            const size_t calls = 100;
+            PageBuffer buffer;
+            buffer.fill(record);
+            timer.start();
+            for (size_t i = 0; i < calls; i++)
+                buffer.page->for_each_record([](RecordID, RecordView view) { bench_sink += view.size; });
+            timer.stop();
+            return calls;
+        });
+
+        run(config, "slotted_page.ids", record_size, capacity, [&](Timer &timer) {
+            const size_t calls = 100;
+            PageBuffer buffer;
+            buffer.fill(record);
+            timer.start();
+            for (size_t i = 0; i < calls; i++)
+                bench_sink += buffer.page->ids().size();
+            timer.stop();
+            return calls;
+        });
+    }
+}
+
+//------------------------HeapFile----------------------------------------------
+
+static void bench_heap_file(const BenchConfig &config)
+{
+    for (size_t n : config.table_sizes)
+    {
+        // n blocks; the table sizes are in rows, and ten rows a block is typical
+        size_t blocks = n / 10 > 0 ? n / 10 : 1;
+
+        run(config, "heap_file.get_new", 0, blocks, [&](Timer &timer) {
+            HeapFile file("_bench_file");
+            file.create();
+            timer.start();
+            for (size_t i = 0; i < blocks; i++)
+                delete file.get_new();
+            timer.stop();
+            file.drop();
+            return blocks;
+        });
+
+        HeapFile file("_bench_file");
+        file.create();
+        for (size_t i = 1; i < blocks; i++)
+            delete file.get_new();
+        BlockID last = file.get_last_block_id();
+
+        run(config, "heap_file.get", 0, blocks, [&](Timer &timer) {
+            uint32_t seed = 42;
+            timer.start();
+            for (size_t i = 0; i < blocks; i++)
+            {
+                SlottedPage *page = file.get(next_random(seed) % last + 1);
+                bench_sink += page->get_block_id();
+                delete page;
+            }
+            timer.stop();
+            return blocks;
+        });
+
+        run(config, "heap_file.put", 0, blocks, [&](Timer &timer) {
+            vector<SlottedPage *> pages;
+            for (BlockID id = 1; id <= last; id++)
+                pages.push_back(file.get(id));
+            timer.start();
+            for (auto page : pages)
+                file.put(page);
+            timer.stop();
+            for (auto page : pages)
+                delete page;
+            return pages.size();
+        });
+
+        file.drop();
+    }
+}
+
+//------------------------HeapTable----------------------------------------------
+
+// A HeapTable with marshal and unmarshal opened up for timing.
+class BenchTable : public HeapTable {
+public:
+    BenchTable(size_t record_size)
+        : HeapTable("_bench_table", ColumnNames{"id", "payload"},
+                    ColumnAttributes{ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)}),
+          record_size(record_size) {}
+
+    using HeapTable::marshal;
+    using HeapTable::unmarshal;
+
+    // A row whose marshaled record is about record_size bytes.
+    ValueDict make_row(int32_t id) const
+    {
+        ValueDict row;
+        row["id"] = Value(id);
+        size_t text = record_size > 6 ? record_size - 6 : 0;  // 4-byte INT, 2-byte TEXT length
+        row["payload"] = Value(string(text, (char)('a' + id % 26)));
+        return row;
+    }
+
+    // Drops the table if left over from an interrupted run.
+    static void remove_stale()
+    {
+        BenchTable stale(0);
+        stale.create_if_not_exists();
+        stale.drop();
+    }
+
+    // Creates the table with n rows. (A dropped table can't be reopened, so each load is on a new BenchTable.)
+    void load(size_t n)
+    {
+        create();
+        for (size_t i = 0; i < n; i++)
+        {
+            ValueDict row = make_row((int32_t)i);
+            insert(&row);
+        }
+    }
+
+private:
+    size_t record_size;
+};
+
+static void bench_heap_table(const BenchConfig &config)
+{
+    const size_t calls = 1000;
+    for (size_t record_size : config.record_sizes)
+    {
+        if (record_size + 8 > DbBlock::BLOCK_SZ)
+            continue;
+        BenchTable table(record_size);
+        ValueDict row = table.make_row(1);
+
+        run(config, "heap_table.marshal", record_size, 0, [&](Timer &timer) {
+            timer.start();
+            for (size_t i = 0; i < calls; i++)
+            {
+                Dbt *data = table.marshal(&row);
+                bench_sink += data->get_size();
+                delete[] (char *)data->get_data();
+                delete data;
+            }
+            timer.stop();
+            return calls;
+        });
+
+        run(config, "heap_table.marshal_arena", record_size, 0, [&](Timer &timer) {
+            Arena arena;
+            timer.start();
+            for (size_t i = 0; i < calls; i++)
+            {
+                bench_sink += table.marshal(&row, arena)->get_size();
+                arena.reset();
+            }
+            timer.stop();
+            return calls;
+        });
+
+        Dbt *marshaled = table.marshal(&row);
+        run(config, "heap_table.unmarshal", record_size, 0, [&](Timer &timer) {
+            timer.start();
+            for (size_t i = 0; i < calls; i++)
+            {
+                ValueDict *unmarshaled = table.unmarshal(marshaled);
+                bench_sink += unmarshaled->size();
+                delete unmarshaled;
+            }
+            timer.stop();
+            return calls;
+        });
+        delete[] (char *)marshaled->get_data();
+        delete marshaled;
+
+        for (size_t n : config.table_sizes)
+        {
+            run(config, "heap_table.insert", record_size, n, [&](Timer &timer) {
+                BenchTable empty(record_size);
+                empty.load(0);
+                vector<ValueDict> rows;
+                for (size_t i = 0; i < n; i++)
+                    rows.push_back(empty.make_row((int32_t)i));
+                timer.start();
+                for (auto const &new_row : rows)
+                    empty.insert(&new_row);
+                timer.stop();
+                empty.drop();
+                return n;
+            });
+
+            BenchTable loaded(record_size);
+            loaded.load(n);
+            run(config, "heap_table.select", record_size, n, [&](Timer &timer) {
+                timer.start();
+                Handles handles = loaded.select();
+                timer.stop();
+                bench_sink += handles.size();
+                return (size_t)1;
+            });
+
+            Handles handles = loaded.select();
+            run(config, "heap_table.project", record_size, n, [&](Timer &timer) {
+                uint32_t seed = 7;
+                ValueDict projected;  // reused, as a caller projecting many rows would
+                timer.start();
+                for (size_t i = 0; i < calls; i++)
+                {
+                    loaded.project(handles[next_random(seed) % handles.size()], nullptr, projected);
+                    bench_sink += projected.size();
+                }
+                timer.stop();
+                return calls;
+            });
+
+            run(config, "heap_table.project_id", record_size, n, [&](Timer &timer) {
+                uint32_t seed = 7;
+                ColumnNames just_id = {"id"};  // the payload isn't decoded at all
+                ValueDict projected;
+                timer.start();
+                for (size_t i = 0; i < calls; i++)
+                {
+                    loaded.project(handles[next_random(seed) % handles.size()], &just_id, projected);
+                    bench_sink += projected.size();
+                }
+                timer.stop();
+                return calls;
+            });
+
+            run(config, "heap_table.project_arena", record_size, n, [&](Timer &timer) {
+                uint32_t seed = 7;
+                Arena arena;
+                timer.start();
+                for (size_t i = 0; i < calls; i++)
+                {
+                    Handle handle = handles[next_random(seed) % handles.size()];
+                    bench_sink += loaded.project(handle, nullptr, arena)->size();
+                    arena.reset();
+                }
+                timer.stop();
+                return calls;
+            });
+            loaded.drop();
+        }
+    }
+}
+
+// Runs body(0) .. body(threads - 1) on threads of their own and waits for them.
+static void run_threads(size_t threads, function<void(size_t)> body)
+{
+    vector<thread> running;
+    for (size_t t = 0; t < threads; t++)
+        running.push_back(thread(body, t));
+    for (auto &t : running)
+        t.join();
+}
+
+// Throughput of n inserts, and of full scans, as the threads sharing them grow.
+static void bench_heap_table_scaling(const BenchConfig &config)
+{
+    for (size_t record_size : config.record_sizes)
+    {
+        if (record_size + 8 > DbBlock::BLOCK_SZ)
+            continue;
+        for (size_t n : config.table_sizes)
+        {
+            for (size_t threads : config.thread_counts)
+            {
+                // the n rows are split among the threads
+                run(config, "heap_table.insert_mt", record_size, n, [&](Timer &timer) {
+                    BenchTable empty(record_size);
+                    empty.load(0);
+                    vector<vector<ValueDict>> rows(threads);
+                    for (size_t i = 0; i < n; i++)
+                        rows[i % threads].push_back(empty.make_row((int32_t)i));
+                    timer.start();
+                    run_threads(threads, [&](size_t t) {
+                        for (auto const &new_row : rows[t])
+                            empty.insert(&new_row);
+                    });
+                    timer.stop();
+                    empty.drop();
+                    return n;
+                }, threads);
+            }
+
+            // each thread scans all n rows
+            BenchTable loaded(record_size);
+            loaded.load(n);
+            for (size_t threads : config.thread_counts)
+            {
+                run(config, "heap_table.scan_mt", record_size, n, [&](Timer &timer) {
+                    vector<size_t> counts(threads);
+                    timer.start();
+                    run_threads(threads, [&](size_t t) {
+                        std::unique_ptr<DbRelationScan> scan = loaded.scan();
+                        Handle handle;
+                        ValueDict row;
+                        while (scan->next(handle, row))
+                            counts[t]++;
+                    });
+                    timer.stop();
+                    size_t rows = 0;
+                    for (size_t count : counts)
+                        rows += count;
+                    bench_sink += rows;
+                    return rows;
+                }, threads);
+            }
+            loaded.drop();
+        }
+    }
+}
+
+//------------------------main----------------------------------------------
+
+static vector<size_t> parse_sizes(const char *text)
+{
+    vector<size_t> sizes;
+    stringstream ss(text);
+    string item;
+    while (getline(ss, item, ','))
+        if (!item.empty())
+            sizes.push_back(strtoul(item.c_str(), nullptr, 10));
+    return sizes;
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig config{2, 20, "text", "", {16, 128, 1024}, {1000, 10000}, {1, 2, 4, 8}};
+    bool badOption = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:w:o:b:s:n:t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            config.repetitions = strtoul(optarg, nullptr, 10);
+            break;
+        case 'w':
+            config.warmup = strtoul(optarg, nullptr, 10);
+            break;
+        case 'o':
+            config.format = optarg;
+            break;
+        case 'b':
+            config.filter = optarg;
+            break;
+        case 's':
+            config.record_sizes = parse_sizes(optarg);
+            break;
+        case 'n':
+            config.table_sizes = parse_sizes(optarg);
+            break;
+        case 't':
+            config.thread_counts = parse_sizes(optarg);
+            break;
+        default:
+            badOption = true;
+        }
+    }
+    if (badOption || optind != argc - 1 || config.repetitions == 0 ||
+        find(config.thread_counts.begin(), config.thread_counts.end(), 0) != config.thread_counts.end() ||
+        (config.format != "text" && config.format != "csv" && config.format != "json"))
+    {
+        cerr << "Usage: sql5300_bench [-r reps] [-w warmup] [-o text|csv|json] [-b filter] "
+             << "[-s record sizes] [-n table sizes] [-t thread counts] dbenvpath" << endl;
+        return 1;
+    }
+
+    DbEnv env(0U);
+    env.set_message_stream(&cerr);
+    env.set_error_stream(&cerr);
+    try {
+        // locking, so that the scaling benchmarks' threads can share a file
+        env.open(argv[optind], DB_CREATE | DB_INIT_MPOOL | DB_INIT_LOCK | DB_THREAD, 0);
+    } catch (DbException &exc) {
+        cerr << "(sql5300_bench: " << exc.what() << ")" << endl;
+        return 1;
+    }
+    _DB_ENV = &env;
+
+    try
+    {
+        print_header(config);
+        BenchTable::remove_stale();
+        bench_slotted_page(config);
+        bench_heap_file(config);
+        bench_heap_table(config);
+        bench_heap_table_scaling(config);
+    }
+    catch (DbRelationError &e)
+    {
+        cerr << "(sql5300_bench: " << e.what() << ")" << endl;
+        return 1;
+    }
+    catch (DbException &e)
+    {
+        cerr << "(sql5300_bench: " << e.what() << ")" << endl;
+        return 1;
+    }
+    return EXIT_SUCCESS;
+}
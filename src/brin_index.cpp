@@ -0,0 +1,420 @@
+/**
+ * Implementation of the block-range indexes declared in brin_index.h.
+ */
+
+#include "brin_index.h"
+#include "Metrics.h"
+#include <algorithm>
+#include <iostream>
+#include <thread>
+
+// Orders two values of the same type.
+static int compare_values(const Value &left, const Value &right)
+{
+    if (left.data_type == ColumnAttribute::INT)
+        return left.n < right.n ? -1 : (left.n > right.n ? 1 : 0);
+    return left.s.compare(right.s);
+}
+
+//------------------------KeyRange----------------------------------------------
+
+void KeyRange::at_least(const Value &value, bool inclusive)
+{
+    int cmp = has_low ? compare_values(value, low) : 1;
+    if (cmp > 0 || (cmp == 0 && !inclusive))
+    {
+        low = value;
+        low_inclusive = inclusive;
+        has_low = true;
+    }
+    if (has_high)
+    {
+        cmp = compare_values(low, high);
+        empty = empty || cmp > 0 || (cmp == 0 && !(low_inclusive && high_inclusive));
+    }
+}
+
+void KeyRange::at_most(const Value &value, bool inclusive)
+{
+    int cmp = has_high ? compare_values(value, high) : -1;
+    if (cmp < 0 || (cmp == 0 && !inclusive))
+    {
+        high = value;
+        high_inclusive = inclusive;
+        has_high = true;
+    }
+    if (has_low)
+    {
+        cmp = compare_values(low, high);
+        empty = empty || cmp > 0 || (cmp == 0 && !(low_inclusive && high_inclusive));
+    }
+}
+
+bool KeyRange::overlaps(const Value &min, const Value &max) const
+{
+    if (empty)
+        return false;
+    if (has_low)
+    {
+        int cmp = compare_values(max, low);
+        if (cmp < 0 || (cmp == 0 && !low_inclusive))
+            return false;
+    }
+    if (has_high)
+    {
+        int cmp = compare_values(min, high);
+        if (cmp > 0 || (cmp == 0 && !high_inclusive))
+            return false;
+    }
+    return true;
+}
+
+//------------------------BrinIndex----------------------------------------------
+
+// Widens a summary (or range of values) to take in a value.
+static void widen(bool &has_values, Value &min, Value &max, const Value &value)
+{
+    if (!has_values)
+    {
+        min = max = value;
+        has_values = true;
+    }
+    else if (compare_values(value, min) < 0)
+        min = value;
+    else if (compare_values(value, max) > 0)
+        max = value;
+}
+
+BrinIndex::BrinIndex(HeapTable &table, const Identifier &index_name, size_t column, BlockID blocks_per_range)
+    : table(table), index_name(index_name), column(column), blocks_per_range(blocks_per_range), ranges_known(0),
+      first_unsummarized(0)
+{
+}
+
+// Appends go to the range being filled, which has no summary, so they don't take the lock.
+void BrinIndex::add(BlockID block_id, const char *record)
+{
+    size_t range = range_of(block_id);
+    if (range >= ranges_known)
+        return;
+    Value value;
+    table.decode_column(record, column, value);
+    std::lock_guard<std::mutex> guard(lock);
+    Summary &summary = summaries[range];
+    if (summary.state != UNSUMMARIZED)
+        widen(summary.has_values, summary.min, summary.max, value);
+}
+
+// Summarizes the ranges before the one last_block is in that have no summary yet. If
+// another thread is summarizing, leaves it to that one (and to the next call).
+size_t BrinIndex::summarize(BlockID last_block)
+{
+    if (last_block == 0)
+        return 0;
+    size_t complete = range_of(last_block);
+    if (first_unsummarized >= complete)
+        return 0;
+    std::unique_lock<std::mutex> summarizing(summarize_lock, std::try_to_lock);
+    if (!summarizing.owns_lock())
+        return 0;
+
+    size_t summarized = 0;
+    for (size_t range = first_unsummarized; range < complete; range++)
+    {
+        bool needed;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (summaries.size() < complete)
+            {
+                summaries.resize(complete);
+                ranges_known = complete;
+            }
+            needed = summaries[range].state == UNSUMMARIZED;
+        }
+        if (needed)
+        {
+            summarize_range(range);
+            summarized++;
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    size_t first = first_unsummarized;
+    while (first < summaries.size() && summaries[first].state == SUMMARIZED)
+        first++;
+    first_unsummarized = first;
+    return summarized;
+}
+
+// Marks the range as being summarized, so writers start widening it, then reads its blocks.
+// Each block is read under its latch, so a record written meanwhile is either in the block
+// as read or widens the summary after. The summary is only complete if nothing forgot it.
+void BrinIndex::summarize_range(size_t range)
+{
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        Summary &summary = summaries[range];
+        summary.state = SUMMARIZING;
+        summary.has_values = false;
+        generation = ++summary.generation;
+    }
+
+    bool has_values = false;
+    Value min, max, value;
+    Arena arena;
+    BlockID first = (BlockID)(range * blocks_per_range + 1);
+    for (BlockID block_id = first; block_id < first + blocks_per_range; block_id++)
+    {
+        {
+            SharedLatch latch(table.file.latch(block_id));
+            SlottedPage *block = table.file.get(block_id, arena);
+            block->for_each_record([&](RecordID, RecordView record) {
+                table.decode_column(record.data, column, value);
+                widen(has_values, min, max, value);
+            });
+        }
+        arena.reset();
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    Summary &summary = summaries[range];
+    if (summary.state != SUMMARIZING || summary.generation != generation)
+        return;
+    if (has_values)
+    {
+        widen(summary.has_values, summary.min, summary.max, min);
+        widen(summary.has_values, summary.min, summary.max, max);
+    }
+    summary.state = SUMMARIZED;
+    METRIC_INC(RANGES_SUMMARIZED);
+}
+
+void BrinIndex::forget(BlockID first, BlockID last)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (summaries.empty() || first > last)
+        return;
+    size_t from = range_of(std::max(first, (BlockID)1));
+    size_t to = std::min(range_of(last), summaries.size() - 1);
+    for (size_t range = from; range <= to; range++)
+    {
+        Summary &summary = summaries[range];
+        summary.state = UNSUMMARIZED;
+        summary.has_values = false;
+        summary.generation++;
+    }
+    if (from < first_unsummarized)
+        first_unsummarized = from;
+}
+
+// A range must be scanned unless its summary is complete and misses the key range. The
+// caller holds the lock.
+bool BrinIndex::may_contain(size_t range, const KeyRange &key_range)
+{
+    if (range >= summaries.size() || summaries[range].state != SUMMARIZED)
+        return !key_range.empty;
+    const Summary &summary = summaries[range];
+    return summary.has_values && key_range.overlaps(summary.min, summary.max);
+}
+
+BlockRanges BrinIndex::block_ranges(const KeyRange &range, BlockID last_block)
+{
+    BlockRanges runs;
+    std::lock_guard<std::mutex> guard(lock);
+    for (BlockID first = 1; first <= last_block; first += blocks_per_range)
+    {
+        if (!may_contain(range_of(first), range))
+            continue;
+        BlockID last = std::min(first + blocks_per_range - 1, last_block);
+        if (!runs.empty() && runs.back().second + 1 == first)
+            runs.back().second = last;
+        else
+            runs.push_back(BlockRange(first, last));
+    }
+    return runs;
+}
+
+size_t BrinIndex::prune(const KeyRange &range, BlockIDs &block_ids)
+{
+    size_t before = block_ids.size();
+    std::lock_guard<std::mutex> guard(lock);
+    block_ids.erase(std::remove_if(block_ids.begin(), block_ids.end(),
+                                   [&](BlockID block_id) { return !may_contain(range_of(block_id), range); }),
+                    block_ids.end());
+    return before - block_ids.size();
+}
+
+//------------------------tests----------------------------------------------
+
+static KeyRange between(int32_t low, int32_t high)
+{
+    KeyRange range;
+    range.at_least(Value(low), true);
+    range.at_most(Value(high), true);
+    return range;
+}
+
+// Every row's block is among those the index gives for the row's value.
+static bool covers(HeapTable &table, BrinIndex &index, const Identifier &column_name)
+{
+    ColumnNames column_names = {column_name};
+    for (auto const &handle : table.select())
+    {
+        int32_t n = table.project(handle, &column_names)[column_name].n;
+        BlockIDs block_ids(1, handle.first);
+        if (index.prune(between(n, n), block_ids) != 0)
+        {
+            std::cout << "value " << n << " in block " << handle.first << " was left out" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+static size_t blocks_in(const BlockRanges &runs)
+{
+    size_t blocks = 0;
+    for (auto const &run : runs)
+        blocks += run.second - run.first + 1;
+    return blocks;
+}
+
+// Key ranges narrow and overlap as comparisons say.
+static bool test_key_range()
+{
+    KeyRange range;
+    range.at_least(Value(10), true);
+    range.at_least(Value(5), false);
+    range.at_most(Value(20), false);
+    bool ok = range.bounded() && !range.empty && range.overlaps(Value(0), Value(10)) &&
+              !range.overlaps(Value(0), Value(9)) && !range.overlaps(Value(20), Value(30)) &&
+              range.overlaps(Value(19), Value(30));
+    range.at_most(Value(10), false);
+    ok = ok && range.empty && !range.overlaps(Value(0), Value(100));
+    KeyRange text;
+    text.at_least(Value(std::string("m")), false);
+    ok = ok && !text.overlaps(Value(std::string("a")), Value(std::string("m"))) &&
+         text.overlaps(Value(std::string("a")), Value(std::string("ma"))) && !KeyRange().bounded();
+    if (!ok)
+        return false;
+    std::cout << "key range ok" << std::endl;
+    return true;
+}
+
+// Rows appended in key order: a range of keys is a short run of blocks, summaries widen as
+// rows are written into summarized ranges, and vacuum and truncation leave them right.
+static bool test_brin_summaries()
+{
+    const int32_t ROWS = 2000;
+    ColumnNames column_names = {"ts", "payload"};
+    ColumnAttributes column_attributes = {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)};
+    HeapTable table("_test_brin_cpp", column_names, column_attributes);
+    table.create_if_not_exists();
+    ValueDict row;
+    row["payload"] = Value(std::string(100, 'p'));
+    Handles handles;
+    for (int32_t i = 0; i < ROWS; i++)
+    {
+        row["ts"] = Value(i);
+        handles.push_back(table.insert(&row));
+    }
+    BrinIndex &index = table.add_brin_index("_test_brin_ts", "ts", 4);
+    BlockID last = handles.back().first;
+    BlockRanges runs = index.block_ranges(between(1000, 1099), last);
+    ValueDict where;
+    where["ts"] = Value(1050);
+    Handles found = table.select(&where);
+    if (blocks_in(runs) > 3 * 4 || found.size() != 1 || found[0] != handles[1050] || !covers(table, index, "ts"))
+    {
+        std::cout << "brin: " << blocks_in(runs) << " of " << last << " blocks for 100 keys" << std::endl;
+        table.drop();
+        return false;
+    }
+    std::cout << "brin block ranges ok (" << blocks_in(runs) << " of " << last << " blocks)" << std::endl;
+
+    // make room in the first block and write a new version of one of its rows there
+    for (int32_t i = 1; i < 10; i++)
+        table.del(handles[i]);
+    table.collect_garbage();
+    ValueDict new_values;
+    new_values["ts"] = Value(ROWS * 10);
+    Handle updated = table.update(handles[0], &new_values);
+    runs = index.block_ranges(between(ROWS * 10, ROWS * 10), last);
+    if (updated.first != handles[0].first || runs.empty() || runs.front().first != 1 || !covers(table, index, "ts"))
+    {
+        std::cout << "brin didn't widen: block " << updated.first << std::endl;
+        table.drop();
+        return false;
+    }
+    std::cout << "brin widening ok" << std::endl;
+
+    // delete the second half, vacuum it away and grow the table again: what's left of the
+    // deleted keys is the first range (which still has the updated row) and the last one
+    // (which the file is filling)
+    for (int32_t i = ROWS / 2; i < ROWS; i++)
+        table.del(handles[i]);
+    VacuumStats stats = table.vacuum();
+    last = 0;
+    for (auto const &handle : table.select())
+        last = std::max(last, handle.first);
+    bool ok = stats.blocks_truncated > 0 && covers(table, index, "ts") &&
+              blocks_in(index.block_ranges(between(ROWS / 2, ROWS - 1), last)) <= 2 * 4;
+    for (int32_t i = 0; i < ROWS / 2; i++)
+    {
+        row["ts"] = Value(ROWS * 2 + i);
+        table.insert(&row);
+    }
+    table.summarize();
+    ok = ok && covers(table, index, "ts");
+    table.drop();
+    if (!ok)
+    {
+        std::cout << "brin after vacuum: " << stats.blocks_truncated << " blocks truncated" << std::endl;
+        return false;
+    }
+    std::cout << "brin vacuum/truncate ok" << std::endl;
+    return true;
+}
+
+// Rows written while ranges are being summarized are never left out.
+static bool test_brin_concurrent()
+{
+    const int THREADS = 4, ROWS = 500;
+    ColumnNames column_names = {"ts", "payload"};
+    ColumnAttributes column_attributes = {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)};
+    HeapTable table("_test_brin_concurrent_cpp", column_names, column_attributes);
+    table.create_if_not_exists();
+    BrinIndex &index = table.add_brin_index("_test_brin_concurrent_ts", "ts", 2);
+    std::atomic<int> running(THREADS);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; t++)
+        threads.push_back(std::thread([&, t]() {
+            ValueDict row;
+            row["payload"] = Value(std::string(200, 'c'));
+            for (int i = 0; i < ROWS; i++)
+            {
+                row["ts"] = Value(t * 100000 + i);
+                table.insert(&row);
+            }
+            running--;
+        }));
+    while (running > 0)
+        table.summarize();
+    for (auto &thread : threads)
+        thread.join();
+    table.summarize();
+    bool ok = covers(table, index, "ts") && table.select().size() == (size_t)(THREADS * ROWS);
+    table.drop();
+    if (!ok)
+        return false;
+    std::cout << "brin concurrent summarize ok" << std::endl;
+    return true;
+}
+
+// test function -- returns true if all tests pass
+bool test_brin_index()
+{
+    std::cout << "\nTesting BrinIndex...." << std::endl;
+    return test_key_range() && test_brin_summaries() && test_brin_concurrent();
+}
@@ -1,6 +1,13 @@
 #include "heap_storage.h"
+#include "brin_index.h"
+#include "table_stats.h"
 #include "storage_engine.h"
+#include "Metrics.h"
+#include "transactions.h"
+#include <algorithm>
 #include <cstring>
+#include <thread>
+#include <unordered_map>
 
 typedef u_int16_t u16;
 
@@ -24,31 +31,57 @@ SlottedPage::SlottedPage(Dbt &block, BlockID block_id, bool is_new) : DbBlock(bl
     }
 }
 
-// Add a new record to the block. Return its id.
+// Frees the block's memory if it was read from a HeapFile (which mallocs a private copy).
+SlottedPage::~SlottedPage()
+{
+    if (this->block.get_flags() & DB_DBT_MALLOC)
+        free(this->block.get_data());
+}
+
+// Add a new record to the block, visible to every snapshot. Return its id.
 RecordID SlottedPage::add(const Dbt *data)
 {
-    if (!has_room(data->get_size()))
+    return add(data, Snapshot::FROZEN);
+}
+
+// Add a new record version created by the transaction with the given stamp, in a
+// tombstone's header if there is one. Return its id.
+RecordID SlottedPage::add(const Dbt *data, Stamp begin)
+{
+    u16 id = (u16)tombstone();
+    if (!has_room(data->get_size(), id == 0 ? 1 : 0))
         throw DbBlockNoRoomError("not enough room for new record");
-    u16 id = ++this->num_records;
+    if (id == 0)
+        id = ++this->num_records;
     u16 size = (u16)data->get_size();
     this->end_free -= size;
     u16 loc = this->end_free + 1;
     put_header();
     put_header(id, size, loc);
+    put_stamp(header_offset(id) + 4, begin);
+    put_stamp(header_offset(id) + 12, Snapshot::FROZEN);
     memcpy(this->address(loc), data->get_data(), size);
+    METRIC_INC(RECORDS_ADDED);
     return id;
 }
 
 // Retrieves a record by its ID
 Dbt *SlottedPage::get(RecordID record_id)
+{
+    RecordView record = view(record_id);
+    if (!record)
+        return nullptr;
+    return new Dbt((void *)record.data, record.size);
+}
+
+// Returns a view of a record's bytes in the block, or an empty view if it was deleted.
+RecordView SlottedPage::view(RecordID record_id)
 {
     u16 size, loc;
     this->get_header(size, loc, record_id);
     if (loc == 0)
-    {
-        return nullptr;
-    }
-    return new Dbt(address(loc), size);
+        return RecordView();
+    return RecordView((const char *)address(loc), size);
 }
 
 // Updates a record with new data.
@@ -75,8 +108,11 @@ void SlottedPage::put(RecordID record_id, const Dbt &data)
         slide(loc + new_size, loc + size);
     }
 
+    // slide() moved this record too, so its header has the new location
+    get_header(size, loc, record_id);
     put_header();
     put_header(record_id, new_size, loc);
+    METRIC_INC(RECORDS_UPDATED);
 }
 
 // Deletes a record by its ID.
@@ -86,40 +122,101 @@ void SlottedPage::del(RecordID record_id)
     get_header(size, loc, record_id);
     put_header(record_id, 0, 0);
     slide(loc, loc + size);
+    METRIC_INC(RECORDS_DELETED);
 }
 
-// Returns a list of IDs for all non-deleted (tombstone) records in the block.
-RecordIDs *SlottedPage::ids(void)
+// Drops the tombstones at the end of the headers. Returns how many.
+u16 SlottedPage::compact()
 {
-    u16 size, loc;
-    RecordIDs *ids = new RecordIDs();
-
-    for (RecordID i = 1; i <= this->num_records; i++)
+    u16 dropped = 0;
+    while (this->num_records > 0 && get_n(header_offset(this->num_records) + 2) == 0)
     {
-        get_header(size, loc, i);
-        if (loc == 0) // tombstone
-            continue;
-        ids->push_back(i);
+        this->num_records--;
+        dropped++;
     }
+    if (dropped > 0)
+        put_header();
+    return dropped;
+}
 
+// Bytes left for new records and their headers.
+u16 SlottedPage::free_space()
+{
+    int available = (int)end_free - (HEADER_SZ + num_records * RECORD_HEADER_SZ);
+    return available > 0 ? (u16)available : 0;
+}
+
+// Fills record_ids with the IDs of all non-deleted (tombstone) records in the block.
+void SlottedPage::ids(RecordIDs &record_ids)
+{
+    record_ids.clear();
+    for_each_record([&record_ids](RecordID id, RecordView) { record_ids.push_back(id); });
+}
+
+// Fills record_ids with the IDs of the record versions the snapshot sees.
+void SlottedPage::ids(const Snapshot &snapshot, RecordIDs &record_ids)
+{
+    record_ids.clear();
+    for_each_record(snapshot, [&record_ids](RecordID id, RecordView) { record_ids.push_back(id); });
+}
+
+// Returns the IDs of the record versions the snapshot sees, in a list made in the arena.
+ArenaRecordIDs *SlottedPage::ids(const Snapshot &snapshot, Arena &arena)
+{
+    ArenaRecordIDs *ids = arena.make<ArenaRecordIDs>(ArenaAllocator<RecordID>(arena));
+    ids->reserve(this->num_records);
+    for_each_record(snapshot, [ids](RecordID id, RecordView) { ids->push_back(id); });
     return ids;
 }
 
+// Retrieves the stamps of the transactions that created and ended a record version.
+void SlottedPage::get_stamps(RecordID record_id, Stamp &begin, Stamp &end)
+{
+    if (record_id == 0 || record_id > num_records)
+        throw DbRelationError("no such record");
+    begin = get_stamp(header_offset(record_id) + 4);
+    end = get_stamp(header_offset(record_id) + 12);
+}
+
+// Marks a record version as ended by the transaction with the given stamp.
+void SlottedPage::set_end(RecordID record_id, Stamp end)
+{
+    if (record_id == 0 || record_id > num_records)
+        throw DbRelationError("no such record");
+    put_stamp(header_offset(record_id) + 12, end);
+}
+
 // Retrieves the header information for a record.
 void SlottedPage::get_header(u16 &size, u16 &loc, RecordID id)
 {
     if (id > num_records)
         throw("Record id is not valid: " + id);
 
-    size = get_n(4 * id);
-    loc = get_n((4 * id) + 2);
+    size = get_n(header_offset(id));
+    loc = get_n(header_offset(id) + 2);
 }
 
-// Checks if there is enough room for a record of a given size.
-bool SlottedPage::has_room(u16 size)
+// Checks if there is enough room for a record of a given size (and new_headers more headers).
+bool SlottedPage::has_room(u16 size, u16 new_headers)
 {
-    u16 available = end_free - (num_records + 2) * 4;
-    return size <= available;
+    // signed, so a nearly full block doesn't wrap around to a huge amount of room
+    int available = (int)end_free - (HEADER_SZ + (num_records + new_headers) * RECORD_HEADER_SZ);
+    return (int)size <= available;
+}
+
+// Returns the id of the first tombstone, or 0 if there is none.
+RecordID SlottedPage::tombstone()
+{
+    for (RecordID id = 1; id <= this->num_records; id++)
+        if (get_n(header_offset(id) + 2) == 0)
+            return id;
+    return 0;
+}
+
+// Offset of a record's header, or of the block's header for id zero.
+u16 SlottedPage::header_offset(RecordID id)
+{
+    return id == 0 ? 0 : HEADER_SZ + (id - 1) * RECORD_HEADER_SZ;
 }
 
 // Slides records in the block to make room for updated records.
@@ -131,17 +228,12 @@ void SlottedPage::slide(u16 start, u16 end)
 
     memmove(this->address(this->end_free + shift + 1), address(this->end_free + 1), start - (this->end_free + 1));
 
-    RecordIDs *ids = this->ids();
-    for (RecordID &id : *ids)
-    {
+    for_each_record([this, start, shift](RecordID id, RecordView) {
         u16 size, loc;
         get_header(size, loc, id);
         if (loc <= start)
-        {
-            loc += shift;
-            put_header(id, size, loc);
-        }
-    }
+            put_header(id, size, loc + shift);
+    });
     end_free += shift;
     put_header();
 }
@@ -158,6 +250,20 @@ void SlottedPage::put_n(u16 offset, u16 n)
     *(u16 *)this->address(offset) = n;
 }
 
+// Get an 8-byte stamp at given offset in block (record headers don't keep it aligned).
+Stamp SlottedPage::get_stamp(u16 offset)
+{
+    Stamp stamp;
+    memcpy(&stamp, this->address(offset), sizeof(stamp));
+    return stamp;
+}
+
+// Put an 8-byte stamp at given offset in block.
+void SlottedPage::put_stamp(u16 offset, Stamp stamp)
+{
+    memcpy(this->address(offset), &stamp, sizeof(stamp));
+}
+
 // Make a void* pointer for a given offset into the data block.
 void *SlottedPage::address(u16 offset)
 {
@@ -173,8 +279,8 @@ void SlottedPage::put_header(RecordID id, u16 size, u16 loc)
         size = this->num_records;
         loc = this->end_free;
     }
-    put_n((u16)4 * id, size);
-    put_n((u16)4 * id + 2, loc);
+    put_n(header_offset(id), size);
+    put_n(header_offset(id) + 2, loc);
 }
 
 //------------------------HeapFile----------------------------------------------
@@ -183,7 +289,7 @@ void SlottedPage::put_header(RecordID id, u16 size, u16 loc)
 void HeapFile::create(void)
 {
     this->db_open(DB_CREATE | DB_EXCL);
-    SlottedPage *blockPage = this->get_new();
+    delete this->get_new();  // a new file starts with one empty block
 }
 
 // Drops the heap file by closing and removing the database file.
@@ -205,7 +311,21 @@ void HeapFile::db_open(uint flags)
 {
     if (closed == false)
         return; // no need to do anything
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (closed == false)
+        return; // another thread opened it first
 
+    u_int32_t env_flags = 0;
+    _DB_ENV->get_open_flags(&env_flags);
+    if (env_flags & DB_THREAD)
+        flags |= DB_THREAD; // the handle is shared by all the threads using this file
+    if (env_flags & DB_INIT_TXN)
+    {
+        // readers outside a transaction don't wait for writers' locks; their snapshots
+        // hide the uncommitted versions they see
+        flags |= DB_READ_UNCOMMITTED;
+        this->read_flags = DB_READ_UNCOMMITTED;
+    }
     this->db.set_re_len(DbBlock::BLOCK_SZ);
     this->dbfilename = this->name + ".db";
     db.open(nullptr, this->dbfilename.c_str(), nullptr, DB_RECNO, flags, 0644); // RECNO is a record number database, 0644 is unix file permission
@@ -219,6 +339,7 @@ void HeapFile::db_open(uint flags)
 // Closes the heap file database.
 void HeapFile::close(void)
 {
+    std::lock_guard<std::mutex> guard(this->lock);
     if(closed == true) return;
     this->db.close(0);
     this->closed = true;
@@ -232,43 +353,110 @@ SlottedPage *HeapFile::get_new(void)
     std::memset(block, 0, sizeof(block));
     Dbt data(block, sizeof(block));
 
-    int block_id = ++this->last;
+    BlockID block_id = ++this->last; // every caller gets an id of its own
     Dbt key(&block_id, sizeof(block_id));
 
-    // write out an empty block and read it back in so Berkeley DB is managing the memory
-    SlottedPage *page = new SlottedPage(data, this->last, true);
-    this->db.put(nullptr, &key, &data, 0); // write it out with initialization applied
-    this->db.get(nullptr, &key, &data, 0);
-    return page;
+    // write out an empty block and read it back in so the page doesn't point at our stack;
+    // a thread appending to the file's last block may have written it first, so don't overwrite
+    SlottedPage *page = new SlottedPage(data, block_id, true);
+    this->db.put(Transaction::current(), &key, &data, DB_NOOVERWRITE); // write it out with initialization applied
+    delete page;
+    METRIC_INC(BLOCKS_ALLOCATED);
+    METRIC_INC(BLOCK_WRITES);
+    METRIC_ADD(BYTES_WRITTEN, DbBlock::BLOCK_SZ);
+    return this->get(block_id);
 }
 
+thread_local uint64_t HeapFile::blocks_read = 0;
+
 // Retrieves a block from the database by its ID and 
 // returns pointer to the SlottedPage representing the block.
 SlottedPage *HeapFile::get(BlockID block_id)
 {
+    METRIC_TIME(BLOCK_READ_LATENCY);
     Dbt key(&block_id, sizeof(block_id));
     Dbt data;
-    this->db.get(nullptr, &key, &data, 0);
+    data.set_flags(DB_DBT_MALLOC); // private copy, so it survives other reads of this file (freed by ~SlottedPage)
+    DbTxn *txn = Transaction::current();
+    int status = this->db.get(txn, &key, &data, txn == nullptr ? this->read_flags : 0);
+    if (status == DB_NOTFOUND || status == DB_KEYEMPTY)
+    {
+        // allocated but not written yet, or by a transaction that has since aborted: reads as an empty block
+        data.set_data(calloc(1, DbBlock::BLOCK_SZ));
+        data.set_size(DbBlock::BLOCK_SZ);
+        return new SlottedPage(data, block_id, true);
+    }
+    blocks_read++;
+    METRIC_INC(BLOCK_READS);
+    METRIC_ADD(BYTES_READ, data.get_size());
     return new SlottedPage(data, block_id, false);
 }
 
+// Reads a block into the arena: the bytes go straight into arena memory (no malloc'd copy).
+SlottedPage *HeapFile::get(BlockID block_id, Arena &arena)
+{
+    METRIC_TIME(BLOCK_READ_LATENCY);
+    Dbt key(&block_id, sizeof(block_id));
+    Dbt data;
+    data.set_data(arena.allocate(DbBlock::BLOCK_SZ));
+    data.set_ulen(DbBlock::BLOCK_SZ);
+    data.set_flags(DB_DBT_USERMEM);
+    DbTxn *txn = Transaction::current();
+    int status = this->db.get(txn, &key, &data, txn == nullptr ? this->read_flags : 0);
+    if (status == DB_NOTFOUND || status == DB_KEYEMPTY)
+    {
+        memset(data.get_data(), 0, DbBlock::BLOCK_SZ);
+        data.set_size(DbBlock::BLOCK_SZ);
+        return arena.make<SlottedPage>(data, block_id, true);
+    }
+    blocks_read++;
+    METRIC_INC(BLOCK_READS);
+    METRIC_ADD(BYTES_READ, data.get_size());
+    return arena.make<SlottedPage>(data, block_id, false);
+}
+
 // Writes a block back to the database.
 void HeapFile::put(DbBlock *block)
 {
+    METRIC_TIME(BLOCK_WRITE_LATENCY);
     int block_id = block->get_block_id();
     Dbt key(&block_id, sizeof(block_id));
-    this->db.put(nullptr, &key, block->get_block(), 0); // txnid is null
+    this->db.put(Transaction::current(), &key, block->get_block(), 0); // autocommitted outside a Transaction
+    METRIC_INC(BLOCK_WRITES);
+    METRIC_ADD(BYTES_WRITTEN, block->get_block()->get_size());
 }
 
-// Returns a list of all block IDs in the heap file.
-BlockIDs *HeapFile::block_ids()
+// Deletes the last block from the file if it still is the last. A block allocated after it
+// in the meantime makes it an interior block again, so it is written back, empty, to keep
+// the file without holes (its record count is its block count when it's next opened).
+bool HeapFile::remove_last(BlockID block_id)
 {
-    BlockIDs *blockIds = new BlockIDs;
-    for (BlockID i = 1; i <= (BlockID)this->last; i++)
+    if (this->last != block_id)
+        return false;
+    Dbt key(&block_id, sizeof(block_id));
+    this->db.del(Transaction::current(), &key, 0);
+    u_int32_t expected = block_id;
+    if (this->last.compare_exchange_strong(expected, block_id - 1))
     {
-        blockIds->push_back(i);
+        METRIC_INC(BLOCKS_TRUNCATED);
+        return true;
     }
-    return blockIds;
+    char block[DbBlock::BLOCK_SZ];
+    std::memset(block, 0, sizeof(block));
+    Dbt data(block, sizeof(block));
+    SlottedPage page(data, block_id, true);
+    this->put(&page);
+    return false;
+}
+
+// Fills ids with all the block IDs in the heap file.
+void HeapFile::block_ids(BlockIDs &ids)
+{
+    BlockID last = this->last;
+    ids.clear();
+    ids.reserve(last);
+    for (BlockID i = 1; i <= last; i++)
+        ids.push_back(i);
 }
 
 //------------------------HeapTable----------------------------------------------
@@ -276,8 +464,41 @@ BlockIDs *HeapFile::block_ids()
 // Constructor for HeapTable, initializes the heap table with specified parameters.
 HeapTable::HeapTable(Identifier table_name, ColumnNames column_names, ColumnAttributes column_attributes)
     : DbRelation(table_name, column_names, column_attributes), // Initialize base class
-      file(table_name)                                         // Initialize member variable file
+      file(table_name),                                        // Initialize member variable file
+      dead_versions(0), brin_indexes(column_names.size())
+{
+    for (auto &index : brin_indexes)
+        index = nullptr;
+    // the columns up to the first TEXT one have fixed offsets; each later one gets an entry
+    // in the directory at the front of every record
+    size_t entries = 0;
+    u16 offset = 0;
+    bool after_text = false;
+    for (auto const &attribute : this->column_attributes)
+    {
+        if (after_text)
+        {
+            directory_entries.push_back((int)entries++);
+            fixed_offsets.push_back(0);
+            continue;
+        }
+        directory_entries.push_back(-1);
+        fixed_offsets.push_back(offset);
+        if (attribute.get_data_type() == ColumnAttribute::TEXT)
+            after_text = true;
+        else
+            offset += sizeof(int32_t);
+    }
+    this->directory_size = (u16)(entries * sizeof(u16));
+    for (size_t i = 0; i < fixed_offsets.size(); i++)
+        if (directory_entries[i] < 0)
+            fixed_offsets[i] += this->directory_size;
+}
+
+HeapTable::~HeapTable()
 {
+    for (auto &index : brin_indexes)
+        delete index.load();
 }
 
 // Creates the table by creating the new file for it
@@ -318,79 +539,299 @@ void HeapTable::close()
 }
 
 // Inserts a new row into the table and returns 
-// a handle to the newly inserted row
+// a handle to the newly inserted row, counting it in the table's statistics (uncounted again
+// if the transaction aborts). Outside a transaction, it then summarizes any block ranges
+// the insert filled.
 Handle HeapTable::insert(const ValueDict *row)
 {
     this->open();
-    return this->append(this->validate(row));
+    ValueDict *full_row = this->validate(row);
+    Handle handle;
+    try
+    {
+        Transaction transaction;
+        handle = this->append(full_row);
+        std::shared_ptr<TableStats> stats = this->get_stats();
+        if (stats != nullptr)
+        {
+            stats->add_row(*full_row, handle.first);
+            Transaction::on_abort([stats]() { stats->count_rows(-1); });
+        }
+        transaction.commit(false);
+    }
+    catch (...)
+    {
+        delete full_row;
+        throw;
+    }
+    delete full_row;
+    if (Transaction::stamp() == Snapshot::FROZEN)
+        this->summarize();
+    return handle;
 }
 
-void HeapTable::update(const Handle handle, const ValueDict *new_values)
+// Replaces the values of the given columns of a row; its other columns keep their values.
+// Writes the new values as a new version of the row, in the same block if it has room, and
+// ends the old version. Returns the new version's handle.
+Handle HeapTable::update(const Handle handle, const ValueDict *new_values)
 {
-    // FIXME
+    this->open();
+    for (auto const &new_value : *new_values)
+        if (std::find(this->column_names.begin(), this->column_names.end(), new_value.first) == this->column_names.end())
+            throw DbRelationError("unknown column '" + new_value.first + "'");
+
+    Transaction transaction;
+    Stamp stamp = Transaction::stamp();
+    Handle updated(handle.first, 0);
+    Arena arena;
+    Dbt *data;
+    {
+        ExclusiveLatch latch(this->file.latch(handle.first));
+        SlottedPage *block = this->file.get(handle.first, arena);
+        this->end_version(block, handle.second, stamp);
+        ValueDict *row = unmarshal(block->view(handle.second), arena);
+        for (auto const &new_value : *new_values)
+            (*row)[new_value.first] = new_value.second;
+        data = marshal(row, arena);
+        try
+        {
+            updated.second = this->add_version(block, data, stamp);
+        }
+        catch (DbBlockNoRoomError const &)
+        {
+            // the new version goes elsewhere
+        }
+        this->file.put(block);
+    }
+    if (updated.second == 0)
+        updated = this->append(data);
+    transaction.commit(false);
+    return updated;
 }
 
+// Deletes a row by ending its current version, and takes it off the statistics' row count;
+// the space is reclaimed once no snapshot can see it any more.
 void HeapTable::del(const Handle handle)
 {
-    // FIXME
+    this->open();
+    Transaction transaction;
+    {
+        Arena arena;
+        ExclusiveLatch latch(this->file.latch(handle.first));
+        SlottedPage *block = this->file.get(handle.first, arena);
+        this->end_version(block, handle.second, Transaction::stamp());
+        this->file.put(block);
+    }
+    std::shared_ptr<TableStats> stats = this->get_stats();
+    if (stats != nullptr)
+    {
+        stats->count_rows(-1);
+        Transaction::on_abort([stats]() { stats->count_rows(1); });
+    }
+    transaction.commit(false);
+}
+
+// Selects rows from the table based on a condition/predicate (where) into handles.
+// Only equality on each column of where is supported; a null where selects every row.
+// Only the columns in where are decoded, and only in the blocks BRIN indexes don't rule out.
+void HeapTable::select(const ValueDict *where, Handles &handles)
+{
+    this->open();
+    // a version's values never change, so its block needn't be latched to read them
+    std::shared_ptr<const Snapshot> snapshot = Transaction::snapshot();
+    handles.clear();
+    std::vector<std::pair<size_t, const Value *>> conditions;
+    if (where != nullptr)
+        for (auto const &column : *where)
+        {
+            auto it = std::find(this->column_names.begin(), this->column_names.end(), column.first);
+            if (it == this->column_names.end())
+                return;  // no row has the column, so none matches
+            conditions.push_back(std::make_pair((size_t)(it - this->column_names.begin()), &column.second));
+        }
+    BlockIDs block_ids = file.block_ids();
+    this->prune_blocks(conditions, block_ids);
+    Value value;
+    Arena arena;
+    for (auto const &block_id : block_ids)
+    {
+        SlottedPage *block = file.get(block_id, arena);
+        block->for_each_record(*snapshot, [&](RecordID record_id, RecordView record) {
+            for (auto const &condition : conditions)
+            {
+                decode_column(record.data, condition.first, value);
+                if (value != *condition.second)
+                    return;
+            }
+            handles.push_back(Handle(block_id, record_id));
+        });
+        arena.reset();
+    }
 }
 
-// Selects all rows from the table.
-// @return A vector of handles to the selected rows.
-Handles *HeapTable::select()
+// Reclaims the space of row versions that no snapshot can see any more, one block (and
+// one transaction) at a time. Returns how many versions it reclaimed.
+size_t HeapTable::collect_garbage()
 {
-    return select(nullptr);
+    this->open();
+    VacuumStats stats;
+    size_t used, room;
+    for (auto const &block_id : file.block_ids())
+        this->vacuum_block(block_id, stats, used, room);
+    return stats.versions_reclaimed;
 }
 
-// Selects rows from the table based on a condition/predicate (where)
-Handles *HeapTable::select(const ValueDict *where)
+// Vacuums the table in three passes over its blocks: reclaim and compact each one; move the
+// rows of nearly empty blocks, latest first, into the earliest blocks with room for them;
+// and truncate the file's empty tail. The BRIN summaries of the blocks that lost versions
+// are then built again, tighter.
+VacuumStats HeapTable::vacuum(std::chrono::microseconds pause)
 {
-    Handles *handles = new Handles();
-    BlockIDs *block_ids = file.block_ids();
-    for (auto const &block_id : *block_ids)
+    this->open();
+    VacuumStats stats;
+    BlockIDs block_ids = this->file.block_ids();
+    std::vector<size_t> used(block_ids.size() + 1, 0), room(block_ids.size() + 1, 0);
+    for (auto const &block_id : block_ids)
     {
-        SlottedPage *block = file.get(block_id);
-        RecordIDs *record_ids = block->ids();
-        for (auto const &record_id : *record_ids)
-            handles->push_back(Handle(block_id, record_id));
-        delete record_ids;
-        delete block;
+        size_t reclaimed = stats.versions_reclaimed;
+        this->vacuum_block(block_id, stats, used[block_id], room[block_id]);
+        if (stats.versions_reclaimed > reclaimed)
+            for (auto &index : brin_indexes)
+                if (index != nullptr)
+                    index.load()->forget(block_id, block_id);
+        std::this_thread::sleep_for(pause);
+    }
+
+    std::vector<BlockID> emptied;
+    for (BlockID source = (BlockID)block_ids.size(); source > 1; source--)
+    {
+        if (used[source] == 0 || used[source] > DbBlock::BLOCK_SZ / 4)
+            continue;
+        BlockID target = 1;
+        while (target < source && room[target] < used[source])
+            target++;
+        if (target == source)
+            continue;
+        size_t moved = this->move_rows(source, target);
+        if (moved == 0)
+            continue;
+        stats.rows_moved += moved;
+        room[target] -= used[source];
+        used[target] += used[source];
+        used[source] = 0;
+        emptied.push_back(source);
+        std::this_thread::sleep_for(pause);
     }
-    delete block_ids;
-    return handles;
+
+    // the moved versions are dead as soon as no snapshot is older than the moves
+    size_t unused;
+    for (auto const &block_id : emptied)
+        this->vacuum_block(block_id, stats, unused, unused);
+    stats.blocks_truncated = this->truncate();
+    this->summarize();
+    return stats;
 }
 
-// Projects a row from the table.
-ValueDict *HeapTable::project(Handle handle)
+// Adds the index and summarizes what the file has filled so far. Writers start widening the
+// index's summaries as soon as it's published.
+BrinIndex &HeapTable::add_brin_index(const Identifier &index_name, const Identifier &column_name,
+                                     BlockID blocks_per_range)
 {
-    return project(handle, &this->column_names);
+    this->open();
+    auto it = std::find(this->column_names.begin(), this->column_names.end(), column_name);
+    if (it == this->column_names.end())
+        throw DbRelationError("unknown column '" + column_name + "'");
+    size_t column = it - this->column_names.begin();
+    BrinIndex *index = new BrinIndex(*this, index_name, column,
+                                     blocks_per_range == 0 ? BrinIndex::BLOCKS_PER_RANGE : blocks_per_range);
+    BrinIndex *none = nullptr;
+    if (!brin_indexes[column].compare_exchange_strong(none, index))
+    {
+        delete index;
+        throw DbRelationError("column '" + column_name + "' already has an index");
+    }
+    this->summarize();
+    return *index;
 }
 
-// Projects a row from the table with specified columns.
-ValueDict *HeapTable::project(Handle handle, const ColumnNames *column_names)
+void HeapTable::summarize()
 {
-    BlockID blockID = handle.first;
-    RecordID recordID = handle.second;
-    SlottedPage *block = this->file.get(blockID);
-    Dbt *data = block->get(recordID);
-    ValueDict *rows = unmarshal(data);
-    if (column_names == nullptr || column_names->empty())
-        return rows;
+    BlockID last = this->file.get_last_block_id();
+    for (auto &index : brin_indexes)
+        if (index != nullptr)
+            index.load()->summarize(last);
+}
 
-    // Create a new ValueDict for the filtered columns.
-    ValueDict *filteredRows = new ValueDict;
-    for (const auto &colName : *column_names)
+// Each condition's index narrows the list to the blocks whose ranges may hold its value.
+void HeapTable::prune_blocks(const std::vector<std::pair<size_t, const Value *>> &conditions, BlockIDs &block_ids)
+{
+    for (auto const &condition : conditions)
     {
-        auto it = rows->find(colName);
-        if (it != rows->end())
-        {
-            (*filteredRows)[colName] = it->second;
-        }
+        BrinIndex *index = brin_indexes[condition.first];
+        if (index == nullptr)
+            continue;
+        KeyRange range;
+        range.at_least(*condition.second, true);
+        range.at_most(*condition.second, true);
+        METRIC_ADD(BRIN_BLOCKS_SKIPPED, index->prune(range, block_ids));
     }
-    delete rows;
-    delete block;
-    delete data;
-    return filteredRows;
+}
+
+// Starts a streaming scan over all the rows in the table.
+std::unique_ptr<DbRelationScan> HeapTable::scan()
+{
+    this->open();
+    return std::unique_ptr<DbRelationScan>(new HeapTableScan(*this));
+}
+
+// Estimates the row count from the statistics, if the table has been analyzed, or else from
+// the number of blocks and how full the last one is, reading just that one block.
+size_t HeapTable::estimated_row_count()
+{
+    std::shared_ptr<TableStats> stats = this->get_stats();
+    if (stats != nullptr)
+        return stats->get_row_count();
+    this->open();
+    BlockID last = this->file.get_last_block_id();
+    if (last == 0)
+        return 0;
+    Arena arena;
+    size_t in_last = 0;
+    this->file.get(last, arena)->for_each_record([&in_last](RecordID, RecordView) { in_last++; });
+    // full blocks hold at least as many as the last; assume the same average
+    return (size_t)(last - 1) * std::max(in_last, (size_t)1) + in_last;
+}
+
+// Projects a row from the table with specified columns into row, decoding only those.
+void HeapTable::project(Handle handle, const ColumnNames *column_names, ValueDict &row)
+{
+    Arena arena;
+    RecordView record = view(handle, arena);
+    if (column_names == nullptr || column_names->empty() || column_names == &this->column_names)
+        unmarshal(record, row);
+    else
+        unmarshal(record, *column_names, row);
+}
+
+// Projects a row from the table with specified columns, reading it into the arena.
+ValueDict *HeapTable::project(Handle handle, const ColumnNames *column_names, Arena &arena)
+{
+    RecordView record = view(handle, arena);
+    if (column_names == nullptr || column_names->empty() || column_names == &this->column_names)
+        return unmarshal(record, arena);
+    ValueDict *projected = arena.make<ValueDict>();
+    unmarshal(record, *column_names, *projected);
+    return projected;
+}
+
+// Reads the block of a row into the arena and returns a view of the row's record.
+RecordView HeapTable::view(Handle handle, Arena &arena)
+{
+    SlottedPage *block = this->file.get(handle.first, arena);
+    RecordView record = block->view(handle.second);
+    if (!record)
+        throw DbRelationError("no such row");
+    return record;
 }
 
 // Validates a row against the table's schema to make sure the columns
@@ -414,27 +855,281 @@ ValueDict *HeapTable::validate(const ValueDict *row)
     return fullRow;
 }
 
+// The block each thread inserts into, by HeapFile latch key. Threads fill blocks of their
+// own, so concurrent inserts don't all wait on the latch of the file's last block.
+static thread_local std::unordered_map<size_t, BlockID> insert_blocks;
+
 // Appends a row to the table after marshalling the data 
-// and adding it to the block
+// and adding it to the thread's insert block, or to a new block once that is full
 Handle HeapTable::append(const ValueDict *row)
 {
-    Dbt *data = marshal(row);
-    SlottedPage *block = this->file.get(this->file.get_last_block_id());
+    Arena arena;
+    return this->append(marshal(row, arena));
+}
+
+// Appends a marshaled row as a version created by the current transaction.
+Handle HeapTable::append(const Dbt *data)
+{
+    if (data->get_size() > SlottedPage::max_record_size())
+        throw DbBlockNoRoomError("row is too big for a block");
+    BlockID last = this->file.get_last_block_id();
+    auto insert_block = insert_blocks.find(this->file.get_latch_key());
+    // a thread without an insert block takes over the file's last one
+    BlockID block_id = insert_block != insert_blocks.end() && insert_block->second <= last ? insert_block->second : last;
+    RecordID id = 0;
+    if (block_id != 0)
+    {
+        try
+        {
+            id = this->add_to(block_id, data);
+        }
+        catch (DbBlockNoRoomError const &)
+        {
+        }
+    }
+    while (id == 0)
+    {
+        SlottedPage *block = this->file.get_new();
+        block_id = block->get_block_id();
+        delete block;
+        try
+        {
+            id = this->add_to(block_id, data);
+        }
+        catch (DbBlockNoRoomError const &)
+        {
+            // another thread took the new block over as the file's last and filled it
+        }
+    }
+    insert_blocks[this->file.get_latch_key()] = block_id;
+    return Handle(block_id, id);
+}
+
+// Adds a record to a block, holding the block's latch from reading it to writing it back.
+// Returns 0 without waiting if another thread has the latch: it may be waiting on the page
+// locks of our own transaction. Throws DbBlockNoRoomError if the record doesn't fit.
+RecordID HeapTable::add_to(BlockID block_id, const Dbt *data)
+{
+    PageLatch &latch = this->file.latch(block_id);
+    if (!latch.try_lock())
+        return 0;
+    if (block_id > this->file.get_last_block_id())
+    {
+        // vacuumed off the end of the file since the caller chose it
+        latch.unlock();
+        throw DbBlockNoRoomError("block was truncated");
+    }
+    Arena arena;
     RecordID id;
     try
     {
-        id = block->add(data);
+        SlottedPage *block = this->file.get(block_id, arena);
+        id = this->add_version(block, data, Transaction::stamp());
+        this->file.put(block);
     }
-    catch (DbRelationError const &)
+    catch (...)
     {
-        block = this->file.get_new();
-        id = block->add(data);
+        latch.unlock();
+        throw;
     }
-    this->file.put(block);
-    delete block;
-    delete[] (char *)data->get_data();
-    delete data;
-    return Handle(this->file.get_last_block_id(), id);
+    latch.unlock();
+    return id;
+}
+
+// Adds a record version to a block, first reclaiming the block's dead versions if it's full,
+// and widens the BRIN summaries of the block's range to take it in. The caller holds the
+// block's latch. Throws DbBlockNoRoomError if the record still doesn't fit.
+RecordID HeapTable::add_version(SlottedPage *block, const Dbt *data, Stamp stamp)
+{
+    RecordID id;
+    try
+    {
+        id = block->add(data, stamp);
+    }
+    catch (DbBlockNoRoomError const &)
+    {
+        if (this->prune(block, Snapshot::horizon()) == 0)
+            throw;
+        id = block->add(data, stamp);
+    }
+    for (auto &index : brin_indexes)
+        if (index != nullptr)
+            index.load()->add(block->get_block_id(), (const char *)data->get_data());
+    return id;
+}
+
+// Reclaims a block's dead versions and drops its trailing tombstones in a transaction of its
+// own, setting used to the bytes its records and their headers take up and room to the
+// bytes it has left.
+void HeapTable::vacuum_block(BlockID block_id, VacuumStats &stats, size_t &used, size_t &room)
+{
+    Transaction transaction;
+    {
+        Arena arena;
+        ExclusiveLatch latch(this->file.latch(block_id));
+        SlottedPage *block = this->file.get(block_id, arena);
+        size_t pruned = this->prune(block, Snapshot::horizon());
+        u16 freed = block->compact();
+        if (pruned > 0 || freed > 0)
+            this->file.put(block);
+        stats.versions_reclaimed += pruned;
+        stats.slots_freed += freed;
+        used = 0;
+        block->for_each_record(
+            [&used](RecordID, RecordView record) { used += record.size + SlottedPage::RECORD_HEADER_SZ; });
+        room = block->free_space();
+    }
+    transaction.commit(false);
+}
+
+// Moves a block's rows into another as updates by one transaction, so snapshots taken
+// before it commits see the originals and later ones the copies. The rows are read outside
+// the transaction and the source's latch is only tried once the copies are written, so the
+// vacuum never waits for a latch while holding page locks a latch holder may be waiting for.
+// Returns how many rows were moved, or 0 if it gave up (undoing any copies).
+size_t HeapTable::move_rows(BlockID source, BlockID target)
+{
+    Arena arena;
+    std::vector<RecordID> record_ids;
+    std::vector<Stamp> begins;
+    std::vector<Dbt *> copies;
+    {
+        SharedLatch latch(this->file.latch(source));
+        SlottedPage *block = this->file.get(source, arena);
+        Snapshot snapshot;
+        bool current = true;
+        block->for_each_record([&](RecordID record_id, RecordView record) {
+            Stamp begin, end;
+            block->get_stamps(record_id, begin, end);
+            if (end != Snapshot::FROZEN || !snapshot.sees(begin, end))
+                current = false;  // ended, or not committed: still some snapshot's business
+            record_ids.push_back(record_id);
+            begins.push_back(begin);
+            copies.push_back(arena.make<Dbt>(arena.copy(record.data, record.size), record.size));
+        });
+        if (!current || record_ids.empty())
+            return 0;
+    }
+
+    Transaction transaction;
+    Stamp stamp = Transaction::stamp();
+    for (auto const copy : copies)
+    {
+        try
+        {
+            if (this->add_to(target, copy) == 0)
+                return 0;
+        }
+        catch (DbBlockNoRoomError const &)
+        {
+            return 0;
+        }
+    }
+    PageLatch &latch = this->file.latch(source);
+    if (!latch.try_lock())
+        return 0;
+    try
+    {
+        SlottedPage *block = this->file.get(source, arena);
+        for (size_t i = 0; i < record_ids.size(); i++)
+        {
+            Stamp begin, end;
+            block->get_stamps(record_ids[i], begin, end);
+            if (!block->view(record_ids[i]) || begin != begins[i] || end != Snapshot::FROZEN)
+            {
+                latch.unlock();
+                return 0;  // changed since we read it
+            }
+        }
+        for (auto const &record_id : record_ids)
+            block->set_end(record_id, stamp);
+        this->file.put(block);
+    }
+    catch (...)
+    {
+        latch.unlock();
+        throw;
+    }
+    latch.unlock();
+    transaction.commit(false);
+    this->dead_versions += record_ids.size();
+    METRIC_ADD(ROWS_MOVED, record_ids.size());
+    return record_ids.size();
+}
+
+// Removes the empty blocks at the end of the file, last first, stopping at the first that
+// isn't empty (or whose latch is busy). Returns how many it removed.
+size_t HeapTable::truncate()
+{
+    size_t truncated = 0;
+    Arena arena;
+    for (BlockID last = this->file.get_last_block_id(); last > 1; last = this->file.get_last_block_id())
+    {
+        PageLatch &latch = this->file.latch(last);
+        if (!latch.try_lock())
+            break;
+        bool removed = false;
+        try
+        {
+            SlottedPage *block = this->file.get(last, arena);
+            bool empty = true;
+            block->for_each_record([&empty](RecordID, RecordView) { empty = false; });
+            removed = empty && this->file.remove_last(last);
+        }
+        catch (...)
+        {
+            latch.unlock();
+            throw;
+        }
+        latch.unlock();
+        arena.reset();
+        if (!removed)
+            break;
+        truncated++;
+    }
+    // the blocks cut off are allocated afresh, so their ranges start over unsummarized
+    if (truncated > 0)
+        for (auto &index : brin_indexes)
+            if (index != nullptr)
+                index.load()->forget(this->file.get_last_block_id() + 1);
+    return truncated;
+}
+
+// Ends the version at record_id as of the stamp. Throws DbRelationError if there is no such
+// version or it has already been ended (by another transaction, or this one).
+void HeapTable::end_version(SlottedPage *block, RecordID record_id, Stamp stamp)
+{
+    Stamp begin, end;
+    block->get_stamps(record_id, begin, end);
+    if (!block->view(record_id))
+        throw DbRelationError("no such row");
+    if (end != Snapshot::FROZEN)
+        throw DbRelationError(end == stamp ? "row was already updated or deleted"
+                                           : "row was updated or deleted by another transaction");
+    block->set_end(record_id, stamp);
+    this->dead_versions++;
+}
+
+// Deletes the block's versions that were ended before the horizon, which no snapshot
+// can see. Returns how many.
+size_t HeapTable::prune(SlottedPage *block, Stamp horizon)
+{
+    size_t pruned = 0;
+    block->for_each_record([&](RecordID record_id, RecordView) {
+        Stamp begin, end;
+        block->get_stamps(record_id, begin, end);
+        if (end != Snapshot::FROZEN && end < horizon)
+        {
+            block->del(record_id);
+            pruned++;
+        }
+    });
+    METRIC_ADD(VERSIONS_RECLAIMED, pruned);
+    size_t dead = this->dead_versions;
+    while (!this->dead_versions.compare_exchange_weak(dead, dead > pruned ? dead - pruned : 0))
+    {
+    }
+    return pruned;
 }
 
 // return the bits to go into the file
@@ -442,21 +1137,58 @@ Handle HeapTable::append(const ValueDict *row)
 Dbt *HeapTable::marshal(const ValueDict *row)
 {
     char *bytes = new char[DbBlock::BLOCK_SZ]; // more than we need (we insist that one row fits into DbBlock::BLOCK_SZ)
-    uint offset = 0;
+    u_int32_t size;
+    try
+    {
+        size = marshal(row, bytes);
+    }
+    catch (...)
+    {
+        delete[] bytes;
+        throw;
+    }
+    char *right_size_bytes = new char[size];
+    memcpy(right_size_bytes, bytes, size);
+    delete[] bytes;
+    return new Dbt(right_size_bytes, size);
+}
+
+// return the bits to go into the file, made in the arena
+Dbt *HeapTable::marshal(const ValueDict *row, Arena &arena)
+{
+    char *bytes = (char *)arena.allocate(DbBlock::BLOCK_SZ, 1);
+    u_int32_t size = marshal(row, bytes);
+    arena.shrink(bytes, size);
+    return arena.make<Dbt>(bytes, size);
+}
+
+// write the bits to go into the file to bytes (DbBlock::BLOCK_SZ of them) and return their size:
+// the offset directory, then the columns
+u_int32_t HeapTable::marshal(const ValueDict *row, char *bytes)
+{
+    uint offset = this->directory_size;
     uint col_num = 0;
     for (auto const &column_name : this->column_names)
     {
-        ColumnAttribute ca = this->column_attributes[col_num++];
+        if (this->directory_entries[col_num] >= 0)
+            *(u16 *)(bytes + this->directory_entries[col_num] * sizeof(u16)) = (u16)offset;
+        const ColumnAttribute &ca = this->column_attributes[col_num++];
         ValueDict::const_iterator column = row->find(column_name);
-        Value value = column->second;
+        const Value &value = column->second;
+        if (value.is_null)
+            throw DbRelationError("cannot store NULL in column '" + column_name + "'");
         if (ca.get_data_type() == ColumnAttribute::DataType::INT)
         {
+            if (offset + sizeof(int32_t) > DbBlock::BLOCK_SZ)
+                throw DbBlockNoRoomError("row is too big for a block");
             *(int32_t *)(bytes + offset) = value.n;
             offset += sizeof(int32_t);
         }
         else if (ca.get_data_type() == ColumnAttribute::DataType::TEXT)
         {
             uint size = value.s.length();
+            if (offset + sizeof(u16) + size > DbBlock::BLOCK_SZ)
+                throw DbBlockNoRoomError("row is too big for a block");
             *(u16 *)(bytes + offset) = size;
             offset += sizeof(u16);
             memcpy(bytes + offset, value.s.c_str(), size); // assume ascii for now
@@ -467,48 +1199,162 @@ Dbt *HeapTable::marshal(const ValueDict *row)
             throw DbRelationError("Only know how to marshal INT and TEXT");
         }
     }
-    char *right_size_bytes = new char[offset];
-    memcpy(right_size_bytes, bytes, offset);
-    delete[] bytes;
-    Dbt *data = new Dbt(right_size_bytes, offset);
-    return data;
+    METRIC_INC(MARSHAL_CALLS);
+    METRIC_ADD(MARSHAL_BYTES, offset);
+    return offset;
 }
 
 // Unmarshals a row from its stored format and
 // returns a dictionary representing the unmarshaled row.
 ValueDict *HeapTable::unmarshal(Dbt *data)
 {
-    char *bytes = static_cast<char *>(data->get_data());
-    uint offset = 0;
-    uint col_num = 0;
-
     ValueDict *row = new ValueDict();
-    for (auto const &column_name : this->column_names)
+    try
     {
-        ColumnAttribute ca = this->column_attributes[col_num++];
+        unmarshal(RecordView((const char *)data->get_data(), (u16)data->get_size()), *row);
+    }
+    catch (...)
+    {
+        delete row;
+        throw;
+    }
+    return row;
+}
+
+// Unmarshals a row into a dictionary made in the arena.
+ValueDict *HeapTable::unmarshal(RecordView record, Arena &arena)
+{
+    ValueDict *row = arena.make<ValueDict>();
+    unmarshal(record, *row);
+    return row;
+}
 
+// Unmarshals a row into row, overwriting the values it has for the table's columns in place.
+void HeapTable::unmarshal(RecordView record, ValueDict &row)
+{
+    const char *bytes = record.data;
+    uint offset = this->directory_size;  // the columns are in order after the directory
+    uint col_num = 0;
+    if (row.size() != this->column_names.size())
+        row.clear();
+    for (auto const &column_name : this->column_names)
+    {
+        const ColumnAttribute &ca = this->column_attributes[col_num++];
+        Value &value = row[column_name];
+        value.is_null = false;
         if (ca.get_data_type() == ColumnAttribute::DataType::INT)
         {
             // Read an integer value
-            int32_t value = *(reinterpret_cast<int32_t *>(bytes + offset));
+            value.data_type = ColumnAttribute::INT;
+            value.n = *(reinterpret_cast<const int32_t *>(bytes + offset));
             offset += sizeof(int32_t);
-            (*row)[column_name] = Value(value);
         }
         else if (ca.get_data_type() == ColumnAttribute::DataType::TEXT)
         {
-            u16 size = *(reinterpret_cast<u16 *>(bytes + offset));
+            u16 size = *(reinterpret_cast<const u16 *>(bytes + offset));
             offset += sizeof(u16);
-            std::string value(bytes + offset, size);
+            value.data_type = ColumnAttribute::TEXT;
+            value.n = 0;
+            value.s.assign(bytes + offset, size);
             offset += size;
-            (*row)[column_name] = Value(value);
         }
         else
         {
-            delete row;
             throw DbRelationError("Unsupported data type found");
         }
     }
-    return row;
+    if (row.size() != this->column_names.size())
+    {
+        // it had other columns too: start over without them
+        row.clear();
+        unmarshal(record, row);
+        return;
+    }
+    METRIC_INC(UNMARSHAL_CALLS);
+    METRIC_ADD(UNMARSHAL_BYTES, offset);
+}
+
+// Unmarshals the named columns of a row into row, finding each through the directory.
+void HeapTable::unmarshal(RecordView record, const ColumnNames &column_names, ValueDict &row)
+{
+    size_t decoded = 0;
+    for (auto const &column_name : column_names)
+    {
+        auto it = std::find(this->column_names.begin(), this->column_names.end(), column_name);
+        if (it == this->column_names.end())
+            continue;
+        decode_column(record.data, it - this->column_names.begin(), row[column_name]);
+        decoded++;
+    }
+    if (row.size() != decoded)
+    {
+        // it had other columns too: start over without them
+        row.clear();
+        unmarshal(record, column_names, row);
+        return;
+    }
+    METRIC_INC(UNMARSHAL_CALLS);
+}
+
+// Decodes one column of a record into value.
+void HeapTable::decode_column(const char *record, size_t column, Value &value) const
+{
+    const char *bytes = record + column_offset(record, column);
+    value.is_null = false;
+    if (this->column_attributes[column].get_data_type() == ColumnAttribute::INT)
+    {
+        value.data_type = ColumnAttribute::INT;
+        value.n = *(reinterpret_cast<const int32_t *>(bytes));
+    }
+    else
+    {
+        value.data_type = ColumnAttribute::TEXT;
+        value.n = 0;
+        value.s.assign(bytes + sizeof(u16), *(reinterpret_cast<const u16 *>(bytes)));
+    }
+}
+
+//------------------------HeapTableScan----------------------------------------------
+
+// Positions the scan before the first record of the table's first block.
+HeapTableScan::HeapTableScan(HeapTable &table)
+    : table(table), snapshot(Transaction::snapshot()), block_ids(table.file.block_ids()), block_index(0),
+      block(nullptr), record_ids(nullptr), record_index(0)
+{
+}
+
+HeapTableScan::~HeapTableScan()
+{
+    release_block();
+}
+
+// Returns the next live record, moving on to the next block once the current one is exhausted.
+bool HeapTableScan::next(Handle &handle, ValueDict &row)
+{
+    while (true)
+    {
+        if (block != nullptr && record_index < record_ids->size())
+        {
+            RecordID record_id = (*record_ids)[record_index++];
+            table.unmarshal(block->view(record_id), row);
+            handle = Handle(block->get_block_id(), record_id);
+            return true;
+        }
+        release_block();
+        if (block_index >= block_ids.size())
+            return false;
+        block = table.file.get(block_ids[block_index++], arena);
+        record_ids = block->ids(*snapshot, arena);
+        record_index = 0;
+    }
+}
+
+// Frees the current block and its record ids (resets the arena they were read into).
+void HeapTableScan::release_block()
+{
+    arena.reset();
+    record_ids = nullptr;
+    block = nullptr;
 }
 
 // test function -- returns true if all tests pass
@@ -540,25 +1386,77 @@ bool test_heap_table()
     table.insert(&row);
     std::cout << "insert ok" << std::endl;
 
-    Handles *handles = table.select();
-    std::cout << "select ok " << handles->size() << std::endl;
-    ValueDict *result = table.project((*handles)[0]);
+    Handles handles = table.select();
+    std::cout << "select ok " << handles.size() << std::endl;
+    ValueDict result = table.project(handles[0]);
     std::cout << "project ok" << std::endl;
-    if (result == nullptr)
-    {
-        std::cerr << "Project returned null." << std::endl;
-        return false;
-    }
-    Value value = (*result)["a"];
+    Value value = result["a"];
     if (value.n != 12)
     {
         std::cout << "failed here because value.n " << value.n << std::endl;
         return false;
     }
-    value = (*result)["b"];
+    value = result["b"];
     if (value.s != "Hello!")
         return false;
+    ColumnNames just_b = {"b"};
+    table.project(handles[0], &just_b, result);  // into a row that already has other columns
+    if (result.size() != 1 || result["b"].s != "Hello!")
+        return false;
+
+    ValueDict new_values;
+    new_values["b"] = Value("Goodbye, and thanks for all the fish");
+    Handle updated = table.update(handles[0], &new_values);
+    result = table.project(updated);
+    if (result["a"].n != 12 || result["b"].s != new_values["b"].s)
+        return false;
+    result = table.project(handles[0]);  // the old version is still there
+    if (result["b"].s != "Hello!")
+        return false;
+    table.select(nullptr, handles);
+    if (handles.size() != 1 || handles[0] != updated)
+        return false;
+    std::cout << "update ok" << std::endl;
+    table.del(handles[0]);
+    if (!table.select().empty())
+        return false;
+    std::cout << "del ok" << std::endl;
     table.drop();
+
+    // columns after a TEXT column are found through the record's offset directory
+    ColumnNames late_names = {"s", "t", "n"};
+    ColumnAttributes late_attributes = {ColumnAttribute(ColumnAttribute::TEXT), ColumnAttribute(ColumnAttribute::TEXT),
+                                        ColumnAttribute(ColumnAttribute::INT)};
+    HeapTable late("_test_late_cpp", late_names, late_attributes);
+    late.create_if_not_exists();
+    ValueDict late_row;
+    for (int i = 0; i < 20; i++)
+    {
+        late_row["s"] = Value(std::string(i, 's'));
+        late_row["t"] = Value(std::string(20 - i, 't'));
+        late_row["n"] = Value(i);
+        late.insert(&late_row);
+    }
+    ValueDict where;
+    where["n"] = Value(7);
+    where["t"] = Value(std::string(13, 't'));
+    handles = late.select(&where);
+    ColumnNames n_and_t = {"n", "t"};
+    bool late_ok = handles.size() == 1;
+    if (late_ok)
+    {
+        result = late.project(handles[0], &n_and_t);
+        late_ok = result.size() == 2 && result["n"].n == 7 && result["t"].s == std::string(13, 't');
+        result = late.project(handles[0]);
+        late_ok = late_ok && result.size() == 3 && result["s"].s == std::string(7, 's');
+    }
+    late.drop();
+    if (!late_ok)
+    {
+        std::cout << "late materialization: wrong rows" << std::endl;
+        return false;
+    }
+    std::cout << "project/select of later columns ok" << std::endl;
     std::cout<<"Testing HeapTable Done"<<std::endl;
     return true;
 }
@@ -588,7 +1486,7 @@ bool test_slotted_page()
         RecordID id2 = slottedPage.add(&data2_dbt);
 
         // validate data
-        Dbt *retrieved_data1 = slottedPage.get(id1);
+        std::unique_ptr<Dbt> retrieved_data1(slottedPage.get(id1));
         if (std::strcmp((char *)retrieved_data1->get_data(), data1) != 0)
         {
             std::cerr << "Error: Failed to retrieve record 1 data" << std::endl;
@@ -596,7 +1494,7 @@ bool test_slotted_page()
         }
 
         std::cout << "SlottedPage::add(): retrieved record 1 successfully" << std::endl;
-        Dbt *retrieved_data2 = slottedPage.get(id2);
+        std::unique_ptr<Dbt> retrieved_data2(slottedPage.get(id2));
         if (std::strcmp((char *)retrieved_data2->get_data(), data2) != 0)
         {
             std::cerr << "Error: Failed to retrieve record 2 data" << std::endl;
@@ -613,12 +1511,47 @@ bool test_slotted_page()
         slottedPage.del(id1);
 
         // Validate update
-        RecordIDs *ids = slottedPage.ids();
-        if (ids->size() != 1 || ids->at(0) != id2)
+        RecordIDs ids = slottedPage.ids();
+        if (ids.size() != 1 || ids.at(0) != id2)
         {
             std::cerr << "Record deletion or update (put) failed" << std::endl;
             return false;
         }
+
+        // views see the records in place; for_each_record visits just the live ones
+        RecordView view2 = slottedPage.view(id2);
+        if (slottedPage.view(id1) || !view2 || std::strcmp(view2.data, updatedData2) != 0)
+        {
+            std::cerr << "SlottedPage::view() failed" << std::endl;
+            return false;
+        }
+        size_t visited = 0;
+        slottedPage.for_each_record([&](RecordID id, RecordView record) {
+            if (id == id2 && record.data == view2.data && record.size == view2.size)
+                visited++;
+            else
+                visited += 100;
+        });
+        if (visited != 1)
+        {
+            std::cerr << "SlottedPage::for_each_record() failed" << std::endl;
+            return false;
+        }
+
+        // a deleted record's id is reused; tombstones at the end are dropped by compact
+        u_int16_t room = slottedPage.free_space();
+        if (slottedPage.add(&data1_dbt) != id1 || slottedPage.free_space() != room - data1_dbt.get_size())
+        {
+            std::cerr << "SlottedPage::add() didn't reuse a tombstone" << std::endl;
+            return false;
+        }
+        slottedPage.del(id2);
+        if (slottedPage.compact() != 1 || slottedPage.compact() != 0 || slottedPage.ids().size() != 1 ||
+            slottedPage.add(&data1_dbt) != id2)
+        {
+            std::cerr << "SlottedPage::compact() failed" << std::endl;
+            return false;
+        }
         std::cout << "SlottedPage test passed successfully." << std::endl;
         return true;
     }
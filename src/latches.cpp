@@ -0,0 +1,203 @@
+/**
+ * Implementation of the page latches declared in latches.h.
+ */
+
+#include "latches.h"
+#include "heap_storage.h"
+#include "Metrics.h"
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <set>
+#include <thread>
+#include <vector>
+
+PageLatch LatchManager::latches[LatchManager::LATCHES];
+
+//------------------------PageLatch----------------------------------------------
+
+PageLatch::PageLatch()
+{
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    // a steady stream of scans mustn't starve a writer
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&rwlock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+
+PageLatch::~PageLatch()
+{
+    pthread_rwlock_destroy(&rwlock);
+}
+
+void PageLatch::lock_shared()
+{
+    if (pthread_rwlock_tryrdlock(&rwlock) == 0)
+        return;
+    METRIC_INC(LATCH_WAITS);
+    pthread_rwlock_rdlock(&rwlock);
+}
+
+void PageLatch::unlock_shared()
+{
+    pthread_rwlock_unlock(&rwlock);
+}
+
+void PageLatch::lock()
+{
+    if (pthread_rwlock_trywrlock(&rwlock) == 0)
+        return;
+    METRIC_INC(LATCH_WAITS);
+    pthread_rwlock_wrlock(&rwlock);
+}
+
+bool PageLatch::try_lock()
+{
+    return pthread_rwlock_trywrlock(&rwlock) == 0;
+}
+
+void PageLatch::unlock()
+{
+    pthread_rwlock_unlock(&rwlock);
+}
+
+//------------------------LatchManager----------------------------------------------
+
+PageLatch &LatchManager::latch(size_t file_key, uint32_t block_id)
+{
+    // Fibonacci hashing spreads a file's consecutive blocks over the whole table
+    uint64_t h = ((uint64_t)file_key ^ block_id) * 0x9E3779B97F4A7C15ull;
+    return latches[(h >> 32) % LATCHES];
+}
+
+size_t LatchManager::file_key(const std::string &name)
+{
+    return std::hash<std::string>()(name);
+}
+
+//------------------------tests----------------------------------------------
+
+static void run_threads(size_t count, std::function<void(size_t)> body)
+{
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < count; t++)
+        threads.push_back(std::thread(body, t));
+    for (auto &thread : threads)
+        thread.join();
+}
+
+// Exclusive holders of a latch exclude each other and shared holders see no torn writes.
+static bool test_page_latch()
+{
+    const size_t THREADS = 8, ROUNDS = 5000, BLOCKS = 4;
+    size_t key = LatchManager::file_key("_test_latches");
+    long counts[BLOCKS][2] = {};  // both halves of a pair change together
+    std::atomic<bool> torn(false);
+    run_threads(THREADS, [&](size_t t) {
+        for (size_t i = 0; i < ROUNDS; i++)
+        {
+            uint32_t block_id = (uint32_t)((t + i) % BLOCKS);
+            if (t % 2 == 0)
+            {
+                ExclusiveLatch latch(LatchManager::latch(key, block_id));
+                counts[block_id][0]++;
+                counts[block_id][1]++;
+            }
+            else
+            {
+                SharedLatch latch(LatchManager::latch(key, block_id));
+                if (counts[block_id][0] != counts[block_id][1])
+                    torn = true;
+            }
+        }
+    });
+    long total = 0;
+    for (size_t b = 0; b < BLOCKS; b++)
+        total += counts[b][0];
+    if (torn || total != (long)(THREADS / 2 * ROUNDS))
+    {
+        std::cout << "latch: " << total << " increments, torn " << torn << std::endl;
+        return false;
+    }
+    std::cout << "page latch ok" << std::endl;
+    return true;
+}
+
+// Concurrent inserts lose no rows, and concurrent updates of one block lose no changes.
+static bool test_concurrent_heap_table()
+{
+    const size_t THREADS = 8, ROWS = 300, UPDATES = 50;
+    ColumnNames column_names = {"a", "b"};
+    ColumnAttributes column_attributes = {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)};
+    HeapTable table("_test_latches_cpp", column_names, column_attributes);
+    table.create_if_not_exists();
+
+    std::vector<Handles> inserted(THREADS);
+    run_threads(THREADS, [&](size_t t) {
+        for (size_t i = 0; i < ROWS; i++)
+        {
+            ValueDict row;
+            row["a"] = Value((int)(t * ROWS + i));
+            row["b"] = Value(std::string(100, (char)('a' + t)));
+            inserted[t].push_back(table.insert(&row));
+        }
+    });
+    std::set<Handle> distinct;
+    for (auto const &handles : inserted)
+        distinct.insert(handles.begin(), handles.end());
+    size_t selected = table.select().size();
+    if (distinct.size() != THREADS * ROWS || selected != THREADS * ROWS)
+    {
+        std::cout << "concurrent insert: " << distinct.size() << " handles, " << selected << " rows" << std::endl;
+        table.drop();
+        return false;
+    }
+    for (size_t t = 0; t < THREADS; t++)
+    {
+        bool ok = table.project(inserted[t][ROWS / 2])["a"] == Value((int)(t * ROWS + ROWS / 2));
+        if (!ok)
+        {
+            std::cout << "concurrent insert: wrong row for thread " << t << std::endl;
+            table.drop();
+            return false;
+        }
+    }
+    std::cout << "concurrent insert ok" << std::endl;
+
+    // every thread updates its own row of the same block, over and over (each update
+    // writes a new version, so the rows move to new blocks as it fills up)
+    Handles same_block;
+    Handles all = table.select();
+    for (auto const &handle : all)
+        if (handle.first == all.front().first && same_block.size() < THREADS)
+            same_block.push_back(handle);
+    run_threads(same_block.size(), [&](size_t t) {
+        for (size_t i = 1; i <= UPDATES; i++)
+        {
+            ValueDict new_values;
+            new_values["a"] = Value((int)(t * 1000 + i));
+            same_block[t] = table.update(same_block[t], &new_values);
+        }
+    });
+    for (size_t t = 0; t < same_block.size(); t++)
+    {
+        bool ok = table.project(same_block[t])["a"] == Value((int)(t * 1000 + UPDATES));
+        if (!ok)
+        {
+            std::cout << "concurrent update: lost update of thread " << t << std::endl;
+            table.drop();
+            return false;
+        }
+    }
+    table.drop();
+    std::cout << "concurrent update ok" << std::endl;
+    return true;
+}
+
+// test function -- returns true if all tests pass
+bool test_latches()
+{
+    std::cout << "\nTesting page latches...." << std::endl;
+    return test_page_latch() && test_concurrent_heap_table();
+}
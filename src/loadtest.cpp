@@ -0,0 +1,392 @@
+/**
+ * @file loadtest.cpp
+ *
+ * Load-test client for the server mode (sql5300 -s): each of -c client threads opens its
+ * own connection and sends statements for -d seconds, each waiting for the answer to the
+ * last before sending the next. Reports throughput and latency per statement type, and
+ * can run with several client counts in turn (-c 1,4,16). Built by "make loadtest".
+ *
+ * First it creates the table _loadtest (id INT, payload TEXT) if need be and loads -n
+ * rows into it. Clients then pick statements by the weights given with -m:
+ *     select  SELECT * FROM _loadtest WHERE id = <a loaded id>
+ *     insert  INSERT INTO _loadtest VALUES (<a new id>, '<payload>')
+ *     count   SELECT COUNT(*) FROM _loadtest
+ * Answers starting with "Error:" count as errors.
+ *
+ * Usage: sql5300_loadtest [-c clients,...] [-d seconds] [-n rows] [-m select=W,insert=W,count=W]
+ *                         [-s seed] [-o text|csv] socketpath
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Metrics.h"
+
+using namespace std;
+
+enum StatementType {
+    ST_SELECT, ST_INSERT, ST_COUNT, NUM_STATEMENT_TYPES
+};
+
+static const char *STATEMENT_NAMES[NUM_STATEMENT_TYPES] = {"select", "insert", "count"};
+
+static const char *const TABLE_NAME = "_loadtest";
+
+struct LoadTestConfig {
+    vector<size_t> client_counts;
+    double seconds;
+    size_t rows;
+    double mix[NUM_STATEMENT_TYPES];
+    uint64_t seed;
+    string format;
+    string socket_path;
+};
+
+// Per-thread random numbers (xorshift64*).
+class Random {
+public:
+    explicit Random(uint64_t seed) : state(seed * 0x9E3779B97F4A7C15ull + 1) {}
+
+    uint64_t next()
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1Dull;
+    }
+
+    double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+
+private:
+    uint64_t state;
+};
+
+/**
+ * One session with the server.
+ */
+class Connection {
+public:
+    explicit Connection(const string &socket_path) : fd(-1)
+    {
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(address.sun_path))
+            throw runtime_error("socket path too long: " + socket_path);
+        strcpy(address.sun_path, socket_path.c_str());
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, (sockaddr *)&address, sizeof(address)) < 0)
+        {
+            string error = socket_path + ": " + strerror(errno);
+            if (fd >= 0)
+                close(fd);
+            throw runtime_error(error);
+        }
+    }
+
+    ~Connection()
+    {
+        close(fd);
+    }
+
+    Connection(const Connection &other) = delete;
+
+    Connection &operator=(const Connection &other) = delete;
+
+    // Sends one statement and returns the server's answer.
+    string query(const string &statement)
+    {
+        string request = statement + "\n";
+        size_t sent = 0;
+        while (sent < request.size())
+        {
+            ssize_t n = send(fd, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                throw runtime_error(string("send: ") + strerror(errno));
+            sent += (size_t)n;
+        }
+        while (true)
+        {
+            size_t end = pending.find('\0');
+            if (end != string::npos)
+            {
+                string answer = pending.substr(0, end);
+                pending.erase(0, end + 1);
+                return answer;
+            }
+            char buffer[16 * 1024];
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n <= 0)
+                throw runtime_error("server closed the connection");
+            pending.append(buffer, (size_t)n);
+        }
+    }
+
+private:
+    int fd;
+    string pending;  // received beyond the last answer
+};
+
+/**
+ * What the clients share: the range of ids to select and the next id to insert.
+ */
+class LoadTest {
+public:
+    explicit LoadTest(const LoadTestConfig &config) : config(config), next_id(0) {}
+
+    // Creates the table if need be and adds config.rows rows.
+    void load()
+    {
+        Connection connection(config.socket_path);
+        string answer = connection.query(string("CREATE TABLE IF NOT EXISTS ") + TABLE_NAME + " (id INT, payload TEXT)");
+        if (answer.compare(0, 6, "Error:") == 0)
+            throw runtime_error(answer);
+        for (size_t id = 0; id < config.rows; id++)
+        {
+            answer = connection.query(insert_statement((int64_t)id));
+            if (answer.compare(0, 6, "Error:") == 0)
+                throw runtime_error(answer);
+        }
+        next_id = (int64_t)config.rows;
+    }
+
+    // Runs one client until the deadline, recording each statement's latency.
+    void client(size_t client_id, chrono::steady_clock::time_point deadline, LatencyHistogram *histograms,
+                uint64_t *errors)
+    {
+        Random random(config.seed + 1000003 * (client_id + 1));
+        double total_weight = 0;
+        for (double weight : config.mix)
+            total_weight += weight;
+        try
+        {
+            run_client(random, total_weight, deadline, histograms, errors);
+        }
+        catch (runtime_error &e)
+        {
+            cerr << "(sql5300_loadtest: client " << client_id << ": " << e.what() << ")" << endl;
+        }
+    }
+
+private:
+    const LoadTestConfig &config;
+    atomic<int64_t> next_id;
+
+    void run_client(Random &random, double total_weight, chrono::steady_clock::time_point deadline,
+                    LatencyHistogram *histograms, uint64_t *errors)
+    {
+        Connection connection(config.socket_path);
+        while (chrono::steady_clock::now() < deadline)
+        {
+            double pick = random.uniform() * total_weight;
+            int type = 0;
+            while (type < NUM_STATEMENT_TYPES - 1 && pick >= config.mix[type])
+                pick -= config.mix[type++];
+
+            string statement;
+            if (type == ST_SELECT)
+                statement = string("SELECT * FROM ") + TABLE_NAME + " WHERE id = " +
+                            to_string(config.rows == 0 ? 0 : random.next() % config.rows);
+            else if (type == ST_INSERT)
+                statement = insert_statement(next_id++);
+            else
+                statement = string("SELECT COUNT(*) FROM ") + TABLE_NAME;
+
+            auto start = chrono::steady_clock::now();
+            string answer = connection.query(statement);
+            auto elapsed = chrono::steady_clock::now() - start;
+            histograms[type].record((uint64_t)chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+            if (answer.compare(0, 6, "Error:") == 0)
+                errors[type]++;
+        }
+    }
+
+    static string insert_statement(int64_t id)
+    {
+        return string("INSERT INTO ") + TABLE_NAME + " VALUES (" + to_string(id) + ", 'payload " + to_string(id) + "')";
+    }
+};
+
+static void report_header(const LoadTestConfig &config)
+{
+    if (config.format == "csv")
+        cout << "clients,statement,count,errors,per_sec,mean_us,p50_us,p90_us,p99_us,p999_us,max_us\n";
+}
+
+static void report(const LoadTestConfig &config, size_t clients, const string &name, const LatencyHistogram &h,
+                   uint64_t errors, double seconds)
+{
+    double per_sec = h.get_count() / seconds;
+    auto us = [](double ns) { return ns / 1000.0; };
+    cout << fixed << setprecision(1);
+    if (config.format == "csv")
+        cout << clients << "," << name << "," << h.get_count() << "," << errors << "," << per_sec << ","
+             << us(h.get_mean()) << "," << us(h.percentile(50)) << "," << us(h.percentile(90)) << ","
+             << us(h.percentile(99)) << "," << us(h.percentile(99.9)) << "," << us(h.get_max()) << "\n";
+    else
+        cout << left << setw(10) << name << right << setw(10) << h.get_count() << setw(8) << errors << setw(12)
+             << per_sec << setw(10) << us(h.get_mean()) << setw(10) << us(h.percentile(50)) << setw(10)
+             << us(h.percentile(90)) << setw(10) << us(h.percentile(99)) << setw(10) << us(h.percentile(99.9))
+             << setw(10) << us(h.get_max()) << "\n";
+    cout.unsetf(ios::fixed);
+    cout << setprecision(6);
+}
+
+// Runs the mix with the given number of clients.
+static void run_load_test(const LoadTestConfig &config, LoadTest &load_test, size_t clients)
+{
+    vector<vector<LatencyHistogram>> histograms(clients, vector<LatencyHistogram>(NUM_STATEMENT_TYPES));
+    vector<vector<uint64_t>> errors(clients, vector<uint64_t>(NUM_STATEMENT_TYPES, 0));
+
+    auto start = chrono::steady_clock::now();
+    auto deadline = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(config.seconds));
+    vector<thread> threads;
+    for (size_t i = 0; i < clients; i++)
+        threads.push_back(thread(&LoadTest::client, &load_test, i, deadline, histograms[i].data(), errors[i].data()));
+    for (auto &t : threads)
+        t.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    if (config.format == "text")
+        cout << "\n" << clients << " client" << (clients == 1 ? "" : "s") << ", " << setprecision(3) << seconds
+             << " s\n" << setprecision(6) << left << setw(10) << "statement" << right << setw(10) << "count"
+             << setw(8) << "errors" << setw(12) << "per sec" << setw(10) << "mean us" << setw(10) << "p50 us"
+             << setw(10) << "p90 us" << setw(10) << "p99 us" << setw(10) << "p99.9 us" << setw(10) << "max us"
+             << "\n";
+    LatencyHistogram all;
+    uint64_t all_errors = 0;
+    for (int type = 0; type < NUM_STATEMENT_TYPES; type++)
+    {
+        LatencyHistogram merged;
+        uint64_t type_errors = 0;
+        for (size_t i = 0; i < clients; i++)
+        {
+            merged.merge(histograms[i][type]);
+            type_errors += errors[i][type];
+        }
+        all.merge(merged);
+        all_errors += type_errors;
+        if (merged.get_count() > 0)
+            report(config, clients, STATEMENT_NAMES[type], merged, type_errors, seconds);
+    }
+    report(config, clients, "total", all, all_errors, seconds);
+    cout << flush;
+}
+
+//------------------------options----------------------------------------------
+
+static vector<size_t> parse_sizes(const string &text)
+{
+    vector<size_t> sizes;
+    stringstream ss(text);
+    string item;
+    while (getline(ss, item, ','))
+        if (!item.empty())
+            sizes.push_back(strtoul(item.c_str(), nullptr, 10));
+    return sizes;
+}
+
+// "select=80,insert=20" -> weights; statements not named get 0
+static bool parse_mix(const string &text, LoadTestConfig &config)
+{
+    for (int type = 0; type < NUM_STATEMENT_TYPES; type++)
+        config.mix[type] = 0;
+    double total = 0;
+    stringstream ss(text);
+    string item;
+    while (getline(ss, item, ','))
+    {
+        size_t equals = item.find('=');
+        if (equals == string::npos)
+            return false;
+        string name = item.substr(0, equals);
+        int type = 0;
+        while (type < NUM_STATEMENT_TYPES && name != STATEMENT_NAMES[type])
+            type++;
+        if (type == NUM_STATEMENT_TYPES)
+            return false;
+        config.mix[type] = strtod(item.c_str() + equals + 1, nullptr);
+        if (config.mix[type] < 0)
+            return false;
+        total += config.mix[type];
+    }
+    return total > 0;
+}
+
+int main(int argc, char *argv[])
+{
+    LoadTestConfig config;
+    config.client_counts = {1};
+    config.seconds = 10;
+    config.rows = 1000;
+    config.seed = 1;
+    config.format = "text";
+    parse_mix("select=80,insert=15,count=5", config);
+
+    bool badOption = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:n:m:s:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            config.client_counts = parse_sizes(optarg);
+            break;
+        case 'd':
+            config.seconds = strtod(optarg, nullptr);
+            break;
+        case 'n':
+            config.rows = strtoul(optarg, nullptr, 10);
+            break;
+        case 'm':
+            badOption |= !parse_mix(optarg, config);
+            break;
+        case 's':
+            config.seed = strtoull(optarg, nullptr, 10);
+            break;
+        case 'o':
+            config.format = optarg;
+            break;
+        default:
+            badOption = true;
+        }
+    }
+    bool badClients = config.client_counts.empty() ||
+                      find(config.client_counts.begin(), config.client_counts.end(), 0) != config.client_counts.end();
+    if (badOption || badClients || optind != argc - 1 || config.seconds <= 0 ||
+        (config.format != "text" && config.format != "csv"))
+    {
+        cerr << "Usage: sql5300_loadtest [-c clients,...] [-d seconds] [-n rows] [-m select=W,insert=W,count=W]\n"
+             << "                        [-s seed] [-o text|csv] socketpath" << endl;
+        return 1;
+    }
+    config.socket_path = argv[optind];
+
+    try
+    {
+        LoadTest load_test(config);
+        load_test.load();
+        report_header(config);
+        for (size_t clients : config.client_counts)
+            run_load_test(config, load_test, clients);
+    }
+    catch (runtime_error &e)
+    {
+        cerr << "(sql5300_loadtest: " << e.what() << ")" << endl;
+        return 1;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1339 @@
+/**
+ * Implementation of the log-structured merge storage engine declared in lsm_storage.h.
+ */
+
+#include "lsm_storage.h"
+#include "schema_tables.h"
+#include "Metrics.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <set>
+
+typedef u_int16_t u16;
+
+// A run record or log entry: the row id, the version number, whether it's a tombstone and
+// then the marshaled row.
+static const size_t ENTRY_HEADER_SZ = 2 * sizeof(uint64_t) + 1;
+
+// Roughly what a memtable version takes besides its record (map node, key and stamp).
+static const size_t VERSION_OVERHEAD = 80;
+
+// Frozen memtables that may wait to be written out before writers outside a transaction
+// wait with them.
+static const size_t MAX_FROZEN = 2;
+
+static std::string encode_entry(const LsmKey &key, bool deleted, RecordView record)
+{
+    std::string entry(ENTRY_HEADER_SZ + record.size, '\0');
+    memcpy(&entry[0], &key.row_id, sizeof(uint64_t));
+    memcpy(&entry[sizeof(uint64_t)], &key.seq, sizeof(uint64_t));
+    entry[2 * sizeof(uint64_t)] = deleted ? 1 : 0;
+    if (record.size > 0)
+        memcpy(&entry[ENTRY_HEADER_SZ], record.data, record.size);
+    return entry;
+}
+
+static void decode_entry(const char *data, size_t size, LsmKey &key, bool &deleted, RecordView &record)
+{
+    if (size < ENTRY_HEADER_SZ)
+        throw DbRelationError("corrupt LSM entry");
+    memcpy(&key.row_id, data, sizeof(uint64_t));
+    memcpy(&key.seq, data + sizeof(uint64_t), sizeof(uint64_t));
+    deleted = data[2 * sizeof(uint64_t)] != 0;
+    record = RecordView(data + ENTRY_HEADER_SZ, (u16)(size - ENTRY_HEADER_SZ));
+}
+
+// Drops a file that a crash may have left behind before the manifest named it.
+static void remove_leftover(const std::string &name)
+{
+    HeapFile file(name);
+    try
+    {
+        file.drop();
+    }
+    catch (DbException &)
+    {
+        // there was none
+    }
+}
+
+//------------------------BloomFilter----------------------------------------------
+
+// Mixes a key's bits (splitmix64's finalizer), so that neighbouring row ids hash far apart.
+static uint64_t mix(uint64_t key)
+{
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+}
+
+BloomFilter::BloomFilter(size_t keys, size_t bits_per_key)
+    : bits(std::max<size_t>(1, (keys * bits_per_key + 63) / 64), 0),
+      probes(std::max<size_t>(1, bits_per_key * 69 / 100))
+{
+}
+
+// Sets a bit for each probe; the probes step through the filter from one hash by another
+// (double hashing).
+void BloomFilter::add(uint64_t key)
+{
+    uint64_t hash = mix(key);
+    uint64_t step = (hash >> 33) | (hash << 31);
+    size_t size = bits.size() * 64;
+    for (size_t i = 0; i < probes; i++, hash += step)
+        bits[(hash % size) / 64] |= 1ULL << (hash % size % 64);
+}
+
+bool BloomFilter::may_contain(uint64_t key) const
+{
+    uint64_t hash = mix(key);
+    uint64_t step = (hash >> 33) | (hash << 31);
+    size_t size = bits.size() * 64;
+    for (size_t i = 0; i < probes; i++, hash += step)
+        if ((bits[(hash % size) / 64] & (1ULL << (hash % size % 64))) == 0)
+            return false;
+    return true;
+}
+
+//------------------------LsmRun----------------------------------------------
+
+LsmRun::LsmRun(const std::string &name, uint32_t number, uint32_t level)
+    : number(number), level(level), file(name), min_row_id(0), max_row_id(0), max_seq(0), versions(0),
+      obsolete(false)
+{
+}
+
+// A run merged away goes with its last reader.
+LsmRun::~LsmRun()
+{
+    try
+    {
+        if (obsolete)
+            file.drop();
+        else
+            file.close();
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "(could not let go of LSM run " << number << ": " << e.what() << ")" << std::endl;
+    }
+}
+
+//------------------------LsmRunCursor----------------------------------------------
+
+LsmRunCursor::LsmRunCursor(std::shared_ptr<LsmRun> run)
+    : stamp(Snapshot::FROZEN), deleted(false), run(run), block_id(0), block(nullptr), position(0)
+{
+    advance();
+}
+
+LsmRunCursor::~LsmRunCursor()
+{
+    delete block;
+}
+
+// Reads the next block when this one runs out; past the last one, the cursor has no block.
+void LsmRunCursor::advance()
+{
+    if (block != nullptr)
+        position++;
+    while (block == nullptr || position >= record_ids.size())
+    {
+        delete block;
+        block = nullptr;
+        if (run->versions == 0 || block_id >= run->file.get_last_block_id())
+            return;
+        block = run->file.get(++block_id);
+        block->ids(record_ids);
+        position = 0;
+    }
+    RecordView entry = block->view(record_ids[position]);
+    decode_entry(entry.data, entry.size, key, deleted, record);
+    Stamp end;
+    block->get_stamps(record_ids[position], stamp, end);
+}
+
+//------------------------LsmTable----------------------------------------------
+
+LsmTable::LsmTable(Identifier table_name, ColumnNames column_names, ColumnAttributes column_attributes,
+                   size_t memtable_bytes, size_t fanout)
+    : DbRelation(table_name, column_names, column_attributes), memtable_bytes(memtable_bytes),
+      fanout(std::max<size_t>(2, fanout)),
+      manifest(table_name + ".lsm", ColumnNames{"kind", "number", "level"},
+               ColumnAttributes{ColumnAttribute(ColumnAttribute::TEXT), ColumnAttribute(ColumnAttribute::INT),
+                                ColumnAttribute(ColumnAttribute::INT)}),
+      opened(false), runs_changed(0), next_row_id(1), next_seq(1), next_number(1), flush_requests(0), busy(false),
+      stopping(false)
+{
+}
+
+LsmTable::~LsmTable()
+{
+    this->close();
+}
+
+// Creates the manifest and the first memtable's log.
+void LsmTable::create()
+{
+    this->manifest.create();
+    remove_leftover(this->file_name("log", 1));
+    std::unique_ptr<HeapTable> log(this->new_log(1));
+    log->create();
+    log->close();
+    this->change_manifest({}, {std::make_tuple(std::string("log"), 1u, 0u)});
+    this->open();
+}
+
+void LsmTable::create_if_not_exists()
+{
+    try
+    {
+        this->open();
+    }
+    catch (const DbException &e)
+    {
+        this->create();
+    }
+}
+
+// Drops every file the manifest names, and the manifest.
+void LsmTable::drop()
+{
+    this->open();
+    std::vector<std::pair<std::string, uint32_t>> files;
+    ValueDict entry;
+    for (auto const &handle : this->manifest.select())
+    {
+        this->manifest.project(handle, nullptr, entry);
+        files.push_back(std::make_pair(entry["kind"].s, (uint32_t)entry["number"].n));
+    }
+    this->close();
+    for (auto const &file : files)
+    {
+        if (file.first == "log")
+            std::unique_ptr<HeapTable>(this->new_log(file.second))->drop();
+        else
+            HeapFile(this->file_name("run", file.second)).drop();
+    }
+    this->manifest.drop();
+}
+
+// Opens the table as the manifest describes it: the newest log's versions become the
+// memtable and any others frozen memtables still to be written out.
+void LsmTable::open()
+{
+    if (opened)
+        return;
+    std::lock_guard<std::mutex> open_guard(this->open_lock);
+    if (opened)
+        return;
+
+    this->manifest.open();
+    std::vector<uint32_t> logs;
+    std::vector<std::shared_ptr<LsmRun>> loaded;
+    uint32_t last_number = 0;
+    ValueDict entry;
+    for (auto const &handle : this->manifest.select())
+    {
+        this->manifest.project(handle, nullptr, entry);
+        uint32_t number = (uint32_t)entry["number"].n;
+        last_number = std::max(last_number, number);
+        if (entry["kind"].s == "log")
+        {
+            logs.push_back(number);
+        }
+        else
+        {
+            loaded.push_back(std::make_shared<LsmRun>(this->file_name("run", number), number, entry["level"].n));
+            this->load(*loaded.back());
+        }
+    }
+    std::sort(loaded.begin(), loaded.end(), [](const std::shared_ptr<LsmRun> &a, const std::shared_ptr<LsmRun> &b) {
+        return a->level < b->level || (a->level == b->level && a->number > b->number);
+    });
+    std::sort(logs.begin(), logs.end());
+    if (logs.empty())
+    {
+        // a crash between writing out the last memtable and starting its successor's log
+        logs.push_back(++last_number);
+        remove_leftover(this->file_name("log", last_number));
+        std::unique_ptr<HeapTable> log(this->new_log(last_number));
+        log->create();
+        log->close();
+        this->change_manifest({}, {std::make_tuple(std::string("log"), last_number, 0u)});
+    }
+
+    // replay the logs; whatever they hold is committed, so every snapshot sees it
+    uint64_t last_row_id = 0, last_seq = 0;
+    for (auto const &run : loaded)
+    {
+        last_row_id = std::max(last_row_id, run->max_row_id);
+        last_seq = std::max(last_seq, run->max_seq);
+    }
+    std::deque<std::shared_ptr<LsmMemtable>> memtables;
+    for (auto const number : logs)
+    {
+        std::shared_ptr<LsmMemtable> table = std::make_shared<LsmMemtable>(number, this->new_log(number));
+        table->log->open();
+        std::unique_ptr<DbRelationScan> scan = table->log->scan();
+        Handle handle;
+        ValueDict row;
+        while (scan->next(handle, row))
+        {
+            const std::string &bytes = row["entry"].s;
+            LsmKey key;
+            LsmVersion version;
+            RecordView record;
+            decode_entry(bytes.data(), bytes.size(), key, version.deleted, record);
+            version.stamp = Snapshot::FROZEN;
+            version.record.assign(record.data, record.size);
+            table->bytes += version.record.size() + VERSION_OVERHEAD;
+            table->versions[key] = std::move(version);
+            last_row_id = std::max(last_row_id, key.row_id);
+            last_seq = std::max(last_seq, key.seq);
+        }
+        memtables.push_front(table);
+    }
+
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->memtable = memtables.front();
+    memtables.pop_front();
+    this->frozen = memtables;
+    this->runs = loaded;
+    this->runs_changed++;
+    this->next_row_id = last_row_id + 1;
+    this->next_seq = last_seq + 1;
+    this->next_number = last_number + 1;
+    this->flush_requests = 0;
+    this->busy = false;
+    this->stopping = false;
+    this->compactor = std::thread(&LsmTable::run, this);
+    opened = true;
+}
+
+void LsmTable::close()
+{
+    std::lock_guard<std::mutex> open_guard(this->open_lock);
+    if (!opened)
+        return;
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->stopping = true;
+    }
+    this->work.notify_all();
+    this->done.notify_all();
+    this->compactor.join();
+
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->memtable->log->close();
+    for (auto const &table : this->frozen)
+        table->log->close();
+    this->memtable.reset();
+    this->frozen.clear();
+    this->runs.clear();
+    this->manifest.close();
+    opened = false;
+}
+
+// Gives the row the next row id and writes its first version.
+Handle LsmTable::insert(const ValueDict *row)
+{
+    this->open();
+    std::string record;
+    this->marshal(row, record);
+    if (Transaction::stamp() == Snapshot::FROZEN)
+    {
+        // outside a transaction: don't get ahead of the compaction thread
+        std::unique_lock<std::mutex> guard(this->lock);
+        this->done.wait(guard, [this] {
+            return (this->frozen.size() < MAX_FROZEN && this->memtable->bytes < 2 * this->memtable_bytes) ||
+                   this->stopping;
+        });
+    }
+
+    Transaction transaction;
+    std::unique_lock<std::mutex> guard(this->lock);
+    uint64_t row_id = this->next_row_id++;
+    this->write(row_id, false, record, guard);
+    transaction.commit(false);
+    return to_handle(row_id);
+}
+
+// Writes a new version of the row with the given columns changed. The handle stays the same.
+Handle LsmTable::update(const Handle handle, const ValueDict *new_values)
+{
+    for (auto const &new_value : *new_values)
+        if (std::find(this->column_names.begin(), this->column_names.end(), new_value.first) == this->column_names.end())
+            throw DbRelationError("unknown column '" + new_value.first + "'");
+    this->replace(handle, [&](const LsmVersion &version, std::string &record) {
+        ValueDict row;
+        this->unmarshal(version.record.data(), version.record.size(), nullptr, row);
+        for (auto const &new_value : *new_values)
+            row[new_value.first] = new_value.second;
+        this->marshal(&row, record);
+        return true;
+    });
+    return handle;
+}
+
+// Writes a tombstone for the row.
+void LsmTable::del(const Handle handle)
+{
+    this->replace(handle, [](const LsmVersion &, std::string &) { return false; });
+}
+
+void LsmTable::replace(Handle handle, const std::function<bool(const LsmVersion &, std::string &)> &make)
+{
+    this->open();
+    uint64_t row_id = to_row_id(handle);
+    Transaction transaction;
+    std::shared_ptr<const Snapshot> snapshot = Transaction::snapshot();
+    std::unique_lock<std::mutex> guard(this->lock);
+    LsmVersion version;
+    bool found, latest;
+    this->find(row_id, *snapshot, guard, version, found, latest);
+    if (!latest)
+        throw DbRelationError("row was updated or deleted by another transaction");
+    if (!found || version.deleted)
+        throw DbRelationError("no such row");
+    std::string record;
+    bool deleted = !make(version, record);
+    this->write(row_id, deleted, record, guard);
+    transaction.commit(false);
+}
+
+void LsmTable::write(uint64_t row_id, bool deleted, const std::string &record, std::unique_lock<std::mutex> &guard)
+{
+    LsmKey key = {row_id, this->next_seq++};
+    std::shared_ptr<LsmMemtable> target = this->memtable;
+    LsmVersion &version = target->versions[key];
+    version.stamp = Transaction::stamp();
+    version.deleted = deleted;
+    version.record = record;
+    size_t bytes = record.size() + VERSION_OVERHEAD;
+    target->bytes += bytes;
+    if (target->bytes >= this->memtable_bytes)
+        this->work.notify_one();
+    guard.unlock();
+
+    Transaction::on_abort([this, target, key, bytes]() {
+        std::lock_guard<std::mutex> guard(this->lock);
+        if (target->versions.erase(key) > 0)
+            target->bytes -= bytes;
+    });
+    ValueDict entry;
+    entry["entry"] = Value(encode_entry(key, deleted, RecordView(record.data(), (u16)record.size())));
+    target->log->insert(&entry);
+}
+
+// Looks in the memtables and, if they have no version of the row the snapshot sees, in the
+// runs. If the runs changed while it read them, it looks again; the memtables it looks at
+// once more, for versions written meanwhile.
+void LsmTable::find(uint64_t row_id, const Snapshot &snapshot, std::unique_lock<std::mutex> &guard,
+                    LsmVersion &version, bool &found, bool &latest)
+{
+    while (true)
+    {
+        latest = true;
+        if (this->find_in_memory(row_id, snapshot, version, found, latest))
+            return;
+        uint64_t changed = this->runs_changed;
+        std::vector<std::shared_ptr<LsmRun>> current = this->runs;
+        guard.unlock();
+        latest = true;
+        this->find_in_runs(current, row_id, snapshot, version, found, latest);
+        guard.lock();
+        if (this->runs_changed != changed)
+            continue;
+        LsmVersion newer;
+        bool newer_found, memory_latest = true;
+        if (this->find_in_memory(row_id, snapshot, newer, newer_found, memory_latest))
+        {
+            version = newer;
+            found = true;
+        }
+        latest = latest && memory_latest;
+        return;
+    }
+}
+
+// The memtables' versions of a row are together, newest first, and newer memtables hold
+// newer versions.
+bool LsmTable::find_in_memory(uint64_t row_id, const Snapshot &snapshot, LsmVersion &version, bool &found,
+                              bool &latest)
+{
+    found = false;
+    auto look = [&](const LsmVersions &versions) {
+        for (auto it = versions.lower_bound(LsmKey{row_id, UINT64_MAX});
+             it != versions.end() && it->first.row_id == row_id; ++it)
+        {
+            if (snapshot.sees(it->second.stamp, Snapshot::FROZEN))
+            {
+                version = it->second;
+                found = true;
+                return true;
+            }
+            latest = false;
+        }
+        return false;
+    };
+    if (look(this->memtable->versions))
+        return true;
+    for (auto const &table : this->frozen)
+        if (look(table->versions))
+            return true;
+    return false;
+}
+
+// Skips the runs whose row range or filter rules the row out, and reads the blocks of the
+// others that may hold its versions: from the last one that starts before the row, since
+// its versions may begin at the end of that block.
+void LsmTable::find_in_runs(const std::vector<std::shared_ptr<LsmRun>> &runs, uint64_t row_id,
+                            const Snapshot &snapshot, LsmVersion &version, bool &found, bool &latest)
+{
+    found = false;
+    for (auto const &run : runs)
+    {
+        if (run->versions == 0 || row_id < run->min_row_id || row_id > run->max_row_id)
+            continue;
+        if (!run->filter.may_contain(row_id))
+        {
+            METRIC_INC(BLOOM_FILTER_SKIPS);
+            continue;
+        }
+        size_t first = std::lower_bound(run->fences.begin(), run->fences.end(), row_id) - run->fences.begin();
+        if (first > 0)
+            first--;
+        Arena arena;
+        bool past = false;
+        for (size_t i = first; i < run->fences.size() && run->fences[i] <= row_id && !past && !found; i++)
+        {
+            SlottedPage *block = run->file.get((BlockID)(i + 1), arena);
+            block->for_each_record([&](RecordID record_id, RecordView entry) {
+                if (past || found)
+                    return;
+                LsmKey key;
+                bool deleted;
+                RecordView record;
+                decode_entry(entry.data, entry.size, key, deleted, record);
+                if (key.row_id < row_id)
+                    return;
+                if (key.row_id > row_id)
+                {
+                    past = true;
+                    return;
+                }
+                Stamp begin, end;
+                block->get_stamps(record_id, begin, end);
+                if (!snapshot.sees(begin, Snapshot::FROZEN))
+                {
+                    latest = false;
+                    return;
+                }
+                version.stamp = begin;
+                version.deleted = deleted;
+                version.record.assign(record.data, record.size);
+                found = true;
+            });
+        }
+        if (found)
+            return;
+    }
+}
+
+void LsmTable::select(const ValueDict *where, Handles &handles)
+{
+    this->open();
+    handles.clear();
+    ColumnNames where_columns;
+    if (where != nullptr)
+        for (auto const &column : *where)
+        {
+            if (std::find(this->column_names.begin(), this->column_names.end(), column.first) == this->column_names.end())
+                return;  // no row has the column, so none matches
+            where_columns.push_back(column.first);
+        }
+    LsmTableScan scan(*this);
+    uint64_t row_id;
+    RecordView record;
+    ValueDict row;
+    while (scan.next_record(row_id, record))
+    {
+        if (where != nullptr)
+        {
+            this->unmarshal(record.data, record.size, &where_columns, row);
+            bool match = true;
+            for (auto const &column : *where)
+                if (row[column.first] != column.second)
+                {
+                    match = false;
+                    break;
+                }
+            if (!match)
+                continue;
+        }
+        handles.push_back(to_handle(row_id));
+    }
+}
+
+// Reads the newest version of the row the current snapshot sees.
+void LsmTable::project(Handle handle, const ColumnNames *column_names, ValueDict &row)
+{
+    this->open();
+    std::shared_ptr<const Snapshot> snapshot = Transaction::snapshot();
+    LsmVersion version;
+    bool found, latest;
+    {
+        std::unique_lock<std::mutex> guard(this->lock);
+        this->find(to_row_id(handle), *snapshot, guard, version, found, latest);
+    }
+    if (!found || version.deleted)
+        throw DbRelationError("no such row");
+    this->unmarshal(version.record.data(), version.record.size(), column_names, row);
+}
+
+std::unique_ptr<DbRelationScan> LsmTable::scan()
+{
+    this->open();
+    return std::unique_ptr<DbRelationScan>(new LsmTableScan(*this));
+}
+
+// Counts versions rather than rows, so updates and deletes not yet merged away count too.
+size_t LsmTable::estimated_row_count()
+{
+    this->open();
+    std::lock_guard<std::mutex> guard(this->lock);
+    size_t versions = this->memtable->versions.size();
+    for (auto const &table : this->frozen)
+        versions += table->versions.size();
+    for (auto const &run : this->runs)
+        versions += run->versions;
+    return versions;
+}
+
+void LsmTable::flush()
+{
+    this->open();
+    std::unique_lock<std::mutex> guard(this->lock);
+    this->flush_requests++;
+    this->work.notify_one();
+    this->done.wait(guard, [this] {
+        return this->stopping || (this->flush_requests == 0 && this->frozen.empty() && !this->busy &&
+                                  this->full_level() < 0);
+    });
+}
+
+std::vector<size_t> LsmTable::get_level_sizes() const
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    std::vector<size_t> sizes;
+    for (auto const &run : this->runs)
+    {
+        if (sizes.size() <= run->level)
+            sizes.resize(run->level + 1, 0);
+        sizes[run->level]++;
+    }
+    return sizes;
+}
+
+// The compaction thread: freezes the memtable once it's full (or a flush asks), writes out
+// the frozen memtables, oldest first, and then merges any level that has filled up.
+void LsmTable::run()
+{
+    std::unique_lock<std::mutex> guard(this->lock);
+    while (true)
+    {
+        this->work.wait(guard, [this] {
+            return this->stopping || this->flush_requests > 0 || this->memtable->bytes >= this->memtable_bytes ||
+                   !this->frozen.empty() || this->full_level() >= 0;
+        });
+        if (this->stopping)
+            return;
+        bool freezing = (this->flush_requests > 0 || this->memtable->bytes >= this->memtable_bytes) &&
+                        !this->memtable->versions.empty();
+        this->flush_requests = 0;
+        bool writing = !freezing && !this->frozen.empty();
+        int level = freezing || writing ? -1 : this->full_level();
+        this->busy = freezing || writing || level >= 0;
+        guard.unlock();
+        try
+        {
+            if (freezing)
+                this->freeze();
+            else if (writing)
+                this->write_out();
+            else if (level >= 0)
+                this->compact((uint32_t)level);
+        }
+        catch (std::exception &e)
+        {
+            std::cerr << "(compaction of " << this->table_name << " failed: " << e.what() << ")" << std::endl;
+            guard.lock();
+            this->busy = false;
+            this->done.notify_all();
+            this->work.wait_for(guard, std::chrono::seconds(1), [this] { return this->stopping; });
+            continue;
+        }
+        guard.lock();
+        this->busy = false;
+        this->done.notify_all();
+    }
+}
+
+void LsmTable::freeze()
+{
+    uint32_t number;
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        number = this->next_number++;
+    }
+    remove_leftover(this->file_name("log", number));
+    std::unique_ptr<HeapTable> log(this->new_log(number));
+    log->create();
+    this->change_manifest({}, {std::make_tuple(std::string("log"), number, 0u)});
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->frozen.push_front(this->memtable);
+    this->memtable = std::make_shared<LsmMemtable>(number, log.release());
+}
+
+// Waits for the transactions that wrote into the memtable to finish (an abort takes its
+// versions out again), writes the versions out as a level 0 run and replaces the log with
+// the run in the manifest.
+void LsmTable::write_out()
+{
+    std::shared_ptr<LsmMemtable> table;
+    bool bottom;
+    {
+        std::unique_lock<std::mutex> guard(this->lock);
+        table = this->frozen.back();
+        while (!this->stopping)
+        {
+            Snapshot snapshot;
+            bool committed = std::all_of(table->versions.begin(), table->versions.end(),
+                                         [&](const LsmVersions::value_type &version) {
+                                             return snapshot.sees(version.second.stamp, Snapshot::FROZEN);
+                                         });
+            if (committed)
+                break;
+            this->work.wait_for(guard, std::chrono::milliseconds(1));
+        }
+        if (this->stopping)
+            return;
+        bottom = this->runs.empty();
+    }
+
+    LsmVersions::const_iterator it = table->versions.begin();
+    std::shared_ptr<LsmRun> run = this->write_run(
+        0, table->versions.size(), bottom, [&](LsmKey &key, Stamp &stamp, bool &deleted, RecordView &record) {
+            if (it == table->versions.end())
+                return false;
+            key = it->first;
+            stamp = it->second.stamp;
+            deleted = it->second.deleted;
+            record = RecordView(it->second.record.data(), (u16)it->second.record.size());
+            ++it;
+            return true;
+        });
+    this->change_manifest({std::make_pair(std::string("log"), table->number)},
+                          {std::make_tuple(std::string("run"), run->number, 0u)});
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->runs.insert(this->runs.begin(), run);
+        this->frozen.pop_back();
+        this->runs_changed++;
+    }
+    table->log->drop();
+    METRIC_INC(MEMTABLES_WRITTEN);
+}
+
+// Merges all the runs of a level into a new run of the next, which goes before that level's
+// older runs.
+void LsmTable::compact(uint32_t level)
+{
+    std::vector<std::shared_ptr<LsmRun>> inputs;
+    bool bottom = true;
+    size_t expected = 0;
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        for (auto const &run : this->runs)
+        {
+            if (run->level == level)
+            {
+                inputs.push_back(run);
+                expected += run->versions;
+            }
+            else if (run->level > level)
+            {
+                bottom = false;
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<LsmRunCursor>> cursors;
+    for (auto const &run : inputs)
+        cursors.push_back(std::unique_ptr<LsmRunCursor>(new LsmRunCursor(run)));
+    LsmRunCursor *taken = nullptr;  // its record is being written, so it moves on next time
+    std::shared_ptr<LsmRun> run = this->write_run(
+        level + 1, expected, bottom, [&](LsmKey &key, Stamp &stamp, bool &deleted, RecordView &record) {
+            if (taken != nullptr)
+                taken->advance();
+            taken = nullptr;
+            for (auto const &cursor : cursors)
+                if (cursor->valid() && (taken == nullptr || cursor->key < taken->key))
+                    taken = cursor.get();
+            if (taken == nullptr)
+                return false;
+            key = taken->key;
+            stamp = taken->stamp;
+            deleted = taken->deleted;
+            record = taken->record;
+            return true;
+        });
+    cursors.clear();
+
+    std::vector<std::pair<std::string, uint32_t>> removed;
+    for (auto const &input : inputs)
+        removed.push_back(std::make_pair(std::string("run"), input->number));
+    this->change_manifest(removed, {std::make_tuple(std::string("run"), run->number, level + 1)});
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        for (auto const &input : inputs)
+        {
+            this->runs.erase(std::find(this->runs.begin(), this->runs.end(), input));
+            input->obsolete = true;
+        }
+        auto position = std::find_if(this->runs.begin(), this->runs.end(),
+                                     [&](const std::shared_ptr<LsmRun> &other) { return other->level > level; });
+        this->runs.insert(position, run);
+        this->runs_changed++;
+    }
+    METRIC_ADD(RUNS_MERGED, inputs.size());
+}
+
+int LsmTable::full_level() const
+{
+    std::vector<size_t> sizes;
+    for (auto const &run : this->runs)
+    {
+        if (sizes.size() <= run->level)
+            sizes.resize(run->level + 1, 0);
+        if (++sizes[run->level] >= this->fanout)
+            return (int)run->level;
+    }
+    return -1;
+}
+
+// A version is dead if the next newer version of its row is older than the horizon: every
+// snapshot, now and later, sees that one instead.
+std::shared_ptr<LsmRun> LsmTable::write_run(uint32_t level, size_t expected, bool bottom,
+                                            const std::function<bool(LsmKey &, Stamp &, bool &, RecordView &)> &next)
+{
+    uint32_t number;
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        number = this->next_number++;
+    }
+    std::shared_ptr<LsmRun> run = std::make_shared<LsmRun>(this->file_name("run", number), number, level);
+    remove_leftover(this->file_name("run", number));
+    run->file.create();
+    run->filter = BloomFilter(expected);
+    Stamp horizon = Snapshot::horizon();
+
+    SlottedPage *block = run->file.get(1);
+    try
+    {
+        LsmKey key;
+        Stamp stamp;
+        bool deleted;
+        RecordView record;
+        uint64_t row_id = 0;
+        bool dead = false;  // the rest of the row's versions are
+        while (next(key, stamp, deleted, record))
+        {
+            if (key.row_id != row_id)
+            {
+                row_id = key.row_id;
+                dead = false;
+            }
+            if (dead)
+                continue;
+            if (stamp < horizon)
+            {
+                dead = true;
+                if (deleted && bottom)
+                    continue;  // nothing older is anywhere, so the row is simply gone
+            }
+            std::string entry = encode_entry(key, deleted, record);
+            Dbt data(&entry[0], entry.size());
+            if (run->fences.empty())
+                run->fences.push_back(key.row_id);
+            try
+            {
+                block->add(&data, stamp);
+            }
+            catch (DbBlockNoRoomError const &)
+            {
+                run->file.put(block);
+                delete block;
+                block = nullptr;
+                block = run->file.get_new();
+                block->add(&data, stamp);
+                run->fences.push_back(key.row_id);
+            }
+            if (run->versions++ == 0)
+                run->min_row_id = key.row_id;
+            run->max_row_id = key.row_id;
+            run->max_seq = std::max(run->max_seq, key.seq);
+            run->filter.add(key.row_id);
+        }
+        run->file.put(block);
+    }
+    catch (...)
+    {
+        delete block;
+        run->obsolete = true;
+        throw;
+    }
+    delete block;
+    return run;
+}
+
+void LsmTable::load(LsmRun &run)
+{
+    run.file.open();
+    std::vector<uint64_t> row_ids;
+    Arena arena;
+    for (BlockID block_id = 1; block_id <= run.file.get_last_block_id(); block_id++)
+    {
+        SlottedPage *block = run.file.get(block_id, arena);
+        bool first = true;
+        block->for_each_record([&](RecordID, RecordView entry) {
+            LsmKey key;
+            bool deleted;
+            RecordView record;
+            decode_entry(entry.data, entry.size, key, deleted, record);
+            if (first)
+                run.fences.push_back(key.row_id);
+            first = false;
+            if (row_ids.empty() || row_ids.back() != key.row_id)
+                row_ids.push_back(key.row_id);
+            run.max_seq = std::max(run.max_seq, key.seq);
+            run.versions++;
+        });
+        arena.reset();
+    }
+    run.filter = BloomFilter(row_ids.size());
+    for (auto const row_id : row_ids)
+        run.filter.add(row_id);
+    if (!row_ids.empty())
+    {
+        run.min_row_id = row_ids.front();
+        run.max_row_id = row_ids.back();
+    }
+}
+
+void LsmTable::change_manifest(const std::vector<std::pair<std::string, uint32_t>> &removed,
+                               const std::vector<std::tuple<std::string, uint32_t, uint32_t>> &added)
+{
+    Transaction transaction;
+    ValueDict row;
+    for (auto const &entry : removed)
+    {
+        row.clear();
+        row["kind"] = Value(entry.first);
+        row["number"] = Value((int32_t)entry.second);
+        for (auto const &handle : this->manifest.select(&row))
+            this->manifest.del(handle);
+    }
+    for (auto const &entry : added)
+    {
+        row.clear();
+        row["kind"] = Value(std::get<0>(entry));
+        row["number"] = Value((int32_t)std::get<1>(entry));
+        row["level"] = Value((int32_t)std::get<2>(entry));
+        this->manifest.insert(&row);
+    }
+    transaction.commit();
+}
+
+HeapTable *LsmTable::new_log(uint32_t number)
+{
+    return new HeapTable(this->file_name("log", number), ColumnNames{"entry"},
+                         ColumnAttributes{ColumnAttribute(ColumnAttribute::TEXT)});
+}
+
+std::string LsmTable::file_name(const std::string &kind, uint32_t number) const
+{
+    return this->table_name + "." + kind + std::to_string(number);
+}
+
+// A row's columns in order: an INT in 4 bytes, a TEXT as a 2-byte length and its characters.
+void LsmTable::marshal(const ValueDict *row, std::string &record)
+{
+    record.clear();
+    for (size_t i = 0; i < this->column_names.size(); i++)
+    {
+        auto column = row->find(this->column_names[i]);
+        if (column == row->end())
+            throw DbRelationError("Column '" + this->column_names[i] + "' is missing in the row.");
+        const Value &value = column->second;
+        if (value.is_null)
+            throw DbRelationError("cannot store NULL in column '" + this->column_names[i] + "'");
+        if (this->column_attributes[i].get_data_type() == ColumnAttribute::INT)
+        {
+            record.append((const char *)&value.n, sizeof(int32_t));
+        }
+        else
+        {
+            u16 size = (u16)value.s.size();
+            record.append((const char *)&size, sizeof(u16));
+            record.append(value.s);
+        }
+    }
+    // the log holds it as a TEXT value, behind the entry header
+    if (record.size() + ENTRY_HEADER_SZ + sizeof(u16) > SlottedPage::max_record_size())
+        throw DbBlockNoRoomError("row is too big for a block");
+}
+
+void LsmTable::unmarshal(const char *record, size_t size, const ColumnNames *column_names, ValueDict &row)
+{
+    bool all = column_names == nullptr || column_names->empty();
+    row.clear();
+    size_t offset = 0;
+    for (size_t i = 0; i < this->column_names.size() && offset < size; i++)
+    {
+        bool wanted = all || std::find(column_names->begin(), column_names->end(), this->column_names[i]) !=
+                                 column_names->end();
+        if (this->column_attributes[i].get_data_type() == ColumnAttribute::INT)
+        {
+            if (wanted)
+            {
+                int32_t n;
+                memcpy(&n, record + offset, sizeof(int32_t));
+                row[this->column_names[i]] = Value(n);
+            }
+            offset += sizeof(int32_t);
+        }
+        else
+        {
+            u16 length;
+            memcpy(&length, record + offset, sizeof(u16));
+            if (wanted)
+                row[this->column_names[i]] = Value(std::string(record + offset + sizeof(u16), length));
+            offset += sizeof(u16) + length;
+        }
+    }
+}
+
+//------------------------LsmTableScan----------------------------------------------
+
+// Copies the memtables' versions the snapshot sees and holds on to the runs as they are now.
+LsmTableScan::LsmTableScan(LsmTable &table)
+    : table(table), snapshot(Transaction::snapshot()), memory_position(0), taken(-1), decided(0)
+{
+    std::vector<std::shared_ptr<LsmRun>> runs;
+    {
+        std::lock_guard<std::mutex> guard(table.lock);
+        auto copy = [&](const LsmVersions &versions) {
+            for (auto const &version : versions)
+                if (this->snapshot->sees(version.second.stamp, Snapshot::FROZEN))
+                    this->memory.push_back(version);
+        };
+        copy(table.memtable->versions);
+        for (auto const &frozen : table.frozen)
+            copy(frozen->versions);
+        runs = table.runs;
+    }
+    std::sort(this->memory.begin(), this->memory.end(),
+              [](const std::pair<LsmKey, LsmVersion> &a, const std::pair<LsmKey, LsmVersion> &b) {
+                  return a.first < b.first;
+              });
+    for (auto const &run : runs)
+        this->cursors.push_back(std::unique_ptr<LsmRunCursor>(new LsmRunCursor(run)));
+}
+
+LsmTableScan::~LsmTableScan()
+{
+}
+
+bool LsmTableScan::next(Handle &handle, ValueDict &row)
+{
+    uint64_t row_id;
+    RecordView record;
+    if (!this->next_record(row_id, record))
+        return false;
+    this->table.unmarshal(record.data, record.size, nullptr, row);
+    handle = LsmTable::to_handle(row_id);
+    return true;
+}
+
+// Takes the least version of all the sources each time; the first of a row's versions that
+// the snapshot sees is the row's, and the rest are passed over.
+bool LsmTableScan::next_record(uint64_t &row_id, RecordView &record)
+{
+    while (true)
+    {
+        if (this->taken == 0)
+            this->memory_position++;
+        else if (this->taken > 0)
+            this->cursors[this->taken - 1]->advance();
+        this->taken = -1;
+
+        const LsmKey *least = nullptr;
+        if (this->memory_position < this->memory.size())
+        {
+            least = &this->memory[this->memory_position].first;
+            this->taken = 0;
+        }
+        for (size_t i = 0; i < this->cursors.size(); i++)
+            if (this->cursors[i]->valid() && (least == nullptr || this->cursors[i]->key < *least))
+            {
+                least = &this->cursors[i]->key;
+                this->taken = (int)i + 1;
+            }
+        if (least == nullptr)
+            return false;
+
+        Stamp stamp;
+        bool deleted;
+        RecordView view;
+        if (this->taken == 0)
+        {
+            const LsmVersion &version = this->memory[this->memory_position].second;
+            stamp = version.stamp;
+            deleted = version.deleted;
+            view = RecordView(version.record.data(), (u16)version.record.size());
+        }
+        else
+        {
+            const LsmRunCursor &cursor = *this->cursors[this->taken - 1];
+            stamp = cursor.stamp;
+            deleted = cursor.deleted;
+            view = cursor.record;
+        }
+        if (least->row_id == this->decided || !this->snapshot->sees(stamp, Snapshot::FROZEN))
+            continue;
+        this->decided = least->row_id;
+        if (deleted)
+            continue;
+        row_id = least->row_id;
+        record = view;
+        return true;
+    }
+}
+
+//------------------------tests----------------------------------------------
+
+static ColumnNames lsm_test_columns()
+{
+    return ColumnNames{"a", "b"};
+}
+
+static ColumnAttributes lsm_test_attributes()
+{
+    return ColumnAttributes{ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)};
+}
+
+static size_t count_scanned(DbRelation &table)
+{
+    std::unique_ptr<DbRelationScan> scan = table.scan();
+    Handle handle;
+    ValueDict row;
+    size_t n = 0;
+    while (scan->next(handle, row))
+        n++;
+    return n;
+}
+
+// Rows survive being written out and merged, and the table being closed and opened again.
+static bool test_lsm_basics()
+{
+    const int32_t ROWS = 1000;
+    Handles handles;
+    {
+        LsmTable table("_test_lsm_cpp", lsm_test_columns(), lsm_test_attributes(), 4096, 2);
+        table.create();
+        ValueDict row;
+        for (int32_t i = 0; i < ROWS; i++)
+        {
+            row["a"] = Value(i);
+            row["b"] = Value("row " + std::to_string(i));
+            handles.push_back(table.insert(&row));
+        }
+        table.flush();
+        ValueDict where;
+        where["a"] = Value(500);
+        Handles found = table.select(&where);
+        bool ok = found.size() == 1 && found[0] == handles[500] && table.project(found[0])["b"] == Value("row 500");
+        std::vector<size_t> levels = table.get_level_sizes();
+        if (!ok || levels.size() < 2 || table.select().size() != (size_t)ROWS)
+        {
+            std::cout << "lsm: " << table.select().size() << " rows in " << levels.size() << " levels" << std::endl;
+            table.drop();
+            return false;
+        }
+        std::cout << "lsm write out/merge ok (" << levels.size() << " levels)" << std::endl;
+
+        ValueDict new_values;
+        new_values["b"] = Value("changed");
+        for (int32_t i = 0; i < 100; i++)
+        {
+            table.update(handles[i], &new_values);
+            table.del(handles[ROWS - 1 - i]);
+        }
+        table.flush();
+    }
+
+    LsmTable table("_test_lsm_cpp", lsm_test_columns(), lsm_test_attributes(), 4096, 2);
+    table.open();
+    ValueDict where;
+    where["b"] = Value("changed");
+    ValueDict row = table.project(handles[42]);
+    bool ok = table.select(&where).size() == 100 && count_scanned(table) == (size_t)(ROWS - 100) &&
+              row["a"] == Value(42) && row["b"] == Value("changed");
+    bool gone = false;
+    try
+    {
+        table.project(handles[ROWS - 1]);
+    }
+    catch (DbRelationError &)
+    {
+        gone = true;
+    }
+    where.clear();
+    where["c"] = Value(1);
+    ok = ok && gone && table.select(&where).empty();
+    table.drop();
+    if (!ok)
+        return false;
+    std::cout << "lsm update/delete/reopen ok" << std::endl;
+    return true;
+}
+
+// An aborted insert leaves nothing behind, and a scan keeps its snapshot while what it
+// reads is written out and merged away.
+static bool test_lsm_snapshots()
+{
+    LsmTable table("_test_lsm_snapshots_cpp", lsm_test_columns(), lsm_test_attributes(), 4096, 2);
+    table.create();
+    ValueDict row;
+    row["b"] = Value("old");
+    Handles handles;
+    for (int32_t i = 0; i < 200; i++)
+    {
+        row["a"] = Value(i);
+        handles.push_back(table.insert(&row));
+    }
+    {
+        Transaction transaction;
+        row["a"] = Value(-1);
+        table.insert(&row);
+        transaction.abort();
+    }
+    bool ok = table.select().size() == 200;
+
+    std::unique_ptr<DbRelationScan> scan = table.scan();
+    ValueDict new_values;
+    new_values["b"] = Value("new");
+    for (auto const &handle : handles)
+        table.update(handle, &new_values);
+    table.flush();
+    Handle handle;
+    size_t old = 0;
+    while (scan->next(handle, row))
+        if (row["b"] == Value("old"))
+            old++;
+    scan.reset();
+    ValueDict where;
+    where["b"] = Value("new");
+    ok = ok && old == 200 && table.select(&where).size() == 200;
+    table.drop();
+    if (!ok)
+    {
+        std::cout << "lsm snapshot scan saw " << old << " old rows" << std::endl;
+        return false;
+    }
+    std::cout << "lsm abort/snapshot ok" << std::endl;
+    return true;
+}
+
+// Writers on several threads, while the memtable is frozen and written out under them.
+static bool test_lsm_concurrent()
+{
+    const int THREADS = 4, ROWS = 500;
+    LsmTable table("_test_lsm_concurrent_cpp", lsm_test_columns(), lsm_test_attributes(), 8192, 2);
+    table.create();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; t++)
+        threads.push_back(std::thread([&, t]() {
+            ValueDict row;
+            row["b"] = Value(std::string(50, 'c'));
+            for (int i = 0; i < ROWS; i++)
+            {
+                row["a"] = Value(t * 100000 + i);
+                Handle handle = table.insert(&row);
+                if (i % 10 == 0)
+                {
+                    ValueDict new_values;
+                    new_values["b"] = Value("updated");
+                    table.update(handle, &new_values);
+                }
+            }
+        }));
+    for (auto &thread : threads)
+        thread.join();
+    table.flush();
+    ValueDict where;
+    where["b"] = Value("updated");
+    bool ok = table.select().size() == (size_t)(THREADS * ROWS) &&
+              table.select(&where).size() == (size_t)(THREADS * ROWS / 10);
+    table.drop();
+    if (!ok)
+        return false;
+    std::cout << "lsm concurrent writers ok" << std::endl;
+    return true;
+}
+
+// What only a heap table has is refused for an LSM table before the table is opened.
+static bool test_lsm_commands()
+{
+    const Identifier TABLE_NAME = "_test_lsm_commands";
+    Tables tables;
+    tables.create_table(TABLE_NAME, lsm_test_columns(), lsm_test_attributes(), true, "LSM");
+    size_t refused = 0;
+    try
+    {
+        tables.analyze(TABLE_NAME);
+    }
+    catch (DbRelationError &e)
+    {
+        refused += std::string(e.what()).find("not supported for LSM") != std::string::npos;
+    }
+    try
+    {
+        tables.create_index(TABLE_NAME, "_test_lsm_commands_a", "a", "BRIN");
+    }
+    catch (DbRelationError &e)
+    {
+        refused += std::string(e.what()).find("not supported for LSM") != std::string::npos;
+    }
+    tables.drop_table(TABLE_NAME);
+    if (refused != 2)
+    {
+        std::cout << "lsm: only " << refused << " of ANALYZE and CREATE INDEX refused" << std::endl;
+        return false;
+    }
+    std::cout << "lsm unsupported commands ok" << std::endl;
+    return true;
+}
+
+// test function -- returns true if all tests pass
+bool test_lsm_storage()
+{
+    std::cout << "\nTesting LsmTable...." << std::endl;
+    return test_lsm_basics() && test_lsm_snapshots() && test_lsm_concurrent() && test_lsm_commands();
+}
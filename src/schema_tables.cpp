@@ -0,0 +1,440 @@
+#include "schema_tables.h"
+#include "brin_index.h"
+#include "lsm_storage.h"
+#include <cctype>
+
+//------------------------initialize_schema_tables----------------------------------
+
+// Creates "_tables" (and with it "_columns") the first time the database is used.
+void initialize_schema_tables()
+{
+    Tables tables;
+    tables.create_if_not_exists();
+    tables.close();
+}
+
+//------------------------Columns----------------------------------------------
+
+const Identifier Columns::TABLE_NAME = "_columns";
+
+ColumnNames &Columns::COLUMN_NAMES()
+{
+    static ColumnNames column_names = {"table_name", "column_name", "data_type"};
+    return column_names;
+}
+
+ColumnAttributes &Columns::COLUMN_ATTRIBUTES()
+{
+    static ColumnAttributes column_attributes(3, ColumnAttribute(ColumnAttribute::TEXT));
+    return column_attributes;
+}
+
+Columns::Columns() : HeapTable(TABLE_NAME, COLUMN_NAMES(), COLUMN_ATTRIBUTES())
+{
+}
+
+// Only INT and TEXT columns can be stored by the heap storage engine.
+Handle Columns::insert(const ValueDict *row)
+{
+    auto it = row->find("data_type");
+    if (it == row->end() || (it->second.s != "INT" && it->second.s != "TEXT"))
+        throw DbRelationError("unrecognized data type");
+    return HeapTable::insert(row);
+}
+
+//------------------------Indices----------------------------------------------
+
+const Identifier Indices::TABLE_NAME = "_indices";
+
+ColumnNames &Indices::COLUMN_NAMES()
+{
+    static ColumnNames column_names = {"table_name", "index_name", "column_name", "index_type"};
+    return column_names;
+}
+
+ColumnAttributes &Indices::COLUMN_ATTRIBUTES()
+{
+    static ColumnAttributes column_attributes(4, ColumnAttribute(ColumnAttribute::TEXT));
+    return column_attributes;
+}
+
+Indices::Indices() : HeapTable(TABLE_NAME, COLUMN_NAMES(), COLUMN_ATTRIBUTES())
+{
+}
+
+//------------------------Engines----------------------------------------------
+
+const Identifier Engines::TABLE_NAME = "_engines";
+
+ColumnNames &Engines::COLUMN_NAMES()
+{
+    static ColumnNames column_names = {"table_name", "engine"};
+    return column_names;
+}
+
+ColumnAttributes &Engines::COLUMN_ATTRIBUTES()
+{
+    static ColumnAttributes column_attributes(2, ColumnAttribute(ColumnAttribute::TEXT));
+    return column_attributes;
+}
+
+Engines::Engines() : HeapTable(TABLE_NAME, COLUMN_NAMES(), COLUMN_ATTRIBUTES())
+{
+}
+
+//------------------------Statistics----------------------------------------------
+
+const Identifier Statistics::TABLE_NAME = "_statistics";
+
+ColumnNames &Statistics::COLUMN_NAMES()
+{
+    static ColumnNames column_names = {"table_name", "column_name", "row_count", "block_count",
+                                       "sketched_rows", "sketch", "histogram"};
+    return column_names;
+}
+
+ColumnAttributes &Statistics::COLUMN_ATTRIBUTES()
+{
+    static ColumnAttributes column_attributes = {
+        ColumnAttribute(ColumnAttribute::TEXT), ColumnAttribute(ColumnAttribute::TEXT),
+        ColumnAttribute(ColumnAttribute::INT),  ColumnAttribute(ColumnAttribute::INT),
+        ColumnAttribute(ColumnAttribute::INT),  ColumnAttribute(ColumnAttribute::TEXT),
+        ColumnAttribute(ColumnAttribute::TEXT)};
+    return column_attributes;
+}
+
+Statistics::Statistics() : HeapTable(TABLE_NAME, COLUMN_NAMES(), COLUMN_ATTRIBUTES())
+{
+}
+
+//------------------------Tables----------------------------------------------
+
+const Identifier Tables::TABLE_NAME = "_tables";
+
+ColumnNames &Tables::COLUMN_NAMES()
+{
+    static ColumnNames column_names = {"table_name"};
+    return column_names;
+}
+
+ColumnAttributes &Tables::COLUMN_ATTRIBUTES()
+{
+    static ColumnAttributes column_attributes(1, ColumnAttribute(ColumnAttribute::TEXT));
+    return column_attributes;
+}
+
+Tables::Tables() : HeapTable(TABLE_NAME, COLUMN_NAMES(), COLUMN_ATTRIBUTES())
+{
+}
+
+Tables::~Tables()
+{
+    for (auto const &entry : table_cache)
+        delete entry.second;
+    for (auto table : dropped_tables)
+        delete table;
+}
+
+// Creates the catalog tables and records their own schemas in them.
+void Tables::create()
+{
+    HeapTable::create();
+    columns.create_if_not_exists();
+    indices.create_if_not_exists();
+    engines.create_if_not_exists();
+    statistics.create_if_not_exists();
+    describe(TABLE_NAME, COLUMN_NAMES(), COLUMN_ATTRIBUTES());
+    describe(Columns::TABLE_NAME, Columns::COLUMN_NAMES(), Columns::COLUMN_ATTRIBUTES());
+    describe(Indices::TABLE_NAME, Indices::COLUMN_NAMES(), Indices::COLUMN_ATTRIBUTES());
+    describe(Engines::TABLE_NAME, Engines::COLUMN_NAMES(), Engines::COLUMN_ATTRIBUTES());
+    describe(Statistics::TABLE_NAME, Statistics::COLUMN_NAMES(), Statistics::COLUMN_ATTRIBUTES());
+}
+
+// Adds the "_tables" row and the "_columns" rows for a table.
+void Tables::describe(Identifier table_name, const ColumnNames &column_names,
+                      const ColumnAttributes &column_attributes)
+{
+    ValueDict row;
+    row["table_name"] = Value(table_name);
+    HeapTable::insert(&row);
+    for (size_t i = 0; i < column_names.size(); i++)
+    {
+        row["column_name"] = Value(column_names[i]);
+        row["data_type"] = Value(column_attributes[i].get_data_type() == ColumnAttribute::INT ? "INT" : "TEXT");
+        columns.insert(&row);
+    }
+}
+
+bool Tables::exists(Identifier table_name)
+{
+    ValueDict where;
+    where["table_name"] = Value(table_name);
+    return !this->select(&where).empty();
+}
+
+void Tables::get_columns(Identifier table_name, ColumnNames &column_names, ColumnAttributes &column_attributes)
+{
+    ValueDict where;
+    where["table_name"] = Value(table_name);
+    ValueDict row;
+    for (auto const &handle : columns.select(&where))
+    {
+        columns.project(handle, nullptr, row);
+        column_names.push_back(row["column_name"].s);
+        column_attributes.push_back(ColumnAttribute(
+            row["data_type"].s == "INT" ? ColumnAttribute::INT : ColumnAttribute::TEXT));
+    }
+}
+
+DbRelation &Tables::get_table(Identifier table_name)
+{
+    if (table_name == TABLE_NAME)
+        return *this;
+    if (table_name == Columns::TABLE_NAME)
+        return columns;
+    if (table_name == Indices::TABLE_NAME)
+        return indices;
+    if (table_name == Engines::TABLE_NAME)
+        return engines;
+    if (table_name == Statistics::TABLE_NAME)
+        return statistics;
+
+    std::lock_guard<std::mutex> guard(cache_lock);
+    auto cached = table_cache.find(table_name);
+    if (cached != table_cache.end())
+        return *cached->second;
+
+    ColumnNames column_names;
+    ColumnAttributes column_attributes;
+    get_columns(table_name, column_names, column_attributes);
+    if (column_names.empty())
+        throw DbRelationError("table '" + table_name + "' does not exist");
+    if (get_engine(table_name) == "LSM")
+    {
+        DbRelation *table = new LsmTable(table_name, column_names, column_attributes);
+        table_cache[table_name] = table;
+        return *table;
+    }
+    HeapTable *table = new HeapTable(table_name, column_names, column_attributes);
+    try
+    {
+        open_indexes(*table);
+        open_statistics(*table);
+    }
+    catch (...)
+    {
+        delete table;
+        throw;
+    }
+    table_cache[table_name] = table;
+    return *table;
+}
+
+// Builds the table's indexes from their "_indices" rows (summarizing the whole table).
+void Tables::open_indexes(HeapTable &table)
+{
+    if (!exists(Indices::TABLE_NAME))
+        return;
+    ValueDict where;
+    where["table_name"] = Value(table.get_table_name());
+    ValueDict row;
+    for (auto const &handle : indices.select(&where))
+    {
+        indices.project(handle, nullptr, row);
+        table.add_brin_index(row["index_name"].s, row["column_name"].s);
+    }
+}
+
+// The statistics are those of the last ANALYZE, as updated by the inserts and deletes since
+// (up to the last time they were saved).
+void Tables::open_statistics(HeapTable &table)
+{
+    if (!exists(Statistics::TABLE_NAME))
+        return;
+    ValueDict where;
+    where["table_name"] = Value(table.get_table_name());
+    Handles handles = statistics.select(&where);
+    if (handles.empty())
+        return;
+    std::shared_ptr<TableStats> stats =
+        std::make_shared<TableStats>(table.get_column_names(), table.get_column_attributes());
+    ValueDict row;
+    for (auto const &handle : handles)
+    {
+        statistics.project(handle, nullptr, row);
+        stats->load_row(row);
+    }
+    table.set_stats(stats);
+}
+
+// A table without an "_engines" row is a heap table.
+Identifier Tables::get_engine(Identifier table_name)
+{
+    if (!exists(Engines::TABLE_NAME))
+        return "HEAP";
+    ValueDict where;
+    where["table_name"] = Value(table_name);
+    Handles handles = engines.select(&where);
+    if (handles.empty())
+        return "HEAP";
+    return engines.project(handles.front())["engine"].s;
+}
+
+// Lists the tables in the cache.
+std::vector<DbRelation *> Tables::get_open_tables()
+{
+    std::lock_guard<std::mutex> guard(cache_lock);
+    std::vector<DbRelation *> open_tables;
+    for (auto const &entry : table_cache)
+        open_tables.push_back(entry.second);
+    return open_tables;
+}
+
+bool Tables::create_table(Identifier table_name, const ColumnNames &column_names,
+                          const ColumnAttributes &column_attributes, bool if_not_exists, Identifier engine)
+{
+    for (auto &c : engine)
+        c = (char)toupper((unsigned char)c);
+    if (engine != "HEAP" && engine != "LSM")
+        throw DbRelationError("unknown storage engine '" + engine + "'");
+
+    std::lock_guard<std::mutex> guard(create_lock);
+    if (exists(table_name))
+    {
+        if (if_not_exists)
+            return false;
+        throw DbRelationError("table '" + table_name + "' already exists");
+    }
+    if (engine != "HEAP")
+    {
+        if (!exists(Engines::TABLE_NAME))
+        {
+            // a database from before there was a choice of engine
+            engines.create_if_not_exists();
+            describe(Engines::TABLE_NAME, Engines::COLUMN_NAMES(), Engines::COLUMN_ATTRIBUTES());
+        }
+        ValueDict row;
+        row["table_name"] = Value(table_name);
+        row["engine"] = Value(engine);
+        engines.insert(&row);
+    }
+    describe(table_name, column_names, column_attributes);
+    get_table(table_name).create();
+    return true;
+}
+
+// The file goes first, so if that fails the catalog still describes the table.
+void Tables::drop_table(Identifier table_name)
+{
+    if (is_catalog(table_name))
+        throw DbRelationError("cannot drop catalog table '" + table_name + "'");
+
+    std::lock_guard<std::mutex> guard(create_lock);
+    if (!exists(table_name))
+        throw DbRelationError("table '" + table_name + "' does not exist");
+    DbRelation &table = get_table(table_name);
+    table.drop();
+    {
+        std::lock_guard<std::mutex> cache_guard(cache_lock);
+        table_cache.erase(table_name);
+        dropped_tables.push_back(&table);
+    }
+
+    Transaction transaction;
+    ValueDict where;
+    where["table_name"] = Value(table_name);
+    for (HeapTable *catalog : std::vector<HeapTable *>{&statistics, &engines, &indices, &columns, this})
+    {
+        if (!exists(catalog->get_table_name()))
+            continue;  // a database from before the catalog had it
+        for (auto const &handle : catalog->select(&where))
+            catalog->del(handle);
+    }
+    transaction.commit();
+}
+
+void Tables::create_index(Identifier table_name, Identifier index_name, Identifier column_name,
+                          Identifier index_type)
+{
+    for (auto &c : index_type)
+        c = (char)toupper((unsigned char)c);
+    if (index_type != "BRIN")
+        throw DbRelationError("only BRIN indexes are supported");
+    if (is_catalog(table_name))
+        throw DbRelationError("cannot index catalog table '" + table_name + "'");
+    if (get_engine(table_name) == "LSM")
+        throw DbRelationError("CREATE INDEX is not supported for LSM table '" + table_name + "'");
+
+    std::lock_guard<std::mutex> guard(create_lock);
+    HeapTable *table = dynamic_cast<HeapTable *>(&get_table(table_name));
+    if (table == nullptr)
+        throw DbRelationError("cannot index '" + table_name + "'");
+    if (!exists(Indices::TABLE_NAME))
+    {
+        // a database from before there were indexes
+        indices.create_if_not_exists();
+        describe(Indices::TABLE_NAME, Indices::COLUMN_NAMES(), Indices::COLUMN_ATTRIBUTES());
+    }
+    ValueDict row;
+    row["table_name"] = Value(table_name);
+    row["index_name"] = Value(index_name);
+    if (!indices.select(&row).empty())
+        throw DbRelationError("index '" + index_name + "' already exists on '" + table_name + "'");
+    table->add_brin_index(index_name, column_name);
+    row["column_name"] = Value(column_name);
+    row["index_type"] = Value(index_type);
+    indices.insert(&row);
+}
+
+bool Tables::is_catalog(const Identifier &table_name)
+{
+    return table_name == TABLE_NAME || table_name == Columns::TABLE_NAME || table_name == Indices::TABLE_NAME ||
+           table_name == Engines::TABLE_NAME || table_name == Statistics::TABLE_NAME;
+}
+
+std::shared_ptr<TableStats> Tables::analyze(Identifier table_name, size_t sample_blocks)
+{
+    if (is_catalog(table_name))
+        throw DbRelationError("cannot analyze catalog table '" + table_name + "'");
+    if (get_engine(table_name) == "LSM")
+        throw DbRelationError("ANALYZE is not supported for LSM table '" + table_name + "'");
+    HeapTable *table = dynamic_cast<HeapTable *>(&get_table(table_name));
+    if (table == nullptr)
+        throw DbRelationError("cannot analyze '" + table_name + "'");
+    std::shared_ptr<TableStats> stats = TableStats::analyze(*table, sample_blocks);
+    table->set_stats(stats);
+    save_statistics(*table, true);
+    return stats;
+}
+
+// Replaces the table's rows in one transaction. The changes counted before the rows were
+// made are the ones they include; any made meanwhile count towards the next save.
+bool Tables::save_statistics(HeapTable &table, bool force)
+{
+    std::shared_ptr<TableStats> stats = table.get_stats();
+    if (stats == nullptr)
+        return false;
+    size_t changes = stats->get_changes();
+    if (!force && changes < std::max(SAVE_CHANGES, stats->get_row_count() / 10))
+        return false;
+
+    std::lock_guard<std::mutex> guard(statistics_lock);
+    if (!exists(Statistics::TABLE_NAME))
+    {
+        // a database from before there were statistics
+        std::lock_guard<std::mutex> create_guard(create_lock);
+        statistics.create_if_not_exists();
+        describe(Statistics::TABLE_NAME, Statistics::COLUMN_NAMES(), Statistics::COLUMN_ATTRIBUTES());
+    }
+    std::vector<ValueDict> rows = stats->to_rows(table.get_table_name());
+    Transaction transaction;
+    ValueDict where;
+    where["table_name"] = Value(table.get_table_name());
+    for (auto const &handle : statistics.select(&where))
+        statistics.del(handle);
+    for (auto const &row : rows)
+        statistics.insert(&row);
+    transaction.commit();
+    stats->clear_changes(changes);
+    return true;
+}
@@ -5,18 +5,50 @@
  * The code sets up an environment and runs a SQL shell emulator.
  * Users can write SQL commands which are then parsed and "executed".
  * The program runs interactively until the user issues a quit command.
+ * Given a script (-f) or piped input, it instead runs in batch mode: no prompts,
+ * statements may span lines and end with a semicolon, and output is buffered.
+ * Changes are logged and committed durably; -d sets the group commit delay.
+ * With -s, it instead serves many clients over a Unix domain socket (see Server.h).
+ * Tables with many dead row versions are vacuumed in the background; -v sets how often
+ * it looks for them (in ms, 0 for never).
+ * Results are streamed to the output as they are produced, as a text table or, with -o,
+ * as CSV or a compact binary format (see ResultSink.h).
  * This code use Berkeley DB and sql-parser libraries
  * Author: Noha Nomier,  CPSC5300 WQ2024
  */
 
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <memory>
 #include <sstream>
+#include <thread>
 #include "db_cxx.h"
 #include "SQLParser.h"
 #include "SqlExecutor.h"
+#include "Metrics.h"
+#include "transactions.h"
+#include "latches.h"
+#include "arena.h"
 #include "heap_storage.h"
+#include "schema_tables.h"
+#include "BatchPlan.h"
+#include "JoinPlan.h"
+#include "SortPlan.h"
+#include "AggregatePlan.h"
+#include "PlanCache.h"
+#include "Server.h"
+#include "vacuum.h"
+#include "brin_index.h"
+#include "lsm_storage.h"
+#include "table_stats.h"
+#include "Optimizer.h"
+#include "ResultSink.h"
 
 using namespace std;
 using namespace hsql;
@@ -26,58 +58,267 @@ using namespace hsql;
  */
 DbEnv *_DB_ENV;
 
+// Runs one statement (or shell command); returns false on quit.
+static bool run_statement(SqlExecutor &executor, const string &statement, ResultSink &sink)
+{
+    if (statement == "quit")
+        return false;
+    if (statement == "test")
+    {
+        sink.message("test_heap_storage:");
+        sink.message(test_arena() && test_heap_storage() && test_query_plan() && test_batch_plan() && test_join_plan() && test_sort_plan() && test_aggregate_plan() && test_plan_cache() && test_metrics() && test_explain_plan() && test_transactions() && test_mvcc() && test_vacuum() && test_brin_index() && test_table_stats() && test_optimizer() && test_lsm_storage() && test_result_sink() && test_latches() && test_server() ? "ok" : "failed");
+        return true;
+    }
+    try
+    {
+        executor.execute(statement, sink);
+    }
+    catch (SQLExecError &e)
+    {
+        sink.message(string("Error: ") + e.what());
+    }
+    catch (DbRelationError &e)
+    {
+        sink.message(string("Error: ") + e.what());
+    }
+    catch (DbException &e)
+    {
+        sink.message(string("Error: ") + e.what());
+    }
+    catch (std::exception &e)
+    {
+        sink.message(string("Error: ") + e.what());  // e.g., a row too big for a block
+    }
+    sink.flush();
+    return true;
+}
+
+// Formats the time since start the way the shell always has.
+static string milliseconds_since(chrono::steady_clock::time_point start)
+{
+    ostringstream ss;
+    ss << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    return ss.str();
+}
+
+static Server *running_server = nullptr;
+
+static void stop_server(int)
+{
+    running_server->stop();
+}
+
+// Serves clients on a Unix socket until interrupted.
+static int serve(const char *socketPath, size_t workers)
+{
+    try
+    {
+        Server server(socketPath, workers);
+        running_server = &server;
+        signal(SIGINT, stop_server);
+        signal(SIGTERM, stop_server);
+        cout << "(sql5300: serving on " << socketPath << " with " << workers << " worker threads)" << endl;
+        server.run();
+        cout << "(sql5300: shutting down)" << endl;
+    }
+    catch (runtime_error &e)
+    {
+        cerr << "(sql5300: " << e.what() << ")" << endl;
+        return 1;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Reads the next statement of a script: everything up to a semicolon outside of quotes
+// (which is dropped), skipping -- comments. A "quit" or "test" line is a statement on its own.
+// pending holds what's left of the last line read. Returns false at the end of the input.
+static bool read_statement(istream &in, string &pending, string &statement)
+{
+    statement.clear();
+    char quote = '\0';
+    while (true)
+    {
+        if (pending.empty())
+        {
+            if (!getline(in, pending))
+                return statement.find_first_not_of(" \t\r\n") != string::npos;
+            pending += '\n';
+            size_t first = pending.find_first_not_of(" \t\r");
+            size_t last = pending.find_last_not_of(" \t\r\n;");
+            bool blank = statement.find_first_not_of(" \t\r\n") == string::npos;
+            if (blank && first != string::npos && last != string::npos && last >= first)
+            {
+                string word = pending.substr(first, last - first + 1);
+                if (word == "quit" || word == "test")
+                {
+                    pending.clear();
+                    statement = word;
+                    return true;
+                }
+            }
+        }
+
+        // pending always ends with a newline
+        bool ended = false;
+        size_t i = 0;
+        for (; i < pending.size(); i++)
+        {
+            char c = pending[i];
+            if (quote != '\0')
+            {
+                if (c == quote)
+                    quote = '\0';
+            }
+            else if (c == '\'' || c == '"')
+            {
+                quote = c;
+            }
+            else if (c == '-' && pending[i + 1] == '-')
+            {
+                i = pending.find('\n', i) - 1;
+                continue;
+            }
+            else if (c == ';')
+            {
+                ended = true;
+                break;
+            }
+            statement += c;
+        }
+        if (!ended)
+        {
+            pending.clear();
+            continue;
+        }
+        pending.erase(0, i + 1);
+        if (statement.find_first_not_of(" \t\r\n") != string::npos)
+            return true;
+        statement.clear();  // nothing before the semicolon
+    }
+}
+
 int main(int argc, char *argv[])
 {
-    // Open/create the db enviroment
-    if (argc != 2) {
-        cerr << "Usage: cpsc5300: dbenvpath" << endl;
+    // Parse the command line
+    const char *scriptPath = nullptr;
+    bool timing = false;
+    long commitDelay = 0;
+    const char *socketPath = nullptr;
+    long workers = (long)max(thread::hardware_concurrency(), 1U);
+    long vacuumInterval = 1000;
+    string outputFormat = "text";
+    bool badOption = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:td:s:w:v:o:")) != -1)
+    {
+        if (opt == 'f')
+            scriptPath = optarg;
+        else if (opt == 't')
+            timing = true;
+        else if (opt == 'd')
+            commitDelay = strtol(optarg, nullptr, 10);
+        else if (opt == 's')
+            socketPath = optarg;
+        else if (opt == 'w')
+            workers = strtol(optarg, nullptr, 10);
+        else if (opt == 'v')
+            vacuumInterval = strtol(optarg, nullptr, 10);
+        else if (opt == 'o')
+            outputFormat = optarg;
+        else
+            badOption = true;
+    }
+    unique_ptr<ResultSink> sink(ResultSink::create(outputFormat, cout));
+    if (badOption || optind != argc - 1 || commitDelay < 0 || workers < 1 || vacuumInterval < 0 || !sink) {
+        cerr << "Usage: cpsc5300: [-f script.sql] [-t] [-d commit delay usec] [-s socket [-w workers]]"
+             << " [-v vacuum interval msec] [-o text|csv|binary] dbenvpath" << endl;
         return 1;
     }
-    char *envHome = argv[1];
-    cout << "(sql5300: running with database environment at " << envHome << ")" << endl;
+    char *envHome = argv[optind];
+    bool batch = socketPath == nullptr && (scriptPath != nullptr || !isatty(STDIN_FILENO));
+    if (batch)
+        ios::sync_with_stdio(false);  // lets cout buffer
+    ifstream script;
+    if (scriptPath != nullptr)
+    {
+        script.open(scriptPath);
+        if (!script) {
+            cerr << "(sql5300: cannot open " << scriptPath << ")" << endl;
+            return 1;
+        }
+    }
+    istream &in = scriptPath != nullptr ? script : cin;
+
+    // Open/create the db enviroment
+    if (!batch)
+        cout << "(sql5300: running with database environment at " << envHome << ")" << endl;
     DbEnv env(0U);
     env.set_message_stream(&cout);
     env.set_error_stream(&cerr);
     try {
-        env.open(envHome, DB_CREATE | DB_INIT_MPOOL, 0);
+        // write-ahead logged; commits don't sync the log themselves but wait on the group commit
+        env.set_flags(DB_AUTO_COMMIT | DB_TXN_NOSYNC, 1);
+        env.set_lg_bsize(1024 * 1024);
+        env.set_lk_detect(DB_LOCK_DEFAULT);
+        env.log_set_config(DB_LOG_AUTO_REMOVE, 1);
+        env.open(envHome, DB_CREATE | DB_INIT_MPOOL | DB_INIT_LOCK | DB_INIT_LOG | DB_INIT_TXN | DB_RECOVER | DB_THREAD, 0);
     } catch (DbException &exc) {
         cerr << "(sql5300: " << exc.what() << ")";
         exit(1);
     }
     _DB_ENV = &env;
+    GroupCommit groupCommit(&env, chrono::microseconds(commitDelay));
+    Transaction::enable(&groupCommit);
+    initialize_schema_tables();
 
+    // one executor for the session, so statements prepared by name stay around
+    SqlExecutor executor;
+    // which also sets up the catalog shared with the server's sessions, for the vacuum to watch
+    unique_ptr<BackgroundVacuum> vacuum;
+    if (vacuumInterval > 0)
+        vacuum.reset(new BackgroundVacuum(SqlExecutor::get_tables(), chrono::milliseconds(vacuumInterval)));
+    if (socketPath != nullptr)
+        return serve(socketPath, (size_t)workers);
     string userInput;
-    while (true)
+    if (!batch)
     {
-        cout << "SQL> ";
-        getline(cin, userInput);
-        if (userInput.length() == 0)
-            continue; // blank line -- just skip
-        if (userInput == "quit")
-        {
-            break;
-        }
-
-        if (userInput == "test")
+        while (true)
         {
-            cout << "test_heap_storage:\n" << (test_heap_storage() ? "ok" : "failed") << endl;
-            continue;
+            cout << "SQL> ";
+            if (!getline(cin, userInput))
+                break;
+            if (userInput.length() == 0)
+                continue; // blank line -- just skip
+            auto start = chrono::steady_clock::now();
+            bool more = run_statement(executor, userInput, *sink);
+            if (timing && more)
+                sink->message("(" + milliseconds_since(start) + " ms)");
+            cout << flush;
+            if (!more)
+                break;
         }
+        return EXIT_SUCCESS;
+    }
 
-        SQLParserResult *result = SQLParser::parseSQLString(userInput);
-        if (!result->isValid())
-        {
-            cout << "invalid SQL: " << userInput << endl;
-            delete result;
-            continue;
-        }
-        SqlExecutor executor;
-        // execute the statement
-        for (uint i = 0; i < result->size(); ++i)
-        {
-            cout << executor.execute(result->getStatement(i)) << endl;
-        }
-        delete result;
+    // batch mode: no prompts, and output is only flushed when cout's buffer fills (or at the end)
+    cin.tie(nullptr);
+    size_t count = 0;
+    string pending;
+    auto batchStart = chrono::steady_clock::now();
+    while (read_statement(in, pending, userInput))
+    {
+        auto start = chrono::steady_clock::now();
+        bool more = run_statement(executor, userInput, *sink);
+        if (!more)
+            break;
+        count++;
+        if (timing)
+            sink->message("(" + milliseconds_since(start) + " ms)");
     }
+    if (timing)
+        sink->message("(" + to_string(count) + " statements in " +
+                      milliseconds_since(batchStart) + " ms)");
+    sink->flush();
+    cout << flush;
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,544 @@
+/**
+ * Implementation of the table statistics declared in table_stats.h.
+ */
+
+#include "table_stats.h"
+#include "transactions.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+// Mixes the bits of x so that nearby inputs give unrelated outputs (splitmix64's finalizer).
+static uint64_t mix(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+//------------------------HyperLogLog----------------------------------------------
+
+uint64_t HyperLogLog::hash(const Value &value)
+{
+    if (value.is_null)
+        return mix(0);
+    if (value.data_type == ColumnAttribute::INT)
+        return mix((uint64_t)(uint32_t)value.n);
+    uint64_t h = 0xcbf29ce484222325ULL;  // FNV-1a
+    for (char c : value.s)
+        h = (h ^ (unsigned char)c) * 0x100000001b3ULL;
+    return mix(h);
+}
+
+// The register is the hash's first bits; the rank is where the first one bit in the rest is.
+void HyperLogLog::add(uint64_t hash)
+{
+    size_t index = (size_t)(hash >> (64 - PRECISION));
+    uint64_t rest = hash << PRECISION;
+    uint8_t rank = rest == 0 ? (uint8_t)(64 - PRECISION + 1) : (uint8_t)(__builtin_clzll(rest) + 1);
+    if (rank > registers[index])
+        registers[index] = rank;
+}
+
+void HyperLogLog::merge(const HyperLogLog &other)
+{
+    for (size_t i = 0; i < REGISTERS; i++)
+        registers[i] = std::max(registers[i], other.registers[i]);
+}
+
+// The harmonic mean of the registers' estimates, with linear counting for small
+// cardinalities, where many registers are still empty.
+double HyperLogLog::estimate() const
+{
+    const double m = (double)REGISTERS;
+    double sum = 0;
+    size_t empty = 0;
+    for (auto const rank : registers)
+    {
+        sum += std::ldexp(1.0, -(int)rank);
+        if (rank == 0)
+            empty++;
+    }
+    double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    if (estimate <= 2.5 * m && empty > 0)
+        estimate = m * std::log(m / (double)empty);
+    return estimate;
+}
+
+std::string HyperLogLog::to_string() const
+{
+    std::string text(REGISTERS, '0');
+    for (size_t i = 0; i < REGISTERS; i++)
+        text[i] = (char)('0' + registers[i]);
+    return text;
+}
+
+HyperLogLog HyperLogLog::from_string(const std::string &text)
+{
+    if (text.size() != REGISTERS)
+        throw DbRelationError("bad distinct-value sketch");
+    HyperLogLog sketch;
+    for (size_t i = 0; i < REGISTERS; i++)
+    {
+        if (text[i] < '0' || text[i] > (char)('0' + 64 - PRECISION + 1))
+            throw DbRelationError("bad distinct-value sketch");
+        sketch.registers[i] = (uint8_t)(text[i] - '0');
+    }
+    return sketch;
+}
+
+//------------------------EquiDepthHistogram----------------------------------------------
+
+EquiDepthHistogram::EquiDepthHistogram(std::vector<int32_t> values, double rows_per_value, size_t buckets)
+{
+    std::sort(values.begin(), values.end());
+    size_t n = values.size(), count = std::min(buckets, n);
+    for (size_t b = 0; b < count; b++)
+    {
+        size_t start = b * n / count, end = (b + 1) * n / count;
+        this->buckets.push_back(Bucket{values[start], values[end - 1], (double)(end - start) * rows_per_value});
+    }
+}
+
+// A value between two buckets goes into the later one, which widens down to it.
+void EquiDepthHistogram::add(int32_t value)
+{
+    if (buckets.empty())
+    {
+        buckets.push_back(Bucket{value, value, 1});
+        return;
+    }
+    auto it = std::find_if(buckets.begin(), buckets.end(), [value](const Bucket &b) { return value <= b.high; });
+    if (it == buckets.end())
+    {
+        buckets.back().high = value;
+        buckets.back().rows++;
+        return;
+    }
+    it->low = std::min(it->low, value);
+    it->rows++;
+}
+
+double EquiDepthHistogram::rows() const
+{
+    double rows = 0;
+    for (auto const &bucket : buckets)
+        rows += bucket.rows;
+    return rows;
+}
+
+double EquiDepthHistogram::fraction_less(int32_t value, bool or_equal) const
+{
+    double total = rows();
+    if (total <= 0)
+        return 0;
+    double below = 0;
+    for (auto const &bucket : buckets)
+    {
+        if (bucket.high < value || (bucket.high == value && or_equal))
+        {
+            below += bucket.rows;
+            continue;
+        }
+        if (bucket.low > value || (bucket.low == value && !or_equal))
+            break;
+        // value is inside the bucket
+        double width = (double)bucket.high - bucket.low + 1;
+        below += bucket.rows * ((double)value - bucket.low + (or_equal ? 1 : 0)) / width;
+    }
+    return std::min(below / total, 1.0);
+}
+
+double EquiDepthHistogram::fraction_equal(int32_t value, double distinct) const
+{
+    double uniform = distinct >= 1 ? 1 / distinct : 1;
+    double total = rows();
+    if (total <= 0)
+        return uniform;
+    if (value < buckets.front().low || value > buckets.back().high)
+        return 0;
+    double frequent = 0, containing = 0;
+    for (auto const &bucket : buckets)
+    {
+        if (bucket.low == value && bucket.high == value)
+            frequent += bucket.rows;
+        else if (bucket.low <= value && value <= bucket.high)
+            containing = std::max(containing, bucket.rows);
+    }
+    // a frequent value may spill into the buckets either side, too, so it's at least as
+    // common as the average value
+    if (frequent > 0)
+        return std::max(frequent / total, uniform);
+    return std::min(uniform, containing / total);
+}
+
+std::string EquiDepthHistogram::to_string() const
+{
+    std::ostringstream text;
+    for (size_t i = 0; i < buckets.size(); i++)
+        text << (i == 0 ? "" : " ") << buckets[i].low << ':' << buckets[i].high << ':'
+             << (long long)std::llround(buckets[i].rows);
+    return text.str();
+}
+
+EquiDepthHistogram EquiDepthHistogram::from_string(const std::string &text)
+{
+    EquiDepthHistogram histogram;
+    std::istringstream in(text);
+    std::string entry;
+    while (in >> entry)
+    {
+        long long low, high, rows;
+        char colon1, colon2;
+        std::istringstream fields(entry);
+        if (!(fields >> low >> colon1 >> high >> colon2 >> rows) || colon1 != ':' || colon2 != ':' || low > high)
+            throw DbRelationError("bad histogram bucket '" + entry + "'");
+        histogram.buckets.push_back(Bucket{(int32_t)low, (int32_t)high, (double)rows});
+    }
+    return histogram;
+}
+
+//------------------------TableStats----------------------------------------------
+
+TableStats::TableStats(const ColumnNames &column_names, const ColumnAttributes &column_attributes)
+    : column_names(column_names), row_count(0), block_count(0), sampled_blocks(0), changes(0)
+{
+    for (auto const &attribute : column_attributes)
+        columns.push_back(ColumnStats(attribute.get_data_type()));
+}
+
+// Picks the blocks by reservoir sampling (Algorithm R) over the file's block ids, then reads
+// them in file order. The sample's rows stand for the table's in proportion to the blocks.
+std::shared_ptr<TableStats> TableStats::analyze(HeapTable &table, size_t sample_blocks, uint32_t seed)
+{
+    table.open();
+    std::shared_ptr<TableStats> stats =
+        std::make_shared<TableStats>(table.get_column_names(), table.get_column_attributes());
+    BlockIDs block_ids = table.file.block_ids();
+    BlockIDs sample;
+    std::mt19937 random(seed);
+    for (size_t i = 0; i < block_ids.size(); i++)
+    {
+        if (i < sample_blocks)
+        {
+            sample.push_back(block_ids[i]);
+            continue;
+        }
+        size_t j = std::uniform_int_distribution<size_t>(0, i)(random);
+        if (j < sample_blocks)
+            sample[j] = block_ids[i];
+    }
+    std::sort(sample.begin(), sample.end());
+
+    std::shared_ptr<const Snapshot> snapshot = Transaction::snapshot();
+    size_t n_columns = stats->columns.size();
+    std::vector<std::vector<int32_t>> values(n_columns);
+    size_t sampled_rows = 0;
+    Arena arena;
+    ValueDict row;
+    for (auto const &block_id : sample)
+    {
+        SlottedPage *block = table.file.get(block_id, arena);
+        block->for_each_record(*snapshot, [&](RecordID, RecordView record) {
+            table.unmarshal(record, row);
+            sampled_rows++;
+            for (size_t i = 0; i < n_columns; i++)
+            {
+                const Value &value = row[stats->column_names[i]];
+                stats->columns[i].sketch.add(value);
+                if (stats->columns[i].data_type == ColumnAttribute::INT && !value.is_null)
+                    values[i].push_back(value.n);
+            }
+        });
+        arena.reset();
+    }
+
+    double scale = sample.empty() ? 0 : (double)block_ids.size() / (double)sample.size();
+    stats->row_count = std::round((double)sampled_rows * scale);
+    stats->block_count = block_ids.size();
+    stats->sampled_blocks = sample.size();
+    for (size_t i = 0; i < n_columns; i++)
+    {
+        stats->columns[i].sketched_rows = (double)sampled_rows;
+        if (stats->columns[i].data_type == ColumnAttribute::INT)
+            stats->columns[i].histogram = EquiDepthHistogram(values[i], scale);
+    }
+    return stats;
+}
+
+void TableStats::add_row(const ValueDict &row, BlockID block_id)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (size_t i = 0; i < columns.size(); i++)
+    {
+        auto found = row.find(column_names[i]);
+        if (found == row.end())
+            continue;
+        columns[i].sketch.add(found->second);
+        columns[i].sketched_rows++;
+        if (columns[i].data_type == ColumnAttribute::INT && !found->second.is_null)
+            columns[i].histogram.add(found->second.n);
+    }
+    row_count++;
+    block_count = std::max(block_count, (size_t)block_id);
+    changes++;
+}
+
+void TableStats::count_rows(int64_t delta)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    row_count = std::max(row_count + (double)delta, 0.0);
+    changes += (size_t)std::abs(delta);
+}
+
+size_t TableStats::get_row_count() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return (size_t)row_count;
+}
+
+size_t TableStats::get_block_count() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return block_count;
+}
+
+size_t TableStats::get_changes() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return changes;
+}
+
+void TableStats::clear_changes(size_t saved)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    changes -= std::min(changes, saved);
+}
+
+int TableStats::column_of(const Identifier &column_name) const
+{
+    auto it = std::find(column_names.begin(), column_names.end(), column_name);
+    return it == column_names.end() ? -1 : (int)(it - column_names.begin());
+}
+
+double TableStats::distinct_values(const Identifier &column_name) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    int column = column_of(column_name);
+    return column < 0 ? 0 : distinct_values((size_t)column);
+}
+
+// The sketch counts the distinct values among the rows it has seen. If that is nearly all
+// of them, the column looks unique, and the rest of the table is assumed to hold as many
+// new values again, in proportion; otherwise the sample is taken to have met every value.
+double TableStats::distinct_values(size_t column) const
+{
+    const ColumnStats &stats = columns[column];
+    if (stats.sketched_rows <= 0 || row_count <= 0)
+        return 0;
+    double distinct = std::min(stats.sketch.estimate(), stats.sketched_rows);
+    if (stats.sketched_rows < row_count && distinct >= 0.9 * stats.sketched_rows)
+        distinct *= row_count / stats.sketched_rows;
+    return std::max(1.0, std::min(distinct, row_count));
+}
+
+double TableStats::fraction_equal(const Identifier &column_name, const Value &value) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    int column = column_of(column_name);
+    if (column < 0)
+        return 1;
+    if (value.is_null)
+        return 0;
+    double distinct = distinct_values((size_t)column);
+    const ColumnStats &stats = columns[column];
+    if (stats.data_type == ColumnAttribute::INT && value.data_type == ColumnAttribute::INT &&
+        !stats.histogram.empty())
+        return stats.histogram.fraction_equal(value.n, distinct);
+    return distinct >= 1 ? 1 / distinct : 1;
+}
+
+double TableStats::fraction_less(const Identifier &column_name, const Value &value, bool or_equal) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    int column = column_of(column_name);
+    if (column < 0 || value.is_null || value.data_type != ColumnAttribute::INT ||
+        columns[column].histogram.empty())
+        return -1;
+    return columns[column].histogram.fraction_less(value.n, or_equal);
+}
+
+std::vector<ValueDict> TableStats::to_rows(const Identifier &table_name) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<ValueDict> rows;
+    for (size_t i = 0; i < columns.size(); i++)
+    {
+        ValueDict row;
+        row["table_name"] = Value(table_name);
+        row["column_name"] = Value(column_names[i]);
+        row["row_count"] = Value((int32_t)std::min(row_count, (double)INT32_MAX));
+        row["block_count"] = Value((int32_t)std::min(block_count, (size_t)INT32_MAX));
+        row["sketched_rows"] = Value((int32_t)std::min(columns[i].sketched_rows, (double)INT32_MAX));
+        row["sketch"] = Value(columns[i].sketch.to_string());
+        row["histogram"] = Value(columns[i].histogram.to_string());
+        rows.push_back(row);
+    }
+    return rows;
+}
+
+void TableStats::load_row(const ValueDict &row)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    int column = column_of(row.at("column_name").s);
+    if (column < 0)
+        return;  // a column the table no longer has
+    row_count = row.at("row_count").n;
+    block_count = (size_t)row.at("block_count").n;
+    ColumnStats &stats = columns[column];
+    stats.sketched_rows = row.at("sketched_rows").n;
+    stats.sketch = HyperLogLog::from_string(row.at("sketch").s);
+    if (stats.data_type == ColumnAttribute::INT)
+        stats.histogram = EquiDepthHistogram::from_string(row.at("histogram").s);
+}
+
+//------------------------tests----------------------------------------------
+
+static bool near(double actual, double expected, double tolerance)
+{
+    return std::fabs(actual - expected) <= tolerance * std::max(std::fabs(expected), 1.0);
+}
+
+// Sketches count small and large cardinalities within a few percent, merge, and survive
+// being written out.
+static bool test_hyperloglog()
+{
+    HyperLogLog small, large, evens, odds;
+    for (int32_t i = 0; i < 10000; i++)
+    {
+        small.add(Value(i % 100));
+        large.add(Value(i * 7));
+        (i % 2 == 0 ? evens : odds).add(Value(std::to_string(i)));
+    }
+    for (int32_t i = 10000; i < 200000; i++)
+        large.add(Value(i * 7));
+    HyperLogLog all = evens;
+    all.merge(odds);
+    bool ok = near(small.estimate(), 100, 0.1) && near(large.estimate(), 200000, 0.1) &&
+              near(all.estimate(), 10000, 0.1) && HyperLogLog::from_string(large.to_string()) == large;
+    if (!ok)
+    {
+        std::cout << "hyperloglog: " << small.estimate() << " of 100, " << large.estimate() << " of 200000, "
+                  << all.estimate() << " of 10000" << std::endl;
+        return false;
+    }
+    std::cout << "hyperloglog ok (" << (size_t)large.estimate() << " of 200000)" << std::endl;
+    return true;
+}
+
+// Buckets hold equal shares of a sample, so range fractions come out right for skewed data
+// and a value that fills buckets by itself is seen to be frequent.
+static bool test_histogram()
+{
+    std::vector<int32_t> values;
+    for (int32_t i = 0; i < 1000; i++)
+        values.push_back(i % 2 == 0 ? 7 : i * 10);  // half are 7, the rest spread to 10000
+    EquiDepthHistogram histogram(values, 10);
+    bool ok = near(histogram.rows(), 10000, 0.001) && near(histogram.fraction_equal(7, 500), 0.5, 0.1) &&
+              near(histogram.fraction_less(5000, false), 0.75, 0.05) && histogram.fraction_less(0, false) == 0 &&
+              histogram.fraction_less(20000, true) == 1 && histogram.fraction_equal(-5, 500) == 0;
+    EquiDepthHistogram copy = EquiDepthHistogram::from_string(histogram.to_string());
+    ok = ok && copy.to_string() == histogram.to_string() && copy.get_buckets().size() == EquiDepthHistogram::BUCKETS;
+    copy.add(20000);
+    copy.add(-1);
+    ok = ok && copy.get_buckets().back().high == 20000 && copy.get_buckets().front().low == -1 &&
+         near(copy.rows(), 10002, 0.001);
+    if (!ok)
+    {
+        std::cout << "histogram: " << histogram.to_string() << std::endl;
+        return false;
+    }
+    std::cout << "equi-depth histogram ok" << std::endl;
+    return true;
+}
+
+// A sample of a table's blocks estimates its size and its columns' values; inserts and
+// deletes keep the estimates up, and the statistics survive being written out.
+static bool test_analyze()
+{
+    const int32_t ROWS = 20000;
+    ColumnNames column_names = {"id", "grp", "name"};
+    ColumnAttributes column_attributes = {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::INT),
+                                          ColumnAttribute(ColumnAttribute::TEXT)};
+    HeapTable table("_test_stats_cpp", column_names, column_attributes);
+    table.create_if_not_exists();
+    ValueDict row;
+    for (int32_t i = 0; i < ROWS; i++)
+    {
+        row["id"] = Value(i);
+        row["grp"] = Value(i % 50);
+        row["name"] = Value("name " + std::to_string(i % 1000) + std::string(40, 'n'));
+        table.insert(&row);
+    }
+    std::shared_ptr<TableStats> stats = TableStats::analyze(table, 50);
+    bool ok = stats->get_sampled_blocks() == 50 && stats->get_block_count() > 100 &&
+              near((double)stats->get_row_count(), ROWS, 0.1) && near(stats->distinct_values("id"), ROWS, 0.2) &&
+              near(stats->distinct_values("grp"), 50, 0.1) && near(stats->distinct_values("name"), 1000, 0.15) &&
+              std::fabs(stats->fraction_less("id", Value(ROWS / 4), false) - 0.25) < 0.05 &&
+              std::fabs(stats->fraction_equal("grp", Value(3)) - 0.02) < 0.005 &&
+              stats->fraction_less("name", Value(1), false) < 0;
+    if (!ok)
+    {
+        std::cout << "analyze: " << stats->get_row_count() << " rows in " << stats->get_block_count() << " blocks, "
+                  << stats->distinct_values("id") << " ids, " << stats->distinct_values("grp") << " groups, "
+                  << stats->distinct_values("name") << " names, " << stats->fraction_less("id", Value(ROWS / 4), false)
+                  << " below " << ROWS / 4 << std::endl;
+        table.drop();
+        return false;
+    }
+    std::cout << "analyze ok (" << stats->get_row_count() << " rows, " << (size_t)stats->distinct_values("id")
+              << " ids, " << (size_t)stats->distinct_values("grp") << " groups)" << std::endl;
+
+    size_t before = stats->get_row_count();
+    table.set_stats(stats);
+    for (int32_t i = ROWS; i < ROWS + 1000; i++)
+    {
+        row["id"] = Value(i);
+        table.insert(&row);
+    }
+    Handles handles = table.select();
+    for (size_t i = 0; i < 10; i++)
+        table.del(handles[i]);
+    {
+        Transaction transaction;
+        table.insert(&row);
+        transaction.abort();
+    }
+    ok = stats->get_row_count() == before + 990 && stats->get_changes() == 1012 &&
+         table.estimated_row_count() == before + 990 && stats->fraction_less("id", Value(ROWS + 500), false) > 0.9;
+    TableStats copy(column_names, column_attributes);
+    for (auto const &stats_row : stats->to_rows("_test_stats_cpp"))
+        copy.load_row(stats_row);
+    ok = ok && copy.get_row_count() == stats->get_row_count() && copy.get_block_count() == stats->get_block_count() &&
+         near(copy.distinct_values("name"), stats->distinct_values("name"), 0.001) &&
+         std::fabs(copy.fraction_less("id", Value(ROWS / 2), true) - stats->fraction_less("id", Value(ROWS / 2), true)) < 0.01;
+    table.drop();
+    if (!ok)
+    {
+        std::cout << "incremental statistics: " << stats->get_row_count() << " rows (from " << before << "), "
+                  << stats->get_changes() << " changes" << std::endl;
+        return false;
+    }
+    std::cout << "incremental statistics ok" << std::endl;
+    return true;
+}
+
+// test function -- returns true if all tests pass
+bool test_table_stats()
+{
+    std::cout << "\nTesting TableStats...." << std::endl;
+    return test_hyperloglog() && test_histogram() && test_analyze();
+}
@@ -0,0 +1,642 @@
+/**
+ * Implementation of the transactions and group commit declared in transactions.h.
+ */
+
+#include "transactions.h"
+#include "heap_storage.h"
+#include "Metrics.h"
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+#include <set>
+
+GroupCommit *Transaction::group_commit = nullptr;
+const Stamp Snapshot::FROZEN;
+
+// the calling thread's outermost Transaction
+static thread_local Transaction *current_transaction = nullptr;
+
+// Stamps in use: handed out, in progress, and the oldest each live snapshot can see past.
+static std::mutex stamps_lock;
+static Stamp next_stamp = (Stamp)std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+static std::set<Stamp> active_stamps;
+static std::multiset<Stamp> snapshot_xmins;
+
+// The high-water mark of the stamps handed out, kept on disk (record 1 of _stamps.db) so
+// that a clock stepped back between runs can't start the stamps below ones already in
+// records. Stamps are reserved STAMP_RESERVATION at a time, so the mark is rarely written.
+static const Stamp STAMP_RESERVATION = 1 << 20;
+static const char *STAMPS_FILE = "_stamps.db";
+static Db *stamps_db = nullptr;  // open for the life of the process
+static Stamp reserved_stamps = 0;  // every stamp handed out is below this, on disk as well
+
+// Moves next_stamp past the mark on disk, the first time stamps are used after the
+// environment is open. Called with stamps_lock held.
+static void load_stamps()
+{
+    if (stamps_db != nullptr || _DB_ENV == nullptr)
+        return;
+    u_int32_t env_flags = 0;
+    _DB_ENV->get_open_flags(&env_flags);
+    Db *db = new Db(_DB_ENV, 0);
+    try
+    {
+        db->open(nullptr, STAMPS_FILE, nullptr, DB_RECNO, DB_CREATE | (env_flags & DB_THREAD), 0644);
+    }
+    catch (DbException &)
+    {
+        delete db;
+        throw;
+    }
+    db_recno_t recno = 1;
+    Dbt key(&recno, sizeof(recno));
+    Stamp persisted = 0;
+    Dbt data(&persisted, sizeof(persisted));
+    data.set_flags(DB_DBT_USERMEM);
+    data.set_ulen(sizeof(persisted));
+    if (db->get(nullptr, &key, &data, 0) == 0 && data.get_size() == sizeof(persisted))
+        next_stamp = std::max(next_stamp, persisted);
+    stamps_db = db;
+}
+
+// Makes sure the mark on disk is past stamp before it is handed out. The mark's write is
+// logged ahead of any record carrying the stamp, so it is recovered whenever they are.
+// Called with stamps_lock held.
+static void reserve_stamp(Stamp stamp)
+{
+    load_stamps();
+    if (stamps_db == nullptr || stamp < reserved_stamps)
+        return;
+    Stamp mark = stamp + STAMP_RESERVATION;
+    db_recno_t recno = 1;
+    Dbt key(&recno, sizeof(recno));
+    Dbt data(&mark, sizeof(mark));
+    stamps_db->put(nullptr, &key, &data, 0);
+    reserved_stamps = mark;
+}
+
+//------------------------GroupCommit----------------------------------------------
+
+GroupCommit::GroupCommit(DbEnv *env, std::chrono::microseconds delay)
+    : env(env), delay_us(delay.count()), requested(0), flushed(0), flushes(0), stopping(false),
+      next_flush(std::make_shared<Flush>())
+{
+    flusher = std::thread(&GroupCommit::run, this);
+}
+
+GroupCommit::~GroupCommit()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    work.notify_one();
+    flusher.join();
+    try
+    {
+        env->txn_checkpoint(0, 0, 0);  // so recovery on the next open has little log to read
+    }
+    catch (DbException &e)
+    {
+        std::cerr << "(checkpoint failed: " << e.what() << ")" << std::endl;
+    }
+}
+
+void GroupCommit::wait_durable()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    ++requested;
+    std::shared_ptr<Flush> flush = next_flush;
+    work.notify_one();
+    done.wait(guard, [&flush] { return flush->done; });
+    if (!flush->error.empty())
+        throw DbRelationError("could not flush the log: " + flush->error);
+}
+
+uint64_t GroupCommit::get_commits() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return requested;
+}
+
+uint64_t GroupCommit::get_flushes() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return flushes;
+}
+
+// The flusher: waits for a commit, holds off for the delay while more arrive, then flushes
+// the log once for every commit that has arrived by then.
+void GroupCommit::run()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (true)
+    {
+        work.wait(guard, [this] { return stopping || requested > flushed; });
+        if (requested == flushed)
+            return;  // stopping, and nobody is waiting
+        std::chrono::microseconds delay(delay_us.load());
+        if (delay.count() > 0 && !stopping)
+            work.wait_for(guard, delay, [this] { return stopping; });
+
+        uint64_t target = requested;
+        std::shared_ptr<Flush> flush = next_flush;
+        next_flush = std::make_shared<Flush>();
+        guard.unlock();
+        std::string failure;
+        try
+        {
+            flush_log();
+        }
+        catch (DbException &e)
+        {
+            failure = e.what();
+        }
+        METRIC_INC(LOG_FLUSHES);
+        guard.lock();
+        flush->error = failure;
+        flush->done = true;
+        flushed = target;
+        flushes++;
+        done.notify_all();
+    }
+}
+
+void GroupCommit::flush_log()
+{
+    env->log_flush(nullptr);
+}
+
+//------------------------Snapshot----------------------------------------------
+
+Snapshot::Snapshot(Stamp own) : own(own)
+{
+    std::lock_guard<std::mutex> guard(stamps_lock);
+    load_stamps();
+    xmax = next_stamp;
+    active.assign(active_stamps.begin(), active_stamps.end());
+    xmin = active.empty() ? xmax : active.front();
+    snapshot_xmins.insert(xmin);
+}
+
+Snapshot::~Snapshot()
+{
+    std::lock_guard<std::mutex> guard(stamps_lock);
+    snapshot_xmins.erase(snapshot_xmins.find(xmin));
+}
+
+bool Snapshot::sees(Stamp begin, Stamp end) const
+{
+    return committed(begin) && (end == FROZEN || !committed(end));
+}
+
+// Whether the stamp's changes are part of the snapshot. A stamp on a version is never an
+// aborted transaction's: Berkeley DB rolls those versions back before the stamp retires.
+bool Snapshot::committed(Stamp stamp) const
+{
+    if (stamp == FROZEN || stamp == own)
+        return true;
+    return stamp < xmax && !std::binary_search(active.begin(), active.end(), stamp);
+}
+
+Stamp Snapshot::horizon()
+{
+    std::lock_guard<std::mutex> guard(stamps_lock);
+    load_stamps();
+    Stamp oldest = next_stamp;
+    if (!active_stamps.empty())
+        oldest = std::min(oldest, *active_stamps.begin());
+    if (!snapshot_xmins.empty())
+        oldest = std::min(oldest, *snapshot_xmins.begin());
+    return oldest;
+}
+
+//------------------------Transaction----------------------------------------------
+
+Transaction::Transaction() : txn(nullptr), own_stamp(Snapshot::FROZEN), finished(false)
+{
+    if (current_transaction != nullptr)
+        return;  // joining the thread's current transaction
+    {
+        std::lock_guard<std::mutex> guard(stamps_lock);
+        reserve_stamp(next_stamp);
+        own_stamp = next_stamp++;
+        active_stamps.insert(own_stamp);
+    }
+    current_transaction = this;
+    if (group_commit == nullptr)
+        return;  // stamped, but not transactional
+    try
+    {
+        _DB_ENV->txn_begin(nullptr, &txn, 0);
+    }
+    catch (...)
+    {
+        end();
+        throw;
+    }
+}
+
+Transaction::~Transaction()
+{
+    if (finished)
+        return;
+    try
+    {
+        abort();
+    }
+    catch (DbException &e)
+    {
+        std::cerr << "(transaction abort failed: " << e.what() << ")" << std::endl;
+    }
+}
+
+void Transaction::commit(bool durable)
+{
+    finished = true;
+    if (own_stamp == Snapshot::FROZEN)
+        return;  // joined
+    abort_actions.clear();
+    if (txn == nullptr)
+    {
+        end();
+        return;
+    }
+    METRIC_TIME(COMMIT_LATENCY);
+    DbTxn *committing = txn;
+    txn = nullptr;
+    try
+    {
+        committing->commit(DB_TXN_NOSYNC);  // logged, but the log flush is left to the group
+    }
+    catch (...)
+    {
+        end();
+        throw;
+    }
+    METRIC_INC(COMMITS);
+    if (durable)
+    {
+        try
+        {
+            group_commit->wait_durable();
+        }
+        catch (...)
+        {
+            end();  // committed all the same, just not known to be on disk
+            throw;
+        }
+    }
+    end();  // only now can new snapshots see our versions
+}
+
+void Transaction::abort()
+{
+    finished = true;
+    if (own_stamp == Snapshot::FROZEN)
+    {
+        // a joined scope aborts the whole transaction when the outer one unwinds
+        return;
+    }
+    if (txn != nullptr)
+    {
+        DbTxn *aborting = txn;
+        txn = nullptr;
+        try
+        {
+            aborting->abort();  // our versions are gone before our stamp retires
+        }
+        catch (...)
+        {
+            end();
+            throw;
+        }
+        METRIC_INC(ABORTS);
+    }
+    for (auto it = abort_actions.rbegin(); it != abort_actions.rend(); ++it)
+        (*it)();
+    abort_actions.clear();
+    end();
+}
+
+// Stops being the thread's current transaction and retires the stamp.
+void Transaction::end()
+{
+    current_transaction = nullptr;
+    own_snapshot.reset();
+    std::lock_guard<std::mutex> guard(stamps_lock);
+    active_stamps.erase(own_stamp);
+}
+
+DbTxn *Transaction::current()
+{
+    return current_transaction != nullptr ? current_transaction->txn : nullptr;
+}
+
+Stamp Transaction::stamp()
+{
+    return current_transaction != nullptr ? current_transaction->own_stamp : Snapshot::FROZEN;
+}
+
+std::shared_ptr<const Snapshot> Transaction::snapshot()
+{
+    if (current_transaction == nullptr)
+        return std::make_shared<Snapshot>();
+    if (!current_transaction->own_snapshot)
+        current_transaction->own_snapshot = std::make_shared<Snapshot>(current_transaction->own_stamp);
+    return current_transaction->own_snapshot;
+}
+
+void Transaction::on_abort(std::function<void()> action)
+{
+    if (current_transaction != nullptr)
+        current_transaction->abort_actions.push_back(action);
+}
+
+void Transaction::enable(GroupCommit *group_commit)
+{
+    Transaction::group_commit = group_commit;
+}
+
+void Transaction::sync()
+{
+    if (group_commit != nullptr)
+        group_commit->wait_durable();
+}
+
+//------------------------tests----------------------------------------------
+
+static size_t count_rows(HeapTable &table)
+{
+    return table.select().size();
+}
+
+static void insert_rows(HeapTable &table, int from, int to)
+{
+    for (int i = from; i < to; i++)
+    {
+        ValueDict row;
+        row["a"] = Value(i);
+        row["b"] = Value(std::string(100, 'x'));
+        table.insert(&row);
+    }
+}
+
+// A group commit whose first few flushes fail.
+class FailingGroupCommit : public GroupCommit {
+public:
+    FailingGroupCommit(int failures) : GroupCommit(_DB_ENV), failures(failures) {}
+
+protected:
+    int failures;
+
+    virtual void flush_log()
+    {
+        if (failures-- > 0)
+            throw DbException("no space left on device", ENOSPC);
+        GroupCommit::flush_log();
+    }
+};
+
+// test function -- returns true if all tests pass
+bool test_transactions()
+{
+    std::cout << "\nTesting transactions...." << std::endl;
+    if (!Transaction::enabled())
+    {
+        std::cout << "transactions not enabled, skipped" << std::endl;
+        return true;
+    }
+
+    ColumnNames column_names = {"a", "b"};
+    ColumnAttributes column_attributes = {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)};
+    HeapTable table("_test_transactions_cpp", column_names, column_attributes);
+    table.create_if_not_exists();
+
+    // committed rows stay, including ones in blocks allocated by the transaction
+    {
+        Transaction transaction;
+        insert_rows(table, 0, 100);
+        transaction.commit();
+    }
+    if (count_rows(table) != 100)
+    {
+        std::cout << "commit lost rows: " << count_rows(table) << std::endl;
+        return false;
+    }
+
+    // an abandoned transaction (here, with a joined inner scope) leaves nothing behind
+    {
+        Transaction outer;
+        {
+            Transaction inner;
+            insert_rows(table, 100, 300);
+            inner.commit();  // joined: only the outer scope decides
+        }
+        if (count_rows(table) != 300)
+        {
+            std::cout << "transaction can't see its own rows: " << count_rows(table) << std::endl;
+            return false;
+        }
+    }
+    if (count_rows(table) != 100)
+    {
+        std::cout << "abort left rows: " << count_rows(table) << std::endl;
+        return false;
+    }
+
+    // and the file is usable afterwards (the blocks the transaction allocated read as empty)
+    insert_rows(table, 100, 150);
+    if (count_rows(table) != 150)
+    {
+        std::cout << "insert after abort: " << count_rows(table) << std::endl;
+        return false;
+    }
+    table.drop();
+    std::cout << "commit and abort ok" << std::endl;
+
+    // the stamp high-water mark on disk is past every stamp handed out
+    Stamp stamp;
+    {
+        Transaction transaction;
+        stamp = Transaction::stamp();
+        transaction.commit();
+    }
+    Db stamps(_DB_ENV, 0);
+    stamps.open(nullptr, STAMPS_FILE, nullptr, DB_RECNO, 0, 0644);
+    db_recno_t recno = 1;
+    Dbt key(&recno, sizeof(recno));
+    Stamp mark = 0;
+    Dbt data(&mark, sizeof(mark));
+    data.set_flags(DB_DBT_USERMEM);
+    data.set_ulen(sizeof(mark));
+    int status = stamps.get(nullptr, &key, &data, 0);
+    stamps.close(0);
+    if (status != 0 || mark <= stamp)
+    {
+        std::cout << "stamp high-water mark " << mark << " not past stamp " << stamp << std::endl;
+        return false;
+    }
+    std::cout << "stamp high-water mark ok" << std::endl;
+
+    // concurrent commits share flushes
+    GroupCommit group(_DB_ENV, std::chrono::microseconds(2000));
+    const int THREADS = 8, COMMITS = 20;
+    std::vector<std::thread> committers;
+    for (int t = 0; t < THREADS; t++)
+        committers.push_back(std::thread([&group] {
+            for (int i = 0; i < COMMITS; i++)
+                group.wait_durable();
+        }));
+    for (auto &committer : committers)
+        committer.join();
+    if (group.get_commits() != THREADS * COMMITS || group.get_flushes() >= group.get_commits())
+    {
+        std::cout << "group commit: " << group.get_commits() << " commits, " << group.get_flushes() << " flushes"
+                  << std::endl;
+        return false;
+    }
+    std::cout << "group commit ok (" << group.get_commits() << " commits in " << group.get_flushes() << " flushes)"
+              << std::endl;
+
+    // a failed flush fails only the commits that joined it
+    FailingGroupCommit failing(1);
+    bool failed = false;
+    try
+    {
+        failing.wait_durable();
+    }
+    catch (DbRelationError &)
+    {
+        failed = true;
+    }
+    try
+    {
+        failing.wait_durable();
+    }
+    catch (DbRelationError &e)
+    {
+        std::cout << "commit after a failed flush: " << e.what() << std::endl;
+        return false;
+    }
+    if (!failed)
+    {
+        std::cout << "failed flush not reported" << std::endl;
+        return false;
+    }
+    std::cout << "failed flush ok" << std::endl;
+    return true;
+}
+
+// Counts the rows a scan yields, checking that every "a" is below limit.
+static size_t count_scanned(DbRelationScan *scan, int limit)
+{
+    size_t count = 0;
+    Handle handle;
+    ValueDict row;
+    while (scan->next(handle, row))
+        if (row["a"].n < limit && row["b"].s == std::string(100, 'x'))
+            count++;
+    return count;
+}
+
+// test function -- returns true if all tests pass
+bool test_mvcc()
+{
+    std::cout << "\nTesting MVCC...." << std::endl;
+    ColumnNames column_names = {"a", "b"};
+    ColumnAttributes column_attributes = {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)};
+    HeapTable table("_test_mvcc_cpp", column_names, column_attributes);
+    table.create_if_not_exists();
+    insert_rows(table, 0, 50);
+
+    // a scan keeps seeing its snapshot while rows are inserted, updated and deleted
+    std::unique_ptr<DbRelationScan> scan = table.scan();
+    Handles handles = table.select();
+    insert_rows(table, 50, 60);
+    for (size_t i = 0; i < 5; i++)
+    {
+        ValueDict new_values;
+        new_values["b"] = Value("changed");
+        table.update(handles[i], &new_values);
+        table.del(handles[i + 5]);
+    }
+    size_t seen = count_scanned(scan.get(), 50);
+    scan.reset();
+    if (seen != 50 || count_rows(table) != 55)
+    {
+        std::cout << "snapshot scan saw " << seen << " rows, now " << count_rows(table) << std::endl;
+        return false;
+    }
+
+    // an old version can't be updated again: the update that ended it won
+    bool conflict = false;
+    try
+    {
+        ValueDict new_values;
+        new_values["b"] = Value("lost");
+        table.update(handles[0], &new_values);
+    }
+    catch (DbRelationError &)
+    {
+        conflict = true;
+    }
+    if (!conflict)
+    {
+        std::cout << "updated an ended version" << std::endl;
+        return false;
+    }
+    std::cout << "snapshot scan ok" << std::endl;
+
+    // rows of a transaction still in progress are invisible, and reading doesn't wait for it
+    std::mutex lock;
+    std::condition_variable changed;
+    int step = 0;
+    std::thread writer([&] {
+        Transaction transaction;
+        insert_rows(table, 100, 110);
+        std::unique_lock<std::mutex> guard(lock);
+        step = 1;
+        changed.notify_all();
+        changed.wait(guard, [&] { return step == 2; });
+        guard.unlock();
+        transaction.commit();
+    });
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [&] { return step == 1; });
+    }
+    size_t during = count_rows(table);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        step = 2;
+        changed.notify_all();
+    }
+    writer.join();
+    if (during != 55 || count_rows(table) != 65)
+    {
+        std::cout << "uncommitted rows: saw " << during << ", then " << count_rows(table) << std::endl;
+        return false;
+    }
+    std::cout << "uncommitted invisible ok" << std::endl;
+
+    // versions a live snapshot might see aren't reclaimed; once it's gone they are
+    std::shared_ptr<const Snapshot> old = Transaction::snapshot();
+    table.collect_garbage();  // what nobody can see any more
+    table.select(nullptr, handles);
+    for (size_t i = 0; i < 5; i++)
+        table.del(handles[i]);
+    size_t kept = table.collect_garbage();
+    old.reset();
+    size_t reclaimed = table.collect_garbage();
+    if (kept != 0 || reclaimed != 5 || table.collect_garbage() != 0 || count_rows(table) != 60)
+    {
+        std::cout << "garbage collection: " << kept << " with a snapshot, " << reclaimed << " without, "
+                  << count_rows(table) << " rows" << std::endl;
+        return false;
+    }
+    table.drop();
+    std::cout << "garbage collection ok" << std::endl;
+    return true;
+}
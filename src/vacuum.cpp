@@ -0,0 +1,205 @@
+/**
+ * Implementation of the background vacuum declared in vacuum.h.
+ */
+
+#include "vacuum.h"
+#include <pthread.h>
+#include <sched.h>
+#include <iostream>
+#include <map>
+#include <set>
+
+//------------------------BackgroundVacuum----------------------------------------------
+
+BackgroundVacuum::BackgroundVacuum(Tables &tables, std::chrono::milliseconds interval, size_t threshold,
+                                   std::chrono::microseconds pause)
+    : tables(tables), interval(interval), threshold(threshold), pause(pause), stopping(false), woken(false),
+      vacuums(0)
+{
+    thread = std::thread(&BackgroundVacuum::run, this);
+}
+
+BackgroundVacuum::~BackgroundVacuum()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    work.notify_one();
+    thread.join();
+}
+
+void BackgroundVacuum::wake()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        woken = true;
+    }
+    work.notify_one();
+}
+
+uint64_t BackgroundVacuum::get_vacuums() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return vacuums;
+}
+
+// Every interval (or when woken), vacuums each open table whose dead versions have grown by
+// the threshold since it was last vacuumed. Versions an old snapshot still sees survive a
+// vacuum, so a table isn't vacuumed again just because they are still there.
+void BackgroundVacuum::run()
+{
+    // only take the CPU when nothing else wants it
+    sched_param param;
+    param.sched_priority = 0;
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+    std::map<HeapTable *, size_t> left;  // dead versions a table had after its last vacuum
+    std::unique_lock<std::mutex> guard(lock);
+    while (true)
+    {
+        work.wait_for(guard, interval, [this] { return stopping || woken; });
+        if (stopping)
+            return;
+        woken = false;
+        guard.unlock();
+        uint64_t vacuumed = 0;
+        for (auto relation : tables.get_open_tables())
+        {
+            HeapTable *table = dynamic_cast<HeapTable *>(relation);
+            if (table == nullptr || table->get_dead_versions() < left[table] + threshold)
+                continue;
+            try
+            {
+                table->vacuum(pause);
+                vacuumed++;
+            }
+            catch (std::exception &e)
+            {
+                std::cerr << "(background vacuum of " << table->get_table_name() << " failed: " << e.what() << ")"
+                          << std::endl;
+            }
+            left[table] = table->get_dead_versions();
+        }
+        guard.lock();
+        vacuums += vacuumed;
+    }
+}
+
+//------------------------tests----------------------------------------------
+
+// Vacuum reclaims, merges and truncates, but only what no snapshot needs.
+static bool test_heap_table_vacuum()
+{
+    const int ROWS = 200;
+    ColumnNames column_names = {"a", "b"};
+    ColumnAttributes column_attributes = {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)};
+    HeapTable table("_test_vacuum_cpp", column_names, column_attributes);
+    table.create_if_not_exists();
+    ValueDict row;
+    Handles handles;
+    for (int i = 0; i < ROWS; i++)
+    {
+        row["a"] = Value(i);
+        row["b"] = Value(std::string(100, 'v'));
+        handles.push_back(table.insert(&row));
+    }
+
+    // all but every tenth row deleted, while a scan from before the deletes is still open
+    std::unique_ptr<DbRelationScan> scan = table.scan();
+    for (int i = 0; i < ROWS; i++)
+        if (i % 10 != 0)
+            table.del(handles[i]);
+    VacuumStats stats = table.vacuum();
+    size_t scanned = 0;
+    Handle handle;
+    while (scan->next(handle, row))
+        scanned++;
+    if (stats.versions_reclaimed != 0 || stats.rows_moved != 0 || scanned != ROWS)
+    {
+        std::cout << "vacuum under a snapshot: " << stats.versions_reclaimed << " reclaimed, " << stats.rows_moved
+                  << " moved, " << scanned << " scanned" << std::endl;
+        table.drop();
+        return false;
+    }
+    scan.reset();
+    std::cout << "vacuum under a snapshot ok" << std::endl;
+
+    // the deleted versions, then the originals of the rows moved out of the sparse blocks
+    stats = table.vacuum();
+    std::set<int> left;
+    for (auto const &h : table.select())
+        left.insert(table.project(h)["a"].n);
+    bool ok = stats.rows_moved > 0 && stats.versions_reclaimed == ROWS - ROWS / 10 + stats.rows_moved &&
+              stats.blocks_truncated > 0 && left.size() == ROWS / 10 && *left.begin() == 0 &&
+              *left.rbegin() == ROWS - 10 && table.get_dead_versions() == 0;
+    if (!ok)
+    {
+        std::cout << "vacuum: " << stats.versions_reclaimed << " reclaimed, " << stats.slots_freed << " slots, "
+                  << stats.rows_moved << " moved, " << stats.blocks_truncated << " truncated, " << left.size()
+                  << " rows left" << std::endl;
+        table.drop();
+        return false;
+    }
+
+    // the file grows again past where it was truncated
+    for (int i = 0; i < ROWS; i++)
+    {
+        row["a"] = Value(ROWS + i);
+        table.insert(&row);
+    }
+    ok = table.select().size() == (size_t)(ROWS + ROWS / 10);
+    table.drop();
+    if (!ok)
+        return false;
+    std::cout << "vacuum ok (" << stats.rows_moved << " rows moved, " << stats.blocks_truncated
+              << " blocks truncated)" << std::endl;
+    return true;
+}
+
+// The background vacuum finds a table with dead versions and vacuums it.
+static bool test_background_vacuum()
+{
+    const Identifier TABLE_NAME = "_test_vacuum_background";
+    const int ROWS = 50;
+    Tables tables;
+    ColumnNames column_names = {"a"};
+    ColumnAttributes column_attributes = {ColumnAttribute(ColumnAttribute::INT)};
+    tables.create_table(TABLE_NAME, column_names, column_attributes, true);
+    HeapTable &table = dynamic_cast<HeapTable &>(tables.get_table(TABLE_NAME));
+    ValueDict row, new_values;
+    for (int i = 0; i < ROWS; i++)
+    {
+        row["a"] = Value(i);
+        new_values["a"] = Value(-i);
+        table.update(table.insert(&row), &new_values);
+    }
+
+    bool ok;
+    {
+        BackgroundVacuum vacuum(tables, std::chrono::milliseconds(10), ROWS / 2, std::chrono::microseconds(0));
+        for (int waited = 0; vacuum.get_vacuums() == 0 && waited < 1000; waited++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        ok = vacuum.get_vacuums() > 0;
+    }
+    size_t dead = table.get_dead_versions();
+    size_t rows = table.select().size();
+    tables.drop_table(TABLE_NAME);
+    ColumnNames left_names;
+    ColumnAttributes left_attributes;
+    tables.get_columns(TABLE_NAME, left_names, left_attributes);
+    if (!ok || dead != 0 || rows != ROWS || tables.exists(TABLE_NAME) || !left_names.empty())
+    {
+        std::cout << "background vacuum: " << dead << " dead versions, " << rows << " rows" << std::endl;
+        return false;
+    }
+    std::cout << "background vacuum ok" << std::endl;
+    return true;
+}
+
+// test function -- returns true if all tests pass
+bool test_vacuum()
+{
+    std::cout << "\nTesting vacuum...." << std::endl;
+    return test_heap_table_vacuum() && test_background_vacuum();
+}
@@ -0,0 +1,638 @@
+/**
+ * @file workload.cpp
+ *
+ * Workload driver: replays a synthetic mix of operations against a HeapTable and reports
+ * throughput and latency per operation type. Built by "make workload".
+ *
+ * The table has an INT key column k followed by the columns given with -c (e.g.,
+ * "int,text:100,text:20"). It's loaded with -n rows, keys 0 to n-1. Clients then pick
+ * operations by the weights given with -m for -d seconds:
+ *     lookup  fetch the row with a key
+ *     scan    read up to -l rows (0 for the whole table)
+ *     insert  add a row for a deleted key, or else a new key (new keys aren't picked later)
+ *     update  change one non-key column of the row with a key
+ *     delete  delete the row with a key
+ * Keys are drawn from a Zipfian distribution with skew -z (0 for uniform) over the loaded
+ * keys, scrambled so the hot keys are spread through the table. Lookups, updates and
+ * deletes of a key that has already been deleted count as misses.
+ *
+ * Lookups go straight to the row's handle, as they would through an index. The clients
+ * share that key-to-handle map, so with several client threads (-t 1,4,8 runs each count
+ * in turn, reloading the table in between) every operation holds the workload's lock;
+ * latencies include the wait for it. (For the storage layer's own scaling, see the
+ * _mt benchmarks of sql5300_bench.)
+ *
+ * With -g, the environment is transactional and each operation commits durably. The
+ * commit is logged under the table's lock, but the wait for the log flush happens
+ * outside it, so the commits of concurrent clients share a flush; -g sets how long the
+ * flusher waits for more of them (see GroupCommit in transactions.h).
+ *
+ * Usage: sql5300_workload [-t threads] [-d seconds] [-n rows] [-c columns] [-m mix]
+ *                         [-z skew] [-l scan length] [-s seed] [-g commit delay usec]
+ *                         [-o text|csv] dbenvpath
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include "db_cxx.h"
+#include "heap_storage.h"
+#include "Metrics.h"
+#include "transactions.h"
+
+using namespace std;
+
+/*
+ * we allocate and initialize the _DB_ENV global
+ */
+DbEnv *_DB_ENV;
+
+enum OperationType {
+    OP_LOOKUP, OP_SCAN, OP_INSERT, OP_UPDATE, OP_DELETE, NUM_OPERATION_TYPES
+};
+
+static const char *OPERATION_NAMES[NUM_OPERATION_TYPES] = {"lookup", "scan", "insert", "update", "delete"};
+
+/**
+ * Zipfian ranks 0 to n-1 (rank 0 the most popular), after Gray et al., "Quickly
+ * Generating Billion-Record Synthetic Databases", as in YCSB.
+ */
+class ZipfianGenerator {
+public:
+    ZipfianGenerator(uint64_t n, double theta) : n(n), theta(theta)
+    {
+        if (theta <= 0)
+            return;
+        double zeta2 = zeta(2, theta);
+        zetan = zeta(n, theta);
+        alpha = 1.0 / (1.0 - theta);
+        eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+    }
+
+    // u is uniform in [0, 1).
+    uint64_t next(double u) const
+    {
+        if (theta <= 0)
+            return (uint64_t)(u * n);
+        double uz = u * zetan;
+        if (uz < 1.0)
+            return 0;
+        if (uz < 1.0 + pow(0.5, theta))
+            return n > 1 ? 1 : 0;
+        uint64_t rank = (uint64_t)(n * pow(eta * u - eta + 1, alpha));
+        return rank < n ? rank : n - 1;
+    }
+
+private:
+    uint64_t n;
+    double theta;
+    double zetan = 0, alpha = 0, eta = 0;
+
+    static double zeta(uint64_t n, double theta)
+    {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; i++)
+            sum += 1.0 / pow((double)i, theta);
+        return sum;
+    }
+};
+
+// Per-thread random numbers (xorshift64*).
+class Random {
+public:
+    explicit Random(uint64_t seed) : state(seed * 0x9E3779B97F4A7C15ull + 1) {}
+
+    uint64_t next()
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1Dull;
+    }
+
+    double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+
+private:
+    uint64_t state;
+};
+
+struct WorkloadConfig {
+    vector<size_t> thread_counts;
+    double seconds;
+    size_t rows;
+    ColumnNames column_names;
+    ColumnAttributes column_attributes;
+    vector<size_t> text_lengths;  // per column (0 for INT)
+    double mix[NUM_OPERATION_TYPES];
+    double skew;
+    size_t scan_length;
+    uint64_t seed;
+    long commit_delay;            // -1 if not transactional
+    string format;
+};
+
+/**
+ * The table under test and what the clients share: the handle of each key (an index, in
+ * effect). An operation on a key holds that key's lock (one of KEY_STRIPES) while it
+ * changes the table and the key's handle together; scans take no lock, and the storage
+ * engine handles the concurrency of the rest.
+ */
+class Workload {
+public:
+    Workload(const WorkloadConfig &config)
+        : config(config), keys(config.rows, config.skew), next_key(0) {}
+
+    // (Re)creates the table with config.rows rows.
+    void load()
+    {
+        // a dropped table can't be reopened, so each load gets a new HeapTable
+        HeapTable stale(TABLE_NAME, config.column_names, config.column_attributes);
+        stale.create_if_not_exists();
+        stale.drop();
+        table.reset(new HeapTable(TABLE_NAME, config.column_names, config.column_attributes));
+        table->create();
+        handles.clear();
+        live.clear();
+        deleted_keys.clear();
+        Random random(config.seed);
+        for (size_t key = 0; key < config.rows; key++)
+        {
+            ValueDict row = make_row((int32_t)key, random);
+            handles.push_back(table->insert(&row));
+            live.push_back(1);
+        }
+        next_key = (int32_t)config.rows;
+    }
+
+    void drop()
+    {
+        table->drop();
+        table.reset();
+    }
+
+    // Runs one client until the deadline, recording each operation's latency.
+    void client(size_t client_id, chrono::steady_clock::time_point deadline, LatencyHistogram *histograms,
+                uint64_t *misses)
+    {
+        Random random(config.seed + 1000003 * (client_id + 1));
+        double total_weight = 0;
+        for (double weight : config.mix)
+            total_weight += weight;
+
+        while (chrono::steady_clock::now() < deadline)
+        {
+            double pick = random.uniform() * total_weight;
+            int op = 0;
+            while (op < NUM_OPERATION_TYPES - 1 && pick >= config.mix[op])
+                pick -= config.mix[op++];
+            size_t key = pick_key(random);
+
+            auto start = chrono::steady_clock::now();
+            bool hit;
+            try
+            {
+                hit = run_operation((OperationType)op, key, random);
+            }
+            catch (DbRelationError &)
+            {
+                hit = false;  // e.g., an updated row that no longer fits in its block
+            }
+            catch (DbException &)
+            {
+                hit = false;  // e.g., chosen as a deadlock victim
+            }
+            auto elapsed = chrono::steady_clock::now() - start;
+            histograms[op].record((uint64_t)chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+            if (!hit)
+                misses[op]++;
+        }
+    }
+
+private:
+    static const char *const TABLE_NAME;
+
+    static const size_t KEY_STRIPES = 64;
+
+    const WorkloadConfig &config;
+    unique_ptr<HeapTable> table;
+    ZipfianGenerator keys;
+    mutex key_locks[KEY_STRIPES]; // key % KEY_STRIPES: for the key's handle and live flag
+    vector<Handle> handles;       // by key
+    vector<char> live;            // by key (not vector<bool>, whose elements share bytes)
+    mutex insert_lock;            // for the two below
+    vector<size_t> deleted_keys;  // to be inserted again
+    int32_t next_key;
+
+    mutex &key_lock(size_t key) { return key_locks[key % KEY_STRIPES]; }
+
+    // A loaded key, Zipfian by rank, with ranks scattered over the keys.
+    size_t pick_key(Random &random)
+    {
+        uint64_t rank = keys.next(random.uniform());
+        return (size_t)((rank * 2654435761ull + 12345) % config.rows);
+    }
+
+    ValueDict make_row(int32_t key, Random &random) const
+    {
+        ValueDict row;
+        row["k"] = Value(key);
+        for (size_t i = 1; i < config.column_names.size(); i++)
+            row[config.column_names[i]] = make_value(i, random);
+        return row;
+    }
+
+    Value make_value(size_t column, Random &random) const
+    {
+        if (config.text_lengths[column] == 0)
+            return Value((int32_t)(random.next() & 0x7fffffff));
+        return Value(string(config.text_lengths[column], (char)('a' + random.next() % 26)));
+    }
+
+    // Returns false for a miss (the key was deleted).
+    bool run_operation(OperationType op, size_t key, Random &random)
+    {
+        bool hit = apply_operation(op, key, random);
+        if (op == OP_INSERT || op == OP_UPDATE || op == OP_DELETE)
+            Transaction::sync();  // outside any lock, so other clients' commits can join the flush
+        return hit;
+    }
+
+    // Runs each operation in a transaction of its own; the bookkeeping changes only once it has
+    // committed (if it throws, the transaction rolls back and the bookkeeping stays as it was).
+    bool apply_operation(OperationType op, size_t key, Random &random)
+    {
+        switch (op)
+        {
+        case OP_LOOKUP:
+        {
+            lock_guard<mutex> guard(key_lock(key));
+            if (!live[key])
+                return false;
+            Transaction transaction;
+            table->project(handles[key]);
+            transaction.commit(false);
+            return true;
+        }
+        case OP_SCAN:
+        {
+            Transaction transaction;
+            std::unique_ptr<DbRelationScan> scan = table->scan();
+            Handle handle;
+            ValueDict row;
+            size_t count = 0;
+            while ((config.scan_length == 0 || count < config.scan_length) && scan->next(handle, row))
+                count++;
+            transaction.commit(false);
+            return true;
+        }
+        case OP_INSERT:
+            return insert(random);
+        case OP_UPDATE:
+        {
+            lock_guard<mutex> guard(key_lock(key));
+            if (!live[key])
+                return false;
+            if (config.column_names.size() == 1)
+                return true;  // nothing but the key
+            size_t column = 1 + random.next() % (config.column_names.size() - 1);
+            ValueDict new_values;
+            new_values[config.column_names[column]] = make_value(column, random);
+            Transaction transaction;
+            Handle handle = table->update(handles[key], &new_values);
+            transaction.commit(false);
+            handles[key] = handle;
+            return true;
+        }
+        case OP_DELETE:
+        {
+            {
+                lock_guard<mutex> guard(key_lock(key));
+                if (!live[key])
+                    return false;
+                Transaction transaction;
+                table->del(handles[key]);
+                transaction.commit(false);
+                live[key] = false;
+            }
+            lock_guard<mutex> guard(insert_lock);
+            deleted_keys.push_back(key);
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+    // Inserts a deleted key again if there is one, else a new key.
+    bool insert(Random &random)
+    {
+        size_t deleted_key = 0;
+        int32_t new_key = -1;
+        {
+            lock_guard<mutex> guard(insert_lock);
+            if (deleted_keys.empty())
+            {
+                new_key = next_key++;
+            }
+            else
+            {
+                deleted_key = deleted_keys.back();
+                deleted_keys.pop_back();
+            }
+        }
+        if (new_key >= 0)
+        {
+            ValueDict row = make_row(new_key, random);
+            Transaction transaction;
+            table->insert(&row);
+            transaction.commit(false);
+            return true;
+        }
+        try
+        {
+            lock_guard<mutex> guard(key_lock(deleted_key));
+            ValueDict row = make_row((int32_t)deleted_key, random);
+            Transaction transaction;
+            Handle handle = table->insert(&row);
+            transaction.commit(false);
+            handles[deleted_key] = handle;
+            live[deleted_key] = true;
+        }
+        catch (...)
+        {
+            lock_guard<mutex> guard(insert_lock);
+            deleted_keys.push_back(deleted_key);  // still deleted, for another insert to take
+            throw;
+        }
+        return true;
+    }
+};
+
+const char *const Workload::TABLE_NAME = "_workload";
+
+static void report_header(const WorkloadConfig &config)
+{
+    if (config.format == "csv")
+        cout << "threads,operation,count,misses,ops_per_sec,mean_us,p50_us,p90_us,p99_us,p999_us,max_us\n";
+}
+
+static void report(const WorkloadConfig &config, size_t threads, const string &name, const LatencyHistogram &h,
+                   uint64_t misses, double seconds)
+{
+    double ops_per_sec = h.get_count() / seconds;
+    auto us = [](double ns) { return ns / 1000.0; };
+    cout << fixed << setprecision(1);
+    if (config.format == "csv")
+        cout << threads << "," << name << "," << h.get_count() << "," << misses << "," << ops_per_sec << ","
+             << us(h.get_mean()) << "," << us(h.percentile(50)) << "," << us(h.percentile(90)) << ","
+             << us(h.percentile(99)) << "," << us(h.percentile(99.9)) << "," << us(h.get_max()) << "\n";
+    else
+        cout << left << setw(10) << name << right << setw(10) << h.get_count() << setw(8) << misses << setw(12)
+             << ops_per_sec << setw(10) << us(h.get_mean()) << setw(10) << us(h.percentile(50)) << setw(10)
+             << us(h.percentile(90)) << setw(10) << us(h.percentile(99)) << setw(10) << us(h.percentile(99.9))
+             << setw(10) << us(h.get_max()) << "\n";
+    cout.unsetf(ios::fixed);
+    cout << setprecision(6);
+}
+
+// Loads the table and runs the mix with the given number of client threads.
+static void run_workload(const WorkloadConfig &config, Workload &workload, size_t threads,
+                         GroupCommit *group_commit)
+{
+    workload.load();
+    uint64_t commits_before = group_commit != nullptr ? group_commit->get_commits() : 0;
+    uint64_t flushes_before = group_commit != nullptr ? group_commit->get_flushes() : 0;
+    vector<vector<LatencyHistogram>> histograms(threads, vector<LatencyHistogram>(NUM_OPERATION_TYPES));
+    vector<vector<uint64_t>> misses(threads, vector<uint64_t>(NUM_OPERATION_TYPES, 0));
+
+    auto start = chrono::steady_clock::now();
+    auto deadline = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(config.seconds));
+    vector<thread> clients;
+    for (size_t i = 0; i < threads; i++)
+        clients.push_back(thread(&Workload::client, &workload, i, deadline, histograms[i].data(), misses[i].data()));
+    for (auto &client : clients)
+        client.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    if (config.format == "text")
+        cout << "\n" << threads << " client thread" << (threads == 1 ? "" : "s") << ", " << setprecision(3)
+             << seconds << " s\n" << setprecision(6) << left << setw(10) << "operation" << right << setw(10)
+             << "count" << setw(8) << "misses" << setw(12) << "ops/sec" << setw(10) << "mean us" << setw(10)
+             << "p50 us" << setw(10) << "p90 us" << setw(10) << "p99 us" << setw(10) << "p99.9 us" << setw(10)
+             << "max us" << "\n";
+    LatencyHistogram all;
+    uint64_t all_misses = 0;
+    for (int op = 0; op < NUM_OPERATION_TYPES; op++)
+    {
+        LatencyHistogram merged;
+        uint64_t op_misses = 0;
+        for (size_t i = 0; i < threads; i++)
+        {
+            merged.merge(histograms[i][op]);
+            op_misses += misses[i][op];
+        }
+        all.merge(merged);
+        all_misses += op_misses;
+        if (merged.get_count() > 0)
+            report(config, threads, OPERATION_NAMES[op], merged, op_misses, seconds);
+    }
+    report(config, threads, "total", all, all_misses, seconds);
+    if (group_commit != nullptr && config.format == "text")
+    {
+        uint64_t commits = group_commit->get_commits() - commits_before;
+        uint64_t flushes = group_commit->get_flushes() - flushes_before;
+        cout << commits << " durable commits in " << flushes << " log flushes";
+        if (flushes > 0)
+            cout << " (" << setprecision(3) << (double)commits / flushes << " per flush)" << setprecision(6);
+        cout << "\n";
+    }
+    cout << flush;
+    workload.drop();
+}
+
+//------------------------options----------------------------------------------
+
+static vector<size_t> parse_sizes(const string &text)
+{
+    vector<size_t> sizes;
+    stringstream ss(text);
+    string item;
+    while (getline(ss, item, ','))
+        if (!item.empty())
+            sizes.push_back(strtoul(item.c_str(), nullptr, 10));
+    return sizes;
+}
+
+// "int,text:100" -> columns c1 INT, c2 TEXT of 100 characters (after the key column k)
+static bool parse_columns(const string &text, WorkloadConfig &config)
+{
+    config.column_names = ColumnNames{"k"};
+    config.column_attributes = ColumnAttributes{ColumnAttribute(ColumnAttribute::INT)};
+    config.text_lengths = vector<size_t>{0};
+    stringstream ss(text);
+    string item;
+    while (getline(ss, item, ','))
+    {
+        config.column_names.push_back("c" + to_string(config.column_names.size()));
+        if (item == "int")
+        {
+            config.column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+            config.text_lengths.push_back(0);
+        }
+        else if (item.compare(0, 5, "text:") == 0 && strtoul(item.c_str() + 5, nullptr, 10) > 0)
+        {
+            config.column_attributes.push_back(ColumnAttribute(ColumnAttribute::TEXT));
+            config.text_lengths.push_back(strtoul(item.c_str() + 5, nullptr, 10));
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// "lookup=50,insert=50" -> weights; operations not named get 0
+static bool parse_mix(const string &text, WorkloadConfig &config)
+{
+    for (int op = 0; op < NUM_OPERATION_TYPES; op++)
+        config.mix[op] = 0;
+    double total = 0;
+    stringstream ss(text);
+    string item;
+    while (getline(ss, item, ','))
+    {
+        size_t equals = item.find('=');
+        if (equals == string::npos)
+            return false;
+        string name = item.substr(0, equals);
+        int op = 0;
+        while (op < NUM_OPERATION_TYPES && name != OPERATION_NAMES[op])
+            op++;
+        if (op == NUM_OPERATION_TYPES)
+            return false;
+        config.mix[op] = strtod(item.c_str() + equals + 1, nullptr);
+        if (config.mix[op] < 0)
+            return false;
+        total += config.mix[op];
+    }
+    return total > 0;
+}
+
+int main(int argc, char *argv[])
+{
+    WorkloadConfig config;
+    config.thread_counts = {1};
+    config.seconds = 10;
+    config.rows = 10000;
+    config.skew = 0.99;
+    config.scan_length = 100;
+    config.seed = 1;
+    config.commit_delay = -1;
+    config.format = "text";
+    parse_columns("int,text:100", config);
+    parse_mix("lookup=50,scan=5,insert=15,update=25,delete=5", config);
+
+    bool badOption = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:d:n:c:m:z:l:s:g:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            config.thread_counts = parse_sizes(optarg);
+            break;
+        case 'd':
+            config.seconds = strtod(optarg, nullptr);
+            break;
+        case 'n':
+            config.rows = strtoul(optarg, nullptr, 10);
+            break;
+        case 'c':
+            badOption |= !parse_columns(optarg, config);
+            break;
+        case 'm':
+            badOption |= !parse_mix(optarg, config);
+            break;
+        case 'z':
+            config.skew = strtod(optarg, nullptr);
+            break;
+        case 'l':
+            config.scan_length = strtoul(optarg, nullptr, 10);
+            break;
+        case 's':
+            config.seed = strtoull(optarg, nullptr, 10);
+            break;
+        case 'g':
+            config.commit_delay = strtol(optarg, nullptr, 10);
+            badOption |= config.commit_delay < 0;
+            break;
+        case 'o':
+            config.format = optarg;
+            break;
+        default:
+            badOption = true;
+        }
+    }
+    bool badThreads = config.thread_counts.empty() ||
+                      find(config.thread_counts.begin(), config.thread_counts.end(), 0) != config.thread_counts.end();
+    if (badOption || badThreads || optind != argc - 1 || config.rows == 0 || config.seconds <= 0 || config.skew >= 1 ||
+        (config.format != "text" && config.format != "csv"))
+    {
+        cerr << "Usage: sql5300_workload [-t threads,...] [-d seconds] [-n rows] [-c int|text:N,...]\n"
+             << "                        [-m lookup=W,scan=W,insert=W,update=W,delete=W] [-z skew (0 to <1)]\n"
+             << "                        [-l scan length] [-s seed] [-g commit delay usec] [-o text|csv] dbenvpath"
+             << endl;
+        return 1;
+    }
+
+    DbEnv env(0U);
+    env.set_message_stream(&cerr);
+    env.set_error_stream(&cerr);
+    bool durable = config.commit_delay >= 0;
+    try {
+        if (durable)
+        {
+            env.set_flags(DB_AUTO_COMMIT | DB_TXN_NOSYNC, 1);
+            env.set_lg_bsize(1024 * 1024);
+            env.set_lk_detect(DB_LOCK_DEFAULT);
+            env.log_set_config(DB_LOG_AUTO_REMOVE, 1);
+        }
+        env.open(argv[optind],
+                 DB_CREATE | DB_INIT_MPOOL | (durable ? DB_INIT_LOCK | DB_INIT_LOG | DB_INIT_TXN | DB_RECOVER : 0), 0);
+    } catch (DbException &exc) {
+        cerr << "(sql5300_workload: " << exc.what() << ")" << endl;
+        return 1;
+    }
+    _DB_ENV = &env;
+    unique_ptr<GroupCommit> group_commit(durable ? new GroupCommit(&env, chrono::microseconds(config.commit_delay)) : nullptr);
+    Transaction::enable(group_commit.get());
+
+    try
+    {
+        Workload workload(config);
+        report_header(config);
+        for (size_t threads : config.thread_counts)
+            run_workload(config, workload, threads, group_commit.get());
+    }
+    catch (DbRelationError &e)
+    {
+        cerr << "(sql5300_workload: " << e.what() << ")" << endl;
+        return 1;
+    }
+    catch (DbException &e)
+    {
+        cerr << "(sql5300_workload: " << e.what() << ")" << endl;
+        return 1;
+    }
+    return EXIT_SUCCESS;
+}